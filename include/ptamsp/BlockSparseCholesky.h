@@ -0,0 +1,65 @@
+// -*- c++ -*-
+//
+// BlockSparseCholesky.h
+//
+// Sparse Cholesky factorisation of a symmetric positive-definite matrix made
+// of 6x6 blocks. This is what the bundle adjuster uses to solve the reduced
+// camera system: one block row per keyframe, and an off-diagonal block only
+// for pairs of keyframes which observe a common point.
+//
+// Usage: SetStructure() once per bundle problem (this picks a fill-reducing
+// ordering and works out where fill-in will appear), then for every solve
+// Zero(), accumulate into Diagonal() and OffDiagonal(), Factorise(), Solve().
+//
+// Blocks are stored in a fill-reducing (minimum degree) order; callers address
+// them by their original block indices via the slots returned by Slot().
+
+#ifndef __BLOCKSPARSECHOLESKY_H
+#define __BLOCKSPARSECHOLESKY_H
+
+#include <TooN/TooN.h>
+#include <vector>
+#include <utility>
+
+using namespace TooN;
+
+class BlockSparseCholesky {
+public:
+    // nBlocks block rows/columns; vPairs lists the (unordered) pairs of blocks
+    // which can be non-zero off the diagonal. Duplicates are fine.
+    void SetStructure(int nBlocks, const std::vector<std::pair<int, int> > &vPairs);
+
+    // Slot of off-diagonal block (j,k), j != k. If bTransposed is set on return,
+    // the slot holds block (k,j) and contributions must be transposed.
+    int Slot(int j, int k, bool &bTransposed) const;
+
+    void Zero();
+    inline Matrix<6> &Diagonal(int j) { return mvBlocks[mvColStart[mvPerm[j]]]; }
+    inline Matrix<6> &OffDiagonal(int nSlot) { return mvBlocks[nSlot]; }
+
+    // In-place L*L^T factorisation. Returns false if the matrix isn't positive definite.
+    bool Factorise();
+
+    // Solves the system with the factorised matrix; b and the result are in original block order.
+    Vector<> Solve(const Vector<> &b) const;
+
+    int Size() const { return mnBlocks; }
+    size_t NonZeroBlocks() const { return mvBlocks.size(); }  // Including fill-in
+
+private:
+    void MinimumDegreeOrdering(const std::vector<std::vector<int> > &vAdj);
+    int FindSlot(int nRow, int nCol) const;   // Permuted coordinates, nRow > nCol
+
+    int mnBlocks = 0;
+    std::vector<int> mvPerm;        // Original -> permuted block index
+    std::vector<int> mvInvPerm;     // Permuted -> original
+
+    // Column-compressed lower triangle in permuted order. Column c owns slots
+    // mvColStart[c] .. mvColStart[c+1]-1; the first is the diagonal, the rest
+    // are sorted by row.
+    std::vector<int> mvColStart;
+    std::vector<int> mvRowIndex;
+    std::vector<Matrix<6> > mvBlocks;
+};
+
+#endif
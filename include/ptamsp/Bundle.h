@@ -16,125 +16,276 @@
 // Unfortunately, having undergone a few tweaks, the code is now
 // not the easiest to read!
 //
-// Basic operation: MapMaker creates a new Bundle object;
+// Basic operation: MapMaker creates a new Bundle object (Bundle::Create());
 // then adds map points and keyframes to adjust;
 // then adds measurements of map points in keyframes;
 // then calls Compute() to do bundle adjustment;
 // then reads results back to update the map.
 
 #include "ATANCamera.h"
+#include "BlockSparseCholesky.h"
+#include "WorkerPool.h"
 #include <TooN/TooN.h>
 using namespace TooN;
 #include <TooN/se3.h>
 #include <vector>
 #include <map>
 #include <set>
-#include <list>
+#include <atomic>
+#include <chrono>
+#include <memory>
 
 // An index into the big measurement map which stores all the measurements.
 
 // Camera struct holds the pose of a keyframe
-// and some computation intermediates
-struct Camera
+// and some computation intermediates.
+// Scalar is the precision of the Jacobians, the accumulators built from them
+// and the Schur complement products (see Bundle::Create()); poses, positions
+// and the factorisation of the reduced camera system are always double.
+template<typename Scalar>
+struct BundleCamera
 {
   bool bFixed;
+  bool bActive;           // Cleared by RemoveCamera()
+  bool bDirty;            // Added, removed or (un)fixed since the last re-index
   SE3<> se3CfW;
   SE3<> se3CfWNew;
-  Matrix<6> m6U;          // Accumulator
-  Vector<6> v6EpsilonA;   // Accumulator
+  Matrix<6,6,Scalar> m6U;          // Accumulator
+  Vector<6,Scalar> v6EpsilonA;     // Accumulator
   int nStartRow;
 };
 
-// Camera-camera pair index
+// Camera-camera pair index: one point seen by cameras j and k (j > k)
 struct OffDiagScriptEntry
 {
   int j;
   int k;
+  int nMeasJ;          // Index of the point's measurement in camera j
+  int nMeasK;          // ... and in camera k
+};
+
+// All the script entries contributing to one off-diagonal block (j,k) of S
+struct OffDiagBlock
+{
+  int j;
+  int k;
+  int nFirst;          // Entries are mvOffDiagScript[nFirst .. nEnd-1]
+  int nEnd;
+  int nSlot;           // Where block (j,k) lives in the sparse S
+  bool bTransposeSlot; // If set, the slot holds (k,j)
 };
 
 // A map point, plus computation intermediates.
-struct Point
+template<typename Scalar>
+struct BundlePoint
 {
-  inline Point()
-  { nMeasurements = 0; nOutliers = 0;}
+  inline BundlePoint()
+  { nMeasurements = 0; nOutliers = 0; bFixed = false; bActive = true; bDirty = true;}
+  bool bFixed;            // Not adjusted; only constrains the cameras
+  bool bActive;           // Cleared by RemovePoint()
+  bool bDirty;            // Gained a measurement or was (un)fixed since the last re-index
   Vector<3> v3Pos;
   Vector<3> v3PosNew;
-  Matrix<3> m3V;          // Accumulator
-  Vector<3> v3EpsilonB;   // Accumulator 
-  Matrix<3> m3VStarInv;
+  Matrix<3,3,Scalar> m3V;          // Accumulator
+  Vector<3,Scalar> v3EpsilonB;     // Accumulator 
+  Matrix<3,3,Scalar> m3VStarInv;
   
   int nMeasurements;
   int nOutliers;
-  std::set<int> sCameras; // Which cameras observe this point?
-  std::vector<OffDiagScriptEntry> vOffDiagonalScript; // A record of all camera-camera pairs observing this point
 };
 
-// A measurement of a point by a camera, plus
-// computation intermediates.
-struct Meas
+// A measurement of a point by a camera. This only holds what every pass
+// reads; the bigger per-measurement intermediates live in arrays parallel
+// to BundleT::mvMeas so the error and reweighting passes stream through
+// small records.
+template<typename Scalar>
+struct BundleMeas
 {
-  inline Meas()
-  {bBad = false;}
+  inline BundleMeas()
+  {bBad = false; bOutlier = false; bPointFixed = false; bRemoved = false; nUpdateStamp = 0;}
   
   // Which camera/point did this measurement come from?
   int p; // The point  - called i in MVG
   int c; // The camera - called j in MVG
 
-  inline bool operator<(const Meas &rhs) const
+  inline bool operator<(const BundleMeas &rhs) const
   {  return(c<rhs.c ||(c==rhs.c && p < rhs.p)); }
   
   bool bBad;
+  bool bOutlier;  // Rejected in an earlier iteration; ignored from then on
+  bool bPointFixed;
+  bool bRemoved;  // Dropped at the next re-index
+  unsigned int nUpdateStamp;  // Last BeginUpdate() pass which saw this measurement
   
   Vector<2> v2Found;
-  Vector<2> v2Epsilon;
-  Matrix<2,6> m26A;
-  Matrix<2,3> m23B;
-  Matrix<6,3> m63W; 
-  Matrix<6,3> m63Y;
+  Vector<2,Scalar> v2Epsilon;   // Weighted error, which feeds the accumulators
   double dSqrtInvNoise;
-  
-  // Temporary projection quantities
-  Vector<3> v3Cam;
   double dErrorSquared;
+};
+
+// Projection intermediates, kept from the error pass to the Jacobian pass
+struct MeasProjection
+{
+  Vector<3> v3Cam;
   Matrix<2> m2CamDerivs;
 };
 
-// Core bundle adjustment class
+// What the last Compute() got done, for scheduling and diagnostics
+struct BundleProgress
+{
+  int nIterations = 0;        // LM iterations, including rejected steps
+  int nAccepted = 0;
+  double dInitialError = 0.0; // Robust cost when Compute() started
+  double dError = 0.0;        // ... after the last accepted step
+  double dLambda = 0.0;
+  double dSeconds = 0.0;
+  // Where dSeconds went
+  double dSetupSeconds = 0.0;     // Re-indexing after structural changes
+  double dJacobianSeconds = 0.0;  // Projection, reweighting, Jacobians and accumulators
+  double dSchurSeconds = 0.0;     // V*^-1 and the reduced camera system S
+  double dSolveSeconds = 0.0;     // Solving S for the camera update
+  double dUpdateSeconds = 0.0;    // Point back-substitution and the new error
+  bool bConverged = false;
+  bool bOutOfTime = false;    // Stopped because the time budget ran out
+};
+
+// Core bundle adjustment interface. Bundle::Create() makes one of the
+// precision asked for; BundleT below does the work.
 class Bundle
 {
 public:
+  // How the reduced camera system is solved each iteration
+  enum Solver
+  {
+    SOLVER_DEFAULT,  // Whatever the Bundle.Solver gvar says
+    SOLVER_DENSE,    // Dense Cholesky
+    SOLVER_SPARSE,   // Block-sparse Cholesky (see BlockSparseCholesky.h)
+    SOLVER_PCG       // Matrix-free conjugate gradients; S is never formed
+  };
+
+  // What the Jacobians and the sums built from them are held in
+  enum Precision
+  {
+    PRECISION_DEFAULT,  // Whatever the Bundle.Precision gvar says
+    PRECISION_DOUBLE,
+    PRECISION_FLOAT     // Halves the memory those passes stream through
+  };
+
+  // We need the camera model because we do full distorting projection in the bundle adjuster. Could probably get away with a linear approximation.
+  static Bundle *Create(const ATANCamera &TCam, Precision precision = PRECISION_DEFAULT);
+  virtual ~Bundle() {}
+
+  virtual int AddCamera(SE3<> se3CamFromWorld, bool bFixed) = 0; // Add a viewpoint. bFixed signifies that this one is not to be adjusted.
+  virtual int AddPoint(Vector<3> v3Pos, bool bFixed = false) = 0;  // Add a map point. bFixed points are held in place.
+  virtual void AddMeas(int nCam, int nPoint, Vector<2> v2Pos, double dSigmaSquared) = 0; // Add a measurement
+  virtual void SetSolver(Solver s) = 0;
+  virtual void SetThreads(int n) = 0;  // Worker threads for Compute(), 0 = one per core; default from Bundle.Threads
+  // Runs Compute()'s passes on the caller's pool rather than one of its own,
+  // so short-lived bundles don't start and join threads each time. The pool
+  // mustn't be running anything else meanwhile. Takes precedence over SetThreads().
+  virtual void SetPool(WorkerPool *pPool) = 0;
+
+  // Incremental changes, for a problem that's kept across Compute() calls.
+  // Ids of removed cameras and points may be handed out again after the next Compute().
+  virtual void RemoveCamera(int n) = 0;
+  virtual void RemovePoint(int n) = 0;
+  virtual void SetCamera(int n, SE3<> se3CamFromWorld, bool bFixed) = 0;
+  virtual void SetPoint(int n, Vector<3> v3Pos, bool bFixed) = 0;
+  // Between BeginUpdate() and EndUpdate(), every measurement still wanted is
+  // passed to UpdateMeas(); the ones which aren't are removed by EndUpdate().
+  virtual void BeginUpdate() = 0;
+  virtual void UpdateMeas(int nCam, int nPoint, Vector<2> v2Pos, double dSigmaSquared) = 0;
+  virtual void EndUpdate() = 0;
+
+  // Perform bundle adjustment. Aborts if *pbAbortSignal gets set to true, and stops
+  // after dTimeBudget seconds if that's non-zero; every accepted step is kept, so a
+  // later Compute() carries on from there. Returns number of accepted update iterations, or negative on error.
+  virtual int Compute(std::atomic<bool> *pbAbortSignal, double dTimeBudget = 0.0) = 0;
+  virtual const BundleProgress &Progress() const = 0;
+  virtual bool Converged() = 0;          // Has bundle adjustment converged?
+  virtual Vector<3> GetPoint(int n) = 0;  // Point coords after adjustment
+  virtual SE3<> GetCamera(int n) = 0;     // Camera pose after adjustment
+  virtual bool CameraFixed(int n) = 0;
+  virtual bool PointFixed(int n) = 0;
+  virtual std::vector<std::pair<int,int> > GetOutlierMeasurements() = 0;  // Measurements flagged as outliers
+  virtual std::set<int> GetOutliers() = 0;                                // Points flagged as outliers
+};
+
+// The adjuster itself, with its Jacobians, accumulators and Schur products in
+// Scalar. Instantiated for double and float in Bundle.cpp.
+template<typename Scalar>
+class BundleT : public Bundle
+{
+public:
+  BundleT(const ATANCamera &TCam);
+  int AddCamera(SE3<> se3CamFromWorld, bool bFixed) override;
+  int AddPoint(Vector<3> v3Pos, bool bFixed = false) override;
+  void AddMeas(int nCam, int nPoint, Vector<2> v2Pos, double dSigmaSquared) override;
+  void SetSolver(Solver s) override { mRequestedSolver = s; }
+  void SetThreads(int n) override { mnThreads = n; }
+  void SetPool(WorkerPool *pPool) override { mpPool = pPool; }
+
+  void RemoveCamera(int n) override;
+  void RemovePoint(int n) override;
+  void SetCamera(int n, SE3<> se3CamFromWorld, bool bFixed) override;
+  void SetPoint(int n, Vector<3> v3Pos, bool bFixed) override;
+  void BeginUpdate() override;
+  void UpdateMeas(int nCam, int nPoint, Vector<2> v2Pos, double dSigmaSquared) override;
+  void EndUpdate() override;
 
-  Bundle(const ATANCamera &TCam);   // We need the camera model because we do full distorting projection in the bundle adjuster. Could probably get away with a linear approximation.
-  int AddCamera(SE3<> se3CamFromWorld, bool bFixed); // Add a viewpoint. bFixed signifies that this one is not to be adjusted.
-  int AddPoint(Vector<3> v3Pos);       // Add a map point.
-  void AddMeas(int nCam, int nPoint, Vector<2> v2Pos, double dSigmaSquared); // Add a measurement
-  int Compute(bool *pbAbortSignal);    // Perform bundle adjustment. Aborts if *pbAbortSignal gets set to true. Returns number of accepted update iterations, or negative on error.
-  inline bool Converged() { return mbConverged;}  // Has bundle adjustment converged?
-  Vector<3> GetPoint(int n);       // Point coords after adjustment
-  SE3<> GetCamera(int n);            // Camera pose after adjustment
-  std::vector<std::pair<int,int> > GetOutlierMeasurements();  // Measurements flagged as outliers
-  std::set<int> GetOutliers();                                // Points flagged as outliers
+  int Compute(std::atomic<bool> *pbAbortSignal, double dTimeBudget = 0.0) override;
+  const BundleProgress &Progress() const override { return mProgress; }
+  bool Converged() override { return mbConverged;}
+  Vector<3> GetPoint(int n) override;
+  SE3<> GetCamera(int n) override;
+  bool CameraFixed(int n) override { return mvCameras[n].bFixed; }
+  bool PointFixed(int n) override { return mvPoints[n].bFixed; }
+  std::vector<std::pair<int,int> > GetOutlierMeasurements() override;
+  std::set<int> GetOutliers() override;
   
 protected:
+  typedef BundleCamera<Scalar> Camera;
+  typedef BundlePoint<Scalar> Point;
+  typedef BundleMeas<Scalar> Meas;
 
-  inline void ProjectAndFindSquaredError(Meas &meas); // Project a single point in a single view, compare to measurement
-  template<class MEstimator> bool Do_LM_Step(bool *pbAbortSignal);
+  inline void ProjectAndFindSquaredError(ATANCamera &camera, Meas &meas, MeasProjection &proj); // Project a single point in a single view, compare to measurement
+  template<class MEstimator> bool Do_LM_Step(std::atomic<bool> *pbAbortSignal);
   template<class MEstimator> double FindNewError();
-  void GenerateMeasLUTs();
-  void GenerateOffDiagScripts();
+  void GenerateCameraRows();
+  void GenerateMeasIndex(std::vector<int> &vMeasRemap);
+  void GenerateOffDiagScripts(const std::vector<int> &vMeasRemap, bool bFull);
+  void GenerateSparseStructure();
+  bool SolvePCG(const Vector<> &vB, Vector<> &vX);
+  void MultiplyS(const Vector<> &vX, Vector<> &vY);
   void ClearAccumulators(); // Zero temporary quantities stored in cameras and points
   void ModifyLambda_GoodStep();
   void ModifyLambda_BadStep();
+  bool OutOfTime();
   
   std::vector<Point> mvPoints;
   std::vector<Camera> mvCameras;
-  std::list<Meas> mMeasList;
+  std::vector<Meas> mvMeas;                  // Sorted by camera, then point, once Compute() starts
+  std::vector<MeasProjection> mvMeasProj;    // Parallel to mvMeas
+  std::vector<Matrix<2,3,Scalar> > mvMeasB;  // Parallel to mvMeas: weighted Bij
+  std::vector<Matrix<6,3,Scalar> > mvMeasW;  // Parallel to mvMeas: Wij = Aij^T Bij
+  std::vector<Matrix<6,3,Scalar> > mvMeasWV; // Parallel to mvMeas: Wij V*i^-1
+  std::vector<int> mvCamMeasStart;           // Camera j's measurements are mvMeas[mvCamMeasStart[j] .. mvCamMeasStart[j+1]-1]
+  std::vector<int> mvPointMeasStart;         // Point i's measurements are mvPointMeas[mvPointMeasStart[i] .. mvPointMeasStart[i+1]-1]
+  std::vector<int> mvPointMeas;              // Indices into mvMeas, by point, in camera order
+  std::vector<OffDiagScriptEntry> mvOffDiagScript;  // Grouped by camera pair
+  std::vector<OffDiagBlock> mvOffDiagBlocks;
   std::vector<std::pair<int,int> > mvOutlierMeasurementIdx;  // p-c pair
-  std::vector<std::vector<Meas*> > mvMeasLUTs;  //Each camera gets a per-point table of pointers to valid measurements
+  std::vector<int> mvFreeCameras;         // Ids which can be reused
+  std::vector<int> mvFreePoints;
+  std::vector<int> mvRemovedCameras;      // Ids removed since the last re-index, not yet reusable
+  std::vector<int> mvRemovedPoints;
+  size_t mnIndexedMeas;                   // mvMeas[0 .. mnIndexedMeas-1] is sorted and indexed
+  bool mbStructureChanged;                // Indices and scripts need rebuilding before the next step
+  bool mbResumeLM;                        // Last Compute() was cut short: carry on with its lambda
+  unsigned int mnUpdateStamp;
   
   ATANCamera mCamera;
   int mnCamsToUpdate;
-  int mnStartRow;
   double mdSigmaSquared;
   double mdLambda;
   double mdLambdaFactor;
@@ -142,12 +293,25 @@ protected:
   bool mbHitMaxIterations;
   int mnCounter;
   int mnAccepted;
+  double mdTimeBudget;
+  std::chrono::steady_clock::time_point mStartTime;
+  BundleProgress mProgress;
+  Solver mRequestedSolver;
+  Solver mSolver;                // What this Compute() actually uses
+  Solver mIndexedSolver;         // What the scripts were last generated for
+  BlockSparseCholesky mSparseS;
+  std::vector<Matrix<6> > mvUStar;       // PCG only: U*j, by camera block
+  std::vector<Matrix<6> > mvSDiagonal;   // PCG only: diagonal blocks of S, by camera block
+  std::vector<Vector<3,Scalar> > mvPCGPointTemp;
+  WorkerPool *mpPool = nullptr;        // Runs the per-measurement, per-camera and per-point passes
+  std::unique_ptr<WorkerPool> mpOwnPool;  // ... unless given one by SetPool()
+  int mnThreads;                       // -1: use the gvar
   
   GVars3::gvar3<int> mgvnMaxIterations;
   GVars3::gvar3<double> mgvdUpdateConvergenceLimit;
   GVars3::gvar3<int> mgvnBundleCout;
   
-  bool *mpbAbortSignal;
+  std::atomic<bool> *mpbAbortSignal;
 };
 
 
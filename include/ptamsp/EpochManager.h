@@ -0,0 +1,96 @@
+// -*- c++ -*-
+//
+// EpochManager.h
+//
+// Epoch-based reclamation for objects shared between the mapmaker and the
+// threads that read the map (tracker, map viewer.)
+//
+// Readers register once and then bracket every pass over the map with
+// Enter()/Leave() (or an EpochManager::Guard). The writer unlinks an object
+// from the map, retires it tagged with Current(), and calls Advance(). The
+// object may be freed once SafeEpoch() is larger than its retirement epoch:
+// by then every reader which could have seen it has left.
+//
+// Reader slots are fixed, so neither side ever blocks or allocates.
+
+#ifndef __EPOCHMANAGER_H
+#define __EPOCHMANAGER_H
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+class EpochManager {
+public:
+    static const int MAX_READERS = 8;
+
+    EpochManager() {
+        for (int i = 0; i < MAX_READERS; i++)
+            maSlots[i].nEpoch.store(IDLE, std::memory_order_relaxed);
+    }
+
+    EpochManager(const EpochManager &) = delete;
+    EpochManager &operator=(const EpochManager &) = delete;
+
+    // Each reader thread calls this once and keeps the slot for its lifetime.
+    int RegisterReader() {
+        int nSlot = mnReaders.fetch_add(1);
+        assert(nSlot < MAX_READERS);
+        return nSlot;
+    }
+
+    // Reader side
+    void Enter(int nSlot) {
+        maSlots[nSlot].nEpoch.store(mnGlobal.load());
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void Leave(int nSlot) {
+        maSlots[nSlot].nEpoch.store(IDLE, std::memory_order_release);
+    }
+
+    // Writer side
+    uint64_t Current() const { return mnGlobal.load(); }
+
+    uint64_t Advance() { return mnGlobal.fetch_add(1) + 1; }
+
+    // Anything retired in an epoch strictly smaller than this is no longer visible to any reader.
+    uint64_t SafeEpoch() const {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t nSafe = mnGlobal.load();
+        int nReaders = mnReaders.load();
+        for (int i = 0; i < nReaders && i < MAX_READERS; i++) {
+            uint64_t n = maSlots[i].nEpoch.load(std::memory_order_acquire);
+            if (n < nSafe)
+                nSafe = n;
+        }
+        return nSafe;
+    }
+
+    // RAII wrapper around Enter()/Leave()
+    class Guard {
+    public:
+        Guard(EpochManager &em, int nSlot) : mEpochs(em), mnSlot(nSlot) { mEpochs.Enter(mnSlot); }
+        ~Guard() { mEpochs.Leave(mnSlot); }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+    private:
+        EpochManager &mEpochs;
+        int mnSlot;
+    };
+
+private:
+    static const uint64_t IDLE = UINT64_MAX;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> nEpoch;
+    };
+
+    std::atomic<uint64_t> mnGlobal{1};
+    std::atomic<int> mnReaders{0};
+    Slot maSlots[MAX_READERS];
+};
+
+#endif
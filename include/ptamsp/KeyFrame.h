@@ -25,9 +25,11 @@ using namespace TooN;
 #include <TooN/se3.h>
 #include <cvd/image.h>
 #include <cvd/byte.h>
+#include <cstdint>
 #include <vector>
 #include <set>
 #include <map>
+#include <memory>
 #include <opencv2/core/core.hpp>
 #include <opencv2/flann/miniflann.hpp>
 #include "nanoflann.hpp"
@@ -37,6 +39,10 @@ class MapPoint;
 
 class SmallBlurryImage;
 
+class ModelBinaryFile;
+struct ModelBinKeyPoint;
+struct ModelBinWorldPoint;
+
 #define LEVELS 4
 
 struct PointCloud
@@ -102,6 +108,7 @@ struct Level {
     std::vector<int> vCornerRowLUT;          // Row-index into the FAST corners, speeds up access
     std::vector<CVD::ImageRef> vMaxCorners;  // The maximal FAST corners
     Level &operator=(const Level &rhs);
+    void MakeCornerRowLUT();                 // Fills vCornerRowLUT from im and vCorners
 
     PointCloud keypointsPC;
     ImageRefKD keypointsKD;
@@ -110,6 +117,10 @@ struct Level {
 
     bool bImplaneCornersCached;           // Also keep image-plane (z=1) positions of FAST corners to speed up epipolar search
     std::vector<Vector<2> > vImplaneCorners; // Corner points un-projected into z=1-plane coordinates
+
+    bool bReleased = false;               // Pixels and corners dropped to save memory (see KeyFrame::ReleaseLevel())
+    CVD::ImageRef irReleasedSize;         // ... and the size the level was
+    bool bRecentlyUsed = false;           // Wanted through KeyFrame::EnsureLevel() since the last trim
 };
 
 // The actual KeyFrame struct. The map contains of a bunch of these. However, the tracker uses this
@@ -119,9 +130,12 @@ struct KeyFrame {
     inline KeyFrame() {
         state = INIT;
     }
+    ~KeyFrame();   // Deletes the spill file, if any
 
     SE3<> se3CfromW;    // The coordinate frame of this key-frame as a Camera-From-World transformation
     bool bFixed;      // Is the coordinate frame of this keyframe fixed? (only true for first KF!)
+    bool bFromModel = false;  // Part of a loaded/installed model rather than added while mapping live
+    int nModelIndex = -1;     // Index in the binary model file it was loaded from, if any
     Level aLevels[LEVELS];  // Images, corners, etc lives in this array of pyramid levels
     std::map<MapPoint *, Measurement> mMeasurements;           // All the measurements associated with the keyframe
 
@@ -131,15 +145,48 @@ struct KeyFrame {
     void
     MakeKeyFrame_Rest();                                 // ... while this calculates the rest of the data which the mapmaker needs.
 
-    double dSceneDepthMean;      // Hacky hueristics to improve epipolar search.
-    double dSceneDepthSigma;
+    double dSceneDepthMean = 1.0;      // Hacky hueristics to improve epipolar search.
+    double dSceneDepthSigma = 1.0;
 
     std::vector<cv::KeyPoint> relocKeypoints;
     std::map<int, cv::Point3d> relocWorldPoints;
     cv::Mat relocFrameDescriptor;
+    std::shared_ptr<const ModelBinaryFile> pModelData;  // Keeps a mapped model alive while relocFrameDescriptor points into it
+    // A keyframe loaded from a binary model leaves its reloc keypoints and
+    // world points (sorted by keypoint) in the mapping instead of the above.
+    const ModelBinKeyPoint *pModelKeyPoints = nullptr;
+    uint32_t nModelKeyPoints = 0;
+    const ModelBinWorldPoint *pModelWorldPoints = nullptr;
+    uint32_t nModelWorldPoints = 0;
+    bool FindRelocWorldPoint(int nKeyPoint, cv::Point3d &pt) const;  // Whichever store it's in
+    std::vector<cv::KeyPoint> RelocKeypoints() const;               // Copies, for saving
+    std::map<int, cv::Point3d> RelocWorldPoints() const;
     void MakeKeyFrame_Reloc(int featureCount, double maxPointRadius);
 
+    size_t MemoryFootprint() const;  // Approximate heap usage in bytes, for map size budgets
+    size_t PyramidFootprint() const; // ... of which the levels
+
+    // Memory policy for map keyframes (see MapMaker::TrimKeyFrames()). Released
+    // levels are rebuilt when next wanted: from the level above, or level 0
+    // from SourcePath(), so only keyframes with one can release level 0.
+    void ReleaseDerivedData();                        // Candidates, image-plane corners, keypoint clouds
+    CVD::Image<CVD::byte> ReleaseLevel(int l);        // Returns the pixels, which readers may still be using
+    bool EnsureLevel(int l);                          // Rebuilds level l if released; false if it can't
+    bool CanReleaseLevel(int l) const { return l > 0 || !SourcePath().empty(); }
+    CVD::ImageRef LevelSize(int l) const;             // Released or not
+
+    // Paging (see MapMaker::PageKeyFrames()). A paged-out keyframe may have
+    // any level released, so the tracker skips points whose patches are in it.
+    bool bPagedOut = false;        // Published under Map::poseSeq
+    uint64_t nPagedOutEpoch = 0;   // Map epoch it was paged out in; its levels go once readers are past it
+    bool SpillLevelZero(const std::string &sPath);    // Writes level 0 raw to sPath and makes it spillPath
+    const std::string &SourcePath() const { return imagePath.empty() ? spillPath : imagePath; }
+    // Reads a keyframe image: a model JPEG, or a raw spill file
+    static bool ReadImage(const std::string &sPath, CVD::Image<CVD::byte> &im);
+    static bool IsSpillFile(const std::string &sPath);
+
     std::string imagePath;
+    std::string spillPath;   // Live keyframes have no imagePath; level 0 is spilled here to page them out
     enum {
         INIT, LITE, REST
     } state = INIT;
@@ -0,0 +1,93 @@
+// -*- c++ -*-
+//
+// KeyFramePreparer.h
+//
+// Decodes the images of loaded keyframes whose pyramids and features weren't
+// stored with the model, or of paged-out keyframes coming back in, and runs
+// MakeKeyFrame_Lite() and MakeKeyFrame_Rest() on them, on a few background
+// threads. Each job works on a scratch keyframe
+// and never touches the real one; the owner (the mapmaker) moves finished
+// levels into their keyframes with Install() when it suits it, so mapping
+// carries on meanwhile.
+//
+// Keyframes nearest the tracker's last reported pose are prepared first;
+// until there is one, they're done in the order they were added.
+
+#ifndef __KEYFRAME_PREPARER_H
+#define __KEYFRAME_PREPARER_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <TooN/TooN.h>
+#include <TooN/se3.h>
+
+using namespace TooN;
+
+#include <ptamsp/SeqLock.h>
+
+struct KeyFrame;
+
+class KeyFramePreparer {
+public:
+    // nThreads 0 means one per hardware thread, less two for the tracker and mapmaker.
+    // Threads are started with the first Add().
+    explicit KeyFramePreparer(int nThreads = 0);
+    ~KeyFramePreparer();
+
+    KeyFramePreparer(const KeyFramePreparer &) = delete;
+    KeyFramePreparer &operator=(const KeyFramePreparer &) = delete;
+
+    // Owner thread:
+    void Add(KeyFrame *pKF);      // Queue a keyframe to (re)build from its SourcePath()
+    void Remove(KeyFrame *pKF);   // Forget a keyframe which is about to be deleted
+    void Clear();                 // Forget everything
+    // Move finished levels into their keyframes; returns how many, and which in pvInstalled
+    int Install(std::vector<KeyFrame *> *pvInstalled = NULL);
+    size_t Outstanding();         // Keyframes added and not yet installed
+    bool IsOutstanding(KeyFrame *pKF);
+
+    // Tracker thread: camera pose to prepare nearby keyframes first
+    void SetPoseHint(const SE3<> &se3CamFromWorld);
+    // Any thread: the camera centre last reported, if there has been one
+    bool PoseHint(Vector<3> &v3Centre) const;
+    unsigned int PoseHintVersion() const { return mPoseHintSeq.Version(); }   // Hints so far
+
+private:
+    struct Job {
+        KeyFrame *pKF;
+        std::string sImagePath;
+        Vector<3> v3Centre;    // Camera centre in the world
+        unsigned long nSerial;
+    };
+    struct Result {
+        KeyFrame *pKF;
+        unsigned long nSerial;
+        std::unique_ptr<KeyFrame> pPrepared;
+    };
+
+    void WorkerLoop();
+    bool TakeNearestJob(Job &job);   // Called with mMutex held
+
+    int mnThreads;
+    std::vector<std::thread> mvWorkers;
+    std::mutex mMutex;
+    std::condition_variable mcvWork;
+    std::vector<Job> mvPending;
+    std::vector<Result> mvFinished;
+    // Keyframes added and not yet installed, with the serial of their job. A
+    // result whose serial doesn't match (removed, or re-added since) is dropped.
+    std::unordered_map<KeyFrame *, unsigned long> mOutstanding;
+    unsigned long mnNextSerial = 0;
+    bool mbStop = false;
+
+    SeqLock mPoseHintSeq;          // The tracker is the only writer
+    Vector<3> mv3PoseHintCentre;
+};
+
+#endif
@@ -8,20 +8,27 @@
 // N.b. since I don't do proper thread safety,
 // everything is stored as lists of pointers,
 // and map points are not erased if they are bad:
-// they are moved to the trash list. That way
-// old pointers which other threads are using are not 
-// invalidated!
+// they are retired, and only freed once no reader
+// thread can still be holding them (see EpochManager.h.)
+// That way old pointers which other threads are using
+// are not invalidated!
 
 #ifndef __MAP_H
 #define __MAP_H
 
+#include <atomic>
 #include <vector>
+#include <memory>
 #include <TooN/se3.h>
 #include <cvd/image.h>
 #include "nanoflann.hpp"
 #include "MapPoint.h"
 #include "KeyFrame.h"
+#include "EpochManager.h"
+#include "MapPointPool.h"
+#include "SeqLock.h"
 
+// Retired points are replaced by NULL; the KD index never visits removed entries.
 struct MapPointCloud
 {
     std::vector<MapPoint*>  pts;
@@ -30,7 +37,7 @@ struct MapPointCloud
 
     inline double kdtree_get_pt(const size_t idx, const size_t dim) const
     {
-        return pts[idx]->v3WorldPos[dim];
+        return pts[idx] ? pts[idx]->v3WorldPos[dim] : 0.0;
     }
 
     template <class BBOX>
@@ -38,37 +45,127 @@ struct MapPointCloud
 
 };
 
+class ModelBinaryFile;
+struct ModelSnapshot;
+
+// Everything a loaded model has put in the map, taken out whole so it can be
+// put back later without loading it again (see ModelCache.h.)
+struct MapContents {
+    std::vector<MapPoint *> vpPoints;
+    std::vector<KeyFrame *> vpKeyFrames;
+    std::shared_ptr<const ModelBinaryFile> pModelFile;
+    std::string sModelFolder;
+    bool bStreamTiles = false;
+    std::vector<KeyFrame *> vpModelKeyFrames;
+    std::vector<MapPoint *> vpModelPoints;
+    std::vector<bool> vbModelTileLoaded;
+    std::vector<uint32_t> vnModelTilePoints;
+    std::vector<uint32_t> vnModelPointMeasStart;
+    std::vector<uint32_t> vnModelPointMeas;
+    size_t nModelPointBudget = 0;
+
+    size_t MemoryFootprint() const;   // Approximate, in bytes; mapped model data isn't counted
+};
+
+// The point and keyframe lists as other threads see them (see Map::Lists().)
+struct MapLists {
+    std::vector<MapPoint *> vpPoints;
+    std::vector<KeyFrame *> vpKeyFrames;
+};
+
 typedef nanoflann::KDTreeSingleIndexDynamicAdaptor<nanoflann::L2_Simple_Adaptor<double, MapPointCloud>, MapPointCloud, 3> MapPointKD;
 
 struct Map {
     Map();
-    ~Map() {
-        delete pointsKD;
-    }
+    ~Map();
 
     inline bool IsGood() { return bGood; }
 
     void Reset();
 
-    void MoveBadPointsToTrash();
-
-    void EmptyTrash();
+    MapPoint *NewPoint();                 // Point from the pool, with TrackerData and MapMakerData attached
+    void DiscardPoint(MapPoint *p);       // For points which never made it into vpPoints
+    void RetireBadPoints();               // Unlinks all bad points and retires them
+    void RetireKeyFrame(KeyFrame *kf);    // kf must already be removed from vpKeyFrames
+    void RetireImage(const CVD::Image<CVD::byte> &im);   // Released keyframe pixels readers may still hold
+    size_t Reclaim(uint64_t nSafeEpoch);  // Frees everything retired before nSafeEpoch
 
     bool AddPoint(MapPoint *p, double minRadius);
-
+    void IndexPoint(MapPoint *p);         // Adds an already-inserted point to the KD index
+    void RebuildPointIndex();             // Re-indexes vpPoints at their current positions
+
+    // Moving whole models in and out. Nothing taken out is retired, so it
+    // stays valid for readers; contents which won't be restored must go
+    // back through RetireContents() to be freed.
+    void TakeContents(MapContents &c);    // Empties the map into c
+    void RestoreContents(MapContents &c); // Into an empty map; re-indexes the points
+    void RetireContents(MapContents &c);
+
+    // Only the mapmaker thread touches these. The tracker and map viewer go
+    // through Lists(): an immutable copy, republished by PublishLists()
+    // and retired through epochs like the points and keyframes themselves.
     std::vector<MapPoint *> vpPoints;
-    std::vector<MapPoint *> vpPointsTrash;
     std::vector<KeyFrame *> vpKeyFrames;
+    const MapLists *Lists() const { return mpLists.load(std::memory_order_acquire); }   // Inside an epoch
+    // Republishes the lists. Anything removed from them must be republished
+    // before it's retired; additions may set bListsChanged instead, and wait
+    // for the mapmaker's next PublishListsIfChanged().
+    void PublishLists();
+    void PublishListsIfChanged() { if (bListsChanged) PublishLists(); }
+    bool bListsChanged = false;
     MapPointCloud pointsCloud;
     MapPointKD *pointsKD;
 
+    EpochManager epochs;       // Readers (tracker, viewer) enter an epoch for each pass over the map
+    SeqLock poseSeq;           // The mapmaker publishes point positions/patches and keyframe poses under this
+    MapPointPool pointPool;
+    std::vector<std::pair<KeyFrame *, uint64_t> > vpKeyFramesRetired;
+    // Bumped whenever keyframes leave the map (removed, reset, swapped out), so
+    // a keyframe pointer or index handed to another thread can be checked
+    std::atomic<unsigned long> nKeyFrameGeneration{0};
+    std::vector<std::pair<CVD::Image<CVD::byte>, uint64_t> > vRetiredImages;
+    std::vector<std::pair<const MapLists *, uint64_t> > vRetiredLists;
+
     bool SaveModelToFile(const std::string &loadFolder, const std::string &name, double cm);
+    // Copies out what SaveModelToFile() writes, for ModelSaver to write on another thread
+    bool SnapshotModel(const std::string &loadFolder, const std::string &name, double cm, ModelSnapshot &snapshot);
     bool LoadModelFromFile(ATANCamera &cam, const std::string &loadFolder, std::string &name, double &cm);
+    bool LoadModelFromBinary(ATANCamera &cam, const std::string &loadFolder,
+                             const std::shared_ptr<const ModelBinaryFile> &pFile, std::string &name, double &cm);
+
+    // Tiles of the loaded binary model (see ModelBinaryFile.h.) With
+    // Model.StreamTiles set, a model of several tiles only has those near the
+    // camera loaded; the mapmaker loads and drops them as it moves.
+    bool LoadModelTile(ATANCamera &cam, int nTile, std::vector<KeyFrame *> *pvNewKeyFrames = NULL);
+    int LoadModelTilesNear(ATANCamera &cam, const Vector<3> &v3Centre, int nRadius,
+                           std::vector<KeyFrame *> *pvNewKeyFrames = NULL);
+    int ModelTileDistance(int nTile, const Vector<3> &v3Centre) const;  // In tiles, along the furthest axis
+    // With Model.PointBudget set, tiles come in with only their most useful
+    // points, a share of the budget in proportion to their size. This adds up
+    // to nMax more to the loaded tiles, next most useful first; returns how many.
+    int LoadMoreModelPoints(ATANCamera &cam, int nMax);
+
+    std::shared_ptr<const ModelBinaryFile> pModelFile;
+    std::string sModelFolder;
+    bool bStreamTiles;
+    std::vector<KeyFrame *> vpModelKeyFrames;   // By index in pModelFile; NULL while not loaded
+    std::vector<MapPoint *> vpModelPoints;
+    std::vector<bool> vbModelTileLoaded;
+    std::vector<uint32_t> vnModelTilePoints;   // How many of each loaded tile's points (by rank) are loaded
+    // The stored measurements of model point i are
+    // vnModelPointMeas[vnModelPointMeasStart[i] .. vnModelPointMeasStart[i+1]-1]
+    std::vector<uint32_t> vnModelPointMeasStart;
+    std::vector<uint32_t> vnModelPointMeas;
+    size_t nModelPointBudget;                  // 0 for all of them
 
     bool bGood;
 
 protected:
-    std::string saveKeyFrame(const std::string &folder, int id, const KeyFrame &kf);
+    std::atomic<const MapLists *> mpLists{nullptr};
+    void IndexModelMeasurements();
+    uint32_t ModelTilePointQuota(int nTile) const;
+    void LoadModelTilePoints(ATANCamera &cam, int nTile, uint32_t nEnd,
+                             const std::vector<KeyFrame *> &vNewKFs = std::vector<KeyFrame *>());
 };
 
 
@@ -16,6 +16,9 @@
 
 #include <thread>
 #include <queue>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
 
 #include <cvd/image.h>
 #include <cvd/byte.h>
@@ -32,6 +35,9 @@
 #include <ptamsp/KeyFrame.h>
 #include <ptamsp/ATANCamera.h>
 #include <ptamsp/TrackingStats.h>
+#include <ptamsp/SPSCQueue.h>
+#include <ptamsp/KeyFramePreparer.h>
+#include <ptamsp/ModelCache.h>
 
 // Each MapPoint has an associated MapMakerData class
 // Where the mapmaker can store extra information
@@ -59,6 +65,11 @@ struct KeypointResize
     }
 };
 
+class Bundle;
+class WorkerPool;
+class ModelLoader;
+class ModelSaver;
+
 // MapMaker dervives from CVD::Thread, so everything in void run() is its own thread.
 class MapMaker  {
 public:
@@ -74,33 +85,38 @@ public:
 
     ~MapMaker();
 
-    void AddKeyFrame(KeyFrame &k);   // Add a key-frame to the map. Called by the tracker.
+    bool AddKeyFrame(KeyFrame &k);   // Add a key-frame to the map. Called by the tracker. False if the queue was full.
     void RequestReset();   // Request that the we reset. Called by the tracker.
     bool ResetDone();      // Returns true if the has been done.
-    int QueueSize() { return mvpKeyFrameQueue.size(); } // How many KFs in the queue waiting to be added?
+    int QueueSize() { return mqKeyFrameQueue.Size(); } // How many KFs in the queue waiting to be added?
     bool NeedNewKeyFrame(KeyFrame &kCurrent);            // Is it a good camera pose to add another KeyFrame?
     bool IsDistanceToNearestKeyFrameExcessive(KeyFrame &kCurrent);  // Is the camera far away from the nearest KeyFrame (i.e. maybe lost?)
     bool IsDistanceToRelocKeyFrameExcessive(SE3<> &camPose, KeyFrame &kTarget);
 
     int nRelocFeatureCount;
-    int nBestRelocKF;
     std::string currentModelName;
 
     void SetMode(Mode m);
 
-    void AddRelocImage(KeyFrame &k);
-    bool NewRelocPoseReady();
-    int BestRelocKeyFrame();
-    SE3<> LastRelocPose();
+    void AddRelocImage(KeyFrame &k);                       // Hands the tracker's current frame to the relocaliser. Never blocks.
+    // Latest relocaliser result, if there is a new one. Results made before
+    // keyframes last left the map are dropped, since their keyframe may be gone,
+    // and the whole queue is drained after a model swap.
+    bool PopRelocResult(SE3<> &se3Pose, KeyFrame *&pBestKF);
+    void ReportQueueStats();                               // Copies hand-off queue depth metrics into the stats
+    void ReportBundleStats();                              // Copies global bundle adjustment metrics into the stats
     double GetOneCM() { return mdOneCM; };
+    void SetPoseHint(const SE3<> &se3CamFromWorld) { mKeyFramePreparer.SetPoseHint(se3CamFromWorld); }  // Tracker thread
 
     bool LoadModelFromFolder(const std::string &folder, CVD::ImageRef imSize, SE3<> &se3TrackerPose);
+    // Loads a model into map, works out everything the mapmaker needs to run
+    // with it, and takes it all out again into model, ready to install. Any
+    // thread may call this, as long as nothing else is using map.
+    static bool PrepareModel(Map &map, ATANCamera &cam, const std::string &sModelPath, CachedModel &model);
     bool LoadMapFromInstaller(const std::string &rootFolder, CVD::ImageRef imSize, SE3<> &se3TrackerPose);
 
     inline bool WasKeyframeAdded() {
-        bool b = mKeyframeAdded;
-        mKeyframeAdded = false;
-        return b;
+        return mKeyframeAdded.exchange(false);
     }
 
     void start();
@@ -114,13 +130,30 @@ protected:
 
     void ApplyGlobalTransformationToMap(const Eigen::Matrix<float, 4, 4> &trans);
 
+    // A candidate matched along its epipolar line, not yet made into a map point
+    struct EpipolarMatch {
+        int nLevel;
+        CVD::ImageRef irLevelPos;
+        Vector<2> v2RootPos;     // In the source keyframe
+        Vector<2> v2TargetPos;   // In the target keyframe
+        Vector<3> v3WorldPos;
+    };
+
     // Map expansion functions:
     void AddKeyFrameFromTopOfQueue();
     void ThinCandidates(KeyFrame &k, int nLevel);
     void AddSomeMapPoints(int nLevel);
     int AddSomeMapPoints(int nLevel, int kfID, int limit = 0);
+    void FindSomeMapPoints(ATANCamera &camera, KeyFrame &kSrc, KeyFrame &kTarget, int nLevel, int limit,
+                           std::vector<EpipolarMatch> &vMatches);
     bool AddPointEpipolar(KeyFrame &kSrc, KeyFrame &kTarget, int nLevel, int nCandidate);
+    void PrepareEpipolarSearch(KeyFrame &kTarget, int nLevel);
+    bool FindPointEpipolar(ATANCamera &camera, KeyFrame &kSrc, KeyFrame &kTarget, int nLevel, int nCandidate,
+                           EpipolarMatch &match);
+    void AddEpipolarPoint(KeyFrame &kSrc, KeyFrame &kTarget, const EpipolarMatch &match);
+    void TrimKeyFrames();    // Releases keyframe data nothing needs resident
     bool RemoveKeyFrame(KeyFrame *kf);
+    KeyFrame *NewPatchSource(MapPoint *p, KeyFrame *kf, const std::set<KeyFrame *> &sExclude);
 
     // Returns point in ref frame B
     Vector<3> ReprojectPoint(SE3<> se3AfromB, const Vector<2> &v2A, const Vector<2> &v2B);
@@ -130,6 +163,18 @@ protected:
     void BundleAdjustAll(bool = false);
     void BundleAdjustRecent();
     void BundleAdjustKeyframe(int i);
+    void LocalBundleSets(KeyFrame *pkfSelected, std::set<KeyFrame *> &sAdjustSet, std::set<KeyFrame *> &sFixedSet,
+                         std::set<MapPoint *> &sMapPoints);
+    void PopulateBundle(Bundle &b, const std::set<KeyFrame *> &sAdjustSet, const std::set<KeyFrame *> &sFixedSet,
+                        const std::set<MapPoint *> &sMapPoints, bool bRecent,
+                        std::vector<KeyFrame *> &vBundleID_View, std::vector<MapPoint *> &vBundleID_Point,
+                        const std::set<MapPoint *> *psHeldPoints = NULL);
+    void RunBundle(Bundle &b, const std::vector<KeyFrame *> &vBundleID_View,
+                   const std::vector<MapPoint *> &vBundleID_Point, bool bRecent, bool bIgnoreOut,
+                   double dTimeBudget = 0.0);
+    void ApplyBundle(Bundle &b, int nAccepted, const std::vector<KeyFrame *> &vBundleID_View,
+                     const std::vector<MapPoint *> &vBundleID_Point, bool bRecent, bool bIgnoreOut);
+    void SyncGlobalBundle();
 
     // Data association functions:
     int ReFindInSingleKeyFrame(KeyFrame &k);
@@ -140,14 +185,34 @@ protected:
     // General Maintenance/Utility:
     void Reset();
     void HandleBadPoints();
+    void ForgetBadPoints();
+    void ReclaimRetired();
+    void StreamModelTiles();
+    void PageKeyFrames();
+    void PageInKeyFrames(const std::vector<KeyFrame *> &vInstalled);
+    std::string NewSpillPath();
+    void StashCurrentModel();
+    void CacheModel(CachedModel &&model);
+    void InstallModel(CachedModel &model, SE3<> &se3TrackerPose);
+    bool CollectLoadedModels();
+    void PrefetchModel(const std::string &sFolder, CVD::ImageRef irImageSize);
+    bool UnloadModelTile(int nTile);   // False if a keyframe had to stay, so the tile did too
+    void CullRedundantKeyFrames();
+    int FusePoints();
+    bool CanFusePoints(MapPoint &pKeep, MapPoint &pDrop);
+    void FusePointInto(MapPoint &pKeep, MapPoint &pDrop);
     double DistToNearestKeyFrame(KeyFrame &kCurrent);
     static double KeyFrameLinearDist(KeyFrame &k1, KeyFrame &k2);
     KeyFrame *ClosestKeyFrame(KeyFrame &k);
     std::vector<KeyFrame *> NClosestKeyFrames(KeyFrame &k, unsigned int N);
     static std::vector<KeyFrame *> NClosestKeyFramesInList(KeyFrame &k, unsigned int N, std::vector<KeyFrame *> &list);
-    void RefreshSceneDepth(KeyFrame *pKF);
+    static bool RefreshSceneDepth(KeyFrame *pKF);   // False, depth left as it was, if it measures too few points
     KeypointResize ConvertAndResizeWithAspectRatio(const cv::Mat &input, CVD::Image<CVD::byte> &imBW);
     Eigen::Matrix<float, 4, 4> GetTransformFromModelToWorld(PTAMInstallerFile &e);
+    // Model installation stages (see LoadMapFromInstaller())
+    bool InstallerBundleAdjustAll(const std::string &sStage);
+    bool InstallerAddPoints(int nPointsPerKF);
+    void InstallerLocalBundles(WorkerPool &pool, const std::vector<int> &vKFs);
     SE3<> GetCameraPosePNP(const PTAMInstallerFile &exprt, int frameN, const ImageRefKD &keypointsKD,
                            KeypointResize &resizer, Eigen::Matrix<float, 4, 4> modelToWorld, cv::Vec3d &prevR,
                            cv::Vec3d &prevT);
@@ -164,13 +229,14 @@ protected:
     bool shouldStop;
     bool isRunning;
 
-    std::vector<Command> mvQueuedCommands;
+    // Hand-off queues. Each of these has exactly one producer and one consumer thread.
+    SPSCQueue<Command> mqQueuedCommands{16};    // GUI thread -> MapMaker
+    SPSCQueue<KeyFrame *> mqKeyFrameQueue{8};   // Tracker -> MapMaker: keyframes waiting to be processed (owned by the queue)
 
     // Member variables:
-    std::vector<KeyFrame *> mvpKeyFrameQueue;  // Queue of keyframes from the tracker waiting to be processed
     std::vector<std::pair<KeyFrame *, MapPoint *> > mvFailureQueue; // Queue of failed observations to re-find
     std::queue<MapPoint *> mqNewQueue;   // Queue of newly-made map points to re-find in other KeyFrames
-    bool mKeyframeAdded = false;
+    std::atomic<bool> mKeyframeAdded{false};
 
     double mdOneCM; // Distance that represents 1 cm in reference world
     double mdWiggleScale;  // Metric distance between the first two KeyFrames (copied from GVar)
@@ -181,14 +247,51 @@ protected:
 
     bool mbBundleConverged_Full;    // Has global bundle adjustment converged?
     bool mbBundleConverged_Recent;  // Has local bundle adjustment converged?
+    bool mbFusionNeeded;            // New points were made since the last duplicate-point fusion pass
+    std::set<KeyFrame *> msCullFailedKFs;   // Keyframes culling couldn't remove; skipped until the map's keyframes change
+    unsigned long mnCullFailedGeneration = 0;   // Map::nKeyFrameGeneration when msCullFailedKFs was last valid
+    size_t mnCullFailedKeyFrames = 0;           // ... and the keyframe count
 
     // Thread interaction signalling stuff
     bool mbResetRequested;   // A reset has been requested
     bool mbResetDone;        // The reset was done.
-    bool mbBundleAbortRequested;      // We should stop bundle adjustment
-    bool mbBundleRunning;             // Bundle adjustment is running
+    std::atomic<bool> mbBundleAbortRequested;      // We should stop bundle adjustment
+    std::atomic<bool> mbBundleRunning;             // Bundle adjustment is running (read by the tracker)
     bool mbBundleRunningIsRecent;     //    ... and it's a local bundle adjustment.
 
+    std::unique_ptr<WorkerPool> mpBundlePool;   // Shared by every bundle the mapmaker runs (see BundlePool())
+    WorkerPool &BundlePool();
+
+    // The global bundle adjustment problem, kept between calls (see SyncGlobalBundle())
+    struct GlobalBundlePoint {
+        int nID;
+        uint64_t nGeneration;  // Pool generation: tells a recycled point record apart from the one we added
+    };
+    std::unique_ptr<Bundle> mpGlobalBundle;
+    std::unordered_map<KeyFrame *, int> mGlobalBundleViews;
+    std::unordered_map<MapPoint *, GlobalBundlePoint> mGlobalBundlePoints;
+    std::vector<KeyFrame *> mvGlobalBundleID_View;   // NULL for unused ids
+    std::vector<MapPoint *> mvGlobalBundleID_Point;
+
+    // Global BA runs in time slices; these are written by the mapmaker and read by ReportBundleStats()
+    std::atomic<int> mnGlobalBundleSlices{0};
+    std::atomic<double> mdGlobalBundleSeconds{0.0};
+    std::atomic<double> mdMaxGlobalBundleSlice{0.0};
+    std::atomic<double> mdGlobalBundleError{0.0};
+
+    CVD::Image<Vector<2> > mimUnProj;   // Pixel -> image plane, for epipolar search
+
+    KeyFramePreparer mKeyFramePreparer;  // Makes pyramids for loaded keyframes whose model didn't store them
+    unsigned int mnModelPoseHintVersion = 0;  // Pose hints up to this one predate the loaded model
+    unsigned int mnPagePoseHintVersion = 0;   // Last pose hint PageKeyFrames() looked at
+    unsigned long mnSpillFiles = 0;
+    ModelCache mModelCache;              // Models recently switched away from (FULL_AUTO)
+    std::string mCurrentModelKey;        // ModelCache::Key() of the loaded model; empty if none
+    std::unique_ptr<ModelLoader> mpModelLoader;  // Loads the next model in the background (FULL_AUTO)
+    std::string msAwaitedModel;          // Folder of the model to switch to once the loader has it
+    CVD::ImageRef mirAwaitedImageSize;   // Image size it was requested at
+    std::unique_ptr<ModelSaver> mpModelSaver;    // Writes models saved with the SaveModel command
+
     double minKFDistance = 10;
     double insertKeypointRadius = 10;
 
@@ -200,15 +303,32 @@ protected:
     TrackingStats &stats;
 
     // Relocalization
+    static cv::FlannBasedMatcher MakeRelocMatcher();
     void BuildRelocIndex();
+    void RetrainRelocMatcher();
+    static void TrainRelocMatcher(const Map &map, cv::FlannBasedMatcher &matcher, std::vector<KeyFrame *> &vRelocKeyFrames);
+    KeyFrame *RelocKeyFrame(int nImage);   // Keyframe behind a reloc matcher image, loading its tile if need be
     void ProcessReloc();
+    void ProcessRelocImage(const cv::Mat &img);
+
+    struct RelocResult {
+        SE3<> se3Pose;
+        KeyFrame *pBestKF;
+        unsigned long nKeyFrameGeneration;   // Map::nKeyFrameGeneration when it was made
+    };
 
     cv::FlannBasedMatcher keyframeImageMatcher;
-    std::mutex relocImageMutex;
-    cv::Mat lastRelocImage;
-    SE3<> lastRelocPose;
-    bool newRelocImage = false;
-    bool newRelocPose = false;
+    // The matcher's images are every keyframe of a streamed model, by index in
+    // its file, whether loaded or not, followed by these keyframes. Without a
+    // streamed model these are simply all the map's keyframes.
+    std::vector<KeyFrame *> mvRelocKeyFrames;
+    // Reloc frames are copied into buffers owned by the queues; MapMaker hands
+    // processed buffers back through mqRelocFreeBuffers so the tracker can reuse them.
+    SPSCQueue<cv::Mat> mqRelocImages{2};        // Tracker -> MapMaker
+    SPSCQueue<cv::Mat> mqRelocFreeBuffers{4};   // MapMaker -> Tracker
+    SPSCQueue<RelocResult> mqRelocResults{4};   // MapMaker -> Tracker
+    std::atomic<bool> mbRelocResultsStale{false};  // Set on a model swap; the tracker then drains mqRelocResults
+    cv::Mat mRelocSpareBuffer;                  // Only touched by the tracker thread
     OrbDatabase relocDBoW;
     std::vector<std::string> relocFeatureToModel;
     std::vector<std::string> last10RelocModels;
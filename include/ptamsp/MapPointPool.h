@@ -0,0 +1,75 @@
+// -*- c++ -*-
+//
+// MapPointPool.h
+//
+// Slab allocator for map points. Each record holds a MapPoint together with
+// its TrackerData and MapMakerData, so a point and both of its private data
+// blocks are a single allocation which sits next to its neighbours in memory.
+//
+// Points are never deleted directly. Once a point has been unlinked from the
+// map it is Retire()d with the current epoch, and Reclaim() later returns
+// records to the free list when no reader can still hold them
+// (see EpochManager.h.)
+//
+// The pool itself is not thread-safe: only the mapmaker thread (or whoever
+// owns the map while the mapmaker isn't running) may call into it.
+
+#ifndef __MAPPOINTPOOL_H
+#define __MAPPOINTPOOL_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct MapPoint;
+struct MapPointRecord;
+
+class MapPointPool {
+public:
+    explicit MapPointPool(size_t nSlabSize = 1024);
+    ~MapPointPool();
+
+    MapPointPool(const MapPointPool &) = delete;
+    MapPointPool &operator=(const MapPointPool &) = delete;
+
+    // Returns a default-constructed MapPoint with pTData and pMMData attached.
+    MapPoint *Allocate();
+
+    // How many times p's record has been freed. Someone holding a MapPoint*
+    // can compare this against the value they saw to tell that the record
+    // was recycled for a different point in the meantime.
+    static uint64_t Generation(const MapPoint *p);
+
+    // Returns a point which was never published to other threads straight to the free list.
+    void Discard(MapPoint *p);
+
+    // The point has been unlinked from the map during epoch nEpoch.
+    void Retire(MapPoint *p, uint64_t nEpoch);
+
+    // Frees all points retired before nSafeEpoch. Returns how many were freed.
+    size_t Reclaim(uint64_t nSafeEpoch);
+
+    // Frees everything, live or retired. Only valid when no reader can hold a point.
+    void Clear();
+
+    // Takes over every record of other, live or free, so points allocated
+    // there can be retired here. other must have nothing retired, and no
+    // other thread may be using either pool.
+    bool Adopt(MapPointPool &other);
+
+    size_t LiveCount() const { return mnLive; }
+    size_t RetiredCount() const { return mvRetired.size(); }
+    size_t Capacity() const { return mvSlabs.size() * mnSlabSize; }
+
+private:
+    void Release(MapPointRecord *r);
+    void AddSlab();
+
+    size_t mnSlabSize;
+    std::vector<std::unique_ptr<MapPointRecord[]> > mvSlabs;
+    MapPointRecord *mpFreeList = nullptr;
+    std::vector<MapPointRecord *> mvRetired;   // In retirement order, so epochs are non-decreasing
+    size_t mnLive = 0;
+};
+
+#endif
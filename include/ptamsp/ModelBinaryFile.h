@@ -0,0 +1,231 @@
+// -*- c++ -*-
+//
+// ModelBinaryFile.h
+//
+// The binary model format (data_ptam.bin). It holds the same data as the
+// cereal data_ptam file, but as flat arrays of fixed-layout records, each
+// section aligned to 64 bytes, so a model is memory-mapped and read in place
+// rather than deserialised element by element. ORB descriptor blocks are
+// handed out as cv::Mat headers over the mapped bytes.
+//
+// Optionally a model also carries each keyframe's image pyramid, FAST
+// corners, maximal corners and Shi-Tomasi candidates, as computed by
+// MakeKeyFrame_Lite() and MakeKeyFrame_Rest() at install time, so loading
+// it needs neither the JPEGs nor any feature extraction. Pyramid pixels are
+// stored raw or PNG-compressed.
+//
+// Keyframes are grouped into tiles: cubic cells of the world, by camera
+// centre. Keyframes, and the points whose source keyframe they are, are
+// stored tile by tile, with a tile index, so a large model can be loaded a
+// few tiles at a time (see Map::LoadModelTile().) Measurements are stored in
+// keyframe order. The tile holding the model's first keyframe comes first,
+// and that keyframe stays first within it. Within a tile, points keep the
+// order they're given in; saved maps give them most useful first, so a
+// loader on a point budget takes the leading share of each tile.
+//
+// All integers and floats are little-endian, as written by this machine;
+// Open() rejects files with a different magic, version or byte order, or
+// whose sections or tile table don't fit the file. The records themselves are
+// only checked a tile at a time, by ValidateTile(), before a tile is read.
+// Bump MODEL_BINARY_VERSION whenever a record layout changes.
+
+#ifndef __MODEL_BINARY_FILE_H
+#define __MODEL_BINARY_FILE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+class PTAMModelFile;
+struct KeyFrame;
+
+#define MODEL_BINARY_VERSION 3
+
+struct ModelBinSection {
+    uint64_t nOffset;   // From the start of the file; a multiple of 64
+    uint64_t nCount;    // Records (bytes for the name, descriptor and string sections)
+};
+
+struct ModelBinHeader {
+    char acMagic[8];         // "PTAMMDL"
+    uint32_t nVersion;
+    uint32_t nByteOrder;     // 0x01020304 as written
+    double dOneCM;
+    double dTileSize;        // Edge of a tile, in world units; 0 if the model is one tile
+    ModelBinSection name;
+    ModelBinSection keyFrames;
+    ModelBinSection keyPoints;
+    ModelBinSection worldPoints;
+    ModelBinSection points;
+    ModelBinSection measurements;
+    ModelBinSection descriptors;
+    ModelBinSection strings;
+    ModelBinSection levels;       // Empty, or LEVELS records per keyframe
+    ModelBinSection pixels;
+    ModelBinSection corners;
+    ModelBinSection candidates;
+    ModelBinSection tiles;
+};
+
+struct ModelBinTile {
+    int32_t anCell[3];          // floor(camera centre / dTileSize)
+    uint32_t nFirstKeyFrame;    // This tile's keyframes are keyFrames[nFirstKeyFrame .. +nKeyFrames-1]
+    uint32_t nKeyFrames;
+    uint32_t nFirstPoint;       // ... and its points likewise
+    uint32_t nPoints;
+    uint32_t nPad;
+};
+
+struct ModelBinKeyFrame {
+    double adT[3];              // se3CfromW translation
+    double adR[3];              // ... and rotation (log)
+    uint32_t nImageOffset;      // Image file name, in the string section
+    uint32_t nImageLength;
+    uint32_t nFirstKeyPoint;    // Reloc keypoints are keyPoints[nFirstKeyPoint .. +nKeyPoints-1]
+    uint32_t nKeyPoints;
+    uint32_t nFirstWorldPoint;  // Reloc world points likewise
+    uint32_t nWorldPoints;
+    uint64_t nDescriptorOffset; // CV_8UC1 rows x cols, in the descriptor section
+    int32_t nDescriptorRows;
+    int32_t nDescriptorCols;
+    uint32_t nFirstMeasurement; // This keyframe's measurements
+    uint32_t nMeasurements;
+};
+
+struct ModelBinKeyPoint {
+    float x;
+    float y;
+    float size;
+    float angle;
+    float response;
+    int32_t nClassID;
+    int32_t nOctave;
+    int32_t nPad;
+};
+
+struct ModelBinWorldPoint {
+    int32_t nKeyPoint;          // Which reloc keypoint this is the world position of
+    int32_t nPad;
+    double x;
+    double y;
+    double z;
+};
+
+struct ModelBinPoint {
+    int32_t nSourceKF;
+    int32_t nCenterX;
+    int32_t nCenterY;
+    float x;
+    float y;
+    float z;
+    int32_t nSourceLevel;
+    uint8_t bFromModel;
+    uint8_t anPad[3];
+};
+
+struct ModelBinMeasurement {
+    int32_t nKF;
+    int32_t nPoint;
+    double x;
+    double y;
+    int32_t nSource;
+    int32_t nLevel;
+    uint8_t bSubPix;
+    uint8_t anPad[7];
+};
+
+enum {
+    MODEL_PIXELS_NONE = 0,      // This keyframe's levels weren't stored
+    MODEL_PIXELS_RAW = 1,
+    MODEL_PIXELS_PNG = 2
+};
+
+struct ModelBinLevel {
+    uint64_t nPixelOffset;      // In the pixel section
+    uint32_t nPixelBytes;
+    uint32_t nEncoding;         // MODEL_PIXELS_*
+    int32_t nWidth;
+    int32_t nHeight;
+    uint32_t nFirstCorner;      // FAST corners are corners[nFirstCorner .. +nCorners-1]
+    uint32_t nCorners;
+    uint32_t nFirstMaxCorner;   // Maximal corners likewise
+    uint32_t nMaxCorners;
+    uint32_t nFirstCandidate;
+    uint32_t nCandidates;
+    uint32_t nPad;
+};
+
+struct ModelBinCorner {
+    int16_t x;
+    int16_t y;
+};
+
+struct ModelBinCandidate {
+    int16_t x;
+    int16_t y;
+    float dSTScore;
+};
+
+class ModelBinaryFile {
+public:
+    ~ModelBinaryFile();
+
+    // Maps a file and checks its layout; NULL if it's missing or not a usable model.
+    static std::shared_ptr<const ModelBinaryFile> Open(const std::string &sPath);
+    // Writes a model in this format (via a temporary file, renamed into place.)
+    // vLevelSources, if given, holds the keyframe for each of model.keyframes
+    // whose pyramid, corners and candidates should go in too; NULL entries and
+    // keyframes not yet through MakeKeyFrame_Rest() are left out. dTileSize 0
+    // makes the whole model one tile. Keyframes and points are reordered.
+    static bool Write(const std::string &sPath, const PTAMModelFile &model,
+                      const std::vector<const KeyFrame *> &vLevelSources = std::vector<const KeyFrame *>(),
+                      bool bCompressPixels = false, double dTileSize = 0.0);
+
+    std::string Name() const;
+    double OneCM() const { return mpHeader->dOneCM; }
+
+    size_t KeyFrameCount() const { return mpHeader->keyFrames.nCount; }
+    size_t PointCount() const { return mpHeader->points.nCount; }
+    size_t MeasurementCount() const { return mpHeader->measurements.nCount; }
+    size_t TileCount() const { return mpHeader->tiles.nCount; }
+    double TileSize() const { return mpHeader->dTileSize; }
+    const ModelBinKeyFrame *KeyFrames() const { return Section<ModelBinKeyFrame>(mpHeader->keyFrames); }
+    const ModelBinKeyPoint *KeyPoints() const { return Section<ModelBinKeyPoint>(mpHeader->keyPoints); }
+    const ModelBinWorldPoint *WorldPoints() const { return Section<ModelBinWorldPoint>(mpHeader->worldPoints); }
+    const ModelBinPoint *Points() const { return Section<ModelBinPoint>(mpHeader->points); }
+    const ModelBinMeasurement *Measurements() const { return Section<ModelBinMeasurement>(mpHeader->measurements); }
+    const ModelBinTile *Tiles() const { return Section<ModelBinTile>(mpHeader->tiles); }
+    int TileOfPoint(size_t nPoint) const;
+    // Checks one tile's keyframe, point, measurement and level records; false
+    // (and a message, once) if anything in them points outside the file or
+    // their tile. Must pass before the tile's records are read. Cached.
+    bool ValidateTile(size_t nTile) const;
+
+    std::string ImageName(const ModelBinKeyFrame &kf) const;
+    // Header over the mapped bytes: valid as long as this file is. Empty if
+    // the keyframe has none, or its record is damaged.
+    cv::Mat Descriptor(const ModelBinKeyFrame &kf) const;
+
+    // Fills keyframe nKF's aLevels from the stored pyramid and features and
+    // marks it REST; false (and kf untouched) if they weren't stored.
+    bool ReadLevels(size_t nKF, KeyFrame &kf) const;
+
+private:
+    ModelBinaryFile() {}
+    bool Validate() const;
+    template<class T> const T *Section(const ModelBinSection &s) const {
+        return reinterpret_cast<const T *>(mpData + s.nOffset);
+    }
+
+    unsigned char *mpData = nullptr;   // Mapped copy-on-write, so cv::Mat users can't write through to the file
+    size_t mnSize = 0;
+    const ModelBinHeader *mpHeader = nullptr;
+    enum { TILE_UNCHECKED = 0, TILE_GOOD = 1, TILE_BAD = 2 };
+    mutable std::unique_ptr<std::atomic<uint8_t>[]> mpTileState;   // By tile; set by ValidateTile()
+};
+
+#endif
@@ -0,0 +1,61 @@
+// -*- c++ -*-
+//
+// ModelCache.h
+//
+// Models the mapmaker has switched away from, kept ready to switch back to.
+// An entry holds everything LoadModelFromFolder() would otherwise rebuild:
+// the map's keyframes (pyramids and all) and points, the model's tiles, and
+// the trained reloc matcher. Entries are keyed by model folder and camera
+// image size, and the least recently used go once the cache is over budget.
+//
+// The cache only holds entries; it can't free them, since their points and
+// keyframes must be retired through the map. Put() hands back whatever it
+// evicts for the owner to do that with.
+
+#ifndef __MODEL_CACHE_H
+#define __MODEL_CACHE_H
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <opencv2/features2d.hpp>
+
+#include <ptamsp/Map.h>
+
+struct CachedModel {
+    std::string sKey;
+    std::string sName;
+    double dOneCM = 0;
+    double dWiggleScale = 0;
+    double dWiggleScaleDepthNormalized = 0;
+    double dMinKFDistance = 0;
+    double dInsertKeypointRadius = 0;
+    MapContents contents;
+    cv::FlannBasedMatcher relocMatcher;
+    std::vector<KeyFrame *> vRelocKeyFrames;
+    size_t nBytes = 0;
+};
+
+class ModelCache {
+public:
+    static std::string Key(const std::string &sFolder, CVD::ImageRef irImageSize);
+
+    // Adds an entry as the most recently used, then evicts from the least
+    // recently used end until the cache holds at most nMaxBytes. An entry
+    // bigger than that on its own is handed straight back.
+    std::vector<CachedModel> Put(CachedModel &&model, size_t nMaxBytes);
+    // Removes the entry for sKey into model; false if there isn't one.
+    bool Take(const std::string &sKey, CachedModel &model);
+    bool Contains(const std::string &sKey) const;
+    std::vector<CachedModel> Clear();
+
+    size_t Size() const { return mlEntries.size(); }
+    size_t Bytes() const { return mnBytes; }
+
+private:
+    std::list<CachedModel> mlEntries;   // Most recently used first
+    size_t mnBytes = 0;
+};
+
+#endif
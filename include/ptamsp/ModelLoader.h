@@ -0,0 +1,69 @@
+// -*- c++ -*-
+//
+// ModelLoader.h
+//
+// Loads models on a background thread, so the mapmaker can go on with the
+// current scene while the next one is read, decoded and indexed. Each model
+// is loaded into a staging map of the loader's own, prepared exactly as
+// MapMaker::PrepareModel() does for a synchronous load, and handed over
+// whole as a CachedModel for the mapmaker to install or cache.
+//
+// One model is loaded at a time, and the next isn't started until the last
+// has been taken: handing one over gives the staging map's point records to
+// the map it's going into (see MapPointPool::Adopt()).
+
+#ifndef __MODEL_LOADER_H
+#define __MODEL_LOADER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ptamsp/ATANCamera.h>
+#include <ptamsp/Map.h>
+#include <ptamsp/ModelCache.h>
+
+class ModelLoader {
+public:
+    ModelLoader(const ATANCamera &cam, const std::string &sDeviceFolder);
+    ~ModelLoader();
+
+    ModelLoader(const ModelLoader &) = delete;
+    ModelLoader &operator=(const ModelLoader &) = delete;
+
+    // Mapmaker thread only:
+    // Queues a model folder to be loaded for the given image size. A
+    // prefetch goes to the back of the queue, anything else to the front;
+    // only a couple of requests are kept, the least urgent being dropped.
+    void Request(const std::string &sFolder, CVD::ImageRef irImageSize, bool bPrefetch);
+    bool IsPending(const std::string &sKey);   // Queued, loading or loaded (by ModelCache::Key())
+    // Takes a loaded model, moving its point records into map's pool; false if none is ready.
+    bool TakeReady(CachedModel &model, Map &map);
+
+private:
+    struct Job {
+        std::string sFolder;
+        std::string sKey;
+        CVD::ImageRef irImageSize;
+    };
+
+    void WorkerLoop();
+
+    ATANCamera mCamera;
+    std::string msDeviceFolder;
+    Map mStaging;              // Only the worker touches it, except in TakeReady() while it waits
+
+    std::thread mWorker;
+    std::mutex mMutex;
+    std::condition_variable mcvWork;
+    std::deque<Job> mdqJobs;
+    std::string msLoadingKey;
+    bool mbReady = false;
+    CachedModel mReady;
+    bool mbStop = false;
+};
+
+#endif
@@ -0,0 +1,78 @@
+// -*- c++ -*-
+//
+// ModelSaver.h
+//
+// Saving a model in two halves. Map::SnapshotModel() copies out everything
+// the saved model is made from, on the thread which owns the map; pixels are
+// shared rather than copied, so that's mostly the model records. Write() then
+// encodes the keyframe images, in parallel, and writes the model files. It
+// can run on any thread, since a snapshot shares nothing mutable with the
+// map. ModelSaver runs Write() on a background thread of its own, so mapping
+// and tracking carry on meanwhile.
+//
+// The whole model is written into a sibling folder (<folder>.saving), synced
+// to disk, and only then swapped in for the old folder, so a failed or
+// interrupted save leaves the previous model as it was: never new images
+// with an old data_ptam.bin, or the other way round.
+
+#ifndef __MODEL_SAVER_H
+#define __MODEL_SAVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ptamsp/PTAMModelFile.h>
+#include <ptamsp/KeyFrame.h>
+
+class ModelBinaryFile;
+class WorkerPool;
+
+struct ModelSnapshot {
+    std::string sFolder;
+    PTAMModelFile model;      // Image names filled in; descriptors share the keyframes' data
+    // Each keyframe's levels, for its image and the binary file. The pixels
+    // are shared with the map's keyframes, whose built levels never change;
+    // but libcvd's image refcounts aren't safe to touch from two threads, so
+    // a snapshot must be destroyed on the thread which made it (see
+    // ModelSaver::CollectFinished().) Write() only reads the pixels.
+    std::vector<std::unique_ptr<KeyFrame> > vpKeyFrames;
+    // Read instead where level 0 is missing: model JPEGs are copied, raw spill files encoded
+    std::vector<std::string> vsSourceImages;
+    std::vector<std::shared_ptr<const ModelBinaryFile> > vpMappedData;  // Descriptors may point into these
+    bool bCompressLevels = false;
+    double dTileSize = 0.0;
+};
+
+class ModelSaver {
+public:
+    ModelSaver();
+    ~ModelSaver();   // Finishes the saves already queued
+
+    ModelSaver(const ModelSaver &) = delete;
+    ModelSaver &operator=(const ModelSaver &) = delete;
+
+    // Writes the model files and keyframe images, replacing the snapshot's folder.
+    static bool Write(const ModelSnapshot &snapshot, WorkerPool *pPool = NULL);
+
+    void Save(std::unique_ptr<ModelSnapshot> pSnapshot);   // Queues a Write() on the saver's thread
+    size_t Pending();                                      // Saves queued or in progress
+    void CollectFinished();                                // Frees written snapshots; call on the thread which made them
+
+private:
+    void WorkerLoop();
+
+    std::thread mWorker;
+    std::mutex mMutex;
+    std::condition_variable mcvWork;
+    std::deque<std::unique_ptr<ModelSnapshot> > mdqSnapshots;
+    std::vector<std::unique_ptr<ModelSnapshot> > mvFinished;   // Written, waiting for CollectFinished()
+    bool mbBusy = false;
+    bool mbStop = false;
+};
+
+#endif
@@ -59,6 +59,8 @@ public:
   // returned as an int. Negative level returned denotes an inappropriate 
   // transformation.
   int CalcSearchLevelAndWarpMatrix(MapPoint &p, SE3<> se3CFromW, Matrix<2> &m2CamDerivs);
+  int CalcSearchLevelAndWarpMatrix(const Vector<3> &v3WorldPos, const Vector<3> &v3PixelRight_W, const Vector<3> &v3PixelDown_W,
+                                   SE3<> se3CFromW, Matrix<2> &m2CamDerivs);  // Same, from a snapshot of the point
   inline int GetLevel() { return mnSearchLevel; }
   inline int GetLevelScale() { return LevelScale(mnSearchLevel); }
   
@@ -66,6 +68,7 @@ public:
   // Generates the NxN search template either from the pre-calculated warping matrix,
   // or an identity transformation.
   void MakeTemplateCoarseCont(MapPoint &p); // If the warping matrix has already been pre-calced, use this.
+  void MakeTemplateCoarseCont(MapPoint &p, KeyFrame &kSource, int nSourceLevel, CVD::ImageRef irCenter); // Same, with the source patch given explicitly
   void MakeTemplateCoarse(MapPoint &p, SE3<> se3CFromW, Matrix<2> &m2CamDerivs); // This also calculates the warp.
   void MakeTemplateCoarseNoWarp(MapPoint &p);  // Identity warp: just copies pixels from the source KF.
   void MakeTemplateCoarseNoWarp(KeyFrame &k, int nLevel, CVD::ImageRef irLevelPos); // Identity warp if no MapPoint struct exists yet.
@@ -0,0 +1,109 @@
+// -*- c++ -*-
+//
+// SPSCQueue.h
+//
+// A bounded, lock-free single-producer/single-consumer ring buffer.
+// This is used for all hand-offs between the tracker thread and the
+// mapmaker thread (keyframes, GUI commands, reloc frames and reloc results.)
+//
+// Exactly one thread may call TryPush() and exactly one (other) thread may call
+// TryPop(). Neither call ever blocks: a full queue makes TryPush() return false,
+// an empty one makes TryPop() return false. Elements are moved in and out, so
+// ownership of whatever an element carries passes with it.
+//
+// The queue also keeps a few depth metrics (high-water mark and number of
+// rejected pushes) which are cheap enough to leave on all the time.
+
+#ifndef __SPSCQUEUE_H
+#define __SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+template<class T>
+class SPSCQueue {
+public:
+    // Capacity is rounded up to the next power of two.
+    explicit SPSCQueue(size_t nCapacity) {
+        size_t n = 2;
+        while (n < nCapacity)
+            n <<= 1;
+        mvSlots.resize(n);
+        mnMask = n - 1;
+    }
+
+    SPSCQueue(const SPSCQueue &) = delete;
+    SPSCQueue &operator=(const SPSCQueue &) = delete;
+
+    // Producer side. Returns false (and leaves t untouched) if the queue is full.
+    bool TryPush(T &&t) {
+        const size_t nTail = mnTail.load(std::memory_order_relaxed);
+        const size_t nHead = mnHead.load(std::memory_order_acquire);
+        if (nTail - nHead > mnMask) {
+            mnRejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        mvSlots[nTail & mnMask] = std::move(t);
+        mnTail.store(nTail + 1, std::memory_order_release);
+
+        size_t nDepth = nTail + 1 - nHead;
+        if (nDepth > mnMaxDepth.load(std::memory_order_relaxed))
+            mnMaxDepth.store(nDepth, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool TryPush(const T &t) {
+        T copy(t);
+        return TryPush(std::move(copy));
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool TryPop(T &t) {
+        const size_t nHead = mnHead.load(std::memory_order_relaxed);
+        const size_t nTail = mnTail.load(std::memory_order_acquire);
+        if (nHead == nTail)
+            return false;
+        t = std::move(mvSlots[nHead & mnMask]);
+        mvSlots[nHead & mnMask] = T();   // Don't keep moved-from resources alive in the ring
+        mnHead.store(nHead + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: peek at the oldest element without removing it.
+    T *Front() {
+        const size_t nHead = mnHead.load(std::memory_order_relaxed);
+        const size_t nTail = mnTail.load(std::memory_order_acquire);
+        if (nHead == nTail)
+            return nullptr;
+        return &mvSlots[nHead & mnMask];
+    }
+
+    // May be called from either side; the answer is only a snapshot.
+    size_t Size() const {
+        const size_t nTail = mnTail.load(std::memory_order_acquire);
+        const size_t nHead = mnHead.load(std::memory_order_acquire);
+        return nTail - nHead;
+    }
+
+    bool Empty() const { return Size() == 0; }
+    size_t Capacity() const { return mnMask + 1; }
+
+    // Depth metrics
+    size_t MaxDepth() const { return mnMaxDepth.load(std::memory_order_relaxed); }
+    size_t Rejected() const { return mnRejected.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<T> mvSlots;
+    size_t mnMask;
+
+    // Producer and consumer indices live on their own cache lines
+    // so the two threads don't keep stealing the line from each other.
+    alignas(64) std::atomic<size_t> mnHead{0};  // Written by the consumer
+    alignas(64) std::atomic<size_t> mnTail{0};  // Written by the producer
+    alignas(64) std::atomic<size_t> mnMaxDepth{0};
+    std::atomic<size_t> mnRejected{0};
+};
+
+#endif
@@ -0,0 +1,71 @@
+// -*- c++ -*-
+//
+// SeqLock.h
+//
+// A sequence lock for data with a single writer and readers which must never
+// wait: the mapmaker publishes new point positions and keyframe poses inside
+// BeginWrite()/EndWrite(), and the tracker copies what it needs between
+// ReadBegin() and ReadRetry(), repeating the copy if a write overlapped it.
+//
+// The version counter is odd while a write is in progress. Readers must only
+// copy plain data inside the read section and not act on it until
+// ReadRetry() has returned false.
+
+#ifndef __SEQLOCK_H
+#define __SEQLOCK_H
+
+#include <atomic>
+#include <thread>
+
+class SeqLock {
+public:
+    SeqLock() = default;
+    SeqLock(const SeqLock &) = delete;
+    SeqLock &operator=(const SeqLock &) = delete;
+
+    // Writer side. Only one thread may write; sections must not nest.
+    void BeginWrite() {
+        mnVersion.store(mnVersion.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void EndWrite() {
+        mnVersion.store(mnVersion.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Reader side
+    unsigned int ReadBegin() const {
+        unsigned int n = mnVersion.load(std::memory_order_acquire);
+        while (n & 1) {
+            std::this_thread::yield();
+            n = mnVersion.load(std::memory_order_acquire);
+        }
+        return n;
+    }
+
+    bool ReadRetry(unsigned int nVersion) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return mnVersion.load(std::memory_order_relaxed) != nVersion;
+    }
+
+    // Number of completed writes so far
+    unsigned int Version() const { return mnVersion.load(std::memory_order_acquire) >> 1; }
+
+    // RAII writer section
+    class WriteGuard {
+    public:
+        explicit WriteGuard(SeqLock &l) : mLock(l) { mLock.BeginWrite(); }
+        ~WriteGuard() { mLock.EndWrite(); }
+
+        WriteGuard(const WriteGuard &) = delete;
+        WriteGuard &operator=(const WriteGuard &) = delete;
+
+    private:
+        SeqLock &mLock;
+    };
+
+private:
+    std::atomic<unsigned int> mnVersion{0};
+};
+
+#endif
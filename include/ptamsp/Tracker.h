@@ -22,6 +22,7 @@
 #define __TRACKER_H
 
 #include "MapMaker.h"
+#include "SPSCQueue.h"
 #include "ATANCamera.h"
 #include "VideoSource.h"
 
@@ -108,7 +109,7 @@ protected:
     // Interface with map maker:
     int mnFrame;                    // Frames processed since last reset
     int mnLastKeyFrameDropped;      // Counter of last keyframe inserted.
-    void AddNewKeyFrame();          // Gives the current frame to the mapmaker to use as a keyframe
+    bool AddNewKeyFrame();          // Gives the current frame to the mapmaker to use as a keyframe. False if it was full
 
     // Tracking quality control:
     int manMeasAttempted[LEVELS];
@@ -117,6 +118,8 @@ protected:
         BAD, DODGY, GOOD
     } mTrackingQuality;
     int mnLostFrames;
+    int mnEpochSlot;                // Reader slot in the map's EpochManager
+    std::vector<TrackerData *> mvpSnapshot;  // Possibly-visible points copied from the map at the start of TrackMap()
 
     // Relocalisation functions:
     bool AttemptRecovery();         // Called by TrackFrame if tracking is lost.
@@ -143,7 +146,7 @@ protected:
         std::string sCommand;
         std::string sParams;
     };
-    std::vector<Command> mvQueuedCommands;
+    SPSCQueue<Command> mqQueuedCommands{16};
 };
 
 #endif
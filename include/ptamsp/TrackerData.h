@@ -20,6 +20,45 @@ struct TrackerData {
     MapPoint &Point;
     PatchFinder Finder;
 
+    // The tracker works on a copy of the point's published state, taken
+    // once per frame under the map's SeqLock, so that bundle adjustment
+    // results landing mid-frame can't give it a torn position.
+    Vector<3> v3WorldPos;
+    Vector<3> v3PixelRight_W;
+    Vector<3> v3PixelDown_W;
+    KeyFrame *pPatchSourceKF;
+    int nSourceLevel;
+    CVD::ImageRef irCenter;
+    bool bSourcePagedOut;   // The patch's pixels may be gone: skip the point this frame
+
+    inline void Snapshot() {
+        v3WorldPos = Point.v3WorldPos;
+        v3PixelRight_W = Point.v3PixelRight_W;
+        v3PixelDown_W = Point.v3PixelDown_W;
+        pPatchSourceKF = Point.pPatchSourceKF;
+        nSourceLevel = Point.nSourceLevel;
+        irCenter = Point.irCenter;
+        bSourcePagedOut = pPatchSourceKF->bPagedOut;
+    }
+
+    // Cheap cull on the live position, done under the SeqLock before
+    // Snapshot() so only points that can land in the image get copied.
+    inline bool MayBeInImage(const SE3<> &se3CFromW, double dMaxRadiusSq) const {
+        Vector<3> v3 = se3CFromW * Point.v3WorldPos;
+        if (v3[2] < 0.001)
+            return false;
+        Vector<2> v2 = project(v3);
+        return v2 * v2 <= dMaxRadiusSq;
+    }
+
+    inline int CalcSearchLevelAndWarpMatrix(const SE3<> &se3CFromW) {
+        return Finder.CalcSearchLevelAndWarpMatrix(v3WorldPos, v3PixelRight_W, v3PixelDown_W, se3CFromW, m2CamDerivs);
+    }
+
+    inline void MakeTemplateCoarseCont() {
+        Finder.MakeTemplateCoarseCont(Point, *pPatchSourceKF, nSourceLevel, irCenter);
+    }
+
     // Projection itermediates:
     Vector<3> v3Cam;        // Coords in current cam frame
     Vector<2> v2ImPlane;    // Coords in current cam z=1 plane
@@ -45,7 +84,7 @@ struct TrackerData {
     // will not be properly in the image.
     inline void Project(const SE3<> &se3CFromW, ATANCamera &Cam) {
         bInImage = bPotentiallyVisible = false;
-        v3Cam = se3CFromW * Point.v3WorldPos;
+        v3Cam = se3CFromW * v3WorldPos;
         if (v3Cam[2] < 0.001)
             return;
         v2ImPlane = project(v3Cam);
@@ -24,6 +24,30 @@ public:
     int GetNumOfEndPoints() {
         return nEndPoints;
     }
+    int GetMaxKeyFrameQueueDepth() {
+        return nMaxKFQueueDepth;
+    }
+    int GetDroppedKeyFrames() {
+        return nDroppedKFs;
+    }
+    int GetMaxRelocQueueDepth() {
+        return nMaxRelocQueueDepth;
+    }
+    int GetDroppedRelocFrames() {
+        return nDroppedRelocFrames;
+    }
+    int GetGlobalBundleSlices() {
+        return nGlobalBundleSlices;
+    }
+    double GetGlobalBundleSeconds() {
+        return dGlobalBundleSeconds;
+    }
+    double GetMaxGlobalBundleSlice() {
+        return dMaxGlobalBundleSlice;
+    }
+    double GetGlobalBundleError() {
+        return dGlobalBundleError;
+    }
 
     void AddTrackTime(double t) {
         sumTimeForTracking += t;
@@ -41,6 +65,18 @@ public:
         nEndKFs = kfs;
         nEndPoints = pts;
     }
+    void SetQueueStats(int kfDepth, int kfDropped, int relocDepth, int relocDropped) {
+        nMaxKFQueueDepth = kfDepth;
+        nDroppedKFs = kfDropped;
+        nMaxRelocQueueDepth = relocDepth;
+        nDroppedRelocFrames = relocDropped;
+    }
+    void SetBundleStats(int slices, double seconds, double maxSlice, double error) {
+        nGlobalBundleSlices = slices;
+        dGlobalBundleSeconds = seconds;
+        dMaxGlobalBundleSlice = maxSlice;
+        dGlobalBundleError = error;
+    }
 
 private:
     double sumTimeForTracking = 0;
@@ -51,6 +87,14 @@ private:
     int nEndKFs = 0;
     int nStartPoints = 0;
     int nEndPoints = 0;
+    int nMaxKFQueueDepth = 0;
+    int nDroppedKFs = 0;
+    int nMaxRelocQueueDepth = 0;
+    int nDroppedRelocFrames = 0;
+    int nGlobalBundleSlices = 0;
+    double dGlobalBundleSeconds = 0;
+    double dMaxGlobalBundleSlice = 0;
+    double dGlobalBundleError = 0;
 };
 
 #endif //PTAM_TRACKINGSTATS_H
@@ -0,0 +1,58 @@
+// -*- c++ -*-
+//
+// WorkerPool.h
+//
+// A small fixed-size thread pool for data-parallel loops. ParallelFor() splits
+// [0, nItems) into chunks which the workers (and the calling thread) pick up
+// until all are done, and returns once every chunk has run.
+//
+// Chunks are handed out dynamically, so callers which need reproducible
+// results must make each item's work independent of which thread runs it
+// (e.g. accumulate per item, and reduce serially afterwards.)
+//
+// One ParallelFor() may run at a time; the pool is meant to be owned by the
+// thread that uses it.
+
+#ifndef __WORKERPOOL_H
+#define __WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+    // nThreads counts the calling thread; 0 means one per hardware thread.
+    explicit WorkerPool(int nThreads = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    int Threads() const { return mvWorkers.size() + 1; }
+
+    // Calls fn(nBegin, nEnd) over disjoint ranges covering [0, nItems).
+    void ParallelFor(int nItems, const std::function<void(int, int)> &fn);
+
+private:
+    void WorkerLoop();
+    void RunChunks();
+
+    std::vector<std::thread> mvWorkers;
+    std::mutex mMutex;
+    std::condition_variable mcvWork;
+    std::condition_variable mcvDone;
+
+    const std::function<void(int, int)> *mpJob = nullptr;
+    int mnItems = 0;
+    int mnChunk = 1;
+    std::atomic<int> mnNext{0};
+    int mnBusy = 0;                // Workers still inside the current job
+    unsigned long mnGeneration = 0;
+    bool mbStop = false;
+};
+
+#endif
@@ -0,0 +1,447 @@
+// ptam_bench_bundle
+//
+// Times Bundle::Compute() on its own, away from the tracker and the video.
+// The problem is either synthetic (reproducible from --seed) or the keyframes,
+// points and measurements of an installed model's data_ptam (or data_ptam.bin)
+// file. The start
+// poses and positions are perturbed so the adjuster has something to do.
+//
+// Usage: ptam_bench_bundle [options]
+//   --cameras N        Synthetic keyframes (default 50)
+//   --points M         Synthetic points (default 2000)
+//   --density d        Fraction of the keyframes which see a point that measure it (default 0.3)
+//   --noise s          Pixel noise sigma (default 0.5)
+//   --outliers r       Fraction of measurements replaced by garbage (default 0.05)
+//   --perturb s        Sigma of the start position error, world units (default 0.02)
+//   --seed n           Random seed (default 1)
+//   --model folder     Load the problem from folder/data_ptam instead
+//   --binary           ... from folder/data_ptam.bin
+//   --config file      GVars config; default is the model's PTAM_calib.cfg, if any
+//   --fix-model-points Hold the points of a loaded model fixed, as MapMaker does
+//   --solver s         Dense, Sparse or PCG (default: Bundle.Solver)
+//   --precision p      Double or Float (default: Bundle.Precision)
+//   --parity tol       Instead of timing, solve once in double and once in float
+//                      and compare; fails if the final errors differ by more
+//                      than the fraction tol. Meant for a recorded --model.
+//   --threads n        Bundle.Threads (0 = one per core)
+//   --repeat n         Number of timed runs (default 3)
+//   --set Name=Value   Any other gvar, e.g. Bundle.MaxIterations=30
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+
+#include <opencv2/core.hpp>
+#include <cereal/archives/binary.hpp>
+#include <gvars3/instances.h>
+
+#include <ptamsp/ATANCamera.h>
+#include <ptamsp/Bundle.h>
+#include <ptamsp/LevelHelpers.h>
+#include <ptamsp/PTAMModelFile.h>
+#include <ptamsp/ModelBinaryFile.h>
+
+using namespace GVars3;
+
+struct BenchMeas {
+    int c;
+    int p;
+    Vector<2> v2Pos;
+    double dSigmaSquared;
+};
+
+// The bundle problem, kept apart from Bundle so every run starts from the same place
+struct BenchProblem {
+    std::vector<SE3<> > vCameras;
+    std::vector<bool> vCameraFixed;
+    std::vector<Vector<3> > vPoints;
+    std::vector<bool> vPointFixed;
+    std::vector<BenchMeas> vMeas;
+};
+
+struct BenchOptions {
+    int nCameras = 50;
+    int nPoints = 2000;
+    double dDensity = 0.3;
+    double dNoise = 0.5;
+    double dOutliers = 0.05;
+    double dPerturb = 0.02;
+    unsigned int nSeed = 1;
+    std::string sModel;
+    bool bBinaryModel = false;
+    std::string sConfig;
+    bool bFixModelPoints = false;
+    std::string sSolver;
+    std::string sPrecision;
+    double dParityTolerance = -1.0;   // Negative: time runs instead
+    int nRepeat = 3;
+};
+
+static Vector<2> ImageSize() {
+    static const Vector<2> v2Default = makeVector(640, 480);
+    return GV3::get<Vector<2> >("Camera.Size", v2Default, HIDDEN);
+}
+
+// Keyframes strung along a gently curving track, looking into a slab of points.
+void MakeSyntheticProblem(ATANCamera &camera, const BenchOptions &opts, std::mt19937 &rng, BenchProblem &problem) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> gauss(0.0, 1.0);
+    const Vector<2> v2Size = ImageSize();
+
+    for (int j = 0; j < opts.nCameras; j++) {
+        double t = opts.nCameras > 1 ? (double) j / (opts.nCameras - 1) : 0.5;
+        Vector<3> v3Centre = makeVector(-2.0 + 4.0 * t, 0.3 * sin(6.0 * t), -4.0 + 0.5 * cos(4.0 * t));
+        SO3<> so3WfC = SO3<>::exp(makeVector(0.05 * gauss(rng), 0.3 - 0.6 * t + 0.05 * gauss(rng), 0.05 * gauss(rng)));
+        SE3<> se3CfW = SE3<>(so3WfC, v3Centre).inverse();
+        problem.vCameras.push_back(se3CfW);
+        problem.vCameraFixed.push_back(j == 0);
+    }
+
+    for (int i = 0; i < opts.nPoints; i++) {
+        Vector<3> v3Pos = makeVector(-4.0 + 8.0 * uniform(rng), -2.0 + 4.0 * uniform(rng), 2.0 * uniform(rng));
+
+        // Which keyframes could see it?
+        std::vector<std::pair<int, Vector<2> > > vVisible;
+        for (int j = 0; j < opts.nCameras; j++) {
+            Vector<3> v3Cam = problem.vCameras[j] * v3Pos;
+            if (v3Cam[2] < 0.1)
+                continue;
+            Vector<2> v2Image = camera.Project(project(v3Cam));
+            if (v2Image[0] < 0 || v2Image[1] < 0 || v2Image[0] >= v2Size[0] || v2Image[1] >= v2Size[1])
+                continue;
+            if (uniform(rng) < opts.dDensity)
+                vVisible.push_back(std::make_pair(j, v2Image));
+        }
+        if (vVisible.size() < 2)
+            continue;
+
+        int nPoint = problem.vPoints.size();
+        problem.vPoints.push_back(v3Pos);
+        problem.vPointFixed.push_back(false);
+        for (auto &v : vVisible) {
+            BenchMeas m;
+            m.c = v.first;
+            m.p = nPoint;
+            m.dSigmaSquared = 1.0;
+            if (uniform(rng) < opts.dOutliers)
+                m.v2Pos = makeVector(v2Size[0] * uniform(rng), v2Size[1] * uniform(rng));
+            else
+                m.v2Pos = v.second + opts.dNoise * makeVector(gauss(rng), gauss(rng));
+            problem.vMeas.push_back(m);
+        }
+    }
+}
+
+// The model's own keyframes, points and measurements, as Map::LoadModelFromFile() reads them
+bool LoadBinaryModelProblem(const BenchOptions &opts, BenchProblem &problem) {
+    std::shared_ptr<const ModelBinaryFile> pFile = ModelBinaryFile::Open(opts.sModel + "/data_ptam.bin");
+    if (!pFile) {
+        std::cout << "Can't open " << opts.sModel << "/data_ptam.bin" << std::endl;
+        return false;
+    }
+    for (size_t t = 0; t < pFile->TileCount(); t++)
+        if (!pFile->ValidateTile(t))
+            return false;
+
+    const ModelBinKeyFrame *pKeyFrames = pFile->KeyFrames();
+    for (size_t i = 0; i < pFile->KeyFrameCount(); i++) {
+        const ModelBinKeyFrame &modelKF = pKeyFrames[i];
+        problem.vCameras.push_back(SE3<>(SO3<>(makeVector(modelKF.adR[0], modelKF.adR[1], modelKF.adR[2])),
+                                         makeVector(modelKF.adT[0], modelKF.adT[1], modelKF.adT[2])));
+        problem.vCameraFixed.push_back(i == 0);
+    }
+    const ModelBinPoint *pPoints = pFile->Points();
+    for (size_t i = 0; i < pFile->PointCount(); i++) {
+        problem.vPoints.push_back(makeVector(pPoints[i].x, pPoints[i].y, pPoints[i].z));
+        problem.vPointFixed.push_back(opts.bFixModelPoints && pPoints[i].bFromModel);
+    }
+    const ModelBinMeasurement *pMeasurements = pFile->Measurements();
+    for (size_t i = 0; i < pFile->MeasurementCount(); i++) {
+        const ModelBinMeasurement &modelM = pMeasurements[i];
+        if (modelM.nKF < 0 || modelM.nKF >= (int) problem.vCameras.size() ||
+            modelM.nPoint < 0 || modelM.nPoint >= (int) problem.vPoints.size())
+            continue;
+        BenchMeas m;
+        m.c = modelM.nKF;
+        m.p = modelM.nPoint;
+        m.v2Pos = makeVector(modelM.x, modelM.y);
+        m.dSigmaSquared = LevelScale(modelM.nLevel) * LevelScale(modelM.nLevel);
+        problem.vMeas.push_back(m);
+    }
+    std::cout << "Loaded model '" << pFile->Name() << "' (binary)" << std::endl;
+    return true;
+}
+
+bool LoadModelProblem(const BenchOptions &opts, BenchProblem &problem) {
+    if (opts.bBinaryModel)
+        return LoadBinaryModelProblem(opts, problem);
+    std::ifstream loaderFile(opts.sModel + "/data_ptam", std::ios::binary);
+    if (!loaderFile.is_open()) {
+        std::cout << "Can't open " << opts.sModel << "/data_ptam" << std::endl;
+        return false;
+    }
+    PTAMModelFile loader;
+    cereal::BinaryInputArchive iarchive(loaderFile);
+    iarchive(loader);
+
+    for (size_t i = 0; i < loader.keyframes.size(); i++) {
+        const ModelKeyFrame &modelKF = loader.keyframes[i];
+        problem.vCameras.push_back(SE3<>(SO3<>(modelKF.R), modelKF.T));
+        problem.vCameraFixed.push_back(i == 0);
+    }
+    for (const auto &modelP : loader.points) {
+        problem.vPoints.push_back(makeVector(modelP.x, modelP.y, modelP.z));
+        problem.vPointFixed.push_back(opts.bFixModelPoints && modelP.fromModel);
+    }
+    for (const auto &modelM : loader.measurements) {
+        if (modelM.kfID < 0 || modelM.kfID >= (int) problem.vCameras.size() ||
+            modelM.pointID < 0 || modelM.pointID >= (int) problem.vPoints.size())
+            continue;
+        BenchMeas m;
+        m.c = modelM.kfID;
+        m.p = modelM.pointID;
+        m.v2Pos = makeVector(modelM.x, modelM.y);
+        m.dSigmaSquared = LevelScale(modelM.level) * LevelScale(modelM.level);
+        problem.vMeas.push_back(m);
+    }
+    std::cout << "Loaded model '" << loader.name << "'" << std::endl;
+    return true;
+}
+
+// Start the adjuster away from where the measurements say things are
+void Perturb(const BenchOptions &opts, std::mt19937 &rng, BenchProblem &problem) {
+    std::normal_distribution<double> gauss(0.0, opts.dPerturb);
+    for (size_t j = 0; j < problem.vCameras.size(); j++) {
+        if (problem.vCameraFixed[j])
+            continue;
+        Vector<6> v6 = makeVector(gauss(rng), gauss(rng), gauss(rng), 0.1 * gauss(rng), 0.1 * gauss(rng), 0.1 * gauss(rng));
+        problem.vCameras[j] = SE3<>::exp(v6) * problem.vCameras[j];
+    }
+    for (size_t i = 0; i < problem.vPoints.size(); i++) {
+        if (problem.vPointFixed[i])
+            continue;
+        problem.vPoints[i] += makeVector(gauss(rng), gauss(rng), gauss(rng));
+    }
+}
+
+bool ParseOptions(int argc, char **argv, BenchOptions &opts) {
+    for (int a = 1; a < argc; a++) {
+        std::string sArg = argv[a];
+        if (sArg == "--fix-model-points") {
+            opts.bFixModelPoints = true;
+            continue;
+        }
+        if (sArg == "--binary") {
+            opts.bBinaryModel = true;
+            continue;
+        }
+        if (a + 1 >= argc) {
+            std::cout << "Missing value for " << sArg << std::endl;
+            return false;
+        }
+        std::string sValue = argv[++a];
+        if (sArg == "--cameras")
+            opts.nCameras = atoi(sValue.c_str());
+        else if (sArg == "--points")
+            opts.nPoints = atoi(sValue.c_str());
+        else if (sArg == "--density")
+            opts.dDensity = atof(sValue.c_str());
+        else if (sArg == "--noise")
+            opts.dNoise = atof(sValue.c_str());
+        else if (sArg == "--outliers")
+            opts.dOutliers = atof(sValue.c_str());
+        else if (sArg == "--perturb")
+            opts.dPerturb = atof(sValue.c_str());
+        else if (sArg == "--seed")
+            opts.nSeed = strtoul(sValue.c_str(), nullptr, 10);
+        else if (sArg == "--model")
+            opts.sModel = sValue;
+        else if (sArg == "--config")
+            opts.sConfig = sValue;
+        else if (sArg == "--solver")
+            opts.sSolver = sValue;
+        else if (sArg == "--precision")
+            opts.sPrecision = sValue;
+        else if (sArg == "--parity")
+            opts.dParityTolerance = atof(sValue.c_str());
+        else if (sArg == "--threads")
+            GUI.ParseLine("Bundle.Threads=" + sValue);
+        else if (sArg == "--repeat")
+            opts.nRepeat = atoi(sValue.c_str());
+        else if (sArg == "--set")
+            GUI.ParseLine(sValue);
+        else {
+            std::cout << "Unknown option " << sArg << std::endl;
+            return false;
+        }
+    }
+    if (opts.bBinaryModel && opts.sModel.empty()) {
+        std::cout << "--binary needs --model" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A fresh adjuster holding the whole problem
+Bundle *MakeBundle(ATANCamera &camera, const BenchProblem &problem, Bundle::Solver solver, Bundle::Precision precision) {
+    Bundle *pBundle = Bundle::Create(camera, precision);
+    pBundle->SetSolver(solver);
+    for (size_t j = 0; j < problem.vCameras.size(); j++)
+        pBundle->AddCamera(problem.vCameras[j], problem.vCameraFixed[j]);
+    for (size_t i = 0; i < problem.vPoints.size(); i++)
+        pBundle->AddPoint(problem.vPoints[i], problem.vPointFixed[i]);
+    for (const auto &m : problem.vMeas)
+        pBundle->AddMeas(m.c, m.p, m.v2Pos, m.dSigmaSquared);
+    return pBundle;
+}
+
+// Solves the problem in double and in float, and reports how far apart the
+// results are. Returns false if the final errors differ by more than the tolerance.
+bool CheckParity(ATANCamera &camera, const BenchOptions &opts, const BenchProblem &problem, Bundle::Solver solver) {
+    std::unique_ptr<Bundle> pDouble(MakeBundle(camera, problem, solver, Bundle::PRECISION_DOUBLE));
+    std::unique_ptr<Bundle> pFloat(MakeBundle(camera, problem, solver, Bundle::PRECISION_FLOAT));
+    std::atomic<bool> bAbort(false);
+    if (pDouble->Compute(&bAbort) < 0 || pFloat->Compute(&bAbort) < 0) {
+        std::cout << "Parity: bundle adjustment failed" << std::endl;
+        return false;
+    }
+
+    double dMaxCamera = 0.0;
+    for (size_t j = 0; j < problem.vCameras.size(); j++) {
+        Vector<6> v6 = SE3<>::ln(pDouble->GetCamera(j) * pFloat->GetCamera(j).inverse());
+        dMaxCamera = std::max(dMaxCamera, sqrt(v6 * v6));
+    }
+    double dMaxPoint = 0.0;
+    for (size_t i = 0; i < problem.vPoints.size(); i++) {
+        Vector<3> v3 = pDouble->GetPoint(i) - pFloat->GetPoint(i);
+        dMaxPoint = std::max(dMaxPoint, sqrt(v3 * v3));
+    }
+    const BundleProgress &d = pDouble->Progress();
+    const BundleProgress &f = pFloat->Progress();
+    double dErrorDiff = std::abs(d.dError - f.dError) / std::max(d.dError, 1e-12);
+
+    std::cout << "Parity: double " << d.nIterations << " iterations, error " << d.dError << ", " << d.dSeconds * 1000.0
+              << " ms" << std::endl;
+    std::cout << "        float  " << f.nIterations << " iterations, error " << f.dError << ", " << f.dSeconds * 1000.0
+              << " ms" << std::endl;
+    std::cout << "  error difference    " << dErrorDiff * 100.0 << " %" << std::endl;
+    std::cout << "  max camera motion   " << dMaxCamera << std::endl;
+    std::cout << "  max point distance  " << dMaxPoint << std::endl;
+    if (dErrorDiff > opts.dParityTolerance) {
+        std::cout << "Parity: FAILED, tolerance " << opts.dParityTolerance * 100.0 << " %" << std::endl;
+        return false;
+    }
+    std::cout << "Parity: ok" << std::endl;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opts;
+    if (!ParseOptions(argc, argv, opts))
+        exit(1);
+
+    std::string sConfig = opts.sConfig;
+    if (sConfig.empty() && !opts.sModel.empty())
+        sConfig = opts.sModel + "/../PTAM_calib.cfg";
+    if (!sConfig.empty()) {
+        std::cout << "Parsing '" << sConfig << "' ..." << std::endl;
+        GUI.LoadFile(sConfig);
+    }
+    // A synthetic problem doesn't need a real calibration
+    if (GV3::get<Vector<NUMTRACKERCAMPARAMETERS> >("Camera.Parameters", ATANCamera::mvDefaultParams, HIDDEN) == ATANCamera::mvDefaultParams)
+        GUI.ParseLine("Camera.Parameters=[ 0.9 1.2 0.5 0.5 0.1 ]");
+    ATANCamera camera("Camera");
+    camera.SetImageSize(ImageSize());
+
+    std::mt19937 rng(opts.nSeed);
+    BenchProblem problem;
+    if (opts.sModel.empty())
+        MakeSyntheticProblem(camera, opts, rng, problem);
+    else if (!LoadModelProblem(opts, problem))
+        exit(1);
+    Perturb(opts, rng, problem);
+
+    Bundle::Solver solver = Bundle::SOLVER_DEFAULT;
+    if (opts.sSolver == "Dense")
+        solver = Bundle::SOLVER_DENSE;
+    else if (opts.sSolver == "Sparse")
+        solver = Bundle::SOLVER_SPARSE;
+    else if (opts.sSolver == "PCG")
+        solver = Bundle::SOLVER_PCG;
+    else if (!opts.sSolver.empty()) {
+        std::cout << "Unknown solver " << opts.sSolver << std::endl;
+        exit(1);
+    }
+
+    Bundle::Precision precision = Bundle::PRECISION_DEFAULT;
+    if (opts.sPrecision == "Double")
+        precision = Bundle::PRECISION_DOUBLE;
+    else if (opts.sPrecision == "Float")
+        precision = Bundle::PRECISION_FLOAT;
+    else if (!opts.sPrecision.empty()) {
+        std::cout << "Unknown precision " << opts.sPrecision << std::endl;
+        exit(1);
+    }
+
+    std::cout << problem.vCameras.size() << " keyframes, " << problem.vPoints.size() << " points, "
+              << problem.vMeas.size() << " measurements" << std::endl;
+    std::cout << std::fixed << std::setprecision(3);
+
+    if (opts.dParityTolerance >= 0)
+        exit(CheckParity(camera, opts, problem, solver) ? 0 : 1);
+
+    BundleProgress total;
+    double dMeasIterations = 0;
+    for (int r = 0; r < opts.nRepeat; r++) {
+        std::unique_ptr<Bundle> pBundle(MakeBundle(camera, problem, solver, precision));
+        Bundle &b = *pBundle;
+
+        std::atomic<bool> bAbort(false);
+        int nAccepted = b.Compute(&bAbort);
+        if (nAccepted < 0) {
+            std::cout << "Run " << r << ": bundle adjustment failed" << std::endl;
+            exit(1);
+        }
+        const BundleProgress &p = b.Progress();
+        std::cout << "Run " << r << ": " << p.nIterations << " iterations (" << p.nAccepted << " accepted), error "
+                  << p.dInitialError << " -> " << p.dError << (p.bConverged ? ", converged" : ", not converged")
+                  << ", " << p.dSeconds * 1000.0 << " ms" << std::endl;
+
+        total.nIterations += p.nIterations;
+        total.nAccepted += p.nAccepted;
+        total.dError += p.dError;
+        total.dSeconds += p.dSeconds;
+        total.dSetupSeconds += p.dSetupSeconds;
+        total.dJacobianSeconds += p.dJacobianSeconds;
+        total.dSchurSeconds += p.dSchurSeconds;
+        total.dSolveSeconds += p.dSolveSeconds;
+        total.dUpdateSeconds += p.dUpdateSeconds;
+        dMeasIterations += (double) p.nIterations * problem.vMeas.size();
+    }
+    if (opts.nRepeat <= 0)
+        exit(0);
+
+    double n = opts.nRepeat;
+    std::cout << "Mean of " << opts.nRepeat << " runs:" << std::endl;
+    std::cout << "  iterations     " << total.nIterations / n << " (" << total.nAccepted / n << " accepted)" << std::endl;
+    std::cout << "  final error    " << total.dError / n << std::endl;
+    std::cout << "  total          " << total.dSeconds * 1000.0 / n << " ms" << std::endl;
+    std::cout << "  setup          " << total.dSetupSeconds * 1000.0 / n << " ms" << std::endl;
+    std::cout << "  jacobians      " << total.dJacobianSeconds * 1000.0 / n << " ms" << std::endl;
+    std::cout << "  schur          " << total.dSchurSeconds * 1000.0 / n << " ms" << std::endl;
+    std::cout << "  solve          " << total.dSolveSeconds * 1000.0 / n << " ms" << std::endl;
+    std::cout << "  update         " << total.dUpdateSeconds * 1000.0 / n << " ms" << std::endl;
+    // Measurements times LM iterations, per second
+    if (total.dSeconds > 0)
+        std::cout << "  throughput     " << std::setprecision(0) << dMeasIterations / total.dSeconds << " measurements/s" << std::endl;
+    exit(0);
+}
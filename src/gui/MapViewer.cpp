@@ -14,6 +14,7 @@ using namespace CVD;
 
 MapViewer::MapViewer(Map &map, GLWindow2 &glw) :
         mMap(map), mGLWindow(glw) {
+    mnEpochSlot = mMap.epochs.RegisterReader();
     mse3ViewerFromWorld = SE3<>::exp(makeVector(0, 0, 5, 0, 0, 0)) * SE3<>::exp(makeVector(0, 0, 0, 0.8 * M_PI, 0, 0));
 }
 
@@ -25,10 +26,11 @@ void MapViewer::DrawMapDots() {
     glPointSize(2);
     glColor3f(0,0,0);
 
+    const std::vector<MapPoint *> &vpPoints = mMap.Lists()->vpPoints;
     glBegin(GL_POINTS);
     mv3MassCenter = Zeros;
-    for (size_t i = 0; i < mMap.vpPoints.size(); i++) {
-        Vector<3> v3Pos = mMap.vpPoints[i]->v3WorldPos;
+    for (size_t i = 0; i < vpPoints.size(); i++) {
+        Vector<3> v3Pos = vpPoints[i]->v3WorldPos;
         v3Pos[2] -= 0.0001;
         glVertex(v3Pos);
     }
@@ -37,9 +39,9 @@ void MapViewer::DrawMapDots() {
     glPointSize(1);
     glBegin(GL_POINTS);
     mv3MassCenter = Zeros;
-    for (size_t i = 0; i < mMap.vpPoints.size(); i++) {
-        Vector<3> v3Pos = mMap.vpPoints[i]->v3WorldPos;
-        glColor(gavLevelColors[mMap.vpPoints[i]->nSourceLevel]);
+    for (size_t i = 0; i < vpPoints.size(); i++) {
+        Vector<3> v3Pos = vpPoints[i]->v3WorldPos;
+        glColor(gavLevelColors[vpPoints[i]->nSourceLevel]);
         if (v3Pos * v3Pos < 10000) {
             nForMass++;
             mv3MassCenter += v3Pos;
@@ -118,6 +120,7 @@ void MapViewer::DrawGrid() {
 }
 
 void MapViewer::DrawMap(SE3<> se3CamFromWorld) {
+    EpochManager::Guard epochGuard(mMap.epochs, mnEpochSlot);
     mMessageForUser.str(""); // Wipe the user message clean
 
     // Update viewer position according to mouse input:
@@ -144,13 +147,14 @@ void MapViewer::DrawMap(SE3<> se3CamFromWorld) {
     //DrawGrid();
     DrawMapDots();
     DrawCamera(se3CamFromWorld);
-    for (size_t i = 0; i < mMap.vpKeyFrames.size(); i++)
-        DrawCamera(mMap.vpKeyFrames[i]->se3CfromW, true);
+    const MapLists &lists = *mMap.Lists();
+    for (size_t i = 0; i < lists.vpKeyFrames.size(); i++)
+        DrawCamera(lists.vpKeyFrames[i]->se3CfromW, true);
     glDisable(GL_DEPTH_TEST);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 
-    mMessageForUser << " Map: " << mMap.vpPoints.size() << "P, " << mMap.vpKeyFrames.size() << "KF";
+    mMessageForUser << " Map: " << lists.vpPoints.size() << "P, " << lists.vpKeyFrames.size() << "KF";
     mMessageForUser << std::setprecision(4);
     mMessageForUser << "   Camera Pos: " << se3CamFromWorld.inverse().get_translation();
 }
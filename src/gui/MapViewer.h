@@ -32,6 +32,7 @@ public:
   
 protected:
   Map &mMap;
+  int mnEpochSlot;
   GLWindow2 &mGLWindow;
   
   void DrawGrid();
@@ -68,6 +68,10 @@ void System::PrintStats() {
     std::cout << "Successful relocalizations: \t" << stats.GetSuccessfulRelocs() << std::endl;
     std::cout << "Number of key frames: \t\t\t" << stats.GetNumOfStartKeyFrames() << "(start)  -  " << stats.GetNumOfEndKeyFrames() << "(end)" << std::endl;
     std::cout << "Number of points: \t\t\t\t" << stats.GetNumOfStartPoints() << "(start)  -  " << stats.GetNumOfEndPoints() << "(end)" << std::endl;
+    std::cout << "Key frame queue: \t\t\t\t" << stats.GetMaxKeyFrameQueueDepth() << "(max depth)  -  " << stats.GetDroppedKeyFrames() << "(dropped)" << std::endl;
+    std::cout << "Reloc frame queue: \t\t\t\t" << stats.GetMaxRelocQueueDepth() << "(max depth)  -  " << stats.GetDroppedRelocFrames() << "(dropped)" << std::endl;
+    std::cout << "Global BA: \t\t\t\t\t\t" << stats.GetGlobalBundleSlices() << "(slices)  -  " << stats.GetGlobalBundleSeconds() << " s(total)  -  "
+              << stats.GetMaxGlobalBundleSlice() << " s(longest slice)  -  " << stats.GetGlobalBundleError() << "(last error)" << std::endl;
     std::cout << "###########################################################" << std::endl;
 }
 
@@ -125,6 +129,8 @@ void System::Run() {
         mGLWindow->HandlePendingEvents();
     }
     stats.SetEndStats(mpMap->vpKeyFrames.size(), mpMap->vpPoints.size());
+    mpMapMaker->ReportQueueStats();
+    mpMapMaker->ReportBundleStats();
     PrintStats();
 }
 
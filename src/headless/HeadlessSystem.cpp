@@ -51,6 +51,14 @@ void HeadlessSystem::PrintStats() {
     std::cout << "N_POINTS_START=" << stats.GetNumOfStartPoints() << std::endl;
     std::cout << "N_KEYFRAMES_END=" << stats.GetNumOfEndKeyFrames() << std::endl;
     std::cout << "N_POINTS_END=" << stats.GetNumOfEndPoints() << std::endl;
+    std::cout << "KF_QUEUE_MAX_DEPTH=" << stats.GetMaxKeyFrameQueueDepth() << std::endl;
+    std::cout << "KF_QUEUE_DROPPED=" << stats.GetDroppedKeyFrames() << std::endl;
+    std::cout << "RELOC_QUEUE_MAX_DEPTH=" << stats.GetMaxRelocQueueDepth() << std::endl;
+    std::cout << "RELOC_QUEUE_DROPPED=" << stats.GetDroppedRelocFrames() << std::endl;
+    std::cout << "GLOBAL_BA_SLICES=" << stats.GetGlobalBundleSlices() << std::endl;
+    std::cout << "GLOBAL_BA_SECONDS=" << stats.GetGlobalBundleSeconds() << std::endl;
+    std::cout << "GLOBAL_BA_MAX_SLICE=" << stats.GetMaxGlobalBundleSlice() << std::endl;
+    std::cout << "GLOBAL_BA_ERROR=" << stats.GetGlobalBundleError() << std::endl;
     std::cout << "###########################################################" << std::endl;
 }
 
@@ -79,6 +87,8 @@ void HeadlessSystem::Run() {
     }
 
     stats.SetEndStats(mpMap->vpKeyFrames.size(), mpMap->vpPoints.size());
+    mpMapMaker->ReportQueueStats();
+    mpMapMaker->ReportBundleStats();
     PrintStats();
 }
 
@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <cmath>
+
+#include <ptamsp/BlockSparseCholesky.h>
+
+// Dense Cholesky of a single 6x6 block, in place. Only the lower triangle of
+// A is read; on return A holds L with the upper triangle zeroed.
+static bool CholeskyBlock(Matrix<6> &A) {
+    for (int j = 0; j < 6; j++) {
+        double d = A[j][j];
+        for (int k = 0; k < j; k++)
+            d -= A[j][k] * A[j][k];
+        if (!(d > 0.0))
+            return false;
+        d = sqrt(d);
+        A[j][j] = d;
+        for (int i = j + 1; i < 6; i++) {
+            double v = A[i][j];
+            for (int k = 0; k < j; k++)
+                v -= A[i][k] * A[j][k];
+            A[i][j] = v / d;
+        }
+    }
+    for (int j = 1; j < 6; j++)
+        for (int i = 0; i < j; i++)
+            A[i][j] = 0.0;
+    return true;
+}
+
+// X := X * L^-T, for lower-triangular L
+static void SolveRightLowerTransposed(const Matrix<6> &L, Matrix<6> &X) {
+    for (int r = 0; r < 6; r++)
+        for (int m = 0; m < 6; m++) {
+            double v = X[r][m];
+            for (int k = 0; k < m; k++)
+                v -= L[m][k] * X[r][k];
+            X[r][m] = v / L[m][m];
+        }
+}
+
+// x := L^-1 x
+static void ForwardSubstitute(const Matrix<6> &L, Vector<6> &x) {
+    for (int m = 0; m < 6; m++) {
+        double v = x[m];
+        for (int k = 0; k < m; k++)
+            v -= L[m][k] * x[k];
+        x[m] = v / L[m][m];
+    }
+}
+
+// x := L^-T x
+static void BackSubstitute(const Matrix<6> &L, Vector<6> &x) {
+    for (int m = 5; m >= 0; m--) {
+        double v = x[m];
+        for (int k = m + 1; k < 6; k++)
+            v -= L[k][m] * x[k];
+        x[m] = v / L[m][m];
+    }
+}
+
+// Minimum degree on the quotient graph, with the approximate degrees of AMD
+// (Amestoy, Davis and Duff.) An eliminated block becomes an element which
+// stands for the clique its neighbours would form, so fill is never built
+// explicitly and each step only costs as much as the pivot's neighbourhood.
+void BlockSparseCholesky::MinimumDegreeOrdering(const std::vector<std::vector<int> > &vAdj) {
+    const int n = mnBlocks;
+    std::vector<std::vector<int> > vVars(vAdj);    // Uneliminated neighbours of each variable
+    std::vector<std::vector<int> > vElems(n);      // Elements next to each variable
+    std::vector<std::vector<int> > vElemVars(n);   // The variables of each element
+    std::vector<int> vDegree(n);
+    std::vector<bool> vbEliminated(n, false);
+    std::vector<bool> vbAbsorbed(n, false);
+    std::vector<int> vMark(n, 0);
+    int nStamp = 0;
+    std::vector<int> vW(n, -1);   // |Le \ Lp| while a step works out degrees
+
+    // One doubly-linked list of variables per degree
+    std::vector<int> vHead(n + 1, -1), vNext(n, -1), vPrev(n, -1);
+    auto Insert = [&](int i) {
+        int d = vDegree[i];
+        vPrev[i] = -1;
+        vNext[i] = vHead[d];
+        if (vHead[d] >= 0)
+            vPrev[vHead[d]] = i;
+        vHead[d] = i;
+    };
+    auto Remove = [&](int i) {
+        if (vPrev[i] >= 0)
+            vNext[vPrev[i]] = vNext[i];
+        else
+            vHead[vDegree[i]] = vNext[i];
+        if (vNext[i] >= 0)
+            vPrev[vNext[i]] = vPrev[i];
+    };
+    for (int i = 0; i < n; i++) {
+        vDegree[i] = vVars[i].size();
+        Insert(i);
+    }
+
+    mvPerm.assign(n, -1);
+    mvInvPerm.assign(n, -1);
+    int nMinDegree = 0;
+    for (int nStep = 0; nStep < n; nStep++) {
+        while (vHead[nMinDegree] < 0)
+            nMinDegree++;
+        int p = vHead[nMinDegree];
+        Remove(p);
+        mvPerm[p] = nStep;
+        mvInvPerm[nStep] = p;
+        vbEliminated[p] = true;
+
+        // Lp: p's neighbours, directly or through the elements it absorbs
+        nStamp++;
+        vMark[p] = nStamp;
+        std::vector<int> &vLp = vElemVars[p];
+        for (int i : vVars[p])
+            if (vMark[i] != nStamp) {
+                vMark[i] = nStamp;
+                vLp.push_back(i);
+            }
+        for (int e : vElems[p]) {
+            if (vbAbsorbed[e])
+                continue;
+            for (int i : vElemVars[e])
+                if (vMark[i] != nStamp) {
+                    vMark[i] = nStamp;
+                    vLp.push_back(i);
+                }
+            vbAbsorbed[e] = true;
+            std::vector<int>().swap(vElemVars[e]);
+        }
+        std::vector<int>().swap(vVars[p]);
+        std::vector<int>().swap(vElems[p]);
+
+        // Element p now connects the whole of Lp, so Lp's direct links to
+        // each other (and to p) go, as do the elements p absorbed.
+        for (int i : vLp) {
+            Remove(i);
+            std::vector<int> &vi = vVars[i];
+            vi.erase(std::remove_if(vi.begin(), vi.end(), [&](int v) { return vMark[v] == nStamp; }), vi.end());
+            std::vector<int> &ei = vElems[i];
+            ei.erase(std::remove_if(ei.begin(), ei.end(), [&](int e) { return vbAbsorbed[e]; }), ei.end());
+            ei.push_back(p);
+        }
+
+        // Approximate external degrees. An element with nothing outside Lp
+        // adds nothing p doesn't, so it is absorbed as well.
+        for (int i : vLp)
+            for (int e : vElems[i]) {
+                if (e == p)
+                    continue;
+                if (vW[e] < 0)
+                    vW[e] = vElemVars[e].size();
+                vW[e]--;
+            }
+        const int nLp = vLp.size();
+        const int nOthers = n - nStep - 2;   // Uneliminated variables besides i
+        for (int i : vLp) {
+            int d = vVars[i].size() + nLp - 1;
+            for (int e : vElems[i])
+                if (e != p) {
+                    if (vW[e] == 0)
+                        vbAbsorbed[e] = true;
+                    else
+                        d += vW[e];
+                }
+            d = std::min(d, vDegree[i] + nLp - 1);
+            vDegree[i] = std::max(0, std::min(d, nOthers));
+            Insert(i);
+            nMinDegree = std::min(nMinDegree, vDegree[i]);
+        }
+        for (int i : vLp) {
+            std::vector<int> &ei = vElems[i];
+            for (int e : ei) {
+                vW[e] = -1;
+                if (vbAbsorbed[e])
+                    std::vector<int>().swap(vElemVars[e]);
+            }
+            ei.erase(std::remove_if(ei.begin(), ei.end(), [&](int e) { return vbAbsorbed[e]; }), ei.end());
+        }
+    }
+}
+
+void BlockSparseCholesky::SetStructure(int nBlocks, const std::vector<std::pair<int, int> > &vPairs) {
+    mnBlocks = nBlocks;
+    std::vector<std::vector<int> > vAdj(mnBlocks);
+    for (const auto &p : vPairs) {
+        if (p.first == p.second)
+            continue;
+        vAdj[p.first].push_back(p.second);
+        vAdj[p.second].push_back(p.first);
+    }
+    for (auto &v : vAdj) {
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    }
+
+    MinimumDegreeOrdering(vAdj);
+
+    // Symbolic factorisation: the pattern of column c of L is that of A's column c
+    // plus the patterns of its children in the elimination tree.
+    std::vector<std::vector<int> > vStruct(mnBlocks);
+    for (int j = 0; j < mnBlocks; j++)
+        for (int k : vAdj[j]) {
+            int pj = mvPerm[j];
+            int pk = mvPerm[k];
+            if (pj > pk)
+                vStruct[pk].push_back(pj);
+        }
+    std::vector<std::vector<int> > vChildren(mnBlocks);
+    for (int c = 0; c < mnBlocks; c++) {
+        for (int ch : vChildren[c])
+            for (int r : vStruct[ch])
+                if (r > c)
+                    vStruct[c].push_back(r);
+        std::sort(vStruct[c].begin(), vStruct[c].end());
+        vStruct[c].erase(std::unique(vStruct[c].begin(), vStruct[c].end()), vStruct[c].end());
+        if (!vStruct[c].empty())
+            vChildren[vStruct[c][0]].push_back(c);
+    }
+
+    mvColStart.resize(mnBlocks + 1);
+    mvRowIndex.clear();
+    for (int c = 0; c < mnBlocks; c++) {
+        mvColStart[c] = mvRowIndex.size();
+        mvRowIndex.push_back(c);
+        mvRowIndex.insert(mvRowIndex.end(), vStruct[c].begin(), vStruct[c].end());
+    }
+    mvColStart[mnBlocks] = mvRowIndex.size();
+    mvBlocks.resize(mvRowIndex.size());
+}
+
+int BlockSparseCholesky::FindSlot(int nRow, int nCol) const {
+    auto begin = mvRowIndex.begin() + mvColStart[nCol] + 1;
+    auto end = mvRowIndex.begin() + mvColStart[nCol + 1];
+    auto it = std::lower_bound(begin, end, nRow);
+    if (it == end || *it != nRow)
+        return -1;
+    return it - mvRowIndex.begin();
+}
+
+int BlockSparseCholesky::Slot(int j, int k, bool &bTransposed) const {
+    int pj = mvPerm[j];
+    int pk = mvPerm[k];
+    bTransposed = pj < pk;
+    if (bTransposed)
+        return FindSlot(pk, pj);
+    return FindSlot(pj, pk);
+}
+
+void BlockSparseCholesky::Zero() {
+    for (auto &m : mvBlocks)
+        m = Zeros;
+}
+
+// Right-looking block Cholesky: factor a column, then push its outer
+// product into the trailing columns. All targets exist thanks to the symbolic step.
+bool BlockSparseCholesky::Factorise() {
+    for (int c = 0; c < mnBlocks; c++) {
+        Matrix<6> &L_cc = mvBlocks[mvColStart[c]];
+        if (!CholeskyBlock(L_cc))
+            return false;
+
+        int nFirst = mvColStart[c] + 1;
+        int nEnd = mvColStart[c + 1];
+        for (int s = nFirst; s < nEnd; s++)
+            SolveRightLowerTransposed(L_cc, mvBlocks[s]);
+
+        for (int s1 = nFirst; s1 < nEnd; s1++) {
+            int r1 = mvRowIndex[s1];
+            const Matrix<6> &L_r1c = mvBlocks[s1];
+            for (int s2 = nFirst; s2 <= s1; s2++) {
+                int r2 = mvRowIndex[s2];
+                int nTarget = (r1 == r2) ? mvColStart[r1] : FindSlot(r1, r2);
+                mvBlocks[nTarget] -= L_r1c * mvBlocks[s2].T();
+            }
+        }
+    }
+    return true;
+}
+
+Vector<> BlockSparseCholesky::Solve(const Vector<> &b) const {
+    std::vector<Vector<6> > vY(mnBlocks);
+    for (int j = 0; j < mnBlocks; j++)
+        vY[mvPerm[j]] = b.slice(j * 6, 6);
+
+    // L y = b
+    for (int c = 0; c < mnBlocks; c++) {
+        ForwardSubstitute(mvBlocks[mvColStart[c]], vY[c]);
+        for (int s = mvColStart[c] + 1; s < mvColStart[c + 1]; s++)
+            vY[mvRowIndex[s]] -= mvBlocks[s] * vY[c];
+    }
+    // L^T x = y
+    for (int c = mnBlocks - 1; c >= 0; c--) {
+        for (int s = mvColStart[c] + 1; s < mvColStart[c + 1]; s++)
+            vY[c] -= mvBlocks[s].T() * vY[mvRowIndex[s]];
+        BackSubstitute(mvBlocks[mvColStart[c]], vY[c]);
+    }
+
+    Vector<> x(mnBlocks * 6);
+    for (int j = 0; j < mnBlocks; j++)
+        x.slice(j * 6, 6) = vY[mvPerm[j]];
+    return x;
+}
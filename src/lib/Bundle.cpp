@@ -1,7 +1,9 @@
 // Copyright 2008 Isis Innovation Limited
 
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
+#include <iterator>
 
 #include <TooN/helpers.h>
 #include <TooN/Cholesky.h>
@@ -21,74 +23,192 @@ inline bool isnan(double d) {return !(d==d);}
 
 // Some inlines which replace standard matrix multiplications 
 // with LL-triangle-only versions.
-inline void BundleTriangle_UpdateM6U_LL(Matrix<6> &m6U, Matrix<2, 6> &m26A) {
+template<typename Precision>
+inline void BundleTriangle_UpdateM6U_LL(Matrix<6, 6, Precision> &m6U, const Matrix<2, 6, Precision> &m26A) {
     for (int r = 0; r < 6; r++)
         for (int c = 0; c <= r; c++)
             m6U(r, c) += m26A.T()(r, 0) * m26A(0, c) + m26A.T()(r, 1) * m26A(1, c);
 }
 
-inline void BundleTriangle_UpdateM3V_LL(Matrix<3> &m3V, Matrix<2, 3> &m23B) {
+template<typename Precision>
+inline void BundleTriangle_UpdateM3V_LL(Matrix<3, 3, Precision> &m3V, const Matrix<2, 3, Precision> &m23B) {
     for (int r = 0; r < 3; r++)
         for (int c = 0; c <= r; c++)
             m3V(r, c) += m23B.T()(r, 0) * m23B(0, c) + m23B.T()(r, 1) * m23B(1, c);
 }
 
+// Seconds since t; moves t on to now. Used for the per-phase timings.
+static double Lap(std::chrono::steady_clock::time_point &t) {
+    std::chrono::steady_clock::time_point tNow = std::chrono::steady_clock::now();
+    double dSeconds = std::chrono::duration<double>(tNow - t).count();
+    t = tNow;
+    return dSeconds;
+}
+
 // Constructor copies MapMaker's camera parameters
-Bundle::Bundle(const ATANCamera &TCam)
+template<typename Scalar>
+BundleT<Scalar>::BundleT(const ATANCamera &TCam)
         : mCamera(TCam) {
     mnCamsToUpdate = 0;
-    mnStartRow = 0;
+    mnIndexedMeas = 0;
+    mbStructureChanged = true;
+    mbResumeLM = false;
+    mnUpdateStamp = 0;
+    mRequestedSolver = SOLVER_DEFAULT;
+    mIndexedSolver = SOLVER_DEFAULT;
+    mnThreads = -1;
     GV3::Register(mgvnMaxIterations, "Bundle.MaxIterations", 20, SILENT);
     GV3::Register(mgvdUpdateConvergenceLimit, "Bundle.UpdateSquaredConvergenceLimit", 1e-06, SILENT);
     GV3::Register(mgvnBundleCout, "Bundle.Cout", 0, SILENT);
 };
 
 // Add a camera to the system, return value is the bundle adjuster's ID for the camera
-int Bundle::AddCamera(SE3<> se3CamFromWorld, bool bFixed) {
-    int n = mvCameras.size();
+template<typename Scalar>
+int BundleT<Scalar>::AddCamera(SE3<> se3CamFromWorld, bool bFixed) {
     Camera c;
     c.bFixed = bFixed;
+    c.bActive = true;
+    c.bDirty = true;
     c.se3CfW = se3CamFromWorld;
-    if (!bFixed) {
-        c.nStartRow = mnStartRow;
-        mnStartRow += 6;
-        mnCamsToUpdate++;
-    } else
-        c.nStartRow = -999999999;
+    c.nStartRow = -999999999;  // Assigned by GenerateCameraRows()
+    mbStructureChanged = true;
+
+    if (!mvFreeCameras.empty()) {
+        int n = mvFreeCameras.back();
+        mvFreeCameras.pop_back();
+        mvCameras[n] = c;
+        return n;
+    }
     mvCameras.push_back(c);
-
-    return n;
+    return mvCameras.size() - 1;
 }
 
-// Add a map point to the system, return value is the bundle adjuster's ID for the point
-int Bundle::AddPoint(Vector<3> v3Pos) {
-    int n = mvPoints.size();
+// Add a map point to the system, return value is the bundle adjuster's ID for the point.
+// A fixed point only constrains the cameras which see it and is never moved.
+template<typename Scalar>
+int BundleT<Scalar>::AddPoint(Vector<3> v3Pos, bool bFixed) {
     Point p;
+    p.bFixed = bFixed;
+    p.m3VStarInv = Zeros;
     if (std::isnan(v3Pos * v3Pos)) {
         // std::cerr << " You sucker, tried to give me a nan " << v3Pos << std::endl;
         v3Pos = Zeros;
     }
     p.v3Pos = v3Pos;
+    mbStructureChanged = true;
+
+    if (!mvFreePoints.empty()) {
+        int n = mvFreePoints.back();
+        mvFreePoints.pop_back();
+        mvPoints[n] = p;
+        return n;
+    }
     mvPoints.push_back(p);
-    return n;
+    return mvPoints.size() - 1;
+}
+
+// Removed cameras and points are treated as fixed until the next re-index
+// drops their measurements; only then can their ids be reused.
+template<typename Scalar>
+void BundleT<Scalar>::RemoveCamera(int n) {
+    mvCameras.at(n).bActive = false;
+    mvCameras[n].bFixed = true;
+    mvCameras[n].bDirty = true;
+    mvRemovedCameras.push_back(n);
+    mbStructureChanged = true;
+}
+
+template<typename Scalar>
+void BundleT<Scalar>::RemovePoint(int n) {
+    mvPoints.at(n).bActive = false;
+    mvPoints[n].bFixed = true;
+    mvPoints[n].bDirty = true;
+    mvRemovedPoints.push_back(n);
+    mbStructureChanged = true;
+}
+
+template<typename Scalar>
+void BundleT<Scalar>::SetCamera(int n, SE3<> se3CamFromWorld, bool bFixed) {
+    Camera &c = mvCameras.at(n);
+    if (c.bFixed != bFixed) {
+        c.bDirty = true;
+        mbStructureChanged = true;
+    }
+    c.bFixed = bFixed;
+    c.se3CfW = se3CamFromWorld;
+}
+
+template<typename Scalar>
+void BundleT<Scalar>::SetPoint(int n, Vector<3> v3Pos, bool bFixed) {
+    Point &p = mvPoints.at(n);
+    if (p.bFixed != bFixed) {
+        p.bDirty = true;
+        mbStructureChanged = true;
+    }
+    p.bFixed = bFixed;
+    if (!std::isnan(v3Pos * v3Pos))
+        p.v3Pos = v3Pos;
+}
+
+template<typename Scalar>
+void BundleT<Scalar>::BeginUpdate() {
+    mnUpdateStamp++;
+}
+
+// Updates the measurement if the problem already has it, otherwise adds it.
+// A measurement passed in again is no longer considered an outlier.
+template<typename Scalar>
+void BundleT<Scalar>::UpdateMeas(int nCam, int nPoint, Vector<2> v2Pos, double dSigmaSquared) {
+    Meas key;
+    key.c = nCam;
+    key.p = nPoint;
+    auto end = mvMeas.begin() + mnIndexedMeas;
+    auto it = std::lower_bound(mvMeas.begin(), end, key);
+    if (it == end || it->c != nCam || it->p != nPoint || it->bRemoved) {
+        AddMeas(nCam, nPoint, v2Pos, dSigmaSquared);
+        return;
+    }
+    it->v2Found = v2Pos;
+    it->dSqrtInvNoise = sqrt(1.0 / dSigmaSquared);
+    it->nUpdateStamp = mnUpdateStamp;
+    if (it->bOutlier) {
+        it->bOutlier = false;
+        mvPoints[nPoint].nOutliers--;
+    }
+}
+
+template<typename Scalar>
+void BundleT<Scalar>::EndUpdate() {
+    for (size_t n = 0; n < mvMeas.size(); n++) {
+        Meas &meas = mvMeas[n];
+        if (!meas.bRemoved && meas.nUpdateStamp != mnUpdateStamp) {
+            meas.bRemoved = true;
+            mbStructureChanged = true;
+        }
+    }
 }
 
 // Add a measurement of one point with one camera
-void Bundle::AddMeas(int nCam, int nPoint, Vector<2> v2Pos, double dSigmaSquared) {
+template<typename Scalar>
+void BundleT<Scalar>::AddMeas(int nCam, int nPoint, Vector<2> v2Pos, double dSigmaSquared) {
     assert(nCam < (int) mvCameras.size());
     assert(nPoint < (int) mvPoints.size());
     mvPoints[nPoint].nMeasurements++;
-    mvPoints[nPoint].sCameras.insert(nCam);
+    mvPoints[nPoint].bDirty = true;
     Meas m;
     m.p = nPoint;
     m.c = nCam;
+    m.bPointFixed = mvPoints[nPoint].bFixed;
     m.v2Found = v2Pos;
     m.dSqrtInvNoise = sqrt(1.0 / dSigmaSquared);
-    mMeasList.push_back(m);
+    m.nUpdateStamp = mnUpdateStamp;
+    mvMeas.push_back(m);
+    mbStructureChanged = true;
 }
 
 // Zero temporary quantities stored in cameras and points
-void Bundle::ClearAccumulators() {
+template<typename Scalar>
+void BundleT<Scalar>::ClearAccumulators() {
     for (size_t i = 0; i < mvPoints.size(); ++i) {
         mvPoints[i].m3V = Zeros;
         mvPoints[i].v3EpsilonB = Zeros;
@@ -104,25 +224,82 @@ void Bundle::ClearAccumulators() {
 // and bundle adjustment needs to be aborted.
 // Returns number of accepted iterations if all good, negative 
 // value for big error.
-int Bundle::Compute(bool *pbAbortSignal) {
+template<typename Scalar>
+int BundleT<Scalar>::Compute(std::atomic<bool> *pbAbortSignal, double dTimeBudget) {
     mpbAbortSignal = pbAbortSignal;
+    mStartTime = std::chrono::steady_clock::now();
+    mdTimeBudget = dTimeBudget;
+    mProgress = BundleProgress();
+    std::chrono::steady_clock::time_point tPhase = mStartTime;
+
+    // 0 means one thread per core
+    static gvar3<int> gvnThreads("Bundle.Threads", 0, SILENT);
+    if (!mpPool) {
+        mpOwnPool.reset(new WorkerPool(mnThreads >= 0 ? mnThreads : *gvnThreads));
+        mpPool = mpOwnPool.get();
+    }
 
-    // Some speedup data structures
-    GenerateMeasLUTs();
-    GenerateOffDiagScripts();
+    mvOutlierMeasurementIdx.clear();
 
-    // Initially behave like gauss-newton
-    mdLambda = 0.0001;
-    mdLambdaFactor = 2.0;
+    // Dense is the original solver, kept around for comparison.
+    static gvar3<std::string> gvsSolver("Bundle.Solver", "Sparse", SILENT);
+    mSolver = mRequestedSolver;
+    if (mSolver == SOLVER_DEFAULT) {
+        if (*gvsSolver == "Dense")
+            mSolver = SOLVER_DENSE;
+        else if (*gvsSolver == "PCG")
+            mSolver = SOLVER_PCG;
+        else
+            mSolver = SOLVER_SPARSE;
+    }
+
+    // Some speedup data structures. These only need redoing if the problem's
+    // structure changed since the last Compute(), and then only for the
+    // cameras and points that changed, unless the solver did.
+    if (mbStructureChanged || mSolver != mIndexedSolver) {
+        std::vector<int> vMeasRemap;
+        GenerateCameraRows();
+        GenerateMeasIndex(vMeasRemap);
+        // PCG works straight from the measurements, so it doesn't need the
+        // off-diagonal scripts (which grow with the square of the observations per point.)
+        if (mSolver != SOLVER_PCG) {
+            GenerateOffDiagScripts(vMeasRemap, mSolver != mIndexedSolver);
+        } else {
+            mvOffDiagScript.clear();
+            mvOffDiagBlocks.clear();
+        }
+        if (mSolver == SOLVER_SPARSE)
+            GenerateSparseStructure();
+        for (size_t j = 0; j < mvCameras.size(); j++)
+            mvCameras[j].bDirty = false;
+        for (size_t i = 0; i < mvPoints.size(); i++)
+            mvPoints[i].bDirty = false;
+        mbStructureChanged = false;
+        mIndexedSolver = mSolver;
+    }
+    mProgress.dSetupSeconds = Lap(tPhase);
+    if (mSolver == SOLVER_PCG) {
+        mvUStar.resize(mnCamsToUpdate);
+        mvSDiagonal.resize(mnCamsToUpdate);
+        mvPCGPointTemp.resize(mvPoints.size());
+    }
+
+    // Initially behave like gauss-newton; but if the last run was cut short,
+    // pick up where it left off.
+    if (!mbResumeLM) {
+        mdLambda = 0.0001;
+        mdLambdaFactor = 2.0;
+    }
     mbConverged = false;
     mbHitMaxIterations = false;
     mnCounter = 0;
     mnAccepted = 0;
+    mProgress.dInitialError = -1.0;
 
     // What MEstimator are we using today?
     static gvar3<std::string> gvsMEstimator("BundleMEstimator", "Tukey", SILENT);
 
-    while (!mbConverged && !mbHitMaxIterations && !*pbAbortSignal) {
+    while (!mbConverged && !mbHitMaxIterations && !*pbAbortSignal && !OutOfTime()) {
         bool bNoError;
         if (*gvsMEstimator == "Cauchy")
             bNoError = Do_LM_Step<Cauchy>(pbAbortSignal);
@@ -137,9 +314,18 @@ int Bundle::Compute(bool *pbAbortSignal) {
             bNoError = Do_LM_Step<Tukey>(pbAbortSignal);
         };
 
-        if (!bNoError)
+        if (!bNoError) {
+            mbResumeLM = false;
             return -1;
+        }
     }
+    mProgress.nIterations = mnCounter;
+    mProgress.nAccepted = mnAccepted;
+    mProgress.dLambda = mdLambda;
+    mProgress.bConverged = mbConverged;
+    mProgress.bOutOfTime = !mbConverged && OutOfTime();
+    mProgress.dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStartTime).count();
+    mbResumeLM = !mbConverged && (*pbAbortSignal || mProgress.bOutOfTime);
 
     if (mbHitMaxIterations)
         cout << "  Hit max iterations." << std::endl;
@@ -148,39 +334,54 @@ int Bundle::Compute(bool *pbAbortSignal) {
 };
 
 // Reproject a single measurement, find error
-inline void Bundle::ProjectAndFindSquaredError(Meas &meas) {
+// The camera model caches state from the last projection, so each thread passes its own copy.
+template<typename Scalar>
+inline void BundleT<Scalar>::ProjectAndFindSquaredError(ATANCamera &camera, Meas &meas, MeasProjection &proj) {
     Camera &cam = mvCameras[meas.c];
     Point &point = mvPoints[meas.p];
 
     // Project the point.
-    meas.v3Cam = cam.se3CfW * point.v3Pos;
-    if (meas.v3Cam[2] <= 0) {
+    proj.v3Cam = cam.se3CfW * point.v3Pos;
+    if (proj.v3Cam[2] <= 0) {
         meas.bBad = true;
         return;
     }
     meas.bBad = false;
-    Vector<2> v2ImPlane = project(meas.v3Cam);
-    Vector<2> v2Image = mCamera.Project(v2ImPlane);
-    meas.m2CamDerivs = mCamera.GetProjectionDerivs();
-    meas.v2Epsilon = meas.dSqrtInvNoise * (meas.v2Found - v2Image);
-    meas.dErrorSquared = meas.v2Epsilon * meas.v2Epsilon;
+    Vector<2> v2ImPlane = project(proj.v3Cam);
+    Vector<2> v2Image = camera.Project(v2ImPlane);
+    proj.m2CamDerivs = camera.GetProjectionDerivs();
+    Vector<2> v2Epsilon = meas.dSqrtInvNoise * (meas.v2Found - v2Image);
+    meas.v2Epsilon = v2Epsilon;
+    meas.dErrorSquared = v2Epsilon * v2Epsilon;
 }
 
+template<typename Scalar>
 template<class MEstimator>
-bool Bundle::Do_LM_Step(bool *pbAbortSignal) {
+bool BundleT<Scalar>::Do_LM_Step(std::atomic<bool> *pbAbortSignal) {
+    std::chrono::steady_clock::time_point tPhase = std::chrono::steady_clock::now();
+
     // Reset all accumulators to zero
     ClearAccumulators();
 
+    // All the passes below are split over cameras or points (never over
+    // measurements feeding the same accumulator), and partial sums are reduced
+    // serially in a fixed order, so results don't depend on the thread count.
+
     //  Do a LM step according to Hartley and Zisserman Algo A6.4 in MVG 2nd Edition
     //  Actual work starts a bit further down - first we have to work out the
     //  projections and errors for each point, so we can do tukey reweighting
+    mpPool->ParallelFor(mvMeas.size(), [&](int nBegin, int nEnd) {
+        ATANCamera camera = mCamera;
+        for (int n = nBegin; n < nEnd; n++)
+            if (!mvMeas[n].bOutlier)
+                ProjectAndFindSquaredError(camera, mvMeas[n], mvMeasProj[n]);
+    });
+
     std::vector<double> vdErrorSquared;
-    for (std::list<Meas>::iterator itr = mMeasList.begin(); itr != mMeasList.end(); itr++) {
-        Meas &meas = *itr;
-        ProjectAndFindSquaredError(meas);
-        if (!meas.bBad)
-            vdErrorSquared.push_back(meas.dErrorSquared);
-    };
+    vdErrorSquared.reserve(mvMeas.size());
+    for (size_t n = 0; n < mvMeas.size(); n++)
+        if (!mvMeas[n].bBad)
+            vdErrorSquared.push_back(mvMeas[n].dErrorSquared);
 
     // Projected all points and got vector of errors; find the median,
     // And work out robust estimate of sigma, then scale this for the tukey
@@ -200,226 +401,310 @@ bool Bundle::Do_LM_Step(bool *pbAbortSignal) {
     //  `` (i) Compute the derivative matrices Aij = [dxij/daj]
     //      and Bij = [dxij/dbi] and the error vectors eij''
     //
-    //  Here we do this by looping over all measurements
+    //  Here we do this by looping over each camera's measurements
     //
-    //  While we're here, might as well update the accumulators U, ea, B, eb
+    //  While we're here, might as well update the accumulators U, ea
     //  from part (ii) as well, and let's calculate Wij while we're here as well.
+    //  B is kept so that V and eb can be summed per point afterwards.
+    std::vector<double> vdCamError(mvCameras.size(), 0.0);
+    mpPool->ParallelFor(mvCameras.size(), [&](int nBegin, int nEnd) {
+        for (int j = nBegin; j < nEnd; j++) {
+            Camera &cam = mvCameras[j];
+            double dError = 0.0;
+            for (int n = mvCamMeasStart[j]; n < mvCamMeasStart[j + 1]; n++) {
+                Meas &meas = mvMeas[n];
+                if (meas.bOutlier)
+                    continue;
+                const MeasProjection &proj = mvMeasProj[n];
 
-    double dCurrentError = 0.0;
-    for (std::list<Meas>::iterator itr = mMeasList.begin(); itr != mMeasList.end(); itr++) {
-        Meas &meas = *itr;
-        Camera &cam = mvCameras[meas.c];
-        Point &point = mvPoints[meas.p];
-
-        // Project the point.
-        // We've done this before - results are still cached in meas.
-        if (meas.bBad) {
-            dCurrentError += 1.0;
-            continue;
-        };
+                // Project the point.
+                // We've done this before - results are still cached in proj.
+                if (meas.bBad) {
+                    dError += 1.0;
+                    continue;
+                };
+
+                // What to do with the weights? The easiest option is to independently weight
+                // The two jacobians, A and B, with sqrt of the tukey weight w;
+                // And also weight the error vector v2Epsilon.
+                // That makes everything else automatic.
+                // Calc the square root of the tukey weight:
+                double dWeight = MEstimator::SquareRootWeight(meas.dErrorSquared, mdSigmaSquared);
+                // Re-weight error:
+                meas.v2Epsilon *= (Scalar) dWeight;
+
+                if (dWeight == 0) {
+                    meas.bBad = true;
+                    dError += 1.0;
+                    continue;
+                }
 
-        // What to do with the weights? The easiest option is to independently weight
-        // The two jacobians, A and B, with sqrt of the tukey weight w;
-        // And also weight the error vector v2Epsilon.
-        // That makes everything else automatic.
-        // Calc the square root of the tukey weight:
-        double dWeight = MEstimator::SquareRootWeight(meas.dErrorSquared, mdSigmaSquared);
-        // Re-weight error:
-        meas.v2Epsilon = dWeight * meas.v2Epsilon;
-
-        if (dWeight == 0) {
-            meas.bBad = true;
-            dCurrentError += 1.0;
-            continue;
-        }
+                dError += MEstimator::ObjectiveScore(meas.dErrorSquared, mdSigmaSquared);
 
-        dCurrentError += MEstimator::ObjectiveScore(meas.dErrorSquared, mdSigmaSquared);
+                // To re-weight the jacobians, I'll just re-weight the camera param matrix
+                // This is only used for the jacs and will save a few fmuls
+                Matrix<2> m2CamDerivs = dWeight * proj.m2CamDerivs;
 
-        // To re-weight the jacobians, I'll just re-weight the camera param matrix
-        // This is only used for the jacs and will save a few fmuls
-        Matrix<2> m2CamDerivs = dWeight * meas.m2CamDerivs;
+                const double dOneOverCameraZ = 1.0 / proj.v3Cam[2];
+                const Vector<4> v4Cam = unproject(proj.v3Cam);
 
-        const double dOneOverCameraZ = 1.0 / meas.v3Cam[2];
-        const Vector<4> v4Cam = unproject(meas.v3Cam);
+                // A is only needed to build the accumulators and W, so it doesn't outlive this iteration.
+                // The derivatives are worked out in double and only then stored in Scalar.
+                Matrix<2, 6, Scalar> m26A;
+                Matrix<2, 3, Scalar> m23B;
 
-        // Calculate A: (the proj derivs WRT the camera)
-        if (cam.bFixed)
-            meas.m26A = Zeros;
-        else {
-            for (int m = 0; m < 6; m++) {
-                const Vector<4> v4Motion = SE3<>::generator_field(m, v4Cam);
-                Vector<2> v2CamFrameMotion;
-                v2CamFrameMotion[0] = (v4Motion[0] - v4Cam[0] * v4Motion[2] * dOneOverCameraZ) * dOneOverCameraZ;
-                v2CamFrameMotion[1] = (v4Motion[1] - v4Cam[1] * v4Motion[2] * dOneOverCameraZ) * dOneOverCameraZ;
-                meas.m26A.T()[m] = meas.dSqrtInvNoise * m2CamDerivs * v2CamFrameMotion;
-            };
-        }
+                // Calculate A: (the proj derivs WRT the camera)
+                if (cam.bFixed)
+                    m26A = Zeros;
+                else {
+                    for (int m = 0; m < 6; m++) {
+                        const Vector<4> v4Motion = SE3<>::generator_field(m, v4Cam);
+                        Vector<2> v2CamFrameMotion;
+                        v2CamFrameMotion[0] = (v4Motion[0] - v4Cam[0] * v4Motion[2] * dOneOverCameraZ) * dOneOverCameraZ;
+                        v2CamFrameMotion[1] = (v4Motion[1] - v4Cam[1] * v4Motion[2] * dOneOverCameraZ) * dOneOverCameraZ;
+                        Vector<2> v2Column = meas.dSqrtInvNoise * m2CamDerivs * v2CamFrameMotion;
+                        m26A.T()[m] = v2Column;
+                    };
+                }
 
-        // Calculate B: (the proj derivs WRT the point)
-        for (int m = 0; m < 3; m++) {
-            const Vector<3> v3Motion = cam.se3CfW.get_rotation().get_matrix().T()[m];
-            Vector<2> v2CamFrameMotion;
-            v2CamFrameMotion[0] = (v3Motion[0] - v4Cam[0] * v3Motion[2] * dOneOverCameraZ) * dOneOverCameraZ;
-            v2CamFrameMotion[1] = (v3Motion[1] - v4Cam[1] * v3Motion[2] * dOneOverCameraZ) * dOneOverCameraZ;
-            meas.m23B.T()[m] = meas.dSqrtInvNoise * m2CamDerivs * v2CamFrameMotion;
-        };
+                // Calculate B: (the proj derivs WRT the point)
+                // Fixed points have no parameters, so no B and no coupling W.
+                if (!meas.bPointFixed) {
+                    for (int m = 0; m < 3; m++) {
+                        const Vector<3> v3Motion = cam.se3CfW.get_rotation().get_matrix().T()[m];
+                        Vector<2> v2CamFrameMotion;
+                        v2CamFrameMotion[0] = (v3Motion[0] - v4Cam[0] * v3Motion[2] * dOneOverCameraZ) * dOneOverCameraZ;
+                        v2CamFrameMotion[1] = (v3Motion[1] - v4Cam[1] * v3Motion[2] * dOneOverCameraZ) * dOneOverCameraZ;
+                        Vector<2> v2Column = meas.dSqrtInvNoise * m2CamDerivs * v2CamFrameMotion;
+                        m23B.T()[m] = v2Column;
+                    };
+                    mvMeasB[n] = m23B;
+                }
 
-        // Update the accumulators
-        if (!cam.bFixed) {
-            //	  cam.m6U += meas.m26A.T() * meas.m26A; 	  // SLOW SLOW this matrix is symmetric
-            BundleTriangle_UpdateM6U_LL(cam.m6U, meas.m26A);
-            cam.v6EpsilonA += meas.m26A.T() * meas.v2Epsilon;
-            // NOISE COVAR OMITTED because it's the 2-Identity
+                // Update the accumulators
+                if (!cam.bFixed) {
+                    //	  cam.m6U += m26A.T() * m26A; 	  // SLOW SLOW this matrix is symmetric
+                    BundleTriangle_UpdateM6U_LL(cam.m6U, m26A);
+                    cam.v6EpsilonA += m26A.T() * meas.v2Epsilon;
+                    // NOISE COVAR OMITTED because it's the 2-Identity
+                }
+
+                if (cam.bFixed || meas.bPointFixed)
+                    mvMeasW[n] = Zeros;
+                else
+                    mvMeasW[n] = m26A.T() * m23B;
+            }
+            vdCamError[j] = dError;
         }
+    });
 
-        //            point.m3V += meas.m23B.T() * meas.m23B;             // SLOW-ish this is symmetric too
-        BundleTriangle_UpdateM3V_LL(point.m3V, meas.m23B);
-        point.v3EpsilonB += meas.m23B.T() * meas.v2Epsilon;
+    double dCurrentError = 0.0;
+    for (size_t j = 0; j < vdCamError.size(); j++)
+        dCurrentError += vdCamError[j];
+
+    // Point accumulators V and eb, from each point's measurements in camera order
+    mpPool->ParallelFor(mvPoints.size(), [&](int nBegin, int nEnd) {
+        for (int i = nBegin; i < nEnd; i++) {
+            Point &point = mvPoints[i];
+            if (point.bFixed)
+                continue;
+            for (int m = mvPointMeasStart[i]; m < mvPointMeasStart[i + 1]; m++) {
+                int n = mvPointMeas[m];
+                if (mvMeas[n].bBad)
+                    continue;
+                //            point.m3V += m23B.T() * m23B;             // SLOW-ish this is symmetric too
+                BundleTriangle_UpdateM3V_LL(point.m3V, mvMeasB[n]);
+                point.v3EpsilonB += mvMeasB[n].T() * mvMeas[n].v2Epsilon;
+            }
+        }
+    });
 
-        if (cam.bFixed)
-            meas.m63W = Zeros;
-        else
-            meas.m63W = meas.m26A.T() * meas.m23B;
-    }
+    mProgress.dJacobianSeconds += Lap(tPhase);
 
     // OK, done (i) and most of (ii) except calcing Yij; this depends on Vi, which should
     // be finished now. So we can find V*i (by adding lambda) and then invert.
     // The next bits depend on mdLambda! So loop this next bit until error goes down.
-    double dNewError = dCurrentError + 9999;
-    while (dNewError > dCurrentError && !mbConverged && !mbHitMaxIterations && !*pbAbortSignal) {
-        // Rest of part (ii) : find V*i inverse
-        for (std::vector<Point>::iterator itr = mvPoints.begin(); itr != mvPoints.end(); itr++) {
-            Point &point = *itr;
-            Matrix<3> m3VStar = point.m3V;
-            if (m3VStar[0][0] * m3VStar[1][1] * m3VStar[2][2] == 0)
-                point.m3VStarInv = Zeros;
-            else {
-                // Fill in the upper-r triangle from the LL;
-                m3VStar[0][1] = m3VStar[1][0];
-                m3VStar[0][2] = m3VStar[2][0];
-                m3VStar[1][2] = m3VStar[2][1];
-
-                for (int i = 0; i < 3; i++)
-                    m3VStar[i][i] *= (1.0 + mdLambda);
-                Cholesky<3> chol(m3VStar);
-                point.m3VStarInv = chol.get_inverse();
-            };
-        }
+    if (mProgress.dInitialError < 0) {
+        mProgress.dInitialError = dCurrentError;
+        mProgress.dError = dCurrentError;
+    }
 
-        // Done part (ii), except calculating Yij;
-        // But we can do this inline when we calculate S in part (iii).
+    double dNewError = dCurrentError + 9999;
+    while (dNewError > dCurrentError && !mbConverged && !mbHitMaxIterations && !*pbAbortSignal && !OutOfTime()) {
+        // Rest of part (ii) : find V*i inverse, and Yij = Wij V*i^-1 for all its measurements
+        mpPool->ParallelFor(mvPoints.size(), [&](int nBegin, int nEnd) {
+            for (int i = nBegin; i < nEnd; i++) {
+                Point &point = mvPoints[i];
+                if (point.bFixed)
+                    continue;
+                Matrix<3, 3, Scalar> m3VStar = point.m3V;
+                if (m3VStar[0][0] * m3VStar[1][1] * m3VStar[2][2] == 0)
+                    point.m3VStarInv = Zeros;
+                else {
+                    // Fill in the upper-r triangle from the LL;
+                    m3VStar[0][1] = m3VStar[1][0];
+                    m3VStar[0][2] = m3VStar[2][0];
+                    m3VStar[1][2] = m3VStar[2][1];
+
+                    for (int d = 0; d < 3; d++)
+                        m3VStar[d][d] *= (Scalar) (1.0 + mdLambda);
+                    Cholesky<3, Scalar> chol(m3VStar);
+                    point.m3VStarInv = chol.get_inverse();
+                };
+
+                for (int m = mvPointMeasStart[i]; m < mvPointMeasStart[i + 1]; m++) {
+                    int n = mvPointMeas[m];
+                    if (!mvMeas[n].bBad)
+                        mvMeasWV[n] = mvMeasW[n] * point.m3VStarInv;
+                }
+            }
+        });
 
         // Part (iii): Construct the the big block-matrix S which will be inverted.
-        Matrix<> mS(mnCamsToUpdate * 6, mnCamsToUpdate * 6);
+        // With the sparse solver only the blocks of S which can be non-zero are stored.
+        // PCG only needs the diagonal blocks, for its preconditioner.
+        const int nDenseRows = (mSolver == SOLVER_DENSE) ? mnCamsToUpdate * 6 : 0;
+        Matrix<> mS(nDenseRows, nDenseRows);
         mS = Zeros;
+        if (mSolver == SOLVER_SPARSE)
+            mSparseS.Zero();
         Vector<> vE(mnCamsToUpdate * 6);
         vE = Zeros;
 
-        Matrix<6> m6; // Temp working space
-        Vector<6> v6; // Temp working space
-
         // Calculate on-diagonal blocks of S (i.e. only one camera at a time:)
-        for (unsigned int j = 0; j < mvCameras.size(); j++) {
-            Camera &cam_j = mvCameras[j];
-            if (cam_j.bFixed) continue;
-            int nCamJStartRow = cam_j.nStartRow;
-
-            // First, do the diagonal elements.
-            //m6= cam_j.m6U;     // can't do this anymore because cam_j.m6U is LL!!
-            for (int r = 0; r < 6; r++) {
-                for (int c = 0; c < r; c++)
-                    m6[r][c] = m6[c][r] = cam_j.m6U[r][c];
-                m6[r][r] = cam_j.m6U[r][r];
-            };
-
-            for (int nn = 0; nn < 6; nn++)
-                m6[nn][nn] *= (1.0 + mdLambda);
-
-            v6 = cam_j.v6EpsilonA;
-
-            std::vector < Meas * > &vMeasLUTj = mvMeasLUTs[j];
-            // Sum over measurements (points):
-            for (unsigned int i = 0; i < mvPoints.size(); i++) {
-                Meas *pMeas = vMeasLUTj[i];
-                if (pMeas == NULL || pMeas->bBad)
-                    continue;
-                m6 -= pMeas->m63W * mvPoints[i].m3VStarInv * pMeas->m63W.T();  // SLOW SLOW should by 6x6sy
-                v6 -= pMeas->m63W * (mvPoints[i].m3VStarInv * mvPoints[i].v3EpsilonB);
+        // Blocks are summed in Scalar and only go over to double for the solver.
+        mpPool->ParallelFor(mvCameras.size(), [&](int nBegin, int nEnd) {
+            Matrix<6, 6, Scalar> m6; // Temp working space
+            Vector<6, Scalar> v6; // Temp working space
+            for (int j = nBegin; j < nEnd; j++) {
+                Camera &cam_j = mvCameras[j];
+                if (cam_j.bFixed) continue;
+                int nCamJStartRow = cam_j.nStartRow;
+
+                // First, do the diagonal elements.
+                //m6= cam_j.m6U;     // can't do this anymore because cam_j.m6U is LL!!
+                for (int r = 0; r < 6; r++) {
+                    for (int c = 0; c < r; c++)
+                        m6[r][c] = m6[c][r] = cam_j.m6U[r][c];
+                    m6[r][r] = cam_j.m6U[r][r];
+                };
+
+                for (int nn = 0; nn < 6; nn++)
+                    m6[nn][nn] *= (Scalar) (1.0 + mdLambda);
+
+                v6 = cam_j.v6EpsilonA;
+                if (mSolver == SOLVER_PCG)
+                    mvUStar[nCamJStartRow / 6] = Matrix<6>(m6);
+
+                // Sum over measurements (points):
+                for (int n = mvCamMeasStart[j]; n < mvCamMeasStart[j + 1]; n++) {
+                    if (mvMeas[n].bBad || mvMeas[n].bPointFixed)
+                        continue;
+                    m6 -= mvMeasWV[n] * mvMeasW[n].T();  // SLOW SLOW should by 6x6sy
+                    v6 -= mvMeasWV[n] * mvPoints[mvMeas[n].p].v3EpsilonB;
+                }
+                const Matrix<6> m6S = m6;
+                if (mSolver == SOLVER_SPARSE)
+                    mSparseS.Diagonal(nCamJStartRow / 6) = m6S;
+                else if (mSolver == SOLVER_PCG)
+                    mvSDiagonal[nCamJStartRow / 6] = m6S;
+                else
+                    mS.slice(nCamJStartRow, nCamJStartRow, 6, 6) = m6S;
+                vE.slice(nCamJStartRow, 6) = Vector<6>(v6);
             }
-            mS.slice(nCamJStartRow, nCamJStartRow, 6, 6) = m6;
-            vE.slice(nCamJStartRow, 6) = v6;
-        }
+        });
 
         // Now find off-diag elements of S. These are camera-point-camera combinations, of which there are lots.
-        // New code which doesn't waste as much time finding i-jk pairs; these are pre-stored in a per-i list.
-        for (unsigned int i = 0; i < mvPoints.size(); i++) {
-            Point &p = mvPoints[i];
-            int nCurrentJ = -1;
-            int nJRow = -1;
-            Meas *pMeas_ij;
-            Meas *pMeas_ik;
-            Matrix<6, 3> m63_MIJW_times_m3VStarInv;
-
-            for (std::vector<OffDiagScriptEntry>::iterator it = p.vOffDiagonalScript.begin();
-                 it != p.vOffDiagonalScript.end();
-                 it++) {
-                OffDiagScriptEntry &e = *it;
-                pMeas_ik = mvMeasLUTs[e.k][i];
-                if (pMeas_ik == NULL || pMeas_ik->bBad)
-                    continue;
-                if (e.j != nCurrentJ) {
-                    pMeas_ij = mvMeasLUTs[e.j][i];
-                    if (pMeas_ij == NULL || pMeas_ij->bBad)
+        // The i-jk triples are pre-stored grouped by camera pair, so each block is summed by one thread.
+        mpPool->ParallelFor(mvOffDiagBlocks.size(), [&](int nBegin, int nEnd) {
+            for (int b = nBegin; b < nEnd; b++) {
+                const OffDiagBlock &block = mvOffDiagBlocks[b];
+                Matrix<6, 6, Scalar> m6Sum = Zeros;
+                for (int t = block.nFirst; t < block.nEnd; t++) {
+                    const OffDiagScriptEntry &e = mvOffDiagScript[t];
+                    if (mvMeas[e.nMeasJ].bBad || mvMeas[e.nMeasK].bBad)
                         continue;
-                    nCurrentJ = e.j;
-                    nJRow = mvCameras[e.j].nStartRow;
-                    m63_MIJW_times_m3VStarInv = pMeas_ij->m63W * p.m3VStarInv;
+                    m6Sum += mvMeasWV[e.nMeasJ] * mvMeasW[e.nMeasK].T();
+                }
+                const Matrix<6> m6 = m6Sum;
+                if (mSolver == SOLVER_SPARSE) {
+                    if (block.bTransposeSlot)
+                        mSparseS.OffDiagonal(block.nSlot) -= m6.T();
+                    else
+                        mSparseS.OffDiagonal(block.nSlot) -= m6;
+                    continue;
                 }
-                int nKRow = mvCameras[pMeas_ik->c].nStartRow;
+                int nJRow = mvCameras[block.j].nStartRow;
+                int nKRow = mvCameras[block.k].nStartRow;
+                assert(nKRow < nJRow);
 #ifndef WIN32
-                mS.slice(nJRow, nKRow, 6, 6) -= m63_MIJW_times_m3VStarInv * pMeas_ik->m63W.T();
+                mS.slice(nJRow, nKRow, 6, 6) -= m6;
 #else
                 Matrix<6> m = mS.slice(nJRow, nKRow, 6, 6);
-                m -= m63_MIJW_times_m3VStarInv * pMeas_ik->m63W.T();
+                m -= m6;
                 mS.slice(nJRow, nKRow, 6, 6) = m;
 #endif
-                assert(nKRow < nJRow);
             }
-        }
+        });
 
-        // Did this purely LL triangle - now update the TR bit as well!
-        // (This is actually unneccessary since the lapack cholesky solver
-        // uses only one triangle, but I'm leaving it in here anyway.)
-        for (int i = 0; i < mS.num_rows(); i++)
-            for (int j = 0; j < i; j++)
-                mS[j][i] = mS[i][j];
+        mProgress.dSchurSeconds += Lap(tPhase);
 
         // Got fat matrix S and vector E from part(iii). Now Cholesky-decompose
         // the matrix, and find the camera update vector.
-        Vector<> vCamerasUpdate(mS.num_rows());
-        vCamerasUpdate = Cholesky<>(mS).backsub(vE);
+        Vector<> vCamerasUpdate(mnCamsToUpdate * 6);
+        if (mSolver == SOLVER_SPARSE || mSolver == SOLVER_PCG) {
+            bool bSolved;
+            if (mSolver == SOLVER_SPARSE) {
+                bSolved = mSparseS.Factorise();
+                if (bSolved)
+                    vCamerasUpdate = mSparseS.Solve(vE);
+            } else
+                bSolved = SolvePCG(vE, vCamerasUpdate);
+            mProgress.dSolveSeconds += Lap(tPhase);
+
+            if (!bSolved) {
+                // Not positive definite at this lambda; treat it like a bad step.
+                cout << "S not positive definite, L" << mdLambda << " TRY AGAIN " << std::endl;
+                ModifyLambda_BadStep();
+                mnCounter++;
+                if (mnCounter >= *mgvnMaxIterations)
+                    mbHitMaxIterations = true;
+                continue;
+            }
+        } else {
+            // Did this purely LL triangle - now update the TR bit as well!
+            // (This is actually unneccessary since the lapack cholesky solver
+            // uses only one triangle, but I'm leaving it in here anyway.)
+            for (int i = 0; i < mS.num_rows(); i++)
+                for (int j = 0; j < i; j++)
+                    mS[j][i] = mS[i][j];
+            vCamerasUpdate = Cholesky<>(mS).backsub(vE);
+            mProgress.dSolveSeconds += Lap(tPhase);
+        }
 
         // Part (iv): Compute the map updates
         Vector<> vMapUpdates(mvPoints.size() * 3);
-        for (unsigned int i = 0; i < mvPoints.size(); i++) {
-            Vector<3> v3Sum;
-            v3Sum = Zeros;
-            for (unsigned int j = 0; j < mvCameras.size(); j++) {
-                Camera &cam = mvCameras[j];
-                if (cam.bFixed)
+        mpPool->ParallelFor(mvPoints.size(), [&](int nBegin, int nEnd) {
+            for (int i = nBegin; i < nEnd; i++) {
+                if (mvPoints[i].bFixed) {
+                    vMapUpdates.slice(i * 3, 3) = Zeros;
                     continue;
-                Meas *pMeas = mvMeasLUTs[j][i];
-                if (pMeas == NULL || pMeas->bBad)
-                    continue;
-                v3Sum += pMeas->m63W.T() * vCamerasUpdate.slice(cam.nStartRow, 6);
+                }
+                Vector<3, Scalar> v3Sum;
+                v3Sum = Zeros;
+                for (int m = mvPointMeasStart[i]; m < mvPointMeasStart[i + 1]; m++) {
+                    int n = mvPointMeas[m];
+                    Camera &cam = mvCameras[mvMeas[n].c];
+                    if (cam.bFixed || mvMeas[n].bBad)
+                        continue;
+                    const Vector<6, Scalar> v6Update = vCamerasUpdate.slice(cam.nStartRow, 6);
+                    v3Sum += mvMeasW[n].T() * v6Update;
+                }
+                Vector<3, Scalar> v3 = mvPoints[i].v3EpsilonB - v3Sum;
+                const Vector<3, Scalar> v3Update = mvPoints[i].m3VStarInv * v3;
+                vMapUpdates.slice(i * 3, 3) = v3Update;
             }
-            Vector<3> v3 = mvPoints[i].v3EpsilonB - v3Sum;
-            vMapUpdates.slice(i * 3, 3) = mvPoints[i].m3VStarInv * v3;
-            if (std::isnan(vMapUpdates.slice(i * 3, 3) * vMapUpdates.slice(i * 3, 3))) {
-                //std::cerr << "NANNERY! " << std::endl;
-                //std::cerr << mvPoints[i].m3VStarInv << std::endl;
-            };
-        }
+        });
 
         // OK, got the two update vectors.
         // First check for convergence..
@@ -443,6 +728,7 @@ bool Bundle::Do_LM_Step(bool *pbAbortSignal) {
             mvPoints[i].v3PosNew = mvPoints[i].v3Pos + vMapUpdates.slice(i * 3, 3);
         // Calculate new error by re-projecting, doing tukey, etc etc:
         dNewError = FindNewError<MEstimator>();
+        mProgress.dUpdateSeconds += Lap(tPhase);
 
         cout << std::setprecision(1) << "L" << mdLambda << std::setprecision(3) << "\tOld " << dCurrentError << "  New " << dNewError << "  Diff " << dCurrentError - dNewError << "\t";
 
@@ -463,6 +749,7 @@ bool Bundle::Do_LM_Step(bool *pbAbortSignal) {
         cout << " WINNER            ------------ " << std::endl;
         // Woo! got somewhere. Update lambda and make changes permanent.
         ModifyLambda_GoodStep();
+        mProgress.dError = dNewError;
         for (unsigned int j = 0; j < mvCameras.size(); j++)
             mvCameras[j].se3CfW = mvCameras[j].se3CfWNew;
         for (unsigned int i = 0; i < mvPoints.size(); i++)
@@ -470,112 +757,375 @@ bool Bundle::Do_LM_Step(bool *pbAbortSignal) {
         mnAccepted++;
     }
 
-    // Finally, ditch all the outliers.
-    std::vector <std::list<Meas>::iterator> vit;
-    for (std::list<Meas>::iterator itr = mMeasList.begin(); itr != mMeasList.end(); itr++)
-        if (itr->bBad) {
-            vit.push_back(itr);
-            mvOutlierMeasurementIdx.push_back(std::make_pair(itr->p, itr->c));
-            mvPoints[itr->p].nOutliers++;
-            mvMeasLUTs[itr->c][itr->p] = NULL;
-        };
-
-    for (unsigned int i = 0; i < vit.size(); i++)
-        mMeasList.erase(vit[i]);
+    // Finally, ditch all the outliers. They stay in mvMeas so the indices
+    // remain valid, but are skipped by every later pass.
+    int nNuked = 0;
+    for (size_t n = 0; n < mvMeas.size(); n++) {
+        Meas &meas = mvMeas[n];
+        if (meas.bBad && !meas.bOutlier) {
+            meas.bOutlier = true;
+            mvOutlierMeasurementIdx.push_back(std::make_pair(meas.p, meas.c));
+            mvPoints[meas.p].nOutliers++;
+            nNuked++;
+        }
+    }
 
-    cout << "Nuked " << vit.size() << " measurements." << std::endl;
+    cout << "Nuked " << nNuked << " measurements." << std::endl;
+    mProgress.dUpdateSeconds += Lap(tPhase);
     return true;
 }
 
 // Find the new total error if cameras and points used their 
 // new coordinates
+template<typename Scalar>
 template<class MEstimator>
-double Bundle::FindNewError() {
-    std::ofstream ofs;
+double BundleT<Scalar>::FindNewError() {
+    std::vector<double> vdCamError(mvCameras.size(), 0.0);
+    std::vector<int> vnBehind(mvCameras.size(), 0);
+    mpPool->ParallelFor(mvCameras.size(), [&](int nBegin, int nEnd) {
+        ATANCamera camera = mCamera;
+        for (int j = nBegin; j < nEnd; j++) {
+            const SE3<> &se3CfWNew = mvCameras[j].se3CfWNew;
+            for (int n = mvCamMeasStart[j]; n < mvCamMeasStart[j + 1]; n++) {
+                const Meas &meas = mvMeas[n];
+                if (meas.bOutlier)
+                    continue;
+                // Project the point.
+                Vector<3> v3Cam = se3CfWNew * mvPoints[meas.p].v3PosNew;
+                if (v3Cam[2] <= 0) {
+                    vdCamError[j] += 1.0;
+                    vnBehind[j]++;
+                    continue;
+                };
+                Vector<2> v2ImPlane = project(v3Cam);
+                Vector<2> v2Image = camera.Project(v2ImPlane);
+                Vector<2> v2Error = meas.dSqrtInvNoise * (meas.v2Found - v2Image);
+                double dErrorSquared = v2Error * v2Error;
+                vdCamError[j] += MEstimator::ObjectiveScore(dErrorSquared, mdSigmaSquared);
+            }
+        }
+    });
+
     double dNewError = 0;
-    std::vector<double> vdErrorSquared;
-    for (std::list<Meas>::iterator itr = mMeasList.begin(); itr != mMeasList.end(); itr++) {
-        Meas &meas = *itr;
-        // Project the point.
-        Vector<3> v3Cam = mvCameras[meas.c].se3CfWNew * mvPoints[meas.p].v3PosNew;
-        if (v3Cam[2] <= 0) {
-            dNewError += 1.0;
+    for (size_t j = 0; j < mvCameras.size(); j++) {
+        dNewError += vdCamError[j];
+        for (int k = 0; k < vnBehind[j]; k++)
             cout << ".";
-            continue;
-        };
-        Vector<2> v2ImPlane = project(v3Cam);
-        Vector<2> v2Image = mCamera.Project(v2ImPlane);
-        Vector<2> v2Error = meas.dSqrtInvNoise * (meas.v2Found - v2Image);
-        double dErrorSquared = v2Error * v2Error;
-        dNewError += MEstimator::ObjectiveScore(dErrorSquared, mdSigmaSquared);
     }
     return dNewError;
 }
 
-// Optimisation: make a bunch of tables, one per camera
-// which point to measurements (if any) for each point
-// This is faster than a std::map lookup.
-void Bundle::GenerateMeasLUTs() {
-    mvMeasLUTs.clear();
-    for (unsigned int nCam = 0; nCam < mvCameras.size(); nCam++) {
-        mvMeasLUTs.push_back(std::vector<Meas *>());
-        mvMeasLUTs.back().resize(mvPoints.size(), NULL);
+// Optimisation: sort the measurements by camera and point, and build
+// compressed index arrays so that each camera's and each point's
+// measurements can be walked directly. Memory is O(measurements), unlike
+// the old dense camera x point lookup tables.
+// The indexed measurements are already in order, so only those added since
+// the last re-index are sorted and then merged in. vMeasRemap gets the new
+// index of each previously indexed measurement, or -1 if it was dropped.
+template<typename Scalar>
+void BundleT<Scalar>::GenerateMeasIndex(std::vector<int> &vMeasRemap) {
+    // Drop removed measurements, and those of removed cameras and points
+    auto Dropped = [&](const Meas &m) {
+        return m.bRemoved || !mvCameras[m.c].bActive || !mvPoints[m.p].bActive;
     };
-    for (std::list<Meas>::iterator it = mMeasList.begin(); it != mMeasList.end(); it++)
-        mvMeasLUTs[it->c][it->p] = &(*it);
+    std::vector<Meas> vAdded;
+    for (size_t n = mnIndexedMeas; n < mvMeas.size(); n++)
+        if (!Dropped(mvMeas[n]))
+            vAdded.push_back(mvMeas[n]);
+    std::stable_sort(vAdded.begin(), vAdded.end());
+
+    std::vector<Meas> vMerged;
+    vMerged.reserve(mnIndexedMeas + vAdded.size());
+    vMeasRemap.assign(mnIndexedMeas, -1);
+    size_t nAdded = 0;
+    for (size_t n = 0; n < mnIndexedMeas; n++) {
+        if (Dropped(mvMeas[n]))
+            continue;
+        while (nAdded < vAdded.size() && vAdded[nAdded] < mvMeas[n])
+            vMerged.push_back(vAdded[nAdded++]);
+        vMeasRemap[n] = vMerged.size();
+        vMerged.push_back(mvMeas[n]);
+    }
+    vMerged.insert(vMerged.end(), vAdded.begin() + nAdded, vAdded.end());
+    mvMeas.swap(vMerged);
+    for (size_t n = 0; n < mvMeas.size(); n++)
+        mvMeas[n].bPointFixed = mvPoints[mvMeas[n].p].bFixed;
+
+    mnIndexedMeas = mvMeas.size();
+    mvMeasProj.resize(mvMeas.size());
+    mvMeasB.resize(mvMeas.size());
+    mvMeasW.resize(mvMeas.size());
+    mvMeasWV.resize(mvMeas.size());
+
+    mvCamMeasStart.assign(mvCameras.size() + 1, 0);
+    mvPointMeasStart.assign(mvPoints.size() + 1, 0);
+    for (size_t n = 0; n < mvMeas.size(); n++) {
+        mvCamMeasStart[mvMeas[n].c + 1]++;
+        mvPointMeasStart[mvMeas[n].p + 1]++;
+    }
+    for (size_t j = 0; j < mvCameras.size(); j++)
+        mvCamMeasStart[j + 1] += mvCamMeasStart[j];
+    for (size_t i = 0; i < mvPoints.size(); i++)
+        mvPointMeasStart[i + 1] += mvPointMeasStart[i];
+
+    // Filling in measurement order keeps each point's list sorted by camera.
+    mvPointMeas.resize(mvMeas.size());
+    std::vector<int> vFill(mvPointMeasStart.begin(), mvPointMeasStart.end() - 1);
+    for (size_t n = 0; n < mvMeas.size(); n++)
+        mvPointMeas[vFill[mvMeas[n].p]++] = n;
+
+    for (size_t i = 0; i < mvPoints.size(); i++) {
+        mvPoints[i].nMeasurements = mvPointMeasStart[i + 1] - mvPointMeasStart[i];
+        mvPoints[i].nOutliers = 0;
+    }
+    for (size_t n = 0; n < mvMeas.size(); n++)
+        if (mvMeas[n].bOutlier)
+            mvPoints[mvMeas[n].p].nOutliers++;
+
+    // Nothing refers to removed cameras and points any more
+    mvFreeCameras.insert(mvFreeCameras.end(), mvRemovedCameras.begin(), mvRemovedCameras.end());
+    mvFreePoints.insert(mvFreePoints.end(), mvRemovedPoints.begin(), mvRemovedPoints.end());
+    mvRemovedCameras.clear();
+    mvRemovedPoints.clear();
+}
+
+// Gives each adjustable camera its block of rows in S
+template<typename Scalar>
+void BundleT<Scalar>::GenerateCameraRows() {
+    mnCamsToUpdate = 0;
+    for (size_t j = 0; j < mvCameras.size(); j++) {
+        Camera &cam = mvCameras[j];
+        if (cam.bActive && !cam.bFixed)
+            cam.nStartRow = 6 * mnCamsToUpdate++;
+        else
+            cam.nStartRow = -999999999;
+    }
 }
 
-// Optimisation: make a per-point list of all
-// observation camera-camera pairs; this is then
-// scanned to make the off-diagonal elements of matrix S
-void Bundle::GenerateOffDiagScripts() {
+// Optimisation: make a list of all observation camera-camera pairs,
+// grouped by pair; each group is then summed to make one off-diagonal
+// block of matrix S.
+// Unless bFull, only the pairs of points which gained a measurement, were
+// (un)fixed or are seen by an (un)fixed camera are generated again; the rest
+// are kept, with their measurement indices moved by vMeasRemap.
+template<typename Scalar>
+void BundleT<Scalar>::GenerateOffDiagScripts(const std::vector<int> &vMeasRemap, bool bFull) {
+    std::vector<bool> vbRedo(mvPoints.size(), bFull);
+    for (size_t i = 0; i < mvPoints.size(); i++)
+        if (mvPoints[i].bDirty)
+            vbRedo[i] = true;
+    for (size_t j = 0; j < mvCameras.size(); j++)
+        if (mvCameras[j].bDirty)
+            for (int n = mvCamMeasStart[j]; n < mvCamMeasStart[j + 1]; n++)
+                vbRedo[mvMeas[n].p] = true;
+
+    // Entries are ordered by camera pair, then point, which is the order
+    // the old from-scratch build produced.
+    auto Before = [&](const OffDiagScriptEntry &a, const OffDiagScriptEntry &b) {
+        if (a.j != b.j)
+            return a.j < b.j;
+        if (a.k != b.k)
+            return a.k < b.k;
+        return mvMeas[a.nMeasJ].p < mvMeas[b.nMeasJ].p;
+    };
+
+    std::vector<OffDiagScriptEntry> vKept;
+    if (!bFull) {
+        vKept.reserve(mvOffDiagScript.size());
+        for (const OffDiagScriptEntry &old : mvOffDiagScript) {
+            OffDiagScriptEntry e = old;
+            e.nMeasJ = vMeasRemap[old.nMeasJ];
+            e.nMeasK = vMeasRemap[old.nMeasK];
+            if (e.nMeasJ < 0 || e.nMeasK < 0 || vbRedo[mvMeas[e.nMeasJ].p])
+                continue;
+            vKept.push_back(e);
+        }
+    }
+
+    std::vector<OffDiagScriptEntry> vNew;
     for (unsigned int i = 0; i < mvPoints.size(); i++) {
-        Point &p = mvPoints[i];
-        p.vOffDiagonalScript.clear();
-        for (std::set<int>::iterator it_j = p.sCameras.begin(); it_j != p.sCameras.end(); it_j++) {
-            int j = *it_j;
+        if (!vbRedo[i] || mvPoints[i].bFixed)
+            continue;   // Fixed points don't couple cameras
+        for (int mj = mvPointMeasStart[i]; mj < mvPointMeasStart[i + 1]; mj++) {
+            int nMeasJ = mvPointMeas[mj];
+            int j = mvMeas[nMeasJ].c;
             if (mvCameras[j].bFixed)
                 continue;
-            Meas *pMeas_j = mvMeasLUTs[j][i];
-            assert(pMeas_j != NULL);
 
-            for (std::set<int>::iterator it_k = p.sCameras.begin(); it_k != it_j; it_k++) {
-                int k = *it_k;
+            for (int mk = mvPointMeasStart[i]; mk < mj; mk++) {
+                int nMeasK = mvPointMeas[mk];
+                int k = mvMeas[nMeasK].c;
                 if (mvCameras[k].bFixed)
                     continue;
 
-                Meas *pMeas_k = mvMeasLUTs[k][i];
-                assert(pMeas_k != NULL);
-
                 OffDiagScriptEntry e;
                 e.j = j;
                 e.k = k;
-                p.vOffDiagonalScript.push_back(e);
+                e.nMeasJ = nMeasJ;
+                e.nMeasK = nMeasK;
+                vNew.push_back(e);
             }
         }
     }
+    std::stable_sort(vNew.begin(), vNew.end(), Before);
+
+    mvOffDiagScript.clear();
+    mvOffDiagScript.reserve(vKept.size() + vNew.size());
+    std::merge(vKept.begin(), vKept.end(), vNew.begin(), vNew.end(), std::back_inserter(mvOffDiagScript), Before);
+
+    mvOffDiagBlocks.clear();
+    for (size_t t = 0; t < mvOffDiagScript.size(); t++) {
+        const OffDiagScriptEntry &e = mvOffDiagScript[t];
+        if (mvOffDiagBlocks.empty() || mvOffDiagBlocks.back().j != e.j || mvOffDiagBlocks.back().k != e.k) {
+            OffDiagBlock block;
+            block.j = e.j;
+            block.k = e.k;
+            block.nFirst = t;
+            block.nSlot = -1;
+            block.bTransposeSlot = false;
+            mvOffDiagBlocks.push_back(block);
+        }
+        mvOffDiagBlocks.back().nEnd = t + 1;
+    }
 }
 
-void Bundle::ModifyLambda_GoodStep() {
+// Hands the camera-camera pairs to the sparse solver, which picks an
+// elimination order; each block then records which stored block it
+// accumulates into.
+template<typename Scalar>
+void BundleT<Scalar>::GenerateSparseStructure() {
+    std::vector<std::pair<int, int> > vPairs;
+    for (const OffDiagBlock &block : mvOffDiagBlocks)
+        vPairs.push_back(std::make_pair(mvCameras[block.j].nStartRow / 6, mvCameras[block.k].nStartRow / 6));
+
+    mSparseS.SetStructure(mnCamsToUpdate, vPairs);
+    for (OffDiagBlock &block : mvOffDiagBlocks)
+        block.nSlot = mSparseS.Slot(mvCameras[block.j].nStartRow / 6, mvCameras[block.k].nStartRow / 6,
+                                    block.bTransposeSlot);
+
+    cout << "Sparse S: " << mnCamsToUpdate << " cameras, " << vPairs.size() << " pairs, "
+         << mSparseS.NonZeroBlocks() << " stored blocks." << std::endl;
+}
+
+// vY = S vX without forming S: S = U* - W V*^-1 W^T, so go through the
+// points first (W^T x), then back out to the cameras.
+template<typename Scalar>
+void BundleT<Scalar>::MultiplyS(const Vector<> &vX, Vector<> &vY) {
+    mpPool->ParallelFor(mvPoints.size(), [&](int nBegin, int nEnd) {
+        for (int i = nBegin; i < nEnd; i++) {
+            Vector<3, Scalar> v3 = Zeros;
+            if (!mvPoints[i].bFixed) {
+                for (int m = mvPointMeasStart[i]; m < mvPointMeasStart[i + 1]; m++) {
+                    int n = mvPointMeas[m];
+                    const Camera &cam = mvCameras[mvMeas[n].c];
+                    if (cam.bFixed || mvMeas[n].bBad)
+                        continue;
+                    const Vector<6, Scalar> v6X = vX.slice(cam.nStartRow, 6);
+                    v3 += mvMeasW[n].T() * v6X;
+                }
+            }
+            mvPCGPointTemp[i] = v3;
+        }
+    });
+
+    mpPool->ParallelFor(mvCameras.size(), [&](int nBegin, int nEnd) {
+        for (int j = nBegin; j < nEnd; j++) {
+            const Camera &cam = mvCameras[j];
+            if (cam.bFixed)
+                continue;
+            Vector<6, Scalar> v6Sum = Zeros;
+            for (int n = mvCamMeasStart[j]; n < mvCamMeasStart[j + 1]; n++) {
+                if (mvMeas[n].bBad || mvMeas[n].bPointFixed)
+                    continue;
+                v6Sum += mvMeasWV[n] * mvPCGPointTemp[mvMeas[n].p];
+            }
+            Vector<6> v6 = mvUStar[cam.nStartRow / 6] * vX.slice(cam.nStartRow, 6);
+            v6 -= Vector<6>(v6Sum);
+            vY.slice(cam.nStartRow, 6) = v6;
+        }
+    });
+}
+
+// Solves S vX = vB by conjugate gradients with a block-Jacobi preconditioner.
+// Returns false if S turns out not to be positive definite.
+template<typename Scalar>
+bool BundleT<Scalar>::SolvePCG(const Vector<> &vB, Vector<> &vX) {
+    static gvar3<int> gvnMaxIterations("Bundle.PCGMaxIterations", 200, SILENT);
+    static gvar3<double> gvdTolerance("Bundle.PCGTolerance", 1e-6, SILENT);  // Relative residual
+
+    const int nBlocks = mnCamsToUpdate;
+    std::vector<Matrix<6> > vPrecond(nBlocks);
+    for (int b = 0; b < nBlocks; b++) {
+        Cholesky<6> chol(mvSDiagonal[b]);
+        if (!(chol.determinant() > 0))
+            return false;
+        vPrecond[b] = chol.get_inverse();
+    }
+
+    const int nRows = nBlocks * 6;
+    vX = Zeros;
+    Vector<> vR = vB;
+    Vector<> vZ(nRows);
+    for (int b = 0; b < nBlocks; b++)
+        vZ.slice(b * 6, 6) = vPrecond[b] * vR.slice(b * 6, 6);
+    Vector<> vP = vZ;
+    Vector<> vQ(nRows);
+    double dRZ = vR * vZ;
+
+    const double dStop = *gvdTolerance * *gvdTolerance * (vB * vB);
+    int nIteration = 0;
+    while (nIteration < *gvnMaxIterations && vR * vR > dStop) {
+        MultiplyS(vP, vQ);
+        double dPQ = vP * vQ;
+        if (!(dPQ > 0))
+            return false;
+        double dAlpha = dRZ / dPQ;
+        vX += dAlpha * vP;
+        vR -= dAlpha * vQ;
+
+        for (int b = 0; b < nBlocks; b++)
+            vZ.slice(b * 6, 6) = vPrecond[b] * vR.slice(b * 6, 6);
+        double dRZNew = vR * vZ;
+        vP = vZ + (dRZNew / dRZ) * vP;
+        dRZ = dRZNew;
+        nIteration++;
+    }
+    cout << "PCG: " << nIteration << " its, residual " << sqrt(vR * vR) << "\t";
+    return true;
+}
+
+template<typename Scalar>
+bool BundleT<Scalar>::OutOfTime() {
+    if (mdTimeBudget <= 0.0)
+        return false;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - mStartTime).count() > mdTimeBudget;
+}
+
+template<typename Scalar>
+void BundleT<Scalar>::ModifyLambda_GoodStep() {
     mdLambdaFactor = 2.0;
     mdLambda *= 0.3;
 };
 
-void Bundle::ModifyLambda_BadStep() {
+template<typename Scalar>
+void BundleT<Scalar>::ModifyLambda_BadStep() {
     mdLambda = mdLambda * mdLambdaFactor;
     mdLambdaFactor = mdLambdaFactor * 2;
 };
 
 
-Vector<3> Bundle::GetPoint(int n) {
+template<typename Scalar>
+Vector<3> BundleT<Scalar>::GetPoint(int n) {
     return mvPoints.at(n).v3Pos;
 }
 
-SE3<> Bundle::GetCamera(int n) {
+template<typename Scalar>
+SE3<> BundleT<Scalar>::GetCamera(int n) {
     return mvCameras.at(n).se3CfW;
 }
 
-std::set<int> Bundle::GetOutliers() {
+template<typename Scalar>
+std::set<int> BundleT<Scalar>::GetOutliers() {
     std::set<int> sOutliers;
     std::set<int>::iterator hint = sOutliers.begin();
     for (unsigned int i = 0; i < mvPoints.size(); i++) {
@@ -587,15 +1137,21 @@ std::set<int> Bundle::GetOutliers() {
 };
 
 
-std::vector <std::pair<int, int>> Bundle::GetOutlierMeasurements() {
+template<typename Scalar>
+std::vector <std::pair<int, int>> BundleT<Scalar>::GetOutlierMeasurements() {
     return mvOutlierMeasurementIdx;
 }
 
+// Makes an adjuster of the precision asked for; by default, of the one the
+// Bundle.Precision gvar names ("Double" or "Float").
+Bundle *Bundle::Create(const ATANCamera &TCam, Precision precision) {
+    static gvar3<std::string> gvsPrecision("Bundle.Precision", "Double", SILENT);
+    if (precision == PRECISION_DEFAULT)
+        precision = (*gvsPrecision == "Float") ? PRECISION_FLOAT : PRECISION_DOUBLE;
+    if (precision == PRECISION_FLOAT)
+        return new BundleT<float>(TCam);
+    return new BundleT<double>(TCam);
+}
 
-
-
-
-
-
-
-
+template class BundleT<double>;
+template class BundleT<float>;
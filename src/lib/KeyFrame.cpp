@@ -1,5 +1,8 @@
 // Copyright 2008 Isis Innovation Limited
 #include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
 #include <random>
 
 #include <cvd/colourspace_convert.h>
@@ -8,16 +11,24 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/features2d.hpp>
 #include <opencv2/highgui.hpp>
+#include <opencv2/imgcodecs.hpp>
 
 #include <ptamsp/KeyFrame.h>
 #include <ptamsp/ShiTomasi.h>
 #include <ptamsp/SmallBlurryImage.h>
 #include <ptamsp/MapPoint.h>
 #include <ptamsp/LevelHelpers.h>
+#include <ptamsp/ModelBinaryFile.h>
 
 using namespace CVD;
 using namespace GVars3;
 
+// I use a different FAST threshold on each level; this is a bit of a hack
+// whose aim is to balance the different levels' relative feature densities.
+static int LevelFastThreshold(int l) {
+    return (l == 0 || l == 3) ? 10 : 15;
+}
+
 void KeyFrame::MakeKeyFrame_Lite(BasicImage<byte> &im) {
     // Perpares a Keyframe from an image. Generates pyramid levels, does FAST detection, etc.
     // Does not fully populate the keyframe struct, but only does the bits needed for the tracker;
@@ -37,30 +48,14 @@ void KeyFrame::MakeKeyFrame_Lite(BasicImage<byte> &im) {
         }
 
         // .. and detect and store FAST corner points.
-        // I use a different threshold on each level; this is a bit of a hack
-        // whose aim is to balance the different levels' relative feature densities.
         lev.vCorners.clear();
         lev.vCandidates.clear();
         lev.vMaxCorners.clear();
-
-        if (i == 0)
-            fast_corner_detect_10(lev.im, lev.vCorners, 10);
-        if (i == 1)
-            fast_corner_detect_10(lev.im, lev.vCorners, 15);
-        if (i == 2)
-            fast_corner_detect_10(lev.im, lev.vCorners, 15);
-        if (i == 3)
-            fast_corner_detect_10(lev.im, lev.vCorners, 10);
+        fast_corner_detect_10(lev.im, lev.vCorners, LevelFastThreshold(i));
 
         // Generate row look-up-table for the FAST corner points: this speeds up
         // finding close-by corner points later on.
-        unsigned int v = 0;
-        lev.vCornerRowLUT.clear();
-        for (int y = 0; y < lev.im.size().y; y++) {
-            while (v < lev.vCorners.size() && y > lev.vCorners[v].y)
-                v++;
-            lev.vCornerRowLUT.push_back(v);
-        }
+        lev.MakeCornerRowLUT();
     }
     state = LITE;
 }
@@ -75,11 +70,7 @@ void KeyFrame::MakeKeyFrame_Rest() {
     for (int l = 0; l < LEVELS; l++) {
         Level &lev = aLevels[l];
         // .. find those FAST corners which are maximal..
-        if (l == 0 || l == 3) {
-            fast_nonmax(lev.im, lev.vCorners, 10, lev.vMaxCorners);
-        } else {
-            fast_nonmax(lev.im, lev.vCorners, 15, lev.vMaxCorners);
-        }
+        fast_nonmax(lev.im, lev.vCorners, LevelFastThreshold(l), lev.vMaxCorners);
         // .. and then calculate the Shi-Tomasi scores of those, and keep the ones with
         // a suitably high score as Candidates, i.e. points which the mapmaker will attempt
         // to make new map points out of.
@@ -101,10 +92,18 @@ void KeyFrame::MakeKeyFrame_Rest() {
 }
 
 void KeyFrame::MakeKeyFrame_Reloc(int featureCount, double maxPointRadius) {
+    if (!EnsureLevel(0))
+        return;
     Image<CVD::byte> im = aLevels[0].im;
     cv::Mat img(im.size().y, im.size().x, CV_8UC1, im.data());
     relocKeypoints.clear();
     relocWorldPoints.clear();
+    relocFrameDescriptor.release();   // Don't compute into a mapped model's bytes
+    pModelKeyPoints = nullptr;
+    nModelKeyPoints = 0;
+    pModelWorldPoints = nullptr;
+    nModelWorldPoints = 0;
+    pModelData.reset();
 
     cv::Ptr<cv::DescriptorExtractor> extractor = cv::ORB::create(featureCount, 1.25f, 8, 31, 0, 2);
     extractor->detectAndCompute(img, cv::noArray(), relocKeypoints, relocFrameDescriptor);
@@ -124,6 +123,85 @@ void KeyFrame::MakeKeyFrame_Reloc(int featureCount, double maxPointRadius) {
     }
 }
 
+bool KeyFrame::FindRelocWorldPoint(int nKeyPoint, cv::Point3d &pt) const {
+    if (pModelWorldPoints) {
+        const ModelBinWorldPoint *pEnd = pModelWorldPoints + nModelWorldPoints;
+        const ModelBinWorldPoint *pFound = std::lower_bound(pModelWorldPoints, pEnd, nKeyPoint,
+            [](const ModelBinWorldPoint &wp, int n) { return wp.nKeyPoint < n; });
+        if (pFound == pEnd || pFound->nKeyPoint != nKeyPoint)
+            return false;
+        pt = cv::Point3d(pFound->x, pFound->y, pFound->z);
+        return true;
+    }
+    auto it = relocWorldPoints.find(nKeyPoint);
+    if (it == relocWorldPoints.end())
+        return false;
+    pt = it->second;
+    return true;
+}
+
+std::vector<cv::KeyPoint> KeyFrame::RelocKeypoints() const {
+    if (!pModelKeyPoints)
+        return relocKeypoints;
+    std::vector<cv::KeyPoint> v(nModelKeyPoints);
+    for (uint32_t k = 0; k < nModelKeyPoints; k++) {
+        const ModelBinKeyPoint &kp = pModelKeyPoints[k];
+        v[k] = cv::KeyPoint(kp.x, kp.y, kp.size, kp.angle, kp.response, kp.nOctave, kp.nClassID);
+    }
+    return v;
+}
+
+std::map<int, cv::Point3d> KeyFrame::RelocWorldPoints() const {
+    if (!pModelWorldPoints)
+        return relocWorldPoints;
+    std::map<int, cv::Point3d> m;
+    for (uint32_t w = 0; w < nModelWorldPoints; w++) {
+        const ModelBinWorldPoint &wp = pModelWorldPoints[w];
+        m.emplace_hint(m.end(), wp.nKeyPoint, cv::Point3d(wp.x, wp.y, wp.z));
+    }
+    return m;
+}
+
+KeyFrame::~KeyFrame() {
+    if (!spillPath.empty())
+        std::remove(spillPath.c_str());
+}
+
+size_t KeyFrame::MemoryFootprint() const {
+    size_t n = sizeof(KeyFrame) + PyramidFootprint();
+    // std::map nodes carry roughly four pointers of overhead each
+    n += mMeasurements.size() * (sizeof(MapPoint *) + sizeof(Measurement) + 4 * sizeof(void *));
+    n += relocKeypoints.capacity() * sizeof(cv::KeyPoint);
+    n += relocWorldPoints.size() * (sizeof(int) + sizeof(cv::Point3d) + 4 * sizeof(void *));
+    if (!pModelData)   // Otherwise it's in the mapped model file
+        n += relocFrameDescriptor.total() * relocFrameDescriptor.elemSize();
+    return n;
+}
+
+size_t KeyFrame::PyramidFootprint() const {
+    size_t n = 0;
+    for (const auto &l : aLevels) {
+        n += l.im.totalsize();
+        n += l.vCorners.capacity() * sizeof(CVD::ImageRef);
+        n += l.vCornerRowLUT.capacity() * sizeof(int);
+        n += l.vMaxCorners.capacity() * sizeof(CVD::ImageRef);
+        n += l.vCandidates.capacity() * sizeof(Candidate);
+        n += l.vImplaneCorners.capacity() * sizeof(Vector<2>);
+        n += l.keypointsPC.pts.capacity() * sizeof(PointCloud::Point);
+    }
+    return n;
+}
+
+void Level::MakeCornerRowLUT() {
+    unsigned int v = 0;
+    vCornerRowLUT.clear();
+    for (int y = 0; y < im.size().y; y++) {
+        while (v < vCorners.size() && y > vCorners[v].y)
+            v++;
+        vCornerRowLUT.push_back(v);
+    }
+}
+
 // The keyframe struct is quite happy with default operator=, but Level needs its own
 // to override CVD's reference-counting behaviour.
 Level &Level::operator=(const Level &rhs) {
@@ -134,9 +212,110 @@ Level &Level::operator=(const Level &rhs) {
     vCorners = rhs.vCorners;
     vMaxCorners = rhs.vMaxCorners;
     vCornerRowLUT = rhs.vCornerRowLUT;
+    bReleased = rhs.bReleased;
+    irReleasedSize = rhs.irReleasedSize;
     return *this;
 }
 
+void KeyFrame::ReleaseDerivedData() {
+    for (auto &lev : aLevels) {
+        std::vector<Candidate>().swap(lev.vCandidates);
+        std::vector<Vector<2> >().swap(lev.vImplaneCorners);
+        lev.bImplaneCornersCached = false;
+        std::vector<PointCloud::Point>().swap(lev.keypointsPC.pts);
+    }
+}
+
+CVD::Image<CVD::byte> KeyFrame::ReleaseLevel(int l) {
+    Level &lev = aLevels[l];
+    CVD::Image<CVD::byte> im = lev.im;
+    if (lev.bReleased)
+        return im;
+    lev.irReleasedSize = lev.im.size();
+    lev.im = CVD::Image<CVD::byte>();
+    std::vector<ImageRef>().swap(lev.vCorners);
+    std::vector<int>().swap(lev.vCornerRowLUT);
+    std::vector<ImageRef>().swap(lev.vMaxCorners);
+    std::vector<Candidate>().swap(lev.vCandidates);
+    std::vector<Vector<2> >().swap(lev.vImplaneCorners);
+    lev.bImplaneCornersCached = false;
+    lev.bReleased = true;
+    return im;
+}
+
+// Same as MakeKeyFrame_Lite() and MakeKeyFrame_Rest() make it, less the
+// candidates: only keyframes which are still to make points need those.
+bool KeyFrame::EnsureLevel(int l) {
+    Level &lev = aLevels[l];
+    lev.bRecentlyUsed = true;
+    if (!lev.bReleased)
+        return true;
+    Image<byte> im;
+    if (l == 0) {
+        if (!ReadImage(SourcePath(), im) || im.size() != lev.irReleasedSize) {
+            std::cout << "KeyFrame: can't rebuild level 0 from " << SourcePath() << std::endl;
+            return false;
+        }
+    } else {
+        if (!EnsureLevel(l - 1))
+            return false;
+        im.resize(aLevels[l - 1].im.size() / 2);
+        halfSample(aLevels[l - 1].im, im);
+    }
+    fast_corner_detect_10(im, lev.vCorners, LevelFastThreshold(l));
+    fast_nonmax(im, lev.vCorners, LevelFastThreshold(l), lev.vMaxCorners);
+    lev.im = im;
+    lev.MakeCornerRowLUT();
+    lev.bReleased = false;
+    return true;
+}
+
+ImageRef KeyFrame::LevelSize(int l) const {
+    return aLevels[l].bReleased ? aLevels[l].irReleasedSize : aLevels[l].im.size();
+}
+
+// Spill files are raw: width and height as int32, then the pixels row by row.
+// They only live as long as this process, so byte order doesn't matter.
+bool KeyFrame::SpillLevelZero(const std::string &sPath) {
+    const Image<byte> &im = aLevels[0].im;
+    std::ofstream file(sPath, std::ios::binary | std::ios::trunc);
+    int32_t anSize[2] = {im.size().x, im.size().y};
+    if (aLevels[0].bReleased || !file.is_open() ||
+        !file.write(reinterpret_cast<const char *>(anSize), sizeof(anSize)) ||
+        !file.write(reinterpret_cast<const char *>(im.data()), im.totalsize())) {
+        std::cout << "KeyFrame: can't spill to " << sPath << std::endl;
+        file.close();
+        std::remove(sPath.c_str());
+        return false;
+    }
+    if (!spillPath.empty() && spillPath != sPath)
+        std::remove(spillPath.c_str());
+    spillPath = sPath;
+    return true;
+}
+
+bool KeyFrame::IsSpillFile(const std::string &sPath) {
+    return sPath.size() > 4 && sPath.compare(sPath.size() - 4, 4, ".raw") == 0;
+}
+
+bool KeyFrame::ReadImage(const std::string &sPath, Image<byte> &im) {
+    if (IsSpillFile(sPath)) {
+        std::ifstream file(sPath, std::ios::binary);
+        int32_t anSize[2];
+        if (!file.read(reinterpret_cast<char *>(anSize), sizeof(anSize)) || anSize[0] <= 0 || anSize[1] <= 0)
+            return false;
+        im.resize(ImageRef(anSize[0], anSize[1]));
+        return (bool) file.read(reinterpret_cast<char *>(im.data()), im.totalsize());
+    }
+    cv::Mat img = cv::imread(sPath, cv::IMREAD_GRAYSCALE);
+    if (img.empty())
+        return false;
+    im.resize(ImageRef(img.cols, img.rows));
+    cv::Mat tmp(img.rows, img.cols, CV_8UC1, im.data());
+    img.copyTo(tmp);
+    return true;
+}
+
 // -------------------------------------------------------------
 // Some useful globals defined in LevelHelpers.h live here:
 Vector<3> gavLevelColors[LEVELS];
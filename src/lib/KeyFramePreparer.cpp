@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include <ptamsp/KeyFramePreparer.h>
+#include <ptamsp/KeyFrame.h>
+
+KeyFramePreparer::KeyFramePreparer(int nThreads) : mnThreads(nThreads), mv3PoseHintCentre(Zeros) {
+    if (mnThreads <= 0)
+        mnThreads = std::max(1, (int) std::thread::hardware_concurrency() - 2);
+}
+
+KeyFramePreparer::~KeyFramePreparer() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mbStop = true;
+    }
+    mcvWork.notify_all();
+    for (auto &t : mvWorkers)
+        t.join();
+}
+
+void KeyFramePreparer::Add(KeyFrame *pKF) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mOutstanding.count(pKF))
+            return;
+        Job job;
+        job.pKF = pKF;
+        job.sImagePath = pKF->SourcePath();
+        job.v3Centre = pKF->se3CfromW.inverse().get_translation();
+        job.nSerial = mnNextSerial++;
+        mOutstanding[pKF] = job.nSerial;
+        mvPending.push_back(job);
+        while ((int) mvWorkers.size() < mnThreads)
+            mvWorkers.emplace_back(&KeyFramePreparer::WorkerLoop, this);
+    }
+    mcvWork.notify_one();
+}
+
+void KeyFramePreparer::Remove(KeyFrame *pKF) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mOutstanding.erase(pKF))
+        return;
+    mvPending.erase(std::remove_if(mvPending.begin(), mvPending.end(),
+                                   [pKF](const Job &j) { return j.pKF == pKF; }), mvPending.end());
+    mvFinished.erase(std::remove_if(mvFinished.begin(), mvFinished.end(),
+                                    [pKF](const Result &r) { return r.pKF == pKF; }), mvFinished.end());
+}
+
+void KeyFramePreparer::Clear() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mOutstanding.clear();
+    mvPending.clear();
+    mvFinished.clear();
+}
+
+size_t KeyFramePreparer::Outstanding() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mOutstanding.size();
+}
+
+bool KeyFramePreparer::IsOutstanding(KeyFrame *pKF) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mOutstanding.count(pKF) > 0;
+}
+
+int KeyFramePreparer::Install(std::vector<KeyFrame *> *pvInstalled) {
+    std::vector<Result> vFinished;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        vFinished.swap(mvFinished);
+        for (const auto &r : vFinished)
+            mOutstanding.erase(r.pKF);
+    }
+    // These moves are cheap: the images share their pixel buffers
+    for (auto &r : vFinished) {
+        for (int l = 0; l < LEVELS; l++) {
+            Level &lev = r.pKF->aLevels[l];
+            Level &prepared = r.pPrepared->aLevels[l];
+            lev.im = prepared.im;
+            lev.vCorners.swap(prepared.vCorners);
+            lev.vCornerRowLUT.swap(prepared.vCornerRowLUT);
+            lev.vMaxCorners.swap(prepared.vMaxCorners);
+            lev.vCandidates.swap(prepared.vCandidates);
+            lev.bImplaneCornersCached = false;
+            lev.vImplaneCorners.clear();
+            lev.bReleased = false;
+        }
+        r.pKF->state = KeyFrame::REST;
+        if (pvInstalled)
+            pvInstalled->push_back(r.pKF);
+    }
+    return vFinished.size();
+}
+
+void KeyFramePreparer::SetPoseHint(const SE3<> &se3CamFromWorld) {
+    SeqLock::WriteGuard publish(mPoseHintSeq);
+    mv3PoseHintCentre = se3CamFromWorld.inverse().get_translation();
+}
+
+bool KeyFramePreparer::PoseHint(Vector<3> &v3Centre) const {
+    if (mPoseHintSeq.Version() == 0)
+        return false;
+    unsigned int nVersion;
+    do {
+        nVersion = mPoseHintSeq.ReadBegin();
+        v3Centre = mv3PoseHintCentre;
+    } while (mPoseHintSeq.ReadRetry(nVersion));
+    return true;
+}
+
+bool KeyFramePreparer::TakeNearestJob(Job &job) {
+    if (mvPending.empty())
+        return false;
+    size_t nBest = 0;
+    Vector<3> v3Hint;
+    if (PoseHint(v3Hint)) {
+        double dBest = std::numeric_limits<double>::max();
+        for (size_t i = 0; i < mvPending.size(); i++) {
+            double d = norm_sq(mvPending[i].v3Centre - v3Hint);
+            if (d < dBest) {
+                dBest = d;
+                nBest = i;
+            }
+        }
+    }
+    job = mvPending[nBest];
+    mvPending.erase(mvPending.begin() + nBest);
+    return true;
+}
+
+void KeyFramePreparer::WorkerLoop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mcvWork.wait(lock, [&] { return mbStop || !mvPending.empty(); });
+            if (mbStop)
+                return;
+            TakeNearestJob(job);
+        }
+
+        // Same as the mapmaker used to do inline with a freshly loaded keyframe
+        std::unique_ptr<KeyFrame> pPrepared(new KeyFrame());
+        CVD::Image<CVD::byte> imBW;
+        bool bRead = KeyFrame::ReadImage(job.sImagePath, imBW);
+        if (!bRead) {
+            std::cout << "KeyFramePreparer: can't read " << job.sImagePath << std::endl;
+        } else {
+            pPrepared->MakeKeyFrame_Lite(imBW);
+            pPrepared->MakeKeyFrame_Rest();
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mOutstanding.find(job.pKF);
+        if (it == mOutstanding.end() || it->second != job.nSerial)
+            continue;   // Removed or cleared while we worked on it
+        if (!bRead)
+            mOutstanding.erase(it);   // Left INIT, as before; not retried
+        else
+            mvFinished.push_back(Result{job.pKF, job.nSerial, std::move(pPrepared)});
+    }
+}
@@ -1,5 +1,8 @@
 // Copyright 2008 Isis Innovation Limited
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <fstream>
 
 #include <gvars3/instances.h>
@@ -9,49 +12,137 @@
 
 
 #include <ptamsp/PTAMModelFile.h>
+#include <ptamsp/ModelBinaryFile.h>
 #include <ptamsp/Map.h>
 #include <ptamsp/MapMaker.h>
+#include <ptamsp/TrackerData.h>
 #include <ptamsp/LevelHelpers.h>
+#include <ptamsp/ModelSaver.h>
+#include <ptamsp/WorkerPool.h>
 
 Map::Map() {
-    pointsCloud.pts = vpPoints;
-    pointsKD = new MapPointKD(3, pointsCloud, nanoflann::KDTreeSingleIndexAdaptorParams(50));
+    pointsKD = NULL;
     Reset();
 }
 
+Map::~Map() {
+    // All other threads are gone by now, so everything can go at once.
+    for (const auto &kf : vpKeyFrames)
+        delete kf;
+    for (const auto &r : vpKeyFramesRetired)
+        delete r.first;
+    delete mpLists.load();
+    for (const auto &r : vRetiredLists)
+        delete r.first;
+    delete pointsKD;
+}
+
+// Everything currently in the map is retired rather than freed, since
+// the tracker or the map viewer may still be part-way through a pass over it.
 void Map::Reset() {
-    for (unsigned int i = 0; i < vpPoints.size(); i++) {
-        pointsKD->removePoint(i);
-        delete vpPoints[i];
-    }
-    for (unsigned int i = 0; i < vpKeyFrames.size(); i++) {
-        delete vpKeyFrames[i];
-    }
+    uint64_t nEpoch = epochs.Current();
+    for (const auto &p : vpPoints)
+        pointPool.Retire(p, nEpoch);
+    for (const auto &kf : vpKeyFrames)
+        vpKeyFramesRetired.push_back(std::make_pair(kf, nEpoch));
     vpKeyFrames.clear();
-    pointsCloud.pts.clear();
+    nKeyFrameGeneration++;
     vpPoints.clear();
+    pointsCloud.pts.clear();
+    delete pointsKD;
+    pointsKD = new MapPointKD(3, pointsCloud, nanoflann::KDTreeSingleIndexAdaptorParams(50));
+    pModelFile.reset();
+    sModelFolder.clear();
+    bStreamTiles = false;
+    vpModelKeyFrames.clear();
+    vpModelPoints.clear();
+    vbModelTileLoaded.clear();
+    vnModelTilePoints.clear();
+    vnModelPointMeasStart.clear();
+    vnModelPointMeas.clear();
+    nModelPointBudget = 0;
     bGood = false;
-    EmptyTrash();
+    PublishLists();
+}
+
+// The old lists go at the same epoch as whatever was just removed from them,
+// and the epoch only moves on once the new ones are in place, so no reader
+// can pick up a list holding anything that's been freed.
+void Map::PublishLists() {
+    const MapLists *pOld = mpLists.exchange(new MapLists{vpPoints, vpKeyFrames}, std::memory_order_acq_rel);
+    if (pOld)
+        vRetiredLists.push_back(std::make_pair(pOld, epochs.Current()));
+    bListsChanged = false;
+    epochs.Advance();
+}
+
+MapPoint *Map::NewPoint() {
+    return pointPool.Allocate();
+}
+
+void Map::DiscardPoint(MapPoint *p) {
+    pointPool.Discard(p);
 }
 
-void Map::MoveBadPointsToTrash() {
+void Map::RetireBadPoints() {
     for (int i = pointsCloud.pts.size() - 1; i >= 0; i--) {
-        if (pointsCloud.pts[i]->bBad)
+        if (pointsCloud.pts[i] && pointsCloud.pts[i]->bBad) {
             pointsKD->removePoint(i);
+            pointsCloud.pts[i] = NULL;
+        }
     }
+    uint64_t nEpoch = epochs.Current();
+    bool bAny = false;
+    bool bAnyFromModel = false;
     for (int i = vpPoints.size() - 1; i >= 0; i--) {
         if (vpPoints[i]->bBad) {
-            vpPointsTrash.push_back(vpPoints[i]);
+            bAnyFromModel |= vpPoints[i]->bFromModel;
+            pointPool.Retire(vpPoints[i], nEpoch);
             vpPoints.erase(vpPoints.begin() + i);
+            bAny = true;
         }
     };
+    if (bAnyFromModel)
+        for (auto &p : vpModelPoints)
+            if (p && p->bBad)
+                p = NULL;
+    if (bAny)
+        PublishLists();
 };
 
-void Map::EmptyTrash() {
-    for (unsigned int i = 0; i < vpPointsTrash.size(); i++)
-        delete vpPointsTrash[i];
-    vpPointsTrash.clear();
-};
+void Map::RetireKeyFrame(KeyFrame *kf) {
+    if (kf->nModelIndex >= 0 && kf->nModelIndex < (int) vpModelKeyFrames.size() && vpModelKeyFrames[kf->nModelIndex] == kf)
+        vpModelKeyFrames[kf->nModelIndex] = NULL;
+    vpKeyFramesRetired.push_back(std::make_pair(kf, epochs.Current()));
+    nKeyFrameGeneration++;
+    PublishLists();
+}
+
+void Map::RetireImage(const CVD::Image<CVD::byte> &im) {
+    if (im.totalsize() == 0)
+        return;
+    vRetiredImages.push_back(std::make_pair(im, epochs.Current()));
+    epochs.Advance();
+}
+
+size_t Map::Reclaim(uint64_t nSafeEpoch) {
+    size_t n = pointPool.Reclaim(nSafeEpoch);
+    auto it = vpKeyFramesRetired.begin();
+    for (; it != vpKeyFramesRetired.end() && it->second < nSafeEpoch; it++) {
+        delete it->first;
+        n++;
+    }
+    vpKeyFramesRetired.erase(vpKeyFramesRetired.begin(), it);
+    auto itImage = vRetiredImages.begin();
+    while (itImage != vRetiredImages.end() && itImage->second < nSafeEpoch)
+        itImage++;
+    vRetiredImages.erase(vRetiredImages.begin(), itImage);
+    auto itLists = vRetiredLists.begin();
+    for (; itLists != vRetiredLists.end() && itLists->second < nSafeEpoch; itLists++)
+        delete itLists->first;
+    vRetiredLists.erase(vRetiredLists.begin(), itLists);
+    return n;
+}
 
 bool Map::AddPoint(MapPoint *p, double minRadius) {
     size_t ret_index[1];
@@ -66,12 +157,149 @@ bool Map::AddPoint(MapPoint *p, double minRadius) {
     }
 
     vpPoints.push_back(p);
+    bListsChanged = true;
+    IndexPoint(p);
+    return true;
+}
+
+void Map::IndexPoint(MapPoint *p) {
     pointsCloud.pts.push_back(p);
     pointsKD->addPoints(pointsCloud.pts.size()-1, pointsCloud.pts.size()-1);
-    return true;
 }
 
-std::string Map::saveKeyFrame(const std::string &folder, int id, const KeyFrame &kf) {
+// Bundle adjustment moves points after they've been indexed, so the tree
+// slowly goes stale; this starts it again from the current positions.
+void Map::RebuildPointIndex() {
+    delete pointsKD;
+    pointsCloud.pts = vpPoints;
+    pointsKD = new MapPointKD(3, pointsCloud, nanoflann::KDTreeSingleIndexAdaptorParams(50));
+    if (!pointsCloud.pts.empty())
+        pointsKD->addPoints(0, pointsCloud.pts.size()-1);
+}
+
+size_t MapContents::MemoryFootprint() const {
+    size_t n = 0;
+    for (const auto &kf : vpKeyFrames)
+        n += kf->MemoryFootprint();
+    for (const auto &p : vpPoints) {
+        n += sizeof(MapPoint) + sizeof(TrackerData) + sizeof(MapMakerData);
+        // std::set nodes carry roughly four pointers of overhead each
+        n += (p->pMMData->sMeasurementKFs.size() + p->pMMData->sNeverRetryKFs.size()) * 5 * sizeof(void *);
+    }
+    n += (vpModelKeyFrames.size() + vpModelPoints.size()) * sizeof(void *);
+    n += (vnModelPointMeasStart.size() + vnModelPointMeas.size()) * sizeof(uint32_t);
+    return n;
+}
+
+// Published under the seqlock, like a tile load, so the tracker sees either
+// the old model or no model at all.
+void Map::TakeContents(MapContents &c) {
+    {
+        SeqLock::WriteGuard publish(poseSeq);
+        c.vpPoints.swap(vpPoints);
+        c.vpKeyFrames.swap(vpKeyFrames);
+        c.pModelFile = std::move(pModelFile);
+        c.sModelFolder.swap(sModelFolder);
+        c.bStreamTiles = bStreamTiles;
+        c.vpModelKeyFrames.swap(vpModelKeyFrames);
+        c.vpModelPoints.swap(vpModelPoints);
+        c.vbModelTileLoaded.swap(vbModelTileLoaded);
+        c.vnModelTilePoints.swap(vnModelTilePoints);
+        c.vnModelPointMeasStart.swap(vnModelPointMeasStart);
+        c.vnModelPointMeas.swap(vnModelPointMeas);
+        c.nModelPointBudget = nModelPointBudget;
+    }
+    vpPoints.clear();
+    vpKeyFrames.clear();
+    nKeyFrameGeneration++;
+    pModelFile.reset();
+    sModelFolder.clear();
+    bStreamTiles = false;
+    vpModelKeyFrames.clear();
+    vpModelPoints.clear();
+    vbModelTileLoaded.clear();
+    vnModelTilePoints.clear();
+    vnModelPointMeasStart.clear();
+    vnModelPointMeas.clear();
+    nModelPointBudget = 0;
+    RebuildPointIndex();
+    bGood = false;
+    PublishLists();
+}
+
+void Map::RestoreContents(MapContents &c) {
+    {
+        SeqLock::WriteGuard publish(poseSeq);
+        vpPoints.swap(c.vpPoints);
+        vpKeyFrames.swap(c.vpKeyFrames);
+        pModelFile = std::move(c.pModelFile);
+        sModelFolder.swap(c.sModelFolder);
+        bStreamTiles = c.bStreamTiles;
+        vpModelKeyFrames.swap(c.vpModelKeyFrames);
+        vpModelPoints.swap(c.vpModelPoints);
+        vbModelTileLoaded.swap(c.vbModelTileLoaded);
+        vnModelTilePoints.swap(c.vnModelTilePoints);
+        vnModelPointMeasStart.swap(c.vnModelPointMeasStart);
+        vnModelPointMeas.swap(c.vnModelPointMeas);
+        nModelPointBudget = c.nModelPointBudget;
+    }
+    c = MapContents();
+    nKeyFrameGeneration++;
+    RebuildPointIndex();
+    PublishLists();
+}
+
+void Map::RetireContents(MapContents &c) {
+    uint64_t nEpoch = epochs.Current();
+    for (const auto &p : c.vpPoints)
+        pointPool.Retire(p, nEpoch);
+    for (const auto &kf : c.vpKeyFrames)
+        vpKeyFramesRetired.push_back(std::make_pair(kf, nEpoch));
+    c = MapContents();
+    epochs.Advance();
+}
+
+// Orders the good points by how much use they are to the tracker: how many
+// keyframes measure them, and how often they've been inliers. So that any
+// leading share of them covers the whole map, the best point of every cell
+// (of dCellSize) comes first, then the second best of every cell, and so on.
+static std::vector<MapPoint *> RankPoints(const std::vector<MapPoint *> &vpPoints, double dCellSize) {
+    struct Ranked {
+        MapPoint *p;
+        double dScore;
+        std::array<int, 3> anCell;
+        int nRankInCell;
+    };
+    std::vector<Ranked> vRanked;
+    for (const auto &p : vpPoints) {
+        if (p->bBad)
+            continue;
+        int nIn = p->nMEstimatorInlierCount;
+        int nOut = p->nMEstimatorOutlierCount;
+        double dInlierRatio = nIn + nOut > 0 ? (double) nIn / (nIn + nOut) : 0.5;
+        Ranked r;
+        r.p = p;
+        r.dScore = p->pMMData->GoodMeasCount() * (1.0 + dInlierRatio) + (p->bFromModel ? 1.0 : 0.0);
+        for (int i = 0; i < 3; i++)
+            r.anCell[i] = dCellSize > 0 ? (int) std::floor(p->v3WorldPos[i] / dCellSize) : 0;
+        vRanked.push_back(r);
+    }
+    std::stable_sort(vRanked.begin(), vRanked.end(), [](const Ranked &a, const Ranked &b) {
+        return a.anCell != b.anCell ? a.anCell < b.anCell : a.dScore > b.dScore;
+    });
+    for (size_t i = 0; i < vRanked.size(); i++)
+        vRanked[i].nRankInCell = (i > 0 && vRanked[i].anCell == vRanked[i - 1].anCell) ? vRanked[i - 1].nRankInCell + 1 : 0;
+    std::stable_sort(vRanked.begin(), vRanked.end(), [](const Ranked &a, const Ranked &b) {
+        return a.nRankInCell != b.nRankInCell ? a.nRankInCell < b.nRankInCell : a.dScore > b.dScore;
+    });
+    std::vector<MapPoint *> vOrdered;
+    vOrdered.reserve(vRanked.size());
+    for (const auto &r : vRanked)
+        vOrdered.push_back(r.p);
+    return vOrdered;
+}
+
+static std::string KeyFrameImageName(int id) {
     std::stringstream imageName;
     if (id >= 100) {
         imageName << "frame" << id;
@@ -81,45 +309,74 @@ std::string Map::saveKeyFrame(const std::string &folder, int id, const KeyFrame
         imageName << "frame00" << id;
     }
     imageName << ".jpg";
-    std::string name = folder + "/" + imageName.str();
-
-    CVD::Image<CVD::byte> im = kf.aLevels[0].im;
-    cv::Mat img(im.size().y, im.size().x, CV_8UC1, im.data());
-    cv::imwrite(name, img);
-
     return imageName.str();
 }
 
 bool Map::SaveModelToFile(const std::string &loadFolder, const std::string &name, double cm) {
+    ModelSnapshot snapshot;
+    if (!SnapshotModel(loadFolder, name, cm, snapshot))
+        return false;
+    WorkerPool pool;
+    return ModelSaver::Write(snapshot, &pool);   // The snapshot goes on this thread too
+}
+
+bool Map::SnapshotModel(const std::string &loadFolder, const std::string &name, double cm, ModelSnapshot &snapshot) {
+    if (bStreamTiles) {
+        std::cout << "Map: can't save a model which is only partly loaded" << std::endl;
+        return false;
+    }
     std::map<KeyFrame*, int> getKFID;
     std::map<MapPoint*, int> getPointID;
 
-    PTAMModelFile loader(name, cm);
+    snapshot.sFolder = loadFolder;
+    PTAMModelFile &loader = snapshot.model;
+    loader = PTAMModelFile(name, cm);
     // Prepare KeyFrames
     for (int i = 0; i < vpKeyFrames.size(); i++) {
         auto kf = vpKeyFrames[i];
         getKFID[kf] = i;
         ModelKeyFrame m;
-        m.image = saveKeyFrame(loadFolder, i, *kf);
+        m.image = KeyFrameImageName(i);
         m.T = kf->se3CfromW.get_translation();
         m.R = kf->se3CfromW.get_rotation().ln();
         // Save relocalizer data
-        for (auto &kp : kf->relocKeypoints) {
+        for (auto &kp : kf->RelocKeypoints()) {
             m.keypoints.emplace_back(ModelCVKeypoint(kp));
         }
         m.descriptor = ModelCVMat(kf->relocFrameDescriptor);
-        for (auto &p : kf->relocWorldPoints) {
+        for (auto &p : kf->RelocWorldPoints()) {
             m.worldPoints[p.first] = ModelCVPoint(p.second);
         }
         loader.keyframes.push_back(m);
+
+        // Pixels are shared, not copied: a built level never changes (see ModelSnapshot)
+        std::unique_ptr<KeyFrame> pCopy(new KeyFrame());
+        for (int l = 0; l < LEVELS; l++) {
+            Level &lev = pCopy->aLevels[l];
+            const Level &src = kf->aLevels[l];
+            lev.im = src.im;
+            lev.vCorners = src.vCorners;
+            lev.vCornerRowLUT = src.vCornerRowLUT;
+            lev.vMaxCorners = src.vMaxCorners;
+            lev.vCandidates = src.vCandidates;
+            lev.bReleased = src.bReleased;
+            lev.irReleasedSize = src.irReleasedSize;
+        }
+        pCopy->state = kf->state;
+        for (int l = 0; l < LEVELS; l++)
+            if (kf->aLevels[l].bReleased)
+                pCopy->state = KeyFrame::LITE;   // Partly released (see MapMaker::TrimKeyFrames()): leave its levels out
+        snapshot.vpKeyFrames.push_back(std::move(pCopy));
+        // A paged-out live keyframe's image is read back from its spill file by the saver
+        snapshot.vsSourceImages.push_back(kf->SourcePath());
+        if (kf->pModelData && std::find(snapshot.vpMappedData.begin(), snapshot.vpMappedData.end(),
+                                        kf->pModelData) == snapshot.vpMappedData.end())
+            snapshot.vpMappedData.push_back(kf->pModelData);
     }
-    // Prepare MapPoints
+    // Prepare MapPoints, most useful first, so a loader can stop early (see Model.PointBudget)
+    static GVars3::gvar3<double> gvdRankCellCM("Model.RankCellCM", 50, GVars3::SILENT);
     int c = 0;
-    for (int i = 0; i < vpPoints.size(); i++) {
-        auto p = vpPoints[i];
-        if (p->bBad) {
-            continue;
-        }
+    for (const auto &p : RankPoints(vpPoints, *gvdRankCellCM * cm)) {
         getPointID[p] = c;
         c++;
         ModelPoint m(getKFID[p->pPatchSourceKF], p->irCenter[0], p->irCenter[1], p->v3WorldPos[0], p->v3WorldPos[1], p->v3WorldPos[2], p->nSourceLevel, p->bFromModel);
@@ -150,17 +407,19 @@ bool Map::SaveModelToFile(const std::string &loadFolder, const std::string &name
             loader.measurements.push_back(meas);
         }
     }
-    // Write to file
-    std::ofstream loaderFile(loadFolder + "/data_ptam", std::ios::binary);
-    {
-        cereal::BinaryOutputArchive oarchive(loaderFile);
-        oarchive(loader);
-    }
-    loaderFile.close();
+    static GVars3::gvar3<int> gvnCompressLevels("Model.CompressLevels", 0, GVars3::SILENT);
+    static GVars3::gvar3<double> gvdTileSizeCM("Model.TileSizeCM", 500, GVars3::SILENT);
+    snapshot.bCompressLevels = *gvnCompressLevels != 0;
+    snapshot.dTileSize = *gvdTileSizeCM * cm;
     return true;
 }
 
 bool Map::LoadModelFromFile(ATANCamera &cam, const std::string &loadFolder, std::string &name, double &cm) {
+    // Models converted to the binary format are mapped, rather than deserialised
+    std::shared_ptr<const ModelBinaryFile> pBinary = ModelBinaryFile::Open(loadFolder + "/data_ptam.bin");
+    if (pBinary)
+        return LoadModelFromBinary(cam, loadFolder, pBinary, name, cm);
+
     std::ifstream loaderFile(loadFolder + "/data_ptam", std::ios::binary);
     PTAMModelFile loader;
     cereal::BinaryInputArchive iarchive(loaderFile);
@@ -170,10 +429,11 @@ bool Map::LoadModelFromFile(ATANCamera &cam, const std::string &loadFolder, std:
     std::map<int, MapPoint*> getPointID;
     // Load KeyFrames
     for (int i = 0; i < loader.keyframes.size(); i++) {
-        auto modelKF = loader.keyframes[i];
+        const auto &modelKF = loader.keyframes[i];
         auto kf = new KeyFrame();
         kf->se3CfromW = SE3<>(SO3<>(modelKF.R), modelKF.T);
         kf->bFixed = i == 0;
+        kf->bFromModel = true;
         kf->imagePath = loadFolder + "/" + modelKF.image;
         vpKeyFrames.push_back(kf);
         getKFID[i] = kf;
@@ -185,10 +445,14 @@ bool Map::LoadModelFromFile(ATANCamera &cam, const std::string &loadFolder, std:
             kf->relocWorldPoints[p.first] = p.second.point;
         }
     }
-    // Load MapPoints
-    for (int i = 0; i < loader.points.size(); i++) {
-        auto modelP = loader.points[i];
-        auto p = new MapPoint();
+    // Load MapPoints: the first of them, if there's a budget, since they're saved most useful first
+    static GVars3::gvar3<int> gvnPointBudget("Model.PointBudget", 0, GVars3::SILENT);
+    size_t nPoints = loader.points.size();
+    if (*gvnPointBudget > 0)
+        nPoints = std::min(nPoints, (size_t) *gvnPointBudget);
+    for (int i = 0; i < nPoints; i++) {
+        const auto &modelP = loader.points[i];
+        auto p = NewPoint();
         p->nSourceLevel = modelP.sourceLevel;
         p->bFromModel = modelP.fromModel;
         p->v3WorldPos[0] = modelP.x;
@@ -198,34 +462,268 @@ bool Map::LoadModelFromFile(ATANCamera &cam, const std::string &loadFolder, std:
         auto center = CVD::ImageRef(modelP.centerX, modelP.centerY);
         p->SetSourcePatch(cam, getKFID[modelP.sourceKF], modelP.sourceLevel, center, LevelZeroPos(center, modelP.sourceLevel));
         vpPoints.push_back(p);
+        IndexPoint(p);
         getPointID[i] = p;
     }
     // Load Measurements
     for (const auto &modelM : loader.measurements) {
         Measurement m;
         m.nLevel = modelM.level;
-        if (modelM.source == 0)
-            m.Source = Measurement::SRC_TRAIL;
-        else if(modelM.source == 1)
-            m.Source = Measurement::SRC_TRACKER;
-        else if(modelM.source == 2)
-            m.Source = Measurement::SRC_REFIND;
-        else if(modelM.source == 3)
-            m.Source = Measurement::SRC_EPIPOLAR;
-        else if(modelM.source == 4)
-            m.Source = Measurement::SRC_ROOT;
+        SetMeasurementSource(m, modelM.source);
         m.v2RootPos[0] = modelM.x;
         m.v2RootPos[1] = modelM.y;
         m.bSubPix = modelM.sub;
 
+        auto itPoint = getPointID.find(modelM.pointID);
+        if (itPoint == getPointID.end())
+            continue;   // Left out by the budget
         auto kf = getKFID[modelM.kfID];
-        auto p = getPointID[modelM.pointID];
+        auto p = itPoint->second;
         kf->mMeasurements[p] = m;
         p->pMMData->sMeasurementKFs.insert(kf);
     }
 
+    PublishLists();
+
     name = loader.name;
     cm = loader.oneCM;
     loaderFile.close();
     return true;
-}
\ No newline at end of file
+}
+
+// As above, from a mapped binary model. The arrays are read in place, and the
+// keyframes' descriptors, reloc keypoints and reloc world points point straight
+// into the mapping, which they keep alive. Only the points, which the tracker
+// and mapmaker update, are built as MapPoints. Each tile's records are checked
+// as the tile is loaded.
+// A model of several tiles is only loaded around its first keyframe, where
+// the tracker starts, if Model.StreamTiles is set.
+bool Map::LoadModelFromBinary(ATANCamera &cam, const std::string &loadFolder,
+                              const std::shared_ptr<const ModelBinaryFile> &pFile, std::string &name, double &cm) {
+    static GVars3::gvar3<int> gvnStreamTiles("Model.StreamTiles", 1, GVars3::SILENT);
+    static GVars3::gvar3<int> gvnTileRadius("Model.TileRadius", 1, GVars3::SILENT);
+    static GVars3::gvar3<int> gvnPointBudget("Model.PointBudget", 0, GVars3::SILENT);
+    pModelFile = pFile;
+    sModelFolder = loadFolder;
+    bStreamTiles = *gvnStreamTiles && pFile->TileCount() > 1;
+    vpModelKeyFrames.assign(pFile->KeyFrameCount(), NULL);
+    vpModelPoints.assign(pFile->PointCount(), NULL);
+    vbModelTileLoaded.assign(pFile->TileCount(), false);
+    vnModelTilePoints.assign(pFile->TileCount(), 0);
+    nModelPointBudget = std::max(*gvnPointBudget, 0);
+    IndexModelMeasurements();
+
+    if (!bStreamTiles) {
+        for (size_t t = 0; t < pFile->TileCount(); t++)
+            LoadModelTile(cam, t);
+    } else {
+        const ModelBinKeyFrame &first = pFile->KeyFrames()[0];
+        SE3<> se3First(SO3<>(makeVector(first.adR[0], first.adR[1], first.adR[2])),
+                       makeVector(first.adT[0], first.adT[1], first.adT[2]));
+        LoadModelTilesNear(cam, se3First.inverse().get_translation(), *gvnTileRadius);
+    }
+    // The first tile holds the keyframe the tracker starts from
+    if (vbModelTileLoaded.empty() || !vbModelTileLoaded[0])
+        return false;
+
+    name = pFile->Name();
+    cm = pFile->OneCM();
+    return true;
+}
+
+// The stored measurements are grouped by keyframe; this groups them by point
+// as well, so loading a few more points only visits their own measurements.
+void Map::IndexModelMeasurements() {
+    const ModelBinMeasurement *pMeas = pModelFile->Measurements();
+    size_t nMeas = pModelFile->MeasurementCount();
+    size_t nPoints = pModelFile->PointCount();
+    vnModelPointMeasStart.assign(nPoints + 1, 0);
+    size_t nKFs = pModelFile->KeyFrameCount();
+    auto inRange = [&](const ModelBinMeasurement &m) {
+        return m.nPoint >= 0 && (size_t) m.nPoint < nPoints && m.nKF >= 0 && (size_t) m.nKF < nKFs;
+    };
+    for (size_t m = 0; m < nMeas; m++)
+        if (inRange(pMeas[m]))
+            vnModelPointMeasStart[pMeas[m].nPoint + 1]++;
+    for (size_t i = 0; i < nPoints; i++)
+        vnModelPointMeasStart[i + 1] += vnModelPointMeasStart[i];
+    vnModelPointMeas.resize(vnModelPointMeasStart[nPoints]);
+    std::vector<uint32_t> vFill(vnModelPointMeasStart.begin(), vnModelPointMeasStart.end() - 1);
+    for (size_t m = 0; m < nMeas; m++)
+        if (inRange(pMeas[m]))
+            vnModelPointMeas[vFill[pMeas[m].nPoint]++] = m;
+}
+
+// Adds one tile's keyframes and points, and every stored measurement between
+// loaded keyframes and loaded points which that makes complete. False if the
+// tile's records are damaged; it's then left out.
+bool Map::LoadModelTile(ATANCamera &cam, int nTile, std::vector<KeyFrame *> *pvNewKeyFrames) {
+    if (vbModelTileLoaded[nTile])
+        return true;
+    const ModelBinaryFile &file = *pModelFile;
+    if (!file.ValidateTile(nTile))
+        return false;
+    const ModelBinTile &tile = file.Tiles()[nTile];
+    const ModelBinKeyFrame *pKFs = file.KeyFrames();
+    std::vector<KeyFrame *> vNewKFs;
+    for (uint32_t i = tile.nFirstKeyFrame; i < tile.nFirstKeyFrame + tile.nKeyFrames; i++) {
+        const ModelBinKeyFrame &modelKF = pKFs[i];
+        auto kf = new KeyFrame();
+        kf->se3CfromW = SE3<>(SO3<>(makeVector(modelKF.adR[0], modelKF.adR[1], modelKF.adR[2])),
+                              makeVector(modelKF.adT[0], modelKF.adT[1], modelKF.adT[2]));
+        // A dropped tile comes back as saved, so refining streamed keyframes
+        // would be undone anyway; fixing them all also keeps the gauge fixed
+        // whichever tiles are loaded.
+        kf->bFixed = i == 0 || bStreamTiles;
+        kf->bFromModel = true;
+        kf->nModelIndex = i;
+        kf->imagePath = sModelFolder + "/" + file.ImageName(modelKF);
+        file.ReadLevels(i, *kf);   // If they weren't stored, the mapmaker makes them from imagePath later
+
+        kf->pModelKeyPoints = file.KeyPoints() + modelKF.nFirstKeyPoint;
+        kf->nModelKeyPoints = modelKF.nKeyPoints;
+        kf->pModelWorldPoints = file.WorldPoints() + modelKF.nFirstWorldPoint;
+        kf->nModelWorldPoints = modelKF.nWorldPoints;
+        kf->relocFrameDescriptor = file.Descriptor(modelKF);
+        kf->pModelData = pModelFile;
+        vpModelKeyFrames[i] = kf;
+        vNewKFs.push_back(kf);
+    }
+
+    vbModelTileLoaded[nTile] = true;
+    vnModelTilePoints[nTile] = 0;
+    LoadModelTilePoints(cam, nTile, ModelTilePointQuota(nTile), vNewKFs);
+    if (pvNewKeyFrames)
+        pvNewKeyFrames->insert(pvNewKeyFrames->end(), vNewKFs.begin(), vNewKFs.end());
+    return true;
+}
+
+// Points are stored most useful first within each tile, so a budget is met by
+// loading the same leading share of every tile.
+uint32_t Map::ModelTilePointQuota(int nTile) const {
+    uint32_t nTilePoints = pModelFile->Tiles()[nTile].nPoints;
+    if (nModelPointBudget == 0 || nModelPointBudget >= pModelFile->PointCount())
+        return nTilePoints;
+    uint64_t nQuota = ((uint64_t) nTilePoints * nModelPointBudget + pModelFile->PointCount() - 1) / pModelFile->PointCount();
+    return std::min<uint64_t>(nQuota, nTilePoints);
+}
+
+// Loads a tile's points up to (not including) rank nEnd, and every stored
+// measurement which that, along with the tile's keyframes if they're in
+// vNewKFs, makes complete; then publishes the lot.
+void Map::LoadModelTilePoints(ATANCamera &cam, int nTile, uint32_t nEnd, const std::vector<KeyFrame *> &vNewKFs) {
+    const ModelBinaryFile &file = *pModelFile;
+    const ModelBinTile &tile = file.Tiles()[nTile];
+    const ModelBinKeyFrame *pKFs = file.KeyFrames();
+    uint32_t nFrom = tile.nFirstPoint + vnModelTilePoints[nTile];
+    uint32_t nTo = tile.nFirstPoint + std::min(nEnd, tile.nPoints);
+
+    const ModelBinPoint *pPoints = file.Points();
+    std::vector<MapPoint *> vNewPoints;
+    for (uint32_t i = nFrom; i < nTo; i++) {
+        const ModelBinPoint &modelP = pPoints[i];
+        KeyFrame *pSourceKF = vpModelKeyFrames[modelP.nSourceKF];
+        if (!pSourceKF)
+            continue;   // Culled since its tile was loaded
+        auto p = NewPoint();
+        p->nSourceLevel = modelP.nSourceLevel;
+        p->bFromModel = modelP.bFromModel;
+        p->v3WorldPos = makeVector((double) modelP.x, (double) modelP.y, (double) modelP.z);
+
+        auto center = CVD::ImageRef(modelP.nCenterX, modelP.nCenterY);
+        p->SetSourcePatch(cam, pSourceKF, modelP.nSourceLevel, center, LevelZeroPos(center, modelP.nSourceLevel));
+        vpModelPoints[i] = p;
+        vNewPoints.push_back(p);
+    }
+    vnModelTilePoints[nTile] = std::max(vnModelTilePoints[nTile], nTo - tile.nFirstPoint);
+
+    // The new keyframes' measurements of any loaded point, and the measurements
+    // of keyframes in other loaded tiles which land on the new points
+    const ModelBinMeasurement *pMeas = file.Measurements();
+    auto addMeasurement = [this](const ModelBinMeasurement &modelM) {
+        Measurement m;
+        m.nLevel = modelM.nLevel;
+        SetMeasurementSource(m, modelM.nSource);
+        m.v2RootPos = makeVector(modelM.x, modelM.y);
+        m.bSubPix = modelM.bSubPix;
+        KeyFrame *kf = vpModelKeyFrames[modelM.nKF];
+        MapPoint *p = vpModelPoints[modelM.nPoint];
+        kf->mMeasurements[p] = m;
+        p->pMMData->sMeasurementKFs.insert(kf);
+    };
+    bool bNewKFs = !vNewKFs.empty();
+    auto isNewKF = [&](uint32_t nKF) {
+        return bNewKFs && nKF >= tile.nFirstKeyFrame && nKF < tile.nFirstKeyFrame + tile.nKeyFrames;
+    };
+    if (bNewKFs) {
+        for (uint32_t i = tile.nFirstKeyFrame; i < tile.nFirstKeyFrame + tile.nKeyFrames; i++) {
+            const ModelBinKeyFrame &modelKF = pKFs[i];
+            for (uint32_t m = modelKF.nFirstMeasurement; m < modelKF.nFirstMeasurement + modelKF.nMeasurements; m++)
+                if (vpModelPoints[pMeas[m].nPoint])
+                    addMeasurement(pMeas[m]);
+        }
+    }
+    for (uint32_t i = nFrom; i < nTo; i++) {
+        if (!vpModelPoints[i])
+            continue;
+        for (uint32_t n = vnModelPointMeasStart[i]; n < vnModelPointMeasStart[i + 1]; n++) {
+            const ModelBinMeasurement &modelM = pMeas[vnModelPointMeas[n]];
+            if (vpModelKeyFrames[modelM.nKF] && !isNewKF(modelM.nKF))   // Those were done above
+                addMeasurement(modelM);
+        }
+    }
+
+    // Everything is set up; now let the tracker see it
+    vpKeyFrames.insert(vpKeyFrames.end(), vNewKFs.begin(), vNewKFs.end());
+    for (const auto &p : vNewPoints) {
+        vpPoints.push_back(p);
+        IndexPoint(p);
+    }
+    PublishLists();
+}
+
+int Map::LoadMoreModelPoints(ATANCamera &cam, int nMax) {
+    if (!pModelFile || nMax <= 0)
+        return 0;
+    const ModelBinTile *pTiles = pModelFile->Tiles();
+    uint64_t nLoadedTilePoints = 0;
+    for (size_t t = 0; t < vbModelTileLoaded.size(); t++)
+        if (vbModelTileLoaded[t] && vnModelTilePoints[t] < pTiles[t].nPoints)
+            nLoadedTilePoints += pTiles[t].nPoints;
+    int nAdded = 0;
+    for (size_t t = 0; t < vbModelTileLoaded.size() && nLoadedTilePoints > 0; t++) {
+        if (!vbModelTileLoaded[t] || vnModelTilePoints[t] >= pTiles[t].nPoints)
+            continue;
+        uint32_t nShare = std::max<uint64_t>(1, (uint64_t) nMax * pTiles[t].nPoints / nLoadedTilePoints);
+        uint32_t nBefore = vnModelTilePoints[t];
+        LoadModelTilePoints(cam, t, nBefore + nShare);
+        nAdded += vnModelTilePoints[t] - nBefore;
+    }
+    return nAdded;
+}
+
+int Map::ModelTileDistance(int nTile, const Vector<3> &v3Centre) const {
+    const ModelBinTile &tile = pModelFile->Tiles()[nTile];
+    double dTileSize = pModelFile->TileSize();
+    int nDistance = 0;
+    for (int d = 0; d < 3; d++) {
+        int nCell = dTileSize > 0 ? (int) std::floor(v3Centre[d] / dTileSize) : 0;
+        nDistance = std::max(nDistance, std::abs(tile.anCell[d] - nCell));
+    }
+    return nDistance;
+}
+
+// Loads every tile within nRadius tiles of v3Centre which isn't loaded yet; returns how many.
+int Map::LoadModelTilesNear(ATANCamera &cam, const Vector<3> &v3Centre, int nRadius,
+                            std::vector<KeyFrame *> *pvNewKeyFrames) {
+    if (!pModelFile)
+        return 0;
+    int nLoaded = 0;
+    for (size_t t = 0; t < pModelFile->TileCount(); t++) {
+        if (vbModelTileLoaded[t] || ModelTileDistance(t, v3Centre) > nRadius)
+            continue;
+        if (LoadModelTile(cam, t, pvNewKeyFrames))
+            nLoaded++;
+    }
+    return nLoaded;
+}
@@ -2,6 +2,11 @@
 
 #include <fstream>
 #include <algorithm>
+#include <unordered_set>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <unistd.h>
 
 #include <cvd/vector_image_ref.h>
 #include <TooN/SVD.h>
@@ -20,6 +25,10 @@
 #include <ptamsp/PatchFinder.h>
 #include <ptamsp/TrackerData.h>
 #include <ptamsp/PTAMInstallerFile.h>
+#include <ptamsp/WorkerPool.h>
+#include <ptamsp/ModelBinaryFile.h>
+#include <ptamsp/ModelLoader.h>
+#include <ptamsp/ModelSaver.h>
 
 #include "SmallMatrixOpts.h"
 
@@ -31,6 +40,10 @@
 using namespace CVD;
 using namespace GVars3;
 
+static double SecondsSince(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
 // Constructor sets up internal reference variable to Map.
 // Most of the intialisation is done by Reset()..
 MapMaker::MapMaker(Map &m, const ATANCamera &cam, TrackingStats &stats, const std::string &deviceFolder, OperationMode mode)
@@ -42,37 +55,45 @@ MapMaker::MapMaker(Map &m, const ATANCamera &cam, TrackingStats &stats, const st
     }
     static gvar3<int>minRelocKeypoints("MapMaker.MinRelocKeypoints", 500, SILENT);
     nRelocFeatureCount = *minRelocKeypoints;
-    cv::Ptr<cv::flann::IndexParams> indexParams = cv::makePtr<cv::flann::LshIndexParams>(6, 12, 1);
-    cv::Ptr<cv::flann::SearchParams> searchParams = cv::makePtr<cv::flann::SearchParams>(50);
-    keyframeImageMatcher = cv::FlannBasedMatcher(indexParams, searchParams);
+    keyframeImageMatcher = MakeRelocMatcher();
+    if (operationMode == MM_MODE_FULL_AUTO)
+        mpModelLoader.reset(new ModelLoader(cam, deviceFolder));
 
     mbResetRequested = false;
     Reset();
     if (operationMode != MM_MODE_INSTALL) {
         start(); // This CVD::thread func starts the map-maker thread with function run()
         GUI.RegisterCommand("SaveMap", GUICommandCallBack, this);
+        GUI.RegisterCommand("SaveModel", GUICommandCallBack, this);
     }
     GV3::Register(mgvdWiggleScale, "MapMaker.WiggleScale", 0.10, SILENT); // Default to 10cm between keyframes
 };
 
 void MapMaker::Reset() {
     // This is only called from within the mapmaker thread...
-    mMap.Reset();
+    mMap.Reset();    // Retires all points and keyframes
     mvFailureQueue.clear();
     while (!mqNewQueue.empty()) mqNewQueue.pop();
-    for (const auto &kf : mMap.vpKeyFrames)
-        delete kf;
-    for (const auto &kf : mvpKeyFrameQueue)
-        delete kf;
+    KeyFrame *pQueued;
+    while (mqKeyFrameQueue.TryPop(pQueued))
+        delete pQueued;
     mMap.vpKeyFrames.clear();
-    mvpKeyFrameQueue.clear();
+    mKeyFramePreparer.Clear();
     mbBundleRunning = false;
     mbBundleConverged_Full = true;
     mbBundleConverged_Recent = true;
+    mbFusionNeeded = false;
     mbResetDone = true;
     mbResetRequested = false;
     mbBundleAbortRequested = false;
+    mpGlobalBundle.reset();
+    mGlobalBundleViews.clear();
+    mGlobalBundlePoints.clear();
+    mvGlobalBundleID_View.clear();
+    mvGlobalBundleID_Point.clear();
     keyframeImageMatcher.clear();
+    mvRelocKeyFrames.clear();
+    mCurrentModelKey.clear();
 }
 
 // CHECK_RESET is a handy macro which makes the mapmaker thread stop
@@ -94,39 +115,28 @@ void MapMaker::run() {
         CHECK_RESET;
 
         // Handle any GUI commands encountered..
-        while (!mvQueuedCommands.empty()) {
-            GUICommandHandler(mvQueuedCommands.begin()->sCommand, mvQueuedCommands.begin()->sParams);
-            mvQueuedCommands.erase(mvQueuedCommands.begin());
-        }
-
-        if (mMap.IsGood()) {
-            int cost = 0;
-            for (const auto &kf : mMap.vpKeyFrames) {
-                if (kf->state < KeyFrame::LITE) {
-                    cv::Mat img = cv::imread(kf->imagePath, cv::IMREAD_GRAYSCALE);
-                    CVD::Image<CVD::byte> imBW(CVD::ImageRef(img.cols, img.rows));
-                    cv::Mat tmp(img.rows, img.cols, CV_8UC1, imBW.data());
-                    img.copyTo(tmp);
-                    kf->MakeKeyFrame_Lite(imBW);
-                    cost += 2;
-                }
-                if (cost > 20)
-                    break;
-            }
-            if (cost == 0) {
-                for (const auto &kf : mMap.vpKeyFrames) {
-                    if (kf->state < KeyFrame::REST) {
-                        kf->MakeKeyFrame_Rest();
-                        cost++;
-                    }
-                    if (cost > 20)
-                        break;
-                }
-            }
+        Command c;
+        while (mqQueuedCommands.TryPop(c))
+            GUICommandHandler(c.sCommand, c.sParams);
+
+        // New points and keyframes from the last pass become visible to the tracker
+        mMap.PublishListsIfChanged();
+        ReclaimRetired();
+        if (mpModelSaver)
+            mpModelSaver->CollectFinished();
+        CollectLoadedModels();
+
+        // Loaded keyframes whose pyramids are ready go live, and paged-out ones come back
+        std::vector<KeyFrame *> vInstalled;
+        mKeyFramePreparer.Install(&vInstalled);
+        PageInKeyFrames(vInstalled);
+        if (mMap.IsGood() && currentMode == MM_MODE_MAP) {
+            StreamModelTiles();
+            PageKeyFrames();
         }
 
         if (currentMode == MM_MODE_RELOC) {
-            if (newRelocImage) {
+            if (!mqRelocImages.Empty()) {
                 ProcessReloc();
                 continue;
             }
@@ -166,6 +176,29 @@ void MapMaker::run() {
                 ReFindFromFailureQueue();
             }
 
+            CHECK_RESET;
+            CHECK_RELOC;
+            // Merge duplicate points made by epipolar search from different keyframes
+            if (mbBundleConverged_Recent && mbBundleConverged_Full && mbFusionNeeded && QueueSize() == 0) {
+                FusePoints();
+            }
+
+            CHECK_RESET;
+            CHECK_RELOC;
+            // Keep the map bounded: drop keyframes which the rest of the map already covers.
+            if (mbBundleConverged_Recent && QueueSize() == 0) {
+                CullRedundantKeyFrames();
+            }
+
+            CHECK_RESET;
+            CHECK_RELOC;
+            // Idle: bring in more of a model loaded on a point budget
+            if (mbBundleConverged_Recent && mbBundleConverged_Full && QueueSize() == 0) {
+                static gvar3<int> gvnPointStep("Model.PointStep", 200, SILENT);
+                if (mMap.LoadMoreModelPoints(mCamera, *gvnPointStep) > 0)
+                    mbBundleConverged_Full = false;
+            }
+
             CHECK_RESET;
             CHECK_RELOC;
             HandleBadPoints();
@@ -203,6 +236,7 @@ void MapMaker::HandleBadPoints() {
 
     // All points marked as bad will be erased - erase all records of them
     // from keyframes in which they might have been measured.
+    bool bAnyBad = false;
     for (unsigned int i = 0; i < mMap.vpPoints.size(); i++) {
         if (mMap.vpPoints[i]->bBad) {
             MapPoint *p = mMap.vpPoints[i];
@@ -211,11 +245,225 @@ void MapMaker::HandleBadPoints() {
                 if (k.mMeasurements.count(p))
                     k.mMeasurements.erase(p);
             }
+            bAnyBad = true;
         }
     }
+    if (!bAnyBad)
+        return;
 
-    // Move bad points to the trash list.
-    mMap.MoveBadPointsToTrash();
+    // Retire bad points; they're freed once the tracker can no longer see them.
+    ForgetBadPoints();
+    mMap.RetireBadPoints();
+}
+
+// Drops the mapmaker's own pending work on points which are about to be retired.
+void MapMaker::ForgetBadPoints() {
+    mvFailureQueue.erase(std::remove_if(mvFailureQueue.begin(), mvFailureQueue.end(),
+                                        [](const std::pair<KeyFrame *, MapPoint *> &f) { return f.second->bBad; }),
+                         mvFailureQueue.end());
+    std::queue<MapPoint *> qGood;
+    while (!mqNewQueue.empty()) {
+        if (!mqNewQueue.front()->bBad)
+            qGood.push(mqNewQueue.front());
+        mqNewQueue.pop();
+    }
+    mqNewQueue.swap(qGood);
+}
+
+// With a streamed model, keeps the tiles around the camera loaded. A tile is
+// only dropped once the camera is a tile further away than loading needs, so
+// moving along a tile border doesn't keep loading and dropping the same one.
+void MapMaker::StreamModelTiles() {
+    static gvar3<int> gvnTileRadius("Model.TileRadius", 1, SILENT);
+    Vector<3> v3Centre;
+    if (!mMap.bStreamTiles || mKeyFramePreparer.PoseHintVersion() == mnModelPoseHintVersion ||
+        !mKeyFramePreparer.PoseHint(v3Centre))
+        return;
+
+    bool bChanged = false;
+    for (size_t t = 0; t < mMap.vbModelTileLoaded.size(); t++) {
+        if (mMap.vbModelTileLoaded[t] && mMap.ModelTileDistance(t, v3Centre) > *gvnTileRadius + 1) {
+            UnloadModelTile(t);
+            bChanged = true;
+        }
+    }
+    std::vector<KeyFrame *> vNewKFs;
+    if (mMap.LoadModelTilesNear(mCamera, v3Centre, *gvnTileRadius, &vNewKFs) > 0) {
+        for (const auto &kf : vNewKFs) {
+            RefreshSceneDepth(kf);
+            if (kf->state < KeyFrame::REST)
+                mKeyFramePreparer.Add(kf);
+        }
+        bChanged = true;
+    }
+    if (bChanged)
+        mbBundleConverged_Full = false;
+}
+
+// Keyframe paging, for maps whose keyframes would take more than
+// MapMaker.KeyFrameBudgetMB. Cold keyframes -- far from the camera, and not
+// the patch source of any point near it -- are paged out, farthest first,
+// until the rest fit: the tracker is told under the SeqLock to skip their
+// points, and once it is past that epoch their levels are released. Live
+// keyframes spill level 0 to a raw file first, so every keyframe can be
+// rebuilt. Paged-out keyframes which turn hot again are rebuilt on the
+// preparer's threads and paged back in by PageInKeyFrames(). Hot keyframes
+// stay resident even if they alone are over the budget.
+void MapMaker::PageKeyFrames() {
+    static gvar3<int> gvnBudgetMB("MapMaker.KeyFrameBudgetMB", 0, SILENT);
+    static gvar3<double> gvdHotRadiusCM("MapMaker.PageRadiusCM", 300, SILENT);
+    Vector<3> v3Centre;
+    if (*gvnBudgetMB <= 0 || operationMode == MM_MODE_INSTALL ||
+        mKeyFramePreparer.PoseHintVersion() == mnPagePoseHintVersion || !mKeyFramePreparer.PoseHint(v3Centre))
+        return;
+    mnPagePoseHintVersion = mKeyFramePreparer.PoseHintVersion();
+
+    double dRadiusSq = *gvdHotRadiusCM * mdOneCM * *gvdHotRadiusCM * mdOneCM;
+    std::unordered_set<KeyFrame *> sHot;
+    for (const auto &kf : mMap.vpKeyFrames)
+        if (norm_sq(kf->se3CfromW.inverse().get_translation() - v3Centre) < dRadiusSq)
+            sHot.insert(kf);
+    for (const auto &p : mMap.vpPoints)
+        if (norm_sq(p->v3WorldPos - v3Centre) < dRadiusSq)
+            sHot.insert(p->pPatchSourceKF);
+
+    uint64_t nSafe = mMap.epochs.SafeEpoch();
+    size_t nResident = 0;
+    std::vector<std::pair<double, KeyFrame *> > vCold;
+    for (const auto &kf : mMap.vpKeyFrames) {
+        if (!kf->bPagedOut) {
+            nResident += kf->MemoryFootprint();
+            if (kf->state == KeyFrame::REST && !sHot.count(kf))
+                vCold.push_back(std::make_pair(norm_sq(kf->se3CfromW.inverse().get_translation() - v3Centre), kf));
+            continue;
+        }
+        // Levels rebuilt meanwhile by EnsureLevel() only stay until the next pass, so aren't counted
+        nResident += kf->MemoryFootprint() - kf->PyramidFootprint();
+        if (kf->nPagedOutEpoch >= nSafe)
+            continue;   // The tracker may still be reading its levels
+        if (sHot.count(kf)) {
+            mKeyFramePreparer.Add(kf);
+        } else if (!mKeyFramePreparer.IsOutstanding(kf)) {
+            kf->ReleaseDerivedData();
+            for (int l = 0; l < LEVELS; l++)
+                if (!kf->aLevels[l].bRecentlyUsed && kf->CanReleaseLevel(l))
+                    kf->ReleaseLevel(l);
+        }
+    }
+
+    size_t nBudget = (size_t) *gvnBudgetMB << 20;
+    if (nResident <= nBudget)
+        return;
+    std::sort(vCold.begin(), vCold.end(), std::greater<std::pair<double, KeyFrame *> >());
+    std::vector<KeyFrame *> vPageOut;
+    for (const auto &c : vCold) {
+        if (nResident <= nBudget)
+            break;
+        KeyFrame *kf = c.second;
+        if (mKeyFramePreparer.IsOutstanding(kf))
+            continue;
+        if (kf->SourcePath().empty() && !kf->SpillLevelZero(NewSpillPath()))
+            continue;
+        nResident -= kf->PyramidFootprint();
+        vPageOut.push_back(kf);
+    }
+    if (vPageOut.empty())
+        return;
+    {
+        SeqLock::WriteGuard publish(mMap.poseSeq);
+        for (const auto &kf : vPageOut) {
+            kf->bPagedOut = true;
+            kf->nPagedOutEpoch = mMap.epochs.Current();
+        }
+    }
+    mMap.epochs.Advance();
+}
+
+// Paged-out keyframes whose levels the preparer has just rebuilt: the
+// tracker may use their patches again.
+void MapMaker::PageInKeyFrames(const std::vector<KeyFrame *> &vInstalled) {
+    bool bAny = false;
+    for (const auto &kf : vInstalled)
+        bAny = bAny || kf->bPagedOut;
+    if (!bAny)
+        return;
+    SeqLock::WriteGuard publish(mMap.poseSeq);
+    for (const auto &kf : vInstalled)
+        kf->bPagedOut = false;
+}
+
+// Spill files for live keyframes go in MapMaker.SpillFolder, by default the
+// system's temporary folder. Each keyframe deletes its own.
+std::string MapMaker::NewSpillPath() {
+    static gvar3<std::string> gvsSpillFolder("MapMaker.SpillFolder", "", SILENT);
+    std::string sFolder = *gvsSpillFolder;
+    if (sFolder.empty())
+        sFolder = std::filesystem::temp_directory_path().string();
+    return sFolder + "/ptamsp-" + std::to_string(getpid()) + "-" + std::to_string(mnSpillFiles++) + ".raw";
+}
+
+// Drops a tile of a streamed model: its points, then its keyframes.
+// If a keyframe can't go (some other point measured outside the tile has
+// nowhere outside it to take its patch from), nothing is touched and the tile
+// stays loaded; returns false.
+bool MapMaker::UnloadModelTile(int nTile) {
+    const ModelBinTile &tile = mMap.pModelFile->Tiles()[nTile];
+    std::set<KeyFrame *> sGoing;
+    for (uint32_t i = tile.nFirstKeyFrame; i < tile.nFirstKeyFrame + tile.nKeyFrames; i++)
+        if (mMap.vpModelKeyFrames[i])
+            sGoing.insert(mMap.vpModelKeyFrames[i]);
+    std::set<MapPoint *> sDropped;
+    for (uint32_t i = tile.nFirstPoint; i < tile.nFirstPoint + tile.nPoints; i++)
+        if (mMap.vpModelPoints[i])
+            sDropped.insert(mMap.vpModelPoints[i]);
+
+    // Every other point sourced in the tile and seen from outside it needs a
+    // keyframe outside it to take its patch over; those seen only from inside
+    // go with the tile
+    std::vector<MapPoint *> vSeenInside;
+    for (const auto &kf : sGoing) {
+        for (const auto &m : kf->mMeasurements) {
+            MapPoint *p = m.first;
+            if (p->pPatchSourceKF != kf || sDropped.count(p))
+                continue;
+            bool bSeenOutside = false;
+            for (const auto &c : p->pMMData->sMeasurementKFs)
+                bSeenOutside = bSeenOutside || !sGoing.count(c);
+            if (bSeenOutside && !NewPatchSource(p, kf, sGoing)) {
+                std::cout << "MapMaker: can't drop tile " << nTile << ", a point has nowhere else to take its patch from; keeping it loaded." << std::endl;
+                return false;
+            }
+            if (!bSeenOutside)
+                vSeenInside.push_back(p);
+        }
+    }
+
+    sDropped.insert(vSeenInside.begin(), vSeenInside.end());
+    for (const auto &p : sDropped)
+        p->bBad = true;
+    HandleBadPoints();   // Takes them out of every keyframe, and retires them
+    mMap.vnModelTilePoints[nTile] = 0;
+    bool bAllRemoved = true;
+    for (uint32_t i = tile.nFirstKeyFrame; i < tile.nFirstKeyFrame + tile.nKeyFrames; i++)
+        if (mMap.vpModelKeyFrames[i] && !RemoveKeyFrame(mMap.vpModelKeyFrames[i]))
+            bAllRemoved = false;
+    if (!bAllRemoved) {
+        std::cout << "MapMaker: couldn't drop every keyframe of tile " << nTile << "; keeping it loaded." << std::endl;
+        return false;
+    }
+    mMap.vbModelTileLoaded[nTile] = false;
+    return true;
+}
+
+// Frees retired points and keyframes once no reader can still hold them.
+// Keyframes still sitting in the tracker's queue may also refer to retired points,
+// so nothing is freed until those have been absorbed. The order of the two checks matters:
+// a tracker which has left its epoch has already pushed any keyframe it made in it.
+void MapMaker::ReclaimRetired() {
+    uint64_t nSafe = mMap.epochs.SafeEpoch();
+    if (QueueSize() > 0)
+        return;
+    mMap.Reclaim(nSafe);
 }
 
 MapMaker::~MapMaker() {
@@ -226,6 +474,8 @@ MapMaker::~MapMaker() {
     std::cout << "Waiting for mapmaker to die.." << std::endl;
     worker.join();
     std::cout << " .. mapmaker has died." << std::endl;
+    for (auto &m : mModelCache.Clear())
+        mMap.RetireContents(m.contents);
 }
 
 void MapMaker::stop() {
@@ -284,45 +534,288 @@ Eigen::Matrix<float, 4, 4> MapMaker::GetTransformFromModelToWorld(PTAMInstallerF
     return Eigen::umeyama(model, ref);
 }
 
+// The keyframe closest to kf, other than those in sExclude, which measures p
+// and has the pixels to take over its source patch: the level may have been
+// released (see TrimKeyFrames()), or it may be a loaded keyframe not yet
+// prepared. NULL if there's none.
+KeyFrame *MapMaker::NewPatchSource(MapPoint *p, KeyFrame *kf, const std::set<KeyFrame *> &sExclude) {
+    std::vector<KeyFrame *> candidateKFs;
+    for (const auto &c : p->pMMData->sMeasurementKFs)
+        if (c != kf && !sExclude.count(c))
+            candidateKFs.push_back(c);
+    for (const auto &c : NClosestKeyFramesInList(*kf, candidateKFs.size(), candidateKFs))
+        if (c->state == KeyFrame::REST && c->EnsureLevel(c->mMeasurements[p].nLevel))
+            return c;
+    return NULL;
+}
+
+// Either removes kf completely or, if some point it's the source of has no
+// other keyframe to take the patch over, changes nothing and returns false.
 bool MapMaker::RemoveKeyFrame(KeyFrame *kf) {
+    // First find every point's new source keyframe
+    std::vector<std::pair<MapPoint *, KeyFrame *> > vNewSources;
+    for (const auto &m : kf->mMeasurements) {
+        auto p = m.first;
+        if (p->pPatchSourceKF != kf || p->pMMData->sMeasurementKFs.size() <= 1)
+            continue;   // Not its source, or the point goes with the keyframe
+        KeyFrame *pBest = NewPatchSource(p, kf, std::set<KeyFrame *>());
+        if (!pBest) {
+            std::cout << "MapMaker: can't remove keyframe, no replacement source keyframe for one of its points" << std::endl;
+            return false;
+        }
+        vNewSources.push_back(std::make_pair(p, pBest));
+    }
+
+    // Now nothing can fail: detach the points
     for (const auto &m : kf->mMeasurements) {
         auto p = m.first;
         p->pMMData->sMeasurementKFs.erase(kf);
-        if (p->pMMData->sMeasurementKFs.empty()) {
-            // If no more measurements, remove this point from map
-            delete p;
-            mMap.vpPoints.erase(std::remove(mMap.vpPoints.begin(), mMap.vpPoints.end(), p),
-                                mMap.vpPoints.end());
-        } else if (p->pPatchSourceKF == kf) {
-            // If source KeyFrame is this keyframe, replace it with the closes next KeyFrame
-            std::vector<KeyFrame *> candidateKFs;
-            for (const auto &c : p->pMMData->sMeasurementKFs) {
-                candidateKFs.push_back(c);
-            }
-            auto best = NClosestKeyFramesInList(*kf, 1, candidateKFs);
-            if (best.size() > 0) {
-                p->pPatchSourceKF = best[0];
-                best[0]->mMeasurements[p].Source = Measurement::SRC_ROOT;
-                auto newCenter = best[0]->mMeasurements[p].v2RootPos;
-                p->irCenter = CVD::ImageRef(newCenter[0], newCenter[1]);
-                p->v3Center_NC = unproject(mCamera.UnProject(p->irCenter));
-                p->v3OneDownFromCenter_NC = unproject(mCamera.UnProject(p->irCenter + CVD::ImageRef(0, 1)));
-                p->v3OneRightFromCenter_NC = unproject(mCamera.UnProject(p->irCenter + CVD::ImageRef(1, 0)));
-                normalize(p->v3Center_NC);
-                normalize(p->v3OneDownFromCenter_NC);
-                normalize(p->v3OneRightFromCenter_NC);
-                p->RefreshPixelVectors();
-            } else {
-                std::cout << "Failed to find replacement source KeyFrame" << std::endl;
-                return false;
-            }
+        if (p->pMMData->sMeasurementKFs.empty())
+            p->bBad = true;   // If no more measurements, remove this point from map
+    }
+    if (!vNewSources.empty()) {
+        SeqLock::WriteGuard publish(mMap.poseSeq);
+        for (const auto &s : vNewSources) {
+            // The new source patch lives at the level the point was measured at in that keyframe.
+            Measurement &mNew = s.second->mMeasurements[s.first];
+            mNew.Source = Measurement::SRC_ROOT;
+            CVD::ImageRef irLevelPos = ir_rounded(mNew.v2RootPos / LevelScale(mNew.nLevel));
+            s.first->SetSourcePatch(mCamera, s.second, mNew.nLevel, irLevelPos, mNew.v2RootPos);
         }
     }
-    delete kf;
     mMap.vpKeyFrames.erase(std::remove(mMap.vpKeyFrames.begin(), mMap.vpKeyFrames.end(), kf),mMap.vpKeyFrames.end());
+    mKeyFramePreparer.Remove(kf);
+    // Points which failed to be found in this keyframe remember that; forget it
+    // before the keyframe's address can be reused.
+    for (const auto &p : mMap.vpPoints)
+        p->pMMData->sNeverRetryKFs.erase(kf);
+    mvFailureQueue.erase(std::remove_if(mvFailureQueue.begin(), mvFailureQueue.end(),
+                                        [kf](const std::pair<KeyFrame *, MapPoint *> &f) { return f.first == kf; }),
+                         mvFailureQueue.end());
+    ForgetBadPoints();
+    mMap.RetireBadPoints();
+    mMap.RetireKeyFrame(kf);
     return true;
 }
 
+// Online keyframe culling, so that long sessions don't slow down as the map grows.
+// Removes at most one keyframe per call: the live keyframe whose measurements are
+// best covered by other keyframes. Normally a keyframe only goes if nearly all of
+// its points are seen by enough others; when the map is over its keyframe or
+// memory budget, the most redundant keyframe goes regardless, unless it alone
+// sees enough points that the map would lose coverage.
+void MapMaker::CullRedundantKeyFrames() {
+    static gvar3<double> gvdRedundancy("MapMaker.CullRedundancy", 0.9, SILENT); // Fraction of measurements which must be redundant
+    static gvar3<int> gvnMinObservers("MapMaker.CullMinObservers", 3, SILENT);  // A measurement is redundant if this many other KFs see the point
+    static gvar3<int> gvnKeepRecent("MapMaker.CullKeepRecent", 5, SILENT);      // Never cull the newest few keyframes
+    static gvar3<int> gvnMaxKeyFrames("MapMaker.MaxKeyFrames", 0, SILENT);      // Keyframe budget, 0 = unlimited
+    static gvar3<int> gvnMaxKeyFrameMB("MapMaker.MaxKeyFrameMB", 0, SILENT);    // Memory budget for keyframes, 0 = unlimited
+    static gvar3<int> gvnKeepSoleObserved("MapMaker.CullKeepSoleObserved", 20, SILENT); // Never cull a keyframe which alone sees this many points
+
+    int nKeyFrames = mMap.vpKeyFrames.size();
+    int nCandidates = nKeyFrames - *gvnKeepRecent;
+    if (nCandidates <= 0)
+        return;
+
+    bool bOverBudget = *gvnMaxKeyFrames > 0 && nKeyFrames > *gvnMaxKeyFrames;
+    if (!bOverBudget && *gvnMaxKeyFrameMB > 0) {
+        size_t nBytes = 0;
+        for (const auto &kf : mMap.vpKeyFrames)
+            nBytes += kf->MemoryFootprint();
+        bOverBudget = nBytes > (size_t) *gvnMaxKeyFrameMB * 1024 * 1024;
+    }
+    // Within budget, only spend time on this when there's nothing better to do.
+    if (!bOverBudget && !mbBundleConverged_Full)
+        return;
+
+    // A keyframe RemoveKeyFrame() refused stays refused until some keyframe
+    // comes or goes and a point might find another patch source.
+    if (mnCullFailedGeneration != mMap.nKeyFrameGeneration.load() || mnCullFailedKeyFrames != mMap.vpKeyFrames.size()) {
+        msCullFailedKFs.clear();
+        mnCullFailedGeneration = mMap.nKeyFrameGeneration.load();
+        mnCullFailedKeyFrames = mMap.vpKeyFrames.size();
+    }
+
+    KeyFrame *pWorst = NULL;
+    double dWorstRedundancy = -1.0;
+    for (int i = 0; i < nCandidates; i++) {
+        KeyFrame *kf = mMap.vpKeyFrames[i];
+        if (kf->bFixed || kf->bFromModel || kf->state < KeyFrame::REST || kf->mMeasurements.empty() ||
+            msCullFailedKFs.count(kf))
+            continue;
+        int nRedundant = 0;
+        int nSoleObserved = 0;
+        for (const auto &m : kf->mMeasurements) {
+            int nOthers = (int) m.first->pMMData->sMeasurementKFs.size() - 1;
+            if (nOthers >= *gvnMinObservers)
+                nRedundant++;
+            else if (nOthers == 0)
+                nSoleObserved++;
+        }
+        if (nSoleObserved >= *gvnKeepSoleObserved)
+            continue;
+        double dRedundancy = nRedundant / (double) kf->mMeasurements.size();
+        if (dRedundancy > dWorstRedundancy) {
+            dWorstRedundancy = dRedundancy;
+            pWorst = kf;
+        }
+    }
+    if (!pWorst || (!bOverBudget && dWorstRedundancy < *gvdRedundancy))
+        return;
+
+    std::vector<MapPoint *> vpAffected;
+    for (const auto &m : pWorst->mMeasurements)
+        vpAffected.push_back(m.first);
+    if (!RemoveKeyFrame(pWorst)) {
+        msCullFailedKFs.insert(pWorst);
+        return;
+    }
+
+    // A point left with a single view can no longer be triangulated; HandleBadPoints() clears these up.
+    for (const auto &p : vpAffected)
+        if (!p->bBad && !p->bFromModel && p->pMMData->GoodMeasCount() < 2)
+            p->bBad = true;
+
+    RetrainRelocMatcher();
+    mbBundleConverged_Full = false;
+}
+
+// Background fusion of duplicate map points. Epipolar search from different
+// keyframes often triangulates the same physical feature more than once; the
+// tracker then searches for it twice and bundle adjustment carries both.
+// Returns the number of points merged away.
+int MapMaker::FusePoints() {
+    static gvar3<double> gvdFuseRadius("MapMaker.FuseRadiusCM", 1.0, SILENT);  // Max 3D distance between duplicates
+    mbFusionNeeded = false;
+
+    // Positions have moved since most points were indexed
+    mMap.RebuildPointIndex();
+
+    double dRadius = *gvdFuseRadius * mdOneCM;
+    std::vector<std::pair<size_t, double> > vMatches;
+    int nFused = 0;
+    for (unsigned int i = 0; i < mMap.vpPoints.size(); i++) {
+        MapPoint *p = mMap.vpPoints[i];
+        if (p->bBad)
+            continue;
+
+        vMatches.clear();
+        nanoflann::RadiusResultSet<double, size_t> resultSet(dRadius * dRadius, vMatches);
+        double query[3] = {p->v3WorldPos[0], p->v3WorldPos[1], p->v3WorldPos[2]};
+        mMap.pointsKD->findNeighbors(resultSet, query, nanoflann::SearchParams(10));
+
+        for (const auto &match : vMatches) {
+            MapPoint *q = mMap.pointsCloud.pts[match.first];
+            if (q == p || q == NULL || q->bBad || p->bBad)
+                continue;
+            // Keep whichever point is better supported; model points always win.
+            MapPoint *pKeep = p;
+            MapPoint *pDrop = q;
+            if (q->bFromModel > p->bFromModel ||
+                (q->bFromModel == p->bFromModel && q->pMMData->GoodMeasCount() > p->pMMData->GoodMeasCount()))
+                std::swap(pKeep, pDrop);
+            if (pDrop->bFromModel || !CanFusePoints(*pKeep, *pDrop))
+                continue;
+            FusePointInto(*pKeep, *pDrop);
+            nFused++;
+        }
+    }
+
+    if (nFused > 0) {
+        ForgetBadPoints();
+        mMap.RetireBadPoints();
+        mbBundleConverged_Full = false;
+    }
+    return nFused;
+}
+
+// Two nearby points are the same feature if no keyframe sees both of them, and
+// pKeep reprojects onto every measurement of pDrop.
+bool MapMaker::CanFusePoints(MapPoint &pKeep, MapPoint &pDrop) {
+    static gvar3<double> gvdMaxError("MapMaker.FuseMaxPixelError", 3.0, SILENT);
+    for (const auto &kf : pDrop.pMMData->sMeasurementKFs) {
+        if (pKeep.pMMData->sMeasurementKFs.count(kf))
+            return false;
+        Vector<3> v3Cam = kf->se3CfromW * pKeep.v3WorldPos;
+        if (v3Cam[2] < 0.001)
+            return false;
+        meas_it it = kf->mMeasurements.find(&pDrop);
+        if (it == kf->mMeasurements.end())
+            continue;
+        const Measurement &m = it->second;
+        Vector<2> v2Error = mCamera.Project(project(v3Cam)) - m.v2RootPos;
+        double dMax = *gvdMaxError * LevelScale(m.nLevel);
+        if (v2Error * v2Error > dMax * dMax)
+            return false;
+    }
+    return true;
+}
+
+// Moves all of pDrop's measurements over to pKeep and marks pDrop bad.
+void MapMaker::FusePointInto(MapPoint &pKeep, MapPoint &pDrop) {
+    for (const auto &kf : pDrop.pMMData->sMeasurementKFs) {
+        meas_it it = kf->mMeasurements.find(&pDrop);
+        if (it == kf->mMeasurements.end())
+            continue;
+        Measurement m = it->second;
+        if (m.Source == Measurement::SRC_ROOT)   // pKeep already has its own source patch
+            m.Source = Measurement::SRC_REFIND;
+        kf->mMeasurements.erase(it);
+        kf->mMeasurements[&pKeep] = m;
+        pKeep.pMMData->sMeasurementKFs.insert(kf);
+    }
+    pDrop.pMMData->sMeasurementKFs.clear();
+    pKeep.nMEstimatorInlierCount += pDrop.nMEstimatorInlierCount;
+    pKeep.nMEstimatorOutlierCount += pDrop.nMEstimatorOutlierCount;
+    pDrop.bBad = true;
+}
+
+// The reloc matcher refers to keyframes by index, so it must be retrained whenever
+// keyframes are removed. Uses the descriptors already stored in the keyframes;
+// those of a streamed model come straight from its file, loaded or not.
+void MapMaker::RetrainRelocMatcher() {
+    TrainRelocMatcher(mMap, keyframeImageMatcher, mvRelocKeyFrames);
+}
+
+void MapMaker::TrainRelocMatcher(const Map &map, cv::FlannBasedMatcher &matcher, std::vector<KeyFrame *> &vRelocKeyFrames) {
+    matcher.clear();
+    vRelocKeyFrames.clear();
+    if (map.bStreamTiles)
+        for (size_t i = 0; i < map.pModelFile->KeyFrameCount(); i++)
+            matcher.add(map.pModelFile->Descriptor(map.pModelFile->KeyFrames()[i]));
+    for (const auto &kf : map.vpKeyFrames) {
+        if (map.bStreamTiles && kf->nModelIndex >= 0)
+            continue;
+        matcher.add(kf->relocFrameDescriptor);
+        vRelocKeyFrames.push_back(kf);
+    }
+    matcher.train();
+}
+
+KeyFrame *MapMaker::RelocKeyFrame(int nImage) {
+    static gvar3<int> gvnTileRadius("Model.TileRadius", 1, SILENT);
+    int nModelKFs = mMap.bStreamTiles ? mMap.pModelFile->KeyFrameCount() : 0;
+    if (nImage < nModelKFs) {
+        if (!mMap.vpModelKeyFrames[nImage]) {
+            // Relocalised into a part of the model that isn't loaded: fetch the tiles around it
+            const ModelBinKeyFrame &modelKF = mMap.pModelFile->KeyFrames()[nImage];
+            SE3<> se3CfromW(SO3<>(makeVector(modelKF.adR[0], modelKF.adR[1], modelKF.adR[2])),
+                            makeVector(modelKF.adT[0], modelKF.adT[1], modelKF.adT[2]));
+            std::vector<KeyFrame *> vNewKFs;
+            mMap.LoadModelTilesNear(mCamera, se3CfromW.inverse().get_translation(), *gvnTileRadius, &vNewKFs);
+            for (const auto &kf : vNewKFs) {
+                RefreshSceneDepth(kf);
+                if (kf->state < KeyFrame::REST)
+                    mKeyFramePreparer.Add(kf);
+            }
+            mbBundleConverged_Full = false;
+        }
+        return mMap.vpModelKeyFrames[nImage];
+    }
+    nImage -= nModelKFs;
+    return nImage < (int) mvRelocKeyFrames.size() ? mvRelocKeyFrames[nImage] : NULL;
+}
+
 KeypointResize MapMaker::ConvertAndResizeWithAspectRatio(const cv::Mat &input, CVD::Image<CVD::byte> &imBW) {
     cv::Mat output;
     double dstW = imBW.size().x;
@@ -410,40 +903,150 @@ SE3<> MapMaker::GetCameraPosePNP(const PTAMInstallerFile &exprt, int frameN, con
 }
 
 bool MapMaker::LoadModelFromFolder(const std::string &folder, CVD::ImageRef imSize, SE3<> &se3TrackerPose) {
+    StashCurrentModel();
     Reset();
     mCamera.SetImageSize(imSize);
 
-    if (!mMap.LoadModelFromFile(mCamera, deviceFolder + "/" + folder, currentModelName, mdOneCM))
-        return false;
+    std::string sKey = ModelCache::Key(folder, imSize);
+    CachedModel m;
+    if (!mModelCache.Take(sKey, m)) {
+        if (!PrepareModel(mMap, mCamera, deviceFolder + "/" + folder, m))
+            return false;
+        m.sKey = sKey;
+    }
+    InstallModel(m, se3TrackerPose);
+    return true;
+}
 
-    mdWiggleScale = *mgvdWiggleScale;
-    minKFDistance = 10.0;
-    insertKeypointRadius = 7.0 * ((mCamera.GetImageSize()[0] + mCamera.GetImageSize()[1]) / 2.0) / 1000;
-    if (insertKeypointRadius < 5)
-        insertKeypointRadius = 5;
-    mdWiggleScale = mdOneCM * 10.0;
+bool MapMaker::PrepareModel(Map &map, ATANCamera &cam, const std::string &sModelPath, CachedModel &model) {
+    if (!map.LoadModelFromFile(cam, sModelPath, model.sName, model.dOneCM))
+        return false;
 
+    model.dMinKFDistance = 10.0;
+    model.dInsertKeypointRadius = 7.0 * ((cam.GetImageSize()[0] + cam.GetImageSize()[1]) / 2.0) / 1000;
+    if (model.dInsertKeypointRadius < 5)
+        model.dInsertKeypointRadius = 5;
+    model.dWiggleScale = model.dOneCM * 10.0;
 
     // Prepare data for relocalization
-    for (const auto &kf : mMap.vpKeyFrames) {
-        keyframeImageMatcher.add(kf->relocFrameDescriptor);
-    }
-    keyframeImageMatcher.train();
+    model.relocMatcher = MakeRelocMatcher();
+    TrainRelocMatcher(map, model.relocMatcher, model.vRelocKeyFrames);
 
     double meanDepth = 0;
-    for (auto & kf : mMap.vpKeyFrames) {
-        RefreshSceneDepth(kf);
-        meanDepth += kf->dSceneDepthMean;
+    int nDepths = 0;
+    for (auto & kf : map.vpKeyFrames) {
+        if (RefreshSceneDepth(kf)) {
+            meanDepth += kf->dSceneDepthMean;
+            nDepths++;
+        }
+    }
+    model.dWiggleScaleDepthNormalized = model.dWiggleScale / (nDepths ? meanDepth / nDepths : 1.0);
+
+    map.TakeContents(model.contents);
+    model.nBytes = model.contents.MemoryFootprint();
+    return true;
+}
+
+// Rather than reset away the model we're switching from, move it, as it
+// stands, into the model cache. Nothing in it is freed, so the tracker can
+// finish whatever pass it's in the middle of.
+void MapMaker::StashCurrentModel() {
+    static gvar3<int> gvnModelCacheMB("MapMaker.ModelCacheMB", 512, SILENT);
+    if (*gvnModelCacheMB <= 0 || mCurrentModelKey.empty() || !mMap.IsGood() || mMap.vpKeyFrames.empty())
+        return;
+
+    CachedModel m;
+    m.sKey = mCurrentModelKey;
+    m.sName = currentModelName;
+    m.dOneCM = mdOneCM;
+    m.dWiggleScale = mdWiggleScale;
+    m.dWiggleScaleDepthNormalized = mdWiggleScaleDepthNormalized;
+    m.dMinKFDistance = minKFDistance;
+    m.dInsertKeypointRadius = insertKeypointRadius;
+    m.relocMatcher = keyframeImageMatcher;
+    keyframeImageMatcher = MakeRelocMatcher();
+    m.vRelocKeyFrames.swap(mvRelocKeyFrames);
+    mMap.TakeContents(m.contents);
+    m.nBytes = m.contents.MemoryFootprint();
+    mCurrentModelKey.clear();
+    CacheModel(std::move(m));
+}
+
+void MapMaker::CacheModel(CachedModel &&model) {
+    static gvar3<int> gvnModelCacheMB("MapMaker.ModelCacheMB", 512, SILENT);
+    for (auto &evicted : mModelCache.Put(std::move(model), (size_t) std::max(*gvnModelCacheMB, 0) << 20)) {
+        std::cout << "Dropping cached model " << evicted.sKey << std::endl;
+        mMap.RetireContents(evicted.contents);
     }
-    mdWiggleScaleDepthNormalized = mdWiggleScale / (meanDepth / mMap.vpKeyFrames.size());
+}
+
+// Called with the map freshly reset
+void MapMaker::InstallModel(CachedModel &m, SE3<> &se3TrackerPose) {
+    mMap.RestoreContents(m.contents);
+    currentModelName = m.sName;
+    mdOneCM = m.dOneCM;
+    mdWiggleScale = m.dWiggleScale;
+    mdWiggleScaleDepthNormalized = m.dWiggleScaleDepthNormalized;
+    minKFDistance = m.dMinKFDistance;
+    insertKeypointRadius = m.dInsertKeypointRadius;
+    keyframeImageMatcher = m.relocMatcher;
+    mvRelocKeyFrames.swap(m.vRelocKeyFrames);
+
+    // Keyframes the model didn't store pyramids for (or which were still
+    // waiting when the model was cached) are made in the background
+    for (const auto &kf : mMap.vpKeyFrames)
+        if (kf->state < KeyFrame::REST)
+            mKeyFramePreparer.Add(kf);
+    mnModelPoseHintVersion = mKeyFramePreparer.PoseHintVersion();
 
+    mCurrentModelKey = m.sKey;
+    mbRelocResultsStale = true;
     mMap.bGood = true;
     se3TrackerPose = mMap.vpKeyFrames[0]->se3CfromW;
     stats.AddLoadedModel(mMap.vpKeyFrames.size(), mMap.vpPoints.size());
-    return true;
+}
+
+// Models the background loader has finished go into the model cache, except
+// the one we're waiting to switch to, which is installed straight away.
+// Runs every pass of the main loop, so a model that finishes loading while no
+// reloc frames are coming in isn't left waiting. A switch only happens while
+// relocalising: once the tracker has its footing again the awaited model is
+// just cached. Returns whether a switch happened.
+bool MapMaker::CollectLoadedModels() {
+    if (!mpModelLoader)
+        return false;
+    if (currentMode != MM_MODE_RELOC)
+        msAwaitedModel.clear();
+    std::string sAwaitedKey = msAwaitedModel.empty() ? "" : ModelCache::Key(msAwaitedModel, mirAwaitedImageSize);
+    bool bSwitched = false;
+    CachedModel m;
+    while (mpModelLoader->TakeReady(m, mMap)) {
+        if (sAwaitedKey.empty() || m.sKey != sAwaitedKey) {
+            CacheModel(std::move(m));
+            continue;
+        }
+        SE3<> tmp;
+        StashCurrentModel();
+        Reset();
+        mCamera.SetImageSize(mirAwaitedImageSize);
+        InstallModel(m, tmp);
+        currentModel = msAwaitedModel;
+        msAwaitedModel.clear();
+        bSwitched = true;
+    }
+    return bSwitched;
+}
+
+void MapMaker::PrefetchModel(const std::string &sFolder, CVD::ImageRef irImageSize) {
+    if (!mpModelLoader || sFolder.empty() || sFolder == currentModel)
+        return;
+    std::string sKey = ModelCache::Key(sFolder, irImageSize);
+    if (!mModelCache.Contains(sKey))
+        mpModelLoader->Request(sFolder, irImageSize, true);
 }
 
 bool MapMaker::LoadMapFromInstaller(const std::string &rootFolder, CVD::ImageRef imSize, SE3<> &se3TrackerPose) {
+    std::chrono::steady_clock::time_point tInstallStart = std::chrono::steady_clock::now();
     mdWiggleScale = *mgvdWiggleScale; // Cache this for the new map.
     mCamera.SetImageSize(imSize);
     minKFDistance = 10.0;
@@ -489,6 +1092,7 @@ bool MapMaker::LoadMapFromInstaller(const std::string &rootFolder, CVD::ImageRef
 
         // Prepare keyframe structure
         auto *kf = new KeyFrame();
+        kf->bFromModel = true;
         kf->MakeKeyFrame_Lite(imBW);
         kf->MakeKeyFrame_Rest();
 
@@ -505,6 +1109,7 @@ bool MapMaker::LoadMapFromInstaller(const std::string &rootFolder, CVD::ImageRef
         kf->bFixed = frameN == 0;
         kf->se3CfromW = GetCameraPosePNP(ptamExport, frameN, *kd, resizer, transformFromModelToWorld, prevR, prevT);
         mMap.vpKeyFrames.push_back(kf);
+        mMap.bListsChanged = true;
 
         if (frameN == 1) {
             mMap.vpKeyFrames[0]->se3CfromW = GetCameraPosePNP(ptamExport, 0, *levelKeypointKD[0], kpResize[0], transformFromModelToWorld, prevR, prevT);
@@ -548,13 +1153,13 @@ bool MapMaker::LoadMapFromInstaller(const std::string &rootFolder, CVD::ImageRef
 
         // Create new point
         Eigen::Vector4f posWorld = transformFromModelToWorld * point.getEigen4f();
-        auto *p = new MapPoint();
+        auto *p = mMap.NewPoint();
         p->v3WorldPos[0] = posWorld.x();
         p->v3WorldPos[1] = posWorld.y();
         p->v3WorldPos[2] = posWorld.z();
         // Check if any already inserted point is too close
         if (!mMap.AddPoint(p, mdOneCM)) {
-            delete p;
+            mMap.DiscardPoint(p);
             continue;
         }
 
@@ -610,36 +1215,22 @@ bool MapMaker::LoadMapFromInstaller(const std::string &rootFolder, CVD::ImageRef
         }
     }
 
+    std::cout << "  Installer: " << mMap.vpKeyFrames.size() << " keyframes, " << mMap.vpPoints.size()
+              << " model points, loaded in " << SecondsSince(tInstallStart) << " s" << std::endl;
+
     // Make first bundle adjust
-    mbBundleConverged_Full = false;
-    mbBundleConverged_Recent = false;
-    while (!mbBundleConverged_Full) {
-        BundleAdjustAll(false);
-        if (mbResetRequested)
-            return false;
-    }
+    if (!InstallerBundleAdjustAll("first global BA"))
+        return false;
 
     // Estimate the feature depth distribution and add more points
     int newPointsPerKF = mMap.vpPoints.size() / mMap.vpKeyFrames.size();
-    std::vector<int> kfIDs;
-    for (int i = 0; i < mMap.vpKeyFrames.size(); i++)
-        kfIDs.push_back(i);
-    for (int i : kfIDs) {
-        RefreshSceneDepth(mMap.vpKeyFrames[i]);
-        AddSomeMapPoints(3, i, newPointsPerKF);
-        AddSomeMapPoints(2, i, newPointsPerKF/3);
-        AddSomeMapPoints(1, i, newPointsPerKF/2);
-        ReFindNewlyMade();
-        BundleAdjustKeyframe(i);
-    }
+    if (!InstallerAddPoints(newPointsPerKF))
+        return false;
+    int nFused = FusePoints();
+    std::cout << "  Installer: fused " << nFused << " points" << std::endl;
 
-    mbBundleConverged_Full = false;
-    mbBundleConverged_Recent = false;
-    while (!mbBundleConverged_Full) {
-        BundleAdjustAll(false);
-        if (mbResetRequested)
-            return false;
-    }
+    if (!InstallerBundleAdjustAll("final global BA"))
+        return false;
 
     // Reverse transformation caused by bundle adjust and transform to reference coordinates
     {
@@ -655,22 +1246,204 @@ bool MapMaker::LoadMapFromInstaller(const std::string &rootFolder, CVD::ImageRef
         ApplyGlobalTransformationToMap(Eigen::umeyama(now, target));
     }
 
+    // Points dropped by keyframe thinning were kept alive for the calibration above
+    ReclaimRetired();
+
     // Prepare data for relocalization
     BuildRelocIndex();
 
     double meanDepth = 0;
+    int nDepths = 0;
     for (auto & kf : mMap.vpKeyFrames) {
-        RefreshSceneDepth(kf);
-        meanDepth += kf->dSceneDepthMean;
+        if (RefreshSceneDepth(kf)) {
+            meanDepth += kf->dSceneDepthMean;
+            nDepths++;
+        }
     }
-    mdWiggleScaleDepthNormalized = mdWiggleScale / (meanDepth / mMap.vpKeyFrames.size());
+    mdWiggleScaleDepthNormalized = mdWiggleScale / (nDepths ? meanDepth / nDepths : 1.0);
 
     mMap.bGood = true;
     se3TrackerPose = mMap.vpKeyFrames[0]->se3CfromW;
     stats.AddLoadedModel(mMap.vpKeyFrames.size(), mMap.vpPoints.size());
+    std::cout << "  Installer: done, " << mMap.vpKeyFrames.size() << " keyframes, " << mMap.vpPoints.size()
+              << " points, " << SecondsSince(tInstallStart) << " s in total" << std::endl;
+    return true;
+}
+
+// Global BA to convergence, for the installer, with progress reports.
+bool MapMaker::InstallerBundleAdjustAll(const std::string &sStage) {
+    std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+    double dLastReport = 0.0;
+    int nPasses = 0;
+    mbBundleConverged_Full = false;
+    mbBundleConverged_Recent = false;
+    while (!mbBundleConverged_Full) {
+        BundleAdjustAll(false);
+        if (mbResetRequested)
+            return false;
+        nPasses++;
+        double dSeconds = SecondsSince(tStart);
+        if (dSeconds - dLastReport > 5.0) {
+            std::cout << "  Installer: " << sStage << " running, " << nPasses << " passes";
+            if (mpGlobalBundle)
+                std::cout << ", error " << mpGlobalBundle->Progress().dError;
+            std::cout << ", " << dSeconds << " s" << std::endl;
+            dLastReport = dSeconds;
+        }
+    }
+    std::cout << "  Installer: " << sStage << " converged after " << nPasses << " passes, "
+              << SecondsSince(tStart) << " s" << std::endl;
+    return true;
+}
+
+// Adds epipolar points to every keyframe of an installed model, with a local BA
+// around each. Keyframes are taken in waves in which no keyframe is another's
+// search target, so within a wave the searches are independent and run on a
+// worker pool; the new points are then committed in keyframe order.
+bool MapMaker::InstallerAddPoints(int nPointsPerKF) {
+    static gvar3<int> gvnThreads("MapMaker.InstallerThreads", 0, SILENT);  // 0 = one per core
+    WorkerPool pool(*gvnThreads);
+    std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+    const int nKeyFrames = mMap.vpKeyFrames.size();
+    std::vector<KeyFrame *> vTargets(nKeyFrames);
+    for (int i = 0; i < nKeyFrames; i++)
+        vTargets[i] = ClosestKeyFrame(*mMap.vpKeyFrames[i]);
+
+    std::vector<std::vector<int> > vWaves;
+    std::vector<std::set<KeyFrame *> > vWaveBusy;   // Sources and targets already in each wave
+    for (int i = 0; i < nKeyFrames; i++) {
+        size_t w = 0;
+        while (w < vWaves.size() && (vWaveBusy[w].count(mMap.vpKeyFrames[i]) || vWaveBusy[w].count(vTargets[i])))
+            w++;
+        if (w == vWaves.size()) {
+            vWaves.emplace_back();
+            vWaveBusy.emplace_back();
+        }
+        vWaves[w].push_back(i);
+        vWaveBusy[w].insert(mMap.vpKeyFrames[i]);
+        vWaveBusy[w].insert(vTargets[i]);
+    }
+
+    for (size_t w = 0; w < vWaves.size(); w++) {
+        const std::vector<int> &vWave = vWaves[w];
+        std::chrono::steady_clock::time_point tWave = std::chrono::steady_clock::now();
+
+        // The search's caches are built lazily, so make them before going parallel
+        for (int i : vWave)
+            for (int nLevel = 1; nLevel <= 3; nLevel++)
+                if (vTargets[i]->EnsureLevel(nLevel))
+                    PrepareEpipolarSearch(*vTargets[i], nLevel);
+
+        std::vector<std::vector<EpipolarMatch> > vMatches(vWave.size());
+        pool.ParallelFor(vWave.size(), [&](int nBegin, int nEnd) {
+            ATANCamera camera = mCamera;
+            for (int n = nBegin; n < nEnd; n++) {
+                KeyFrame &kSrc = *mMap.vpKeyFrames[vWave[n]];
+                KeyFrame &kTarget = *vTargets[vWave[n]];
+                RefreshSceneDepth(&kSrc);
+                FindSomeMapPoints(camera, kSrc, kTarget, 3, nPointsPerKF, vMatches[n]);
+                FindSomeMapPoints(camera, kSrc, kTarget, 2, nPointsPerKF / 3, vMatches[n]);
+                FindSomeMapPoints(camera, kSrc, kTarget, 1, nPointsPerKF / 2, vMatches[n]);
+            }
+        });
+
+        size_t nNew = 0;
+        for (size_t n = 0; n < vWave.size(); n++) {
+            for (const auto &match : vMatches[n])
+                AddEpipolarPoint(*mMap.vpKeyFrames[vWave[n]], *vTargets[vWave[n]], match);
+            nNew += vMatches[n].size();
+        }
+        ReFindNewlyMade();
+
+        InstallerLocalBundles(pool, vWave);
+        if (mbResetRequested)
+            return false;
+
+        std::cout << "  Installer: point wave " << w + 1 << "/" << vWaves.size() << ", " << vWave.size()
+                  << " keyframes, " << nNew << " new points, " << SecondsSince(tWave) << " s" << std::endl;
+    }
+    std::cout << "  Installer: added points to " << nKeyFrames << " keyframes in " << SecondsSince(tStart)
+              << " s" << std::endl;
     return true;
 }
 
+// Local BA around each of the given keyframes. Adjusters whose adjusted
+// keyframes don't overlap run side by side, one thread each; points which
+// more than one of them would move are held still in all of them.
+void MapMaker::InstallerLocalBundles(WorkerPool &pool, const std::vector<int> &vKFs) {
+    struct LocalBundle {
+        std::set<KeyFrame *> sAdjustSet;
+        std::set<KeyFrame *> sFixedSet;
+        std::set<MapPoint *> sMapPoints;
+        std::vector<KeyFrame *> vBundleID_View;
+        std::vector<MapPoint *> vBundleID_Point;
+        std::unique_ptr<Bundle> pBundle;
+        int nAccepted = 0;
+    };
+    std::vector<LocalBundle> vBundles(vKFs.size());
+    for (size_t n = 0; n < vKFs.size(); n++)
+        LocalBundleSets(mMap.vpKeyFrames[vKFs[n]], vBundles[n].sAdjustSet, vBundles[n].sFixedSet,
+                        vBundles[n].sMapPoints);
+
+    std::vector<std::vector<int> > vRounds;
+    std::vector<std::set<KeyFrame *> > vRoundBusy;
+    for (size_t n = 0; n < vBundles.size(); n++) {
+        size_t r = 0;
+        for (; r < vRounds.size(); r++) {
+            bool bOverlap = false;
+            for (KeyFrame *kf : vBundles[n].sAdjustSet)
+                if (vRoundBusy[r].count(kf)) {
+                    bOverlap = true;
+                    break;
+                }
+            if (!bOverlap)
+                break;
+        }
+        if (r == vRounds.size()) {
+            vRounds.emplace_back();
+            vRoundBusy.emplace_back();
+        }
+        vRounds[r].push_back(n);
+        vRoundBusy[r].insert(vBundles[n].sAdjustSet.begin(), vBundles[n].sAdjustSet.end());
+    }
+
+    for (const std::vector<int> &vRound : vRounds) {
+        std::map<MapPoint *, int> mPointUses;
+        for (int n : vRound)
+            for (MapPoint *p : vBundles[n].sMapPoints)
+                mPointUses[p]++;
+        std::set<MapPoint *> sShared;
+        for (const auto &use : mPointUses)
+            if (use.second > 1)
+                sShared.insert(use.first);
+
+        for (int n : vRound) {
+            LocalBundle &lb = vBundles[n];
+            lb.pBundle.reset(Bundle::Create(mCamera));
+            if (vRound.size() > 1)
+                lb.pBundle->SetThreads(1);   // Already in parallel with each other; a pool of one starts no threads
+            else
+                lb.pBundle->SetPool(&BundlePool());
+            PopulateBundle(*lb.pBundle, lb.sAdjustSet, lb.sFixedSet, lb.sMapPoints, true, lb.vBundleID_View,
+                           lb.vBundleID_Point, &sShared);
+        }
+        mbBundleRunning = true;
+        mbBundleRunningIsRecent = true;
+        pool.ParallelFor(vRound.size(), [&](int nBegin, int nEnd) {
+            for (int m = nBegin; m < nEnd; m++)
+                vBundles[vRound[m]].nAccepted = vBundles[vRound[m]].pBundle->Compute(&mbBundleAbortRequested);
+        });
+        for (int n : vRound) {
+            LocalBundle &lb = vBundles[n];
+            ApplyBundle(*lb.pBundle, lb.nAccepted, lb.vBundleID_View, lb.vBundleID_Point, true, false);
+            lb.pBundle.reset();
+            if (mbResetRequested)
+                return;
+        }
+    }
+}
+
 // ThinCandidates() Thins out a key-frame's candidate list.
 // Candidates are those salient corners where the mapmaker will attempt
 // to make a new map point by epipolar search. We don't want to make new points
@@ -717,6 +1490,24 @@ void MapMaker::AddSomeMapPoints(int nLevel) {
 int MapMaker::AddSomeMapPoints(int nLevel, int kfID, int limit) {
     KeyFrame &kSrc = *(mMap.vpKeyFrames[kfID]); // The new keyframe
     KeyFrame &kTarget = *(ClosestKeyFrame(kSrc));
+
+    if (!kTarget.EnsureLevel(nLevel))
+        return 0;
+    PrepareEpipolarSearch(kTarget, nLevel);
+    std::vector<EpipolarMatch> vMatches;
+    FindSomeMapPoints(mCamera, kSrc, kTarget, nLevel, limit, vMatches);
+    for (const auto &match : vMatches)
+        AddEpipolarPoint(kSrc, kTarget, match);
+    return vMatches.size();
+};
+
+// The search half of AddSomeMapPoints(): appends up to limit (0 = no limit) matches
+// for kSrc's candidates at nLevel to vMatches, without touching the map. Matches
+// already in vMatches keep new ones away from their positions, as committed points would.
+// Only reads kSrc, kTarget and the points kSrc measures, so different source/target
+// pairs can be searched in parallel, each with its own camera.
+void MapMaker::FindSomeMapPoints(ATANCamera &camera, KeyFrame &kSrc, KeyFrame &kTarget, int nLevel, int limit,
+                                 std::vector<EpipolarMatch> &vMatches) {
     Level &l = kSrc.aLevels[nLevel];
 
     ThinCandidates(kSrc, nLevel);
@@ -724,6 +1515,9 @@ int MapMaker::AddSomeMapPoints(int nLevel, int kfID, int limit) {
     unsigned int nMinMagSquared = (insertKeypointRadius*2) / LevelScale(nLevel);
     nMinMagSquared = nMinMagSquared * nMinMagSquared;
     std::vector<CVD::ImageRef> used;
+    for (const auto &match : vMatches)
+        if (match.nLevel == nLevel || match.nLevel == nLevel + 1)
+            used.push_back(ir_rounded(match.v2RootPos / LevelScale(nLevel)));
     int c = 0;
     for (unsigned int i = 0; i < l.vCandidates.size() && (limit == 0 || c < limit); i++) {
         bool good = true;
@@ -733,15 +1527,17 @@ int MapMaker::AddSomeMapPoints(int nLevel, int kfID, int limit) {
                 break;
             }
         }
-        if (good && AddPointEpipolar(kSrc, kTarget, nLevel, i)) {
+        EpipolarMatch match;
+        if (good && FindPointEpipolar(camera, kSrc, kTarget, nLevel, i, match)) {
+            vMatches.push_back(match);
             used.push_back(l.vCandidates[i].irLevelPos);
             c++;
         }
     }
-    return c;
 };
 
 void MapMaker::ApplyGlobalTransformationToMap(const Eigen::Matrix<float, 4, 4>& trans) {
+    SeqLock::WriteGuard publish(mMap.poseSeq);
     for (const auto & vpKeyFrame : mMap.vpKeyFrames) {
         auto old = vpKeyFrame->se3CfromW;
         auto oldR = old.get_rotation().get_matrix();
@@ -788,23 +1584,39 @@ void MapMaker::ApplyGlobalTransformationToMap(const Eigen::Matrix<float, 4, 4>&
 // the tracker thread doesn't want to hang about, so
 // just dumps it on the top of the mapmaker's queue to
 // be dealt with later, and return.
-void MapMaker::AddKeyFrame(KeyFrame &k) {
+// Returns false if the queue was full and the keyframe wasn't taken; the
+// queue counts these (see ReportQueueStats()), and the tracker tries again later.
+bool MapMaker::AddKeyFrame(KeyFrame &k) {
     KeyFrame *pK = new KeyFrame;
     *pK = k;
-    mvpKeyFrameQueue.push_back(pK);
+    if (!mqKeyFrameQueue.TryPush(std::move(pK))) {
+        delete pK;
+        std::cout << "MapMaker: keyframe queue full (" << mqKeyFrameQueue.Rejected() << " rejected so far.)" << std::endl;
+        if (mbBundleRunning)
+            mbBundleAbortRequested = true;
+        return false;
+    }
     if (mbBundleRunning)   // Tell the mapmaker to stop doing low-priority stuff and concentrate on this KF first.
         mbBundleAbortRequested = true;
+    return true;
 }
 
 // Mapmaker's code to handle incoming key-frames.
 void MapMaker::AddKeyFrameFromTopOfQueue() {
-    if (mvpKeyFrameQueue.size() == 0)
+    KeyFrame *pK;
+    if (!mqKeyFrameQueue.TryPop(pK))
         return;
 
-    KeyFrame *pK = mvpKeyFrameQueue[0];
-    mvpKeyFrameQueue.erase(mvpKeyFrameQueue.begin());
     pK->MakeKeyFrame_Rest();
+    // The tracker may have measured points which were retired while this KF was queued.
+    for (meas_it it = pK->mMeasurements.begin(); it != pK->mMeasurements.end();) {
+        if (it->first->bBad)
+            it = pK->mMeasurements.erase(it);
+        else
+            it++;
+    }
     mMap.vpKeyFrames.push_back(pK);
+    mMap.bListsChanged = true;
     // Any measurements? Update the relevant point's measurement counter status map
     for (meas_it it = pK->mMeasurements.begin(); it != pK->mMeasurements.end(); it++) {
         it->first->pMMData->sMeasurementKFs.insert(pK);
@@ -825,6 +1637,7 @@ void MapMaker::AddKeyFrameFromTopOfQueue() {
     pK->MakeKeyFrame_Reloc(nRelocFeatureCount, insertKeypointRadius);
     keyframeImageMatcher.add(pK->relocFrameDescriptor);
     keyframeImageMatcher.train();
+    mvRelocKeyFrames.push_back(pK);
 
     std::vector<cv::Mat> feature;
     feature.resize(pK->relocFrameDescriptor.rows);
@@ -835,10 +1648,41 @@ void MapMaker::AddKeyFrameFromTopOfQueue() {
         relocFeatureToModel.push_back(currentModel);
     }
     ReFindNewlyMade();
+    TrimKeyFrames();
 
     mKeyframeAdded = true;
 }
 
+// Once a keyframe has made its points, what the map needs of it is its pose,
+// measurements and reloc data, plus the pyramid levels its points take their
+// patches from; the tracker reads nothing else. Everything else is released,
+// and rebuilt by EnsureLevel() if wanted again. A level wanted since the last
+// trim is kept one more round, so refind and epipolar search don't thrash.
+void MapMaker::TrimKeyFrames() {
+    static gvar3<int> gvnTrim("MapMaker.TrimKeyFrames", 1, SILENT);
+    if (!*gvnTrim || operationMode == MM_MODE_INSTALL)
+        return;
+
+    std::unordered_map<const KeyFrame *, unsigned int> mSourceLevels;
+    for (const auto &p : mMap.vpPoints)
+        mSourceLevels[p->pPatchSourceKF] |= 1u << p->nSourceLevel;
+
+    for (const auto &kf : mMap.vpKeyFrames) {
+        if (kf->state < KeyFrame::REST)
+            continue;
+        kf->ReleaseDerivedData();
+        auto it = mSourceLevels.find(kf);
+        unsigned int nKeep = it == mSourceLevels.end() ? 0 : it->second;
+        for (int l = 0; l < LEVELS; l++) {
+            Level &lev = kf->aLevels[l];
+            if (!kf->bPagedOut && !lev.bReleased && !lev.bRecentlyUsed && !(nKeep & (1u << l)) &&
+                kf->CanReleaseLevel(l))
+                mMap.RetireImage(kf->ReleaseLevel(l));
+            lev.bRecentlyUsed = false;
+        }
+    }
+}
+
 // Tries to make a new map point out of a single candidate point
 // by searching for that point in another keyframe, and triangulating
 // if a match is found.
@@ -846,22 +1690,53 @@ bool MapMaker::AddPointEpipolar(KeyFrame &kSrc,
                                 KeyFrame &kTarget,
                                 int nLevel,
                                 int nCandidate) {
-    static Image<Vector<2> > imUnProj;
-    static bool bMadeCache = false;
-    if (!bMadeCache) {
-        imUnProj.resize(kSrc.aLevels[0].im.size());
+    if (!kTarget.EnsureLevel(nLevel))
+        return false;
+    PrepareEpipolarSearch(kTarget, nLevel);
+    EpipolarMatch match;
+    if (!FindPointEpipolar(mCamera, kSrc, kTarget, nLevel, nCandidate, match))
+        return false;
+    AddEpipolarPoint(kSrc, kTarget, match);
+    return true;
+}
+
+// Builds the lazily made caches FindPointEpipolar() reads: the unprojection
+// table, and the target keyframe's corners on the image plane at nLevel.
+void MapMaker::PrepareEpipolarSearch(KeyFrame &kTarget, int nLevel) {
+    if (mimUnProj.size() != kTarget.LevelSize(0)) {
+        mimUnProj.resize(kTarget.LevelSize(0));
         CVD::ImageRef ir;
-        do imUnProj[ir] = mCamera.UnProject(ir);
-        while (ir.next(imUnProj.size()));
-        bMadeCache = true;
+        do mimUnProj[ir] = mCamera.UnProject(ir);
+        while (ir.next(mimUnProj.size()));
+    }
+
+    Level &l = kTarget.aLevels[nLevel];
+    if (!l.bImplaneCornersCached) {
+        // over all corners in target img..
+        for (unsigned int i = 0; i < l.vCorners.size(); i++) {
+            auto pos = ir(LevelZeroPos(l.vCorners[i], nLevel));
+            if (pos.x >= 0 && pos.x < mimUnProj.size()[0] && pos.y >= 0 && pos.y < mimUnProj.size()[1]) {
+                l.vImplaneCorners.push_back(mimUnProj[pos]);
+            }
+        }
+        l.bImplaneCornersCached = true;
     }
+}
 
+// The search half of AddPointEpipolar(): finds the candidate along its epipolar
+// line in kTarget and triangulates it. Needs PrepareEpipolarSearch(kTarget, nLevel).
+bool MapMaker::FindPointEpipolar(ATANCamera &camera,
+                                 KeyFrame &kSrc,
+                                 KeyFrame &kTarget,
+                                 int nLevel,
+                                 int nCandidate,
+                                 EpipolarMatch &match) {
     int nLevelScale = LevelScale(nLevel);
     Candidate &candidate = kSrc.aLevels[nLevel].vCandidates[nCandidate];
     CVD::ImageRef irLevelPos = candidate.irLevelPos;
     Vector<2> v2RootPos = LevelZeroPos(irLevelPos, nLevel);
 
-    Vector<3> v3Ray_SC = unproject(mCamera.UnProject(v2RootPos));
+    Vector<3> v3Ray_SC = unproject(camera.UnProject(v2RootPos));
     normalize(v3Ray_SC);
     Vector<3> v3LineDirn_TC = kTarget.se3CfromW.get_rotation() * (kSrc.se3CfromW.get_rotation().inverse() * v3Ray_SC);
 
@@ -901,7 +1776,7 @@ bool MapMaker::AddPointEpipolar(KeyFrame &kSrc,
     v2Normal[1] = -v2AlongProjectedLine[0];
 
     double dNormDist = v2A * v2Normal;
-    if (fabs(dNormDist) > mCamera.LargestRadiusInImage())
+    if (fabs(dNormDist) > camera.LargestRadiusInImage())
         return false;
 
     double dMinLen = std::min(v2AlongProjectedLine * v2A, v2AlongProjectedLine * v2B) - 0.05;
@@ -916,22 +1791,12 @@ bool MapMaker::AddPointEpipolar(KeyFrame &kSrc,
     Finder.MakeTemplateCoarseNoWarp(kSrc, nLevel, irLevelPos);
     if (Finder.TemplateBad()) return false;
 
-    std::vector<Vector<2>> &vv2Corners = kTarget.aLevels[nLevel].vImplaneCorners;
-    std::vector<CVD::ImageRef> &vIR = kTarget.aLevels[nLevel].vCorners;
-    if (!kTarget.aLevels[nLevel].bImplaneCornersCached) {
-        // over all corners in target img..
-        for (unsigned int i = 0; i < vIR.size(); i++) {
-            auto pos = ir(LevelZeroPos(vIR[i], nLevel));
-            if (pos.x >= 0 && pos.x < imUnProj.size()[0] && pos.y >= 0 && pos.y < imUnProj.size()[1]) {
-                vv2Corners.push_back(imUnProj[pos]);
-            }
-        }
-        kTarget.aLevels[nLevel].bImplaneCornersCached = true;
-    }
+    const std::vector<Vector<2>> &vv2Corners = kTarget.aLevels[nLevel].vImplaneCorners;
+    const std::vector<CVD::ImageRef> &vIR = kTarget.aLevels[nLevel].vCorners;
 
     int nBest = -1;
     int nBestZMSSD = Finder.mnMaxSSD + 1;
-    double dMaxDistDiff = mCamera.OnePixelDist() * (4.0 + 1.0 * nLevelScale);
+    double dMaxDistDiff = camera.OnePixelDist() * (4.0 + 1.0 * nLevelScale);
     double dMaxDistSq = dMaxDistDiff * dMaxDistDiff;
 
     for (unsigned int i = 0; i < vv2Corners.size(); i++)   // over all corners in target img..
@@ -958,32 +1823,39 @@ bool MapMaker::AddPointEpipolar(KeyFrame &kSrc,
         return false;
 
     // Now triangulate the 3d point...
-    Vector<3> v3New;
-    v3New = kTarget.se3CfromW.inverse() *
-            ReprojectPoint(kSrc.se3CfromW * kTarget.se3CfromW.inverse(),
-                           mCamera.UnProject(v2RootPos),
-                           mCamera.UnProject(Finder.GetSubPixPos()));
-
-    MapPoint *pNew = new MapPoint;
-    pNew->v3WorldPos = v3New;
-    mMap.vpPoints.push_back(pNew);
+    match.nLevel = nLevel;
+    match.irLevelPos = irLevelPos;
+    match.v2RootPos = v2RootPos;
+    match.v2TargetPos = Finder.GetSubPixPos();
+    match.v3WorldPos = kTarget.se3CfromW.inverse() *
+                       ReprojectPoint(kSrc.se3CfromW * kTarget.se3CfromW.inverse(),
+                                      camera.UnProject(v2RootPos),
+                                      camera.UnProject(match.v2TargetPos));
+    return true;
+}
 
-    pNew->pMMData = new MapMakerData();
-    pNew->SetSourcePatch(mCamera, &kSrc, nLevel, irLevelPos, v2RootPos);
+// The commit half of AddPointEpipolar(): makes the map point and its two measurements.
+void MapMaker::AddEpipolarPoint(KeyFrame &kSrc, KeyFrame &kTarget, const EpipolarMatch &match) {
+    MapPoint *pNew = mMap.NewPoint();
+    pNew->v3WorldPos = match.v3WorldPos;
+    pNew->SetSourcePatch(mCamera, &kSrc, match.nLevel, match.irLevelPos, match.v2RootPos);
+    mMap.vpPoints.push_back(pNew);   // The tracker picks it up at the next PublishListsIfChanged()
+    mMap.bListsChanged = true;
+    mMap.IndexPoint(pNew);
+    mbFusionNeeded = true;
 
     mqNewQueue.push(pNew);
     Measurement m;
-    m.v2RootPos = v2RootPos;
-    m.nLevel = nLevel;
+    m.v2RootPos = match.v2RootPos;
+    m.nLevel = match.nLevel;
     m.bSubPix = true;
     kSrc.mMeasurements[pNew] = m;
 
     m.Source = Measurement::SRC_EPIPOLAR;
-    m.v2RootPos = Finder.GetSubPixPos();
+    m.v2RootPos = match.v2TargetPos;
     kTarget.mMeasurements[pNew] = m;
     pNew->pMMData->sMeasurementKFs.insert(&kSrc);
     pNew->pMMData->sMeasurementKFs.insert(&kTarget);
-    return true;
 }
 
 double MapMaker::KeyFrameLinearDist(KeyFrame &k1, KeyFrame &k2) {
@@ -1032,23 +1904,73 @@ KeyFrame *MapMaker::ClosestKeyFrame(KeyFrame &k) {
     return mMap.vpKeyFrames[nClosest];
 }
 
+// Called by the tracker, inside its epoch: the keyframes come from the
+// published lists, and their poses are copied under the map's SeqLock.
 double MapMaker::DistToNearestKeyFrame(KeyFrame &kCurrent) {
-    KeyFrame *pClosest = ClosestKeyFrame(kCurrent);
-    double dDist = MapMaker::KeyFrameLinearDist(kCurrent, *pClosest);
-    return dDist;
+    const std::vector<KeyFrame *> &vpKeyFrames = mMap.Lists()->vpKeyFrames;
+    std::vector<SE3<> > vPoses(vpKeyFrames.size());
+    unsigned int nVersion;
+    do {
+        nVersion = mMap.poseSeq.ReadBegin();
+        for (size_t i = 0; i < vpKeyFrames.size(); i++)
+            vPoses[i] = vpKeyFrames[i]->se3CfromW;
+    } while (mMap.poseSeq.ReadRetry(nVersion));
+
+    Vector<3> v3CamPos = kCurrent.se3CfromW.inverse().get_translation();
+    double dClosestDist = 9999999999.9;
+    for (const auto &se3 : vPoses) {
+        Vector<3> v3Diff = se3.inverse().get_translation() - v3CamPos;
+        dClosestDist = std::min(dClosestDist, sqrt(v3Diff * v3Diff));
+    }
+    return dClosestDist;
 }
 
 bool MapMaker::NeedNewKeyFrame(KeyFrame &kCurrent) {
-    KeyFrame *pClosest = ClosestKeyFrame(kCurrent);
-    double dDist = MapMaker::KeyFrameLinearDist(kCurrent, *pClosest);
+    double dDist = DistToNearestKeyFrame(kCurrent);
     dDist *= (1.0 / kCurrent.dSceneDepthMean);
     if (dDist > GV2.GetDouble("MapMaker.MaxKFDistWiggleMult", 2, SILENT) * mdWiggleScaleDepthNormalized)
         return true;
     return false;
 }
 
+// Direct factorisation of S gets too expensive for big maps; above this
+// many keyframes global BA switches to the matrix-free PCG solver.
+static void ChooseBundleSolver(Bundle &b, size_t nAdjusted, bool bRecent) {
+    static gvar3<int> gvnPCGKeyFrames("MapMaker.PCGKeyFrames", 150, SILENT);
+    if (!bRecent && *gvnPCGKeyFrames > 0 && (int) nAdjusted >= *gvnPCGKeyFrames)
+        b.SetSolver(Bundle::SOLVER_PCG);
+    else
+        b.SetSolver(Bundle::SOLVER_DEFAULT);
+}
+
 // Perform bundle adjustment on all keyframes, all map points
 void MapMaker::BundleAdjustAll(bool ignoreOut) {
+    // Normally the global problem is kept and patched from call to call
+    static gvar3<int> gvnPersistent("MapMaker.PersistentGlobalBundle", 1, SILENT);
+    if (*gvnPersistent) {
+        SyncGlobalBundle();
+        size_t nAdjusted = 0;
+        for (KeyFrame *kf : mMap.vpKeyFrames)
+            if (!kf->bFixed)
+                nAdjusted++;
+        ChooseBundleSolver(*mpGlobalBundle, nAdjusted, false);
+
+        // Run for at most one slice, then go back to the main loop so new
+        // keyframes get in; the next call resumes where this one stopped.
+        // The slice length bounds how long a keyframe waits behind global BA.
+        static gvar3<int> gvnSliceMs("MapMaker.GlobalBundleSliceMs", 200, SILENT);  // 0 = run to completion
+        RunBundle(*mpGlobalBundle, mvGlobalBundleID_View, mvGlobalBundleID_Point, false, ignoreOut,
+                  *gvnSliceMs * 0.001);
+
+        const BundleProgress &progress = mpGlobalBundle->Progress();
+        mnGlobalBundleSlices++;
+        mdGlobalBundleSeconds = mdGlobalBundleSeconds + progress.dSeconds;
+        if (progress.dSeconds > mdMaxGlobalBundleSlice)
+            mdMaxGlobalBundleSlice = progress.dSeconds;
+        mdGlobalBundleError = progress.dError;
+        return;
+    }
+
     // construct the sets of kfs/points to be adjusted:
     // in this case, all of them
     std::set<KeyFrame *> sAdj;
@@ -1068,7 +1990,17 @@ void MapMaker::BundleAdjustAll(bool ignoreOut) {
 
 void MapMaker::BundleAdjustKeyframe(int idx) {
     std::set<KeyFrame *> sAdjustSet;
-    KeyFrame *pkfSelected = mMap.vpKeyFrames[idx];
+    std::set<KeyFrame *> sFixedSet;
+    std::set<MapPoint *> sMapPoints;
+    LocalBundleSets(mMap.vpKeyFrames[idx], sAdjustSet, sFixedSet, sMapPoints);
+    BundleAdjust(sAdjustSet, sFixedSet, sMapPoints, true);
+}
+
+// The keyframes and points of a local bundle adjustment around pkfSelected:
+// it and its closest keyframes are adjusted, along with every point they
+// measure; other keyframes measuring those points hold them in place.
+void MapMaker::LocalBundleSets(KeyFrame *pkfSelected, std::set<KeyFrame *> &sAdjustSet,
+                               std::set<KeyFrame *> &sFixedSet, std::set<MapPoint *> &sMapPoints) {
     sAdjustSet.insert(pkfSelected);
     std::vector<KeyFrame *> vClosest = NClosestKeyFrames(*pkfSelected, 4);
     for (int i = 0; i < 4; i++)
@@ -1076,7 +2008,6 @@ void MapMaker::BundleAdjustKeyframe(int idx) {
             sAdjustSet.insert(vClosest[i]);
 
     // Now we find the set of features which they contain.
-    std::set<MapPoint *> sMapPoints;
     for (std::set<KeyFrame *>::iterator iter = sAdjustSet.begin(); iter != sAdjustSet.end(); iter++) {
         std::map<MapPoint *, Measurement> &mKFMeas = (*iter)->mMeasurements;
         for (meas_it jiter = mKFMeas.begin(); jiter != mKFMeas.end(); jiter++) {
@@ -1085,7 +2016,6 @@ void MapMaker::BundleAdjustKeyframe(int idx) {
     };
 
     // Finally, add all keyframes which measure above points as fixed keyframes
-    std::set<KeyFrame *> sFixedSet;
     for (std::vector<KeyFrame *>::iterator it = mMap.vpKeyFrames.begin(); it != mMap.vpKeyFrames.end(); it++) {
         if (sAdjustSet.count(*it))
             continue;
@@ -1099,8 +2029,6 @@ void MapMaker::BundleAdjustKeyframe(int idx) {
         if (bInclude)
             sFixedSet.insert(*it);
     }
-
-    BundleAdjust(sAdjustSet, sFixedSet, sMapPoints, true);
 }
 
 // Peform a local bundle adjustment which only adjusts
@@ -1113,34 +2041,48 @@ void MapMaker::BundleAdjustRecent() {
 void
 MapMaker::BundleAdjust(std::set<KeyFrame *> sAdjustSet, std::set<KeyFrame *> sFixedSet, std::set<MapPoint *> sMapPoints,
                        bool bRecent, bool bIgnoreOut) {
-    Bundle b(mCamera);   // Our bundle adjuster
-    mbBundleRunning = true;
-    mbBundleRunningIsRecent = bRecent;
+    std::unique_ptr<Bundle> pBundle(Bundle::Create(mCamera));   // Our bundle adjuster
+    Bundle &b = *pBundle;
+    b.SetPool(&BundlePool());
+    std::vector<MapPoint *> vBundleID_Point;
+    std::vector<KeyFrame *> vBundleID_View;
+    PopulateBundle(b, sAdjustSet, sFixedSet, sMapPoints, bRecent, vBundleID_View, vBundleID_Point);
+    RunBundle(b, vBundleID_View, vBundleID_Point, bRecent, bIgnoreOut);
+}
+
+// Fills a fresh bundle adjuster with the given keyframes and points, and the
+// measurements between them. vBundleID_View and vBundleID_Point get the
+// adjuster's ids. Points in psHeldPoints are added, but not adjusted.
+void MapMaker::PopulateBundle(Bundle &b, const std::set<KeyFrame *> &sAdjustSet, const std::set<KeyFrame *> &sFixedSet,
+                              const std::set<MapPoint *> &sMapPoints, bool bRecent,
+                              std::vector<KeyFrame *> &vBundleID_View, std::vector<MapPoint *> &vBundleID_Point,
+                              const std::set<MapPoint *> *psHeldPoints) {
+    ChooseBundleSolver(b, sAdjustSet.size(), bRecent);
 
     // The bundle adjuster does different accounting of keyframes and map points;
     // Translation maps are stored:
     std::map<MapPoint *, int> mPoint_BundleID;
-    std::map<int, MapPoint *> mBundleID_Point;
     std::map<KeyFrame *, int> mView_BundleID;
-    std::map<int, KeyFrame *> mBundleID_View;
 
     // Add the keyframes' poses to the bundle adjuster. Two parts: first nonfixed, then fixed.
-    for (std::set<KeyFrame *>::iterator it = sAdjustSet.begin(); it != sAdjustSet.end(); it++) {
+    for (std::set<KeyFrame *>::const_iterator it = sAdjustSet.begin(); it != sAdjustSet.end(); it++) {
         int nBundleID = b.AddCamera((*it)->se3CfromW, (*it)->bFixed);
         mView_BundleID[*it] = nBundleID;
-        mBundleID_View[nBundleID] = *it;
+        vBundleID_View.push_back(*it);
     }
-    for (std::set<KeyFrame *>::iterator it = sFixedSet.begin(); it != sFixedSet.end(); it++) {
+    for (std::set<KeyFrame *>::const_iterator it = sFixedSet.begin(); it != sFixedSet.end(); it++) {
         int nBundleID = b.AddCamera((*it)->se3CfromW, true);
         mView_BundleID[*it] = nBundleID;
-        mBundleID_View[nBundleID] = *it;
+        vBundleID_View.push_back(*it);
     }
 
-    // Add the points' 3D position
-    for (std::set<MapPoint *>::iterator it = sMapPoints.begin(); it != sMapPoints.end(); it++) {
-        int nBundleID = b.AddPoint((*it)->v3WorldPos);
+    // Add the points' 3D position. Points from the installed model are trusted, so hold them still.
+    static gvar3<int> gvnFixModelPoints("MapMaker.FixModelPoints", 1, SILENT);
+    for (std::set<MapPoint *>::const_iterator it = sMapPoints.begin(); it != sMapPoints.end(); it++) {
+        bool bFixed = (*gvnFixModelPoints && (*it)->bFromModel) || (psHeldPoints && psHeldPoints->count(*it));
+        int nBundleID = b.AddPoint((*it)->v3WorldPos, bFixed);
         mPoint_BundleID[*it] = nBundleID;
-        mBundleID_Point[nBundleID] = *it;
+        vBundleID_Point.push_back(*it);
     }
 
     // Add the relevant point-in-keyframe measurements
@@ -1157,10 +2099,111 @@ MapMaker::BundleAdjust(std::set<KeyFrame *> sAdjustSet, std::set<KeyFrame *> sFi
                       LevelScale(it->second.nLevel) * LevelScale(it->second.nLevel));
         }
     }
+}
+
+// One pool for all the mapmaker's bundles, made with the first; a local BA is
+// often too small to pay for starting and joining threads of its own.
+WorkerPool &MapMaker::BundlePool() {
+    static gvar3<int> gvnThreads("Bundle.Threads", 0, SILENT);   // 0 means one thread per core
+    if (!mpBundlePool)
+        mpBundlePool.reset(new WorkerPool(*gvnThreads));
+    return *mpBundlePool;
+}
+
+// Global bundle adjustment keeps its problem between calls. Here it is
+// brought up to date with the map: keyframes and points which have gone are
+// removed, new ones added, poses and positions refreshed, and each
+// keyframe's measurements diffed against what the problem already has.
+void MapMaker::SyncGlobalBundle() {
+    if (!mpGlobalBundle) {
+        mpGlobalBundle.reset(Bundle::Create(mCamera));
+        mpGlobalBundle->SetPool(&BundlePool());
+    }
+    Bundle &b = *mpGlobalBundle;
+    static gvar3<int> gvnFixModelPoints("MapMaker.FixModelPoints", 1, SILENT);
+
+    // Keyframes
+    std::unordered_set<KeyFrame *> sKeyFrames(mMap.vpKeyFrames.begin(), mMap.vpKeyFrames.end());
+    for (auto it = mGlobalBundleViews.begin(); it != mGlobalBundleViews.end();) {
+        if (sKeyFrames.count(it->first))
+            it++;
+        else {
+            b.RemoveCamera(it->second);
+            mvGlobalBundleID_View[it->second] = NULL;
+            it = mGlobalBundleViews.erase(it);
+        }
+    }
+    for (KeyFrame *kf : mMap.vpKeyFrames) {
+        auto it = mGlobalBundleViews.find(kf);
+        if (it == mGlobalBundleViews.end()) {
+            int nID = b.AddCamera(kf->se3CfromW, kf->bFixed);
+            mGlobalBundleViews[kf] = nID;
+            if ((int) mvGlobalBundleID_View.size() <= nID)
+                mvGlobalBundleID_View.resize(nID + 1, NULL);
+            mvGlobalBundleID_View[nID] = kf;
+        } else
+            b.SetCamera(it->second, kf->se3CfromW, kf->bFixed);
+    }
+
+    // Points. Point records get recycled, so an entry also has to match the record's generation.
+    std::unordered_set<MapPoint *> sPoints(mMap.vpPoints.begin(), mMap.vpPoints.end());
+    for (auto it = mGlobalBundlePoints.begin(); it != mGlobalBundlePoints.end();) {
+        if (sPoints.count(it->first) && MapPointPool::Generation(it->first) == it->second.nGeneration)
+            it++;
+        else {
+            b.RemovePoint(it->second.nID);
+            mvGlobalBundleID_Point[it->second.nID] = NULL;
+            it = mGlobalBundlePoints.erase(it);
+        }
+    }
+    for (MapPoint *p : mMap.vpPoints) {
+        bool bFixed = *gvnFixModelPoints && p->bFromModel;
+        auto it = mGlobalBundlePoints.find(p);
+        if (it == mGlobalBundlePoints.end()) {
+            GlobalBundlePoint entry;
+            entry.nID = b.AddPoint(p->v3WorldPos, bFixed);
+            entry.nGeneration = MapPointPool::Generation(p);
+            mGlobalBundlePoints[p] = entry;
+            if ((int) mvGlobalBundleID_Point.size() <= entry.nID)
+                mvGlobalBundleID_Point.resize(entry.nID + 1, NULL);
+            mvGlobalBundleID_Point[entry.nID] = p;
+        } else
+            b.SetPoint(it->second.nID, p->v3WorldPos, bFixed);
+    }
+
+    // Measurements
+    b.BeginUpdate();
+    for (KeyFrame *kf : mMap.vpKeyFrames) {
+        int nKF_BundleID = mGlobalBundleViews[kf];
+        for (meas_it it = kf->mMeasurements.begin(); it != kf->mMeasurements.end(); it++) {
+            auto itp = mGlobalBundlePoints.find(it->first);
+            if (itp == mGlobalBundlePoints.end())
+                continue;
+            b.UpdateMeas(nKF_BundleID, itp->second.nID, it->second.v2RootPos,
+                         LevelScale(it->second.nLevel) * LevelScale(it->second.nLevel));
+        }
+    }
+    b.EndUpdate();
+}
+
+// Runs a populated bundle adjuster and applies its results to the map.
+// vBundleID_View and vBundleID_Point translate the adjuster's ids (NULL for unused ids.)
+void MapMaker::RunBundle(Bundle &b, const std::vector<KeyFrame *> &vBundleID_View,
+                         const std::vector<MapPoint *> &vBundleID_Point, bool bRecent, bool bIgnoreOut,
+                         double dTimeBudget) {
+    mbBundleRunning = true;
+    mbBundleRunningIsRecent = bRecent;
 
     // Run the bundle adjuster. This returns the number of successful iterations
-    int nAccepted = b.Compute(&mbBundleAbortRequested);
+    int nAccepted = b.Compute(&mbBundleAbortRequested, dTimeBudget);
+    ApplyBundle(b, nAccepted, vBundleID_View, vBundleID_Point, bRecent, bIgnoreOut);
+}
 
+// Applies the results of a bundle adjuster's Compute(), which returned nAccepted, to the map.
+// Only adjusted keyframes and points are written, so adjusters which share fixed
+// keyframes or points can be applied one after the other.
+void MapMaker::ApplyBundle(Bundle &b, int nAccepted, const std::vector<KeyFrame *> &vBundleID_View,
+                           const std::vector<MapPoint *> &vBundleID_Point, bool bRecent, bool bIgnoreOut) {
     if (nAccepted < 0) {
         // Crap: - LM Ran into a serious problem!
         // This is probably because the initial stereo was messed up.
@@ -1173,12 +2216,17 @@ MapMaker::BundleAdjust(std::set<KeyFrame *> sAdjustSet, std::set<KeyFrame *> sFi
 
     // Bundle adjustment did some updates, apply these to the map
     if (nAccepted > 0) {
-
-        for (std::map<MapPoint *, int>::iterator itr = mPoint_BundleID.begin(); itr != mPoint_BundleID.end(); itr++)
-            itr->first->v3WorldPos = b.GetPoint(itr->second);
-
-        for (std::map<KeyFrame *, int>::iterator itr = mView_BundleID.begin(); itr != mView_BundleID.end(); itr++)
-            itr->first->se3CfromW = b.GetCamera(itr->second);
+        {
+            // Publish all results in one go so the tracker never sees half an update
+            SeqLock::WriteGuard publish(mMap.poseSeq);
+            for (size_t i = 0; i < vBundleID_Point.size(); i++)
+                if (vBundleID_Point[i] && !b.PointFixed(i))
+                    vBundleID_Point[i]->v3WorldPos = b.GetPoint(i);
+
+            for (size_t i = 0; i < vBundleID_View.size(); i++)
+                if (vBundleID_View[i] && !b.CameraFixed(i))
+                    vBundleID_View[i]->se3CfromW = b.GetCamera(i);
+        }
         if (bRecent)
             mbBundleConverged_Recent = false;
         mbBundleConverged_Full = false;
@@ -1198,9 +2246,12 @@ MapMaker::BundleAdjust(std::set<KeyFrame *> sAdjustSet, std::set<KeyFrame *> sFi
     // Handle outlier measurements:
     std::vector<std::pair<int, int>> vOutliers_PC_pair = b.GetOutlierMeasurements();
     for (unsigned int i = 0; i < vOutliers_PC_pair.size(); i++) {
-        MapPoint *pp = mBundleID_Point[vOutliers_PC_pair[i].first];
-        KeyFrame *pk = mBundleID_View[vOutliers_PC_pair[i].second];
-        Measurement &m = pk->mMeasurements[pp];
+        MapPoint *pp = vBundleID_Point[vOutliers_PC_pair[i].first];
+        KeyFrame *pk = vBundleID_View[vOutliers_PC_pair[i].second];
+        meas_it itMeas = pk->mMeasurements.find(pp);
+        if (itMeas == pk->mMeasurements.end())
+            continue;   // Already dealt with by another adjuster applied before this one
+        Measurement &m = itMeas->second;
         // Is the original source kf considered an outlier? That's bad.
         if (!pp->bFromModel && (pp->pMMData->GoodMeasCount() <= 2 || m.Source == Measurement::SRC_ROOT)) {
             pp->bBad = true;
@@ -1246,16 +2297,19 @@ bool MapMaker::ReFind_Common(KeyFrame &k, MapPoint &p) {
         return false;
     }
 
-    CVD::ImageRef irImageSize = k.aLevels[0].im.size();
+    CVD::ImageRef irImageSize = k.LevelSize(0);
     if (v2Image[0] < 0 || v2Image[1] < 0 || v2Image[0] > irImageSize[0] || v2Image[1] > irImageSize[1]) {
         p.pMMData->sNeverRetryKFs.insert(&k);
         return false;
     }
 
+    if (!p.pPatchSourceKF->EnsureLevel(p.nSourceLevel))
+        return false;   // Its source is paged out, and can't be read back just now
+
     Matrix<2> m2CamDerivs = mCamera.GetProjectionDerivs();
     Finder.MakeTemplateCoarse(p, k.se3CfromW, m2CamDerivs);
 
-    if (Finder.TemplateBad()) {
+    if (Finder.TemplateBad() || !k.EnsureLevel(Finder.GetLevel())) {
         p.pMMData->sNeverRetryKFs.insert(&k);
         return false;
     }
@@ -1312,7 +2366,7 @@ void MapMaker::ReFindNewlyMade() {
         return;
     int nFound = 0;
     int nBad = 0;
-    while (!mqNewQueue.empty() && mvpKeyFrameQueue.size() == 0) {
+    while (!mqNewQueue.empty() && QueueSize() == 0) {
         MapPoint *pNew = mqNewQueue.front();
         mqNewQueue.pop();
         if (pNew->bBad) {
@@ -1349,7 +2403,13 @@ bool MapMaker::IsDistanceToNearestKeyFrameExcessive(KeyFrame &kCurrent) {
 
 bool MapMaker::IsDistanceToRelocKeyFrameExcessive(SE3<> &camPose, KeyFrame &kTarget) {
     Vector<3> v3KF1_CamPos = camPose.inverse().get_translation();
-    Vector<3> v3KF2_CamPos = kTarget.se3CfromW.inverse().get_translation();
+    SE3<> se3Target;
+    unsigned int nVersion;
+    do {
+        nVersion = mMap.poseSeq.ReadBegin();
+        se3Target = kTarget.se3CfromW;
+    } while (mMap.poseSeq.ReadRetry(nVersion));
+    Vector<3> v3KF2_CamPos = se3Target.inverse().get_translation();
     Vector<3> v3Diff = v3KF2_CamPos - v3KF1_CamPos;
     double dDist = sqrt(v3Diff * v3Diff);
     return dDist > GV2.GetDouble("MapMaker.MaxRelocKFDistance", 3.0, SILENT) * minKFDistance * mdOneCM;
@@ -1358,7 +2418,7 @@ bool MapMaker::IsDistanceToRelocKeyFrameExcessive(SE3<> &camPose, KeyFrame &kTar
 // Calculates the depth(z-) distribution of map points visible in a keyframe
 // This function is only used for the first two keyframes - all others
 // get this filled in by the tracker
-void MapMaker::RefreshSceneDepth(KeyFrame *pKF) {
+bool MapMaker::RefreshSceneDepth(KeyFrame *pKF) {
     double dSumDepth = 0.0;
     double dSumDepthSquared = 0.0;
     int nMeas = 0;
@@ -1370,16 +2430,21 @@ void MapMaker::RefreshSceneDepth(KeyFrame *pKF) {
         nMeas++;
     }
 
-    assert(nMeas > 2); // If not then something is seriously wrong with this KF!!
+    // Too few to go by: a live keyframe that has lost its points, or a loaded
+    // one whose points were left out by Model.PointBudget.
+    if (nMeas < 3)
+        return false;
     pKF->dSceneDepthMean = dSumDepth / nMeas;
-    pKF->dSceneDepthSigma = sqrt((dSumDepthSquared / nMeas) - (pKF->dSceneDepthMean) * (pKF->dSceneDepthMean));
+    pKF->dSceneDepthSigma = sqrt(std::max(0.0, (dSumDepthSquared / nMeas) - (pKF->dSceneDepthMean) * (pKF->dSceneDepthMean)));
+    return true;
 }
 
 void MapMaker::GUICommandCallBack(void *ptr, std::string sCommand, std::string sParams) {
     Command c;
     c.sCommand = sCommand;
     c.sParams = sParams;
-    ((MapMaker *) ptr)->mvQueuedCommands.push_back(c);
+    if (!((MapMaker *) ptr)->mqQueuedCommands.TryPush(std::move(c)))
+        std::cout << "! MapMaker::GUICommandCallBack: command queue full, dropping " << sCommand << std::endl;
 }
 
 void MapMaker::GUICommandHandler(std::string sCommand, std::string sParams)  // Called by the callback func..
@@ -1407,53 +2472,105 @@ void MapMaker::GUICommandHandler(std::string sCommand, std::string sParams)  //
         return;
     }
 
+    // SaveModel folder [name]: snapshots the map here and writes it as a model in the background
+    if (sCommand == "SaveModel") {
+        std::istringstream ss(sParams);
+        std::string sFolder, sName;
+        ss >> sFolder >> sName;
+        if (sFolder.empty()) {
+            std::cout << "  MapMaker: SaveModel needs a folder" << std::endl;
+            return;
+        }
+        if (sName.empty())
+            sName = currentModelName;
+        std::unique_ptr<ModelSnapshot> pSnapshot(new ModelSnapshot());
+        if (!mMap.SnapshotModel(sFolder, sName, mdOneCM, *pSnapshot)) {
+            std::cout << "  MapMaker: can't save the map as a model" << std::endl;
+            return;
+        }
+        if (!mpModelSaver)
+            mpModelSaver.reset(new ModelSaver());
+        mpModelSaver->Save(std::move(pSnapshot));
+        std::cout << "  MapMaker: saving the map to " << sFolder << " in the background" << std::endl;
+        return;
+    }
+
     std::cout << "! MapMaker::GUICommandHandler: unhandled command " << sCommand << std::endl;
     exit(1);
 };
 
+cv::FlannBasedMatcher MapMaker::MakeRelocMatcher() {
+    cv::Ptr<cv::flann::IndexParams> indexParams = cv::makePtr<cv::flann::LshIndexParams>(6, 12, 1);
+    cv::Ptr<cv::flann::SearchParams> searchParams = cv::makePtr<cv::flann::SearchParams>(50);
+    return cv::FlannBasedMatcher(indexParams, searchParams);
+}
+
 void MapMaker::BuildRelocIndex() {
     // Build descriptors
-    for (const auto &kf : mMap.vpKeyFrames) {
+    for (const auto &kf : mMap.vpKeyFrames)
         kf->MakeKeyFrame_Reloc(nRelocFeatureCount, insertKeypointRadius);
-        keyframeImageMatcher.add(kf->relocFrameDescriptor);
-    }
-    keyframeImageMatcher.train();
+    RetrainRelocMatcher();
 }
 
+// Called by the tracker. The frame's pixels are copied into a buffer which the
+// queue then owns, so the tracker is free to overwrite its own frame straight away.
+// If the relocaliser is still busy with older frames this one is simply dropped.
 void MapMaker::AddRelocImage(KeyFrame &k) {
-    std::unique_lock<std::mutex> lock(relocImageMutex);
-
-    Image<CVD::byte> im = k.aLevels[0].im;
-    cv::Mat img(im.size().y, im.size().x, CV_8UC1, im.data());
-    lastRelocImage = img;
-    newRelocImage = true;
-
-    lock.unlock();
+    cv::Mat recycled;
+    while (mqRelocFreeBuffers.TryPop(recycled))
+        mRelocSpareBuffer = recycled;
+
+    Image<CVD::byte> &im = k.aLevels[0].im;
+    cv::Mat src(im.size().y, im.size().x, CV_8UC1, im.data());
+    src.copyTo(mRelocSpareBuffer);    // Only reallocates if the size changed
+    if (mqRelocImages.TryPush(std::move(mRelocSpareBuffer)))
+        mRelocSpareBuffer = cv::Mat();
 }
 
-SE3<> MapMaker::LastRelocPose() {
-    newRelocPose = false;
-    return lastRelocPose;
+// Called by the tracker: fetches the most recent relocaliser result, discarding older ones.
+bool MapMaker::PopRelocResult(SE3<> &se3Pose, KeyFrame *&pBestKF) {
+    RelocResult r;
+    if (mbRelocResultsStale.exchange(false)) {
+        // Everything queued was made against the model that was just swapped out
+        while (mqRelocResults.TryPop(r)) {
+        }
+        return false;
+    }
+    bool bGot = false;
+    while (mqRelocResults.TryPop(r))
+        bGot = true;
+    if (!bGot || r.nKeyFrameGeneration != mMap.nKeyFrameGeneration.load())
+        return false;
+    se3Pose = r.se3Pose;
+    pBestKF = r.pBestKF;
+    return true;
 }
 
-bool MapMaker::NewRelocPoseReady() {
-    return newRelocPose;
+void MapMaker::ReportBundleStats() {
+    stats.SetBundleStats(mnGlobalBundleSlices, mdGlobalBundleSeconds, mdMaxGlobalBundleSlice, mdGlobalBundleError);
 }
 
-int MapMaker::BestRelocKeyFrame() {
-    return nBestRelocKF;
+void MapMaker::ReportQueueStats() {
+    stats.SetQueueStats(mqKeyFrameQueue.MaxDepth(), mqKeyFrameQueue.Rejected(),
+                        mqRelocImages.MaxDepth(), mqRelocImages.Rejected());
 }
 
 void MapMaker::ProcessReloc() {
-    if (!newRelocImage)
+    // Only the latest frame is worth relocalising against; older ones go straight back to the tracker.
+    cv::Mat img, older;
+    while (mqRelocImages.TryPop(older)) {
+        if (!img.empty())
+            mqRelocFreeBuffers.TryPush(std::move(img));
+        img = std::move(older);
+    }
+    if (img.empty())
         return;
 
-    // Get last frame
-    std::unique_lock<std::mutex> lock(relocImageMutex);
-    cv::Mat img = lastRelocImage;
-    newRelocImage = false;
-    lock.unlock();
+    ProcessRelocImage(img);
+    mqRelocFreeBuffers.TryPush(std::move(img));
+}
 
+void MapMaker::ProcessRelocImage(const cv::Mat &img) {
     // Extract features
     std::vector<cv::KeyPoint> keypoints;
     cv::Mat curentFrameDescriptor;
@@ -1471,6 +2588,24 @@ void MapMaker::ProcessReloc() {
         }
         relocDBoW.query(feature, ret, 5);
 
+        // The loader works on the likeliest models ahead of a switch
+        static gvar3<int> gvnAsyncLoad("MapMaker.AsyncModelLoad", 1, SILENT);
+        static gvar3<int> gvnModelCacheMB("MapMaker.ModelCacheMB", 512, SILENT);
+        CVD::ImageRef irImageSize(img.cols, img.rows);
+        bool bAsync = mpModelLoader && *gvnAsyncLoad && *gvnModelCacheMB > 0;
+        if (bAsync) {
+            if (!ret.empty()) {
+                std::string best = relocFeatureToModel[ret[0].Id];
+                PrefetchModel(best, irImageSize);
+                for (const auto &r : ret) {
+                    if (relocFeatureToModel[r.Id] != best) {
+                        PrefetchModel(relocFeatureToModel[r.Id], irImageSize);
+                        break;
+                    }
+                }
+            }
+        }
+
         std::string nextModel;
         if (ret.size() >= 2) {
             std::string best = relocFeatureToModel[ret[0].Id];
@@ -1512,6 +2647,14 @@ void MapMaker::ProcessReloc() {
         }
 
         if (!nextModel.empty() && (nextModel != currentModel || !mMap.IsGood())) {
+            if (bAsync && !mModelCache.Contains(ModelCache::Key(nextModel, irImageSize))) {
+                // Carry on with the current scene until the loader has this one ready
+                mpModelLoader->Request(nextModel, irImageSize, false);
+                msAwaitedModel = nextModel;
+                mirAwaitedImageSize = irImageSize;
+                return;
+            }
+            msAwaitedModel.clear();
             SE3<> tmp;
             currentModelName = "";
             currentModel = "";
@@ -1526,14 +2669,14 @@ void MapMaker::ProcessReloc() {
     keyframeImageMatcher.knnMatch(curentFrameDescriptor, matches, 2);
 
     // Get matches for image with best matching
-    std::vector<std::vector<cv::DMatch>> matchesPerKF(mMap.vpKeyFrames.size());
+    std::vector<std::vector<cv::DMatch>> matchesPerKF(keyframeImageMatcher.getTrainDescriptors().size());
     for (const auto &x :  matches) {
         if (x.size() == 2 && x[0].distance / x[1].distance < 0.9) {
             matchesPerKF[x[0].imgIdx].push_back(x[0]);
         }
     }
     int max = 0;
-    nBestRelocKF = -1;
+    int nBestRelocKF = -1;
     for (int i = 0; i < matchesPerKF.size(); i++) {
         if (matchesPerKF[i].size() > max) {
             max = matchesPerKF[i].size();
@@ -1543,13 +2686,18 @@ void MapMaker::ProcessReloc() {
     if (nBestRelocKF < 0)
         return;
     auto bestMatches = matchesPerKF[nBestRelocKF];
+    KeyFrame *pBestKF = RelocKeyFrame(nBestRelocKF);
+    auto itBest = std::find(mMap.vpKeyFrames.begin(), mMap.vpKeyFrames.end(), pBestKF);
+    if (!pBestKF || itBest == mMap.vpKeyFrames.end())
+        return;
     // Prepare structures for position estimation
     std::vector<cv::Point3f> worldPos;
     std::vector<cv::Point2f> imgPos;
     for (const auto &x : bestMatches) {
-        if (mMap.vpKeyFrames[nBestRelocKF]->relocWorldPoints.find(x.trainIdx) != mMap.vpKeyFrames[nBestRelocKF]->relocWorldPoints.end()) {
+        cv::Point3d pt;
+        if (pBestKF->FindRelocWorldPoint(x.trainIdx, pt)) {
             imgPos.push_back(keypoints[x.queryIdx].pt);
-            worldPos.push_back(mMap.vpKeyFrames[nBestRelocKF]->relocWorldPoints[x.trainIdx]);
+            worldPos.push_back(pt);
         }
     }
     if (imgPos.size() < 5) {
@@ -1559,11 +2707,11 @@ void MapMaker::ProcessReloc() {
     // Calculate rotation and translation
     cv::Vec3d R, t;
 
-    Vector<3> kfT = mMap.vpKeyFrames[nBestRelocKF]->se3CfromW.get_translation();
+    Vector<3> kfT = pBestKF->se3CfromW.get_translation();
     t(0) = kfT[0];
     t(1) = kfT[1];
     t(2) = kfT[2];
-    Vector<3> kfR = mMap.vpKeyFrames[nBestRelocKF]->se3CfromW.get_rotation().ln();
+    Vector<3> kfR = pBestKF->se3CfromW.get_rotation().ln();
     R(0) = kfR[0];
     R(1) = kfR[1];
     R(2) = kfR[2];
@@ -1581,10 +2729,11 @@ void MapMaker::ProcessReloc() {
     finalR[0] = R(0);
     finalR[1] = R(1);
     finalR[2] = R(2);
-    lock.lock();
-    lastRelocPose = SE3<>(SO3<>(finalR), finalT);
-    newRelocPose = true;
-    lock.unlock();
+    RelocResult r;
+    r.se3Pose = SE3<>(SO3<>(finalR), finalT);
+    r.pBestKF = pBestKF;
+    r.nKeyFrameGeneration = mMap.nKeyFrameGeneration.load();
+    mqRelocResults.TryPush(std::move(r));
 }
 
 void MapMaker::SetMode(Mode m) {
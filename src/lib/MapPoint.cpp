@@ -46,5 +46,4 @@ void MapPoint::SetSourcePatch(ATANCamera &cam, KeyFrame *kf, int level, CVD::Ima
     normalize(v3OneDownFromCenter_NC);
     normalize(v3OneRightFromCenter_NC);
     RefreshPixelVectors();
-    pMMData = new MapMakerData();
 }
@@ -0,0 +1,108 @@
+#include <new>
+
+#include <ptamsp/MapPointPool.h>
+#include <ptamsp/MapPoint.h>
+#include <ptamsp/MapMaker.h>
+#include <ptamsp/TrackerData.h>
+
+// One slab entry. The MapPoint comes first so a MapPoint* handed out by the
+// pool can be turned back into its record with a plain static_cast.
+struct MapPointRecord : public MapPoint {
+    MapPointRecord() : TData(this) {
+        pTData = &TData;
+        pMMData = &MMData;
+    }
+
+    TrackerData TData;
+    MapMakerData MMData;
+    uint64_t nRetiredEpoch = 0;
+    uint64_t nGeneration = 0;   // Bumped each time the record is freed
+    MapPointRecord *pNextFree = nullptr;
+};
+
+MapPointPool::MapPointPool(size_t nSlabSize)
+        : mnSlabSize(nSlabSize) {
+}
+
+MapPointPool::~MapPointPool() = default;
+
+void MapPointPool::AddSlab() {
+    mvSlabs.emplace_back(new MapPointRecord[mnSlabSize]);
+    MapPointRecord *pSlab = mvSlabs.back().get();
+    for (size_t i = mnSlabSize; i > 0; i--) {
+        pSlab[i - 1].pNextFree = mpFreeList;
+        mpFreeList = &pSlab[i - 1];
+    }
+}
+
+MapPoint *MapPointPool::Allocate() {
+    if (!mpFreeList)
+        AddSlab();
+    MapPointRecord *r = mpFreeList;
+    mpFreeList = r->pNextFree;
+    r->pNextFree = nullptr;
+    mnLive++;
+    return r;
+}
+
+// Records are rebuilt in place when they go back on the free list, so the
+// sets and patch templates of dead points don't hang on to their memory.
+void MapPointPool::Release(MapPointRecord *r) {
+    uint64_t nGeneration = r->nGeneration + 1;
+    r->~MapPointRecord();
+    new(r) MapPointRecord();
+    r->nGeneration = nGeneration;
+    r->pNextFree = mpFreeList;
+    mpFreeList = r;
+    mnLive--;
+}
+
+uint64_t MapPointPool::Generation(const MapPoint *p) {
+    return static_cast<const MapPointRecord *>(p)->nGeneration;
+}
+
+void MapPointPool::Discard(MapPoint *p) {
+    Release(static_cast<MapPointRecord *>(p));
+}
+
+void MapPointPool::Retire(MapPoint *p, uint64_t nEpoch) {
+    MapPointRecord *r = static_cast<MapPointRecord *>(p);
+    r->nRetiredEpoch = nEpoch;
+    mvRetired.push_back(r);
+}
+
+size_t MapPointPool::Reclaim(uint64_t nSafeEpoch) {
+    size_t n = 0;
+    while (n < mvRetired.size() && mvRetired[n]->nRetiredEpoch < nSafeEpoch) {
+        Release(mvRetired[n]);
+        n++;
+    }
+    mvRetired.erase(mvRetired.begin(), mvRetired.begin() + n);
+    return n;
+}
+
+void MapPointPool::Clear() {
+    mvRetired.clear();
+    mvSlabs.clear();
+    mpFreeList = nullptr;
+    mnLive = 0;
+}
+
+bool MapPointPool::Adopt(MapPointPool &other) {
+    if (!other.mvRetired.empty() || other.mnSlabSize != mnSlabSize)
+        return false;
+    for (auto &slab : other.mvSlabs)
+        mvSlabs.push_back(std::move(slab));
+    if (other.mpFreeList) {
+        MapPointRecord *pLast = other.mpFreeList;
+        while (pLast->pNextFree)
+            pLast = pLast->pNextFree;
+        pLast->pNextFree = mpFreeList;
+        mpFreeList = other.mpFreeList;
+    }
+    mnLive += other.mnLive;
+    other.mvSlabs.clear();
+    other.mpFreeList = nullptr;
+    other.mnLive = 0;
+    return true;
+}
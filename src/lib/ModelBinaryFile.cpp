@@ -0,0 +1,563 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <ptamsp/ModelBinaryFile.h>
+#include <ptamsp/PTAMModelFile.h>
+#include <ptamsp/KeyFrame.h>
+
+static const char acModelMagic[8] = "PTAMMDL";
+static const uint32_t nModelByteOrder = 0x01020304;
+static const uint64_t nSectionAlign = 64;
+
+static_assert(sizeof(ModelBinSection) == 16, "ModelBinSection layout");
+static_assert(sizeof(ModelBinHeader) == 240, "ModelBinHeader layout");
+static_assert(sizeof(ModelBinKeyFrame) == 96, "ModelBinKeyFrame layout");
+static_assert(sizeof(ModelBinKeyPoint) == 32, "ModelBinKeyPoint layout");
+static_assert(sizeof(ModelBinWorldPoint) == 32, "ModelBinWorldPoint layout");
+static_assert(sizeof(ModelBinPoint) == 32, "ModelBinPoint layout");
+static_assert(sizeof(ModelBinMeasurement) == 40, "ModelBinMeasurement layout");
+static_assert(sizeof(ModelBinLevel) == 56, "ModelBinLevel layout");
+static_assert(sizeof(ModelBinCorner) == 4, "ModelBinCorner layout");
+static_assert(sizeof(ModelBinCandidate) == 8, "ModelBinCandidate layout");
+static_assert(sizeof(ModelBinTile) == 32, "ModelBinTile layout");
+
+ModelBinaryFile::~ModelBinaryFile() {
+    if (mpData)
+        munmap(mpData, mnSize);
+}
+
+std::shared_ptr<const ModelBinaryFile> ModelBinaryFile::Open(const std::string &sPath) {
+    int fd = open(sPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(ModelBinHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    std::shared_ptr<ModelBinaryFile> pFile(new ModelBinaryFile);
+    void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::cout << "ModelBinaryFile: can't map " << sPath << std::endl;
+        return nullptr;
+    }
+    pFile->mpData = static_cast<unsigned char *>(p);
+    pFile->mnSize = st.st_size;
+    pFile->mpHeader = reinterpret_cast<const ModelBinHeader *>(pFile->mpData);
+    if (!pFile->Validate()) {
+        std::cout << "ModelBinaryFile: " << sPath << " is not a version " << MODEL_BINARY_VERSION
+                  << " model file" << std::endl;
+        return nullptr;
+    }
+    pFile->mpTileState.reset(new std::atomic<uint8_t>[pFile->TileCount()]());
+    return pFile;
+}
+
+// The header, the section bounds and the tile table. Everything else is
+// checked a tile at a time, by ValidateTile(), when it's first wanted, so
+// opening a large model doesn't read every record.
+bool ModelBinaryFile::Validate() const {
+    if (memcmp(mpHeader->acMagic, acModelMagic, sizeof(acModelMagic)) != 0 ||
+        mpHeader->nVersion != MODEL_BINARY_VERSION || mpHeader->nByteOrder != nModelByteOrder)
+        return false;
+
+    auto inside = [this](const ModelBinSection &s, size_t nRecordSize) {
+        return s.nOffset % nSectionAlign == 0 && s.nOffset <= mnSize &&
+               s.nCount <= (mnSize - s.nOffset) / nRecordSize;
+    };
+    if (!inside(mpHeader->name, 1) || !inside(mpHeader->keyFrames, sizeof(ModelBinKeyFrame)) ||
+        !inside(mpHeader->keyPoints, sizeof(ModelBinKeyPoint)) ||
+        !inside(mpHeader->worldPoints, sizeof(ModelBinWorldPoint)) ||
+        !inside(mpHeader->points, sizeof(ModelBinPoint)) ||
+        !inside(mpHeader->measurements, sizeof(ModelBinMeasurement)) ||
+        !inside(mpHeader->descriptors, 1) || !inside(mpHeader->strings, 1) ||
+        !inside(mpHeader->levels, sizeof(ModelBinLevel)) || !inside(mpHeader->pixels, 1) ||
+        !inside(mpHeader->corners, sizeof(ModelBinCorner)) ||
+        !inside(mpHeader->candidates, sizeof(ModelBinCandidate)) ||
+        !inside(mpHeader->tiles, sizeof(ModelBinTile)))
+        return false;
+    if (mpHeader->levels.nCount != 0 && mpHeader->levels.nCount != KeyFrameCount() * LEVELS)
+        return false;
+
+    // The tiles cover the keyframes and points in order
+    const ModelBinTile *pTiles = Tiles();
+    uint64_t nNextKF = 0, nNextPoint = 0;
+    for (size_t t = 0; t < TileCount(); t++) {
+        if (pTiles[t].nFirstKeyFrame != nNextKF || pTiles[t].nFirstPoint != nNextPoint)
+            return false;
+        nNextKF += pTiles[t].nKeyFrames;
+        nNextPoint += pTiles[t].nPoints;
+    }
+    return nNextKF == KeyFrameCount() && nNextPoint == PointCount();
+}
+
+// Everything reading a tile's records hands out has to lie inside the file,
+// and every point has to be in its source keyframe's tile, so a tile can be
+// loaded on its own.
+bool ModelBinaryFile::ValidateTile(size_t nTile) const {
+    uint8_t nState = mpTileState[nTile].load(std::memory_order_relaxed);
+    if (nState != TILE_UNCHECKED)
+        return nState == TILE_GOOD;
+
+    bool bGood = true;
+    const ModelBinTile &tile = Tiles()[nTile];
+    const ModelBinKeyFrame *pKFs = KeyFrames();
+    const ModelBinWorldPoint *pWorldPoints = WorldPoints();
+    const ModelBinMeasurement *pMeas = Measurements();
+    for (uint32_t i = tile.nFirstKeyFrame; bGood && i < tile.nFirstKeyFrame + tile.nKeyFrames; i++) {
+        const ModelBinKeyFrame &kf = pKFs[i];
+        uint64_t nDescriptorBytes = (uint64_t) kf.nDescriptorRows * kf.nDescriptorCols;
+        if ((uint64_t) kf.nImageOffset + kf.nImageLength > mpHeader->strings.nCount ||
+            (uint64_t) kf.nFirstKeyPoint + kf.nKeyPoints > mpHeader->keyPoints.nCount ||
+            (uint64_t) kf.nFirstWorldPoint + kf.nWorldPoints > mpHeader->worldPoints.nCount ||
+            kf.nDescriptorRows < 0 || kf.nDescriptorCols < 0 ||
+            kf.nDescriptorOffset + nDescriptorBytes > mpHeader->descriptors.nCount ||
+            (uint64_t) kf.nFirstMeasurement + kf.nMeasurements > mpHeader->measurements.nCount) {
+            bGood = false;
+            break;
+        }
+        // World points are looked up by keypoint in place, so they must be sorted
+        for (uint32_t w = 1; w < kf.nWorldPoints; w++)
+            if (pWorldPoints[kf.nFirstWorldPoint + w - 1].nKeyPoint >= pWorldPoints[kf.nFirstWorldPoint + w].nKeyPoint)
+                bGood = false;
+        for (uint32_t m = kf.nFirstMeasurement; m < kf.nFirstMeasurement + kf.nMeasurements; m++)
+            if (pMeas[m].nKF != (int32_t) i || pMeas[m].nPoint < 0 || (size_t) pMeas[m].nPoint >= PointCount())
+                bGood = false;
+    }
+
+    const ModelBinPoint *pPoints = Points();
+    for (uint32_t i = tile.nFirstPoint; bGood && i < tile.nFirstPoint + tile.nPoints; i++) {
+        int32_t nSource = pPoints[i].nSourceKF;
+        if (nSource < (int32_t) tile.nFirstKeyFrame || nSource >= (int32_t) (tile.nFirstKeyFrame + tile.nKeyFrames))
+            bGood = false;
+    }
+
+    // Stored levels: every corner and candidate has to lie in its level's image
+    const ModelBinLevel *pLevels = Section<ModelBinLevel>(mpHeader->levels);
+    const ModelBinCorner *pCorners = Section<ModelBinCorner>(mpHeader->corners);
+    const ModelBinCandidate *pCandidates = Section<ModelBinCandidate>(mpHeader->candidates);
+    size_t nFirstLevel = mpHeader->levels.nCount ? (size_t) tile.nFirstKeyFrame * LEVELS : 0;
+    size_t nEndLevel = mpHeader->levels.nCount ? (size_t) (tile.nFirstKeyFrame + tile.nKeyFrames) * LEVELS : 0;
+    for (size_t i = nFirstLevel; bGood && i < nEndLevel; i++) {
+        const ModelBinLevel &lev = pLevels[i];
+        if (lev.nEncoding == MODEL_PIXELS_NONE)
+            continue;
+        if (lev.nEncoding > MODEL_PIXELS_PNG || lev.nWidth <= 0 || lev.nHeight <= 0 ||
+            lev.nPixelOffset + lev.nPixelBytes > mpHeader->pixels.nCount ||
+            (lev.nEncoding == MODEL_PIXELS_RAW && lev.nPixelBytes != (uint64_t) lev.nWidth * lev.nHeight) ||
+            (uint64_t) lev.nFirstCorner + lev.nCorners > mpHeader->corners.nCount ||
+            (uint64_t) lev.nFirstMaxCorner + lev.nMaxCorners > mpHeader->corners.nCount ||
+            (uint64_t) lev.nFirstCandidate + lev.nCandidates > mpHeader->candidates.nCount) {
+            bGood = false;
+            break;
+        }
+        auto inImage = [&lev](int x, int y) { return x >= 0 && y >= 0 && x < lev.nWidth && y < lev.nHeight; };
+        for (uint32_t c = 0; c < lev.nCorners; c++)
+            if (!inImage(pCorners[lev.nFirstCorner + c].x, pCorners[lev.nFirstCorner + c].y))
+                bGood = false;
+        for (uint32_t c = 0; c < lev.nMaxCorners; c++)
+            if (!inImage(pCorners[lev.nFirstMaxCorner + c].x, pCorners[lev.nFirstMaxCorner + c].y))
+                bGood = false;
+        for (uint32_t c = 0; c < lev.nCandidates; c++)
+            if (!inImage(pCandidates[lev.nFirstCandidate + c].x, pCandidates[lev.nFirstCandidate + c].y))
+                bGood = false;
+    }
+
+    if (!bGood)
+        std::cout << "ModelBinaryFile: tile " << nTile << " of '" << Name() << "' is damaged" << std::endl;
+    mpTileState[nTile].store(bGood ? TILE_GOOD : TILE_BAD, std::memory_order_relaxed);
+    return bGood;
+}
+
+std::string ModelBinaryFile::Name() const {
+    return std::string(Section<char>(mpHeader->name), mpHeader->name.nCount);
+}
+
+int ModelBinaryFile::TileOfPoint(size_t nPoint) const {
+    const ModelBinTile *pTiles = Tiles();
+    const ModelBinTile *pEnd = pTiles + TileCount();
+    const ModelBinTile *pTile = std::upper_bound(pTiles, pEnd, nPoint, [](size_t n, const ModelBinTile &t) {
+        return n < t.nFirstPoint;
+    });
+    return pTile - pTiles - 1;
+}
+
+std::string ModelBinaryFile::ImageName(const ModelBinKeyFrame &kf) const {
+    if ((uint64_t) kf.nImageOffset + kf.nImageLength > mpHeader->strings.nCount)
+        return std::string();
+    return std::string(Section<char>(mpHeader->strings) + kf.nImageOffset, kf.nImageLength);
+}
+
+cv::Mat ModelBinaryFile::Descriptor(const ModelBinKeyFrame &kf) const {
+    // The reloc matcher takes every keyframe's descriptors, loaded or not, so
+    // this checks its own record rather than relying on ValidateTile()
+    if (kf.nDescriptorRows <= 0 || kf.nDescriptorCols <= 0 ||
+        kf.nDescriptorOffset + (uint64_t) kf.nDescriptorRows * kf.nDescriptorCols > mpHeader->descriptors.nCount)
+        return cv::Mat();
+    unsigned char *pBytes = mpData + mpHeader->descriptors.nOffset + kf.nDescriptorOffset;
+    return cv::Mat(kf.nDescriptorRows, kf.nDescriptorCols, CV_8UC1, pBytes);
+}
+
+bool ModelBinaryFile::ReadLevels(size_t nKF, KeyFrame &kf) const {
+    if (mpHeader->levels.nCount == 0)
+        return false;
+    const ModelBinLevel *pLevels = Section<ModelBinLevel>(mpHeader->levels) + nKF * LEVELS;
+    for (int l = 0; l < LEVELS; l++)
+        if (pLevels[l].nEncoding == MODEL_PIXELS_NONE)
+            return false;
+
+    // Pixels first, so a PNG that doesn't decode leaves the keyframe as it was
+    CVD::Image<CVD::byte> aim[LEVELS];
+    for (int l = 0; l < LEVELS; l++) {
+        const ModelBinLevel &bl = pLevels[l];
+        aim[l].resize(CVD::ImageRef(bl.nWidth, bl.nHeight));
+        cv::Mat dst(bl.nHeight, bl.nWidth, CV_8UC1, aim[l].data());
+        unsigned char *pPixels = mpData + mpHeader->pixels.nOffset + bl.nPixelOffset;
+        if (bl.nEncoding == MODEL_PIXELS_RAW) {
+            memcpy(aim[l].data(), pPixels, bl.nPixelBytes);
+        } else {
+            cv::Mat png = cv::imdecode(cv::Mat(1, bl.nPixelBytes, CV_8UC1, pPixels), cv::IMREAD_GRAYSCALE);
+            if (png.cols != bl.nWidth || png.rows != bl.nHeight)
+                return false;
+            png.copyTo(dst);
+        }
+    }
+
+    const ModelBinCorner *pCorners = Section<ModelBinCorner>(mpHeader->corners);
+    const ModelBinCandidate *pCandidates = Section<ModelBinCandidate>(mpHeader->candidates);
+    for (int l = 0; l < LEVELS; l++) {
+        const ModelBinLevel &bl = pLevels[l];
+        Level &lev = kf.aLevels[l];
+        lev.im = aim[l];
+        lev.vCorners.resize(bl.nCorners);
+        for (uint32_t c = 0; c < bl.nCorners; c++)
+            lev.vCorners[c] = CVD::ImageRef(pCorners[bl.nFirstCorner + c].x, pCorners[bl.nFirstCorner + c].y);
+        lev.MakeCornerRowLUT();
+        lev.vMaxCorners.resize(bl.nMaxCorners);
+        for (uint32_t c = 0; c < bl.nMaxCorners; c++)
+            lev.vMaxCorners[c] = CVD::ImageRef(pCorners[bl.nFirstMaxCorner + c].x, pCorners[bl.nFirstMaxCorner + c].y);
+        lev.vCandidates.resize(bl.nCandidates);
+        for (uint32_t c = 0; c < bl.nCandidates; c++) {
+            const ModelBinCandidate &bc = pCandidates[bl.nFirstCandidate + c];
+            lev.vCandidates[c].irLevelPos = CVD::ImageRef(bc.x, bc.y);
+            lev.vCandidates[c].dSTScore = bc.dSTScore;
+        }
+        lev.bImplaneCornersCached = false;
+        lev.vImplaneCorners.clear();
+    }
+    kf.state = KeyFrame::REST;
+    return true;
+}
+
+bool ModelBinaryFile::Write(const std::string &sPath, const PTAMModelFile &model,
+                            const std::vector<const KeyFrame *> &vLevelSources, bool bCompressPixels,
+                            double dTileSize) {
+    // Which tile each keyframe goes in, and the order everything is written in
+    size_t nKFs = model.keyframes.size();
+    std::vector<std::array<int, 3> > vCells(nKFs);
+    for (size_t i = 0; i < nKFs; i++) {
+        const auto &modelKF = model.keyframes[i];
+        Vector<3> v3Centre = SE3<>(SO3<>(modelKF.R), modelKF.T).inverse().get_translation();
+        for (int d = 0; d < 3; d++)
+            vCells[i][d] = dTileSize > 0 ? (int) std::floor(v3Centre[d] / dTileSize) : 0;
+    }
+    std::vector<size_t> vKFOrder(nKFs);
+    std::iota(vKFOrder.begin(), vKFOrder.end(), 0);
+    std::stable_sort(vKFOrder.begin(), vKFOrder.end(), [&vCells](size_t a, size_t b) {
+        bool bFirstA = vCells[a] == vCells[0], bFirstB = vCells[b] == vCells[0];
+        if (bFirstA != bFirstB)
+            return bFirstA;
+        return vCells[a] < vCells[b];
+    });
+    std::vector<int> vNewKF(nKFs), vKFTile(nKFs);
+    std::vector<ModelBinTile> vTiles;
+    for (size_t n = 0; n < nKFs; n++) {
+        vNewKF[vKFOrder[n]] = n;
+        if (n == 0 || vCells[vKFOrder[n]] != vCells[vKFOrder[n - 1]]) {
+            ModelBinTile t;
+            memset(&t, 0, sizeof(t));
+            for (int d = 0; d < 3; d++)
+                t.anCell[d] = vCells[vKFOrder[n]][d];
+            t.nFirstKeyFrame = n;
+            vTiles.push_back(t);
+        }
+        vTiles.back().nKeyFrames++;
+        vKFTile[n] = vTiles.size() - 1;
+    }
+
+    for (const auto &modelP : model.points)
+        if (modelP.sourceKF < 0 || (size_t) modelP.sourceKF >= nKFs) {
+            std::cout << "ModelBinaryFile: point with a bad source keyframe" << std::endl;
+            return false;
+        }
+    for (const auto &modelM : model.measurements)
+        if (modelM.kfID < 0 || (size_t) modelM.kfID >= nKFs || modelM.pointID < 0 ||
+            (size_t) modelM.pointID >= model.points.size()) {
+            std::cout << "ModelBinaryFile: measurement with a bad keyframe or point" << std::endl;
+            return false;
+        }
+    std::vector<size_t> vPointOrder(model.points.size());
+    std::iota(vPointOrder.begin(), vPointOrder.end(), 0);
+    std::stable_sort(vPointOrder.begin(), vPointOrder.end(), [&](size_t a, size_t b) {
+        return vKFTile[vNewKF[model.points[a].sourceKF]] < vKFTile[vNewKF[model.points[b].sourceKF]];
+    });
+    std::vector<int> vNewPoint(model.points.size());
+    for (size_t n = 0; n < vPointOrder.size(); n++) {
+        vNewPoint[vPointOrder[n]] = n;
+        vTiles[vKFTile[vNewKF[model.points[vPointOrder[n]].sourceKF]]].nPoints++;
+    }
+    uint32_t nNextPoint = 0;
+    for (auto &t : vTiles) {
+        t.nFirstPoint = nNextPoint;
+        nNextPoint += t.nPoints;
+    }
+
+    std::vector<size_t> vMeasOrder(model.measurements.size());
+    std::iota(vMeasOrder.begin(), vMeasOrder.end(), 0);
+    std::stable_sort(vMeasOrder.begin(), vMeasOrder.end(), [&](size_t a, size_t b) {
+        return vNewKF[model.measurements[a].kfID] < vNewKF[model.measurements[b].kfID];
+    });
+
+    std::vector<ModelBinKeyFrame> vKeyFrames;
+    std::vector<ModelBinKeyPoint> vKeyPoints;
+    std::vector<ModelBinWorldPoint> vWorldPoints;
+    std::vector<ModelBinPoint> vPoints;
+    std::vector<ModelBinMeasurement> vMeasurements;
+    std::vector<unsigned char> vDescriptors;
+    std::string sStrings;
+
+    std::vector<uint32_t> vFirstMeas(nKFs + 1, 0);
+    for (const auto &modelM : model.measurements)
+        vFirstMeas[vNewKF[modelM.kfID] + 1]++;
+    std::partial_sum(vFirstMeas.begin(), vFirstMeas.end(), vFirstMeas.begin());
+
+    for (size_t n = 0; n < nKFs; n++) {
+        const auto &modelKF = model.keyframes[vKFOrder[n]];
+        ModelBinKeyFrame kf;
+        memset(&kf, 0, sizeof(kf));
+        for (int d = 0; d < 3; d++) {
+            kf.adT[d] = modelKF.T[d];
+            kf.adR[d] = modelKF.R[d];
+        }
+        kf.nImageOffset = sStrings.size();
+        kf.nImageLength = modelKF.image.size();
+        sStrings += modelKF.image;
+
+        kf.nFirstKeyPoint = vKeyPoints.size();
+        kf.nKeyPoints = modelKF.keypoints.size();
+        for (const auto &mkp : modelKF.keypoints) {
+            const cv::KeyPoint &kp = mkp.keyPoint;
+            ModelBinKeyPoint b;
+            b.x = kp.pt.x;
+            b.y = kp.pt.y;
+            b.size = kp.size;
+            b.angle = kp.angle;
+            b.response = kp.response;
+            b.nClassID = kp.class_id;
+            b.nOctave = kp.octave;
+            b.nPad = 0;
+            vKeyPoints.push_back(b);
+        }
+
+        kf.nFirstWorldPoint = vWorldPoints.size();
+        kf.nWorldPoints = modelKF.worldPoints.size();
+        for (const auto &wp : modelKF.worldPoints) {
+            ModelBinWorldPoint b;
+            b.nKeyPoint = wp.first;
+            b.nPad = 0;
+            b.x = wp.second.point.x;
+            b.y = wp.second.point.y;
+            b.z = wp.second.point.z;
+            vWorldPoints.push_back(b);
+        }
+
+        const cv::Mat &desc = modelKF.descriptor.mat;
+        if (!desc.empty() && desc.type() != CV_8UC1) {
+            std::cout << "ModelBinaryFile: descriptors must be CV_8UC1" << std::endl;
+            return false;
+        }
+        kf.nDescriptorOffset = vDescriptors.size();
+        kf.nDescriptorRows = desc.rows;
+        kf.nDescriptorCols = desc.cols;
+        for (int r = 0; r < desc.rows; r++)
+            vDescriptors.insert(vDescriptors.end(), desc.ptr<unsigned char>(r), desc.ptr<unsigned char>(r) + desc.cols);
+        kf.nFirstMeasurement = vFirstMeas[n];
+        kf.nMeasurements = vFirstMeas[n + 1] - vFirstMeas[n];
+        vKeyFrames.push_back(kf);
+    }
+
+    std::vector<ModelBinLevel> vLevels;
+    std::vector<unsigned char> vPixels;
+    std::vector<ModelBinCorner> vCorners;
+    std::vector<ModelBinCandidate> vCandidates;
+    bool bAnyLevels = false;
+    auto putCorners = [&vCorners](const std::vector<CVD::ImageRef> &v) {
+        for (const auto &ir : v) {
+            ModelBinCorner c;
+            c.x = ir.x;
+            c.y = ir.y;
+            vCorners.push_back(c);
+        }
+    };
+    for (size_t n = 0; n < nKFs; n++) {
+        size_t i = vKFOrder[n];
+        const KeyFrame *pKF = i < vLevelSources.size() ? vLevelSources[i] : NULL;
+        bool bStore = pKF && pKF->state == KeyFrame::REST;
+        for (int l = 0; l < LEVELS; l++) {
+            ModelBinLevel b;
+            memset(&b, 0, sizeof(b));
+            if (bStore) {
+                const Level &lev = pKF->aLevels[l];
+                b.nWidth = lev.im.size().x;
+                b.nHeight = lev.im.size().y;
+                b.nPixelOffset = vPixels.size();
+                cv::Mat im(b.nHeight, b.nWidth, CV_8UC1, const_cast<CVD::byte *>(lev.im.data()));
+                std::vector<unsigned char> vPNG;
+                if (bCompressPixels && cv::imencode(".png", im, vPNG)) {
+                    b.nEncoding = MODEL_PIXELS_PNG;
+                    vPixels.insert(vPixels.end(), vPNG.begin(), vPNG.end());
+                } else {
+                    b.nEncoding = MODEL_PIXELS_RAW;
+                    for (int y = 0; y < b.nHeight; y++)
+                        vPixels.insert(vPixels.end(), im.ptr<unsigned char>(y), im.ptr<unsigned char>(y) + b.nWidth);
+                }
+                b.nPixelBytes = vPixels.size() - b.nPixelOffset;
+
+                b.nFirstCorner = vCorners.size();
+                b.nCorners = lev.vCorners.size();
+                putCorners(lev.vCorners);
+                b.nFirstMaxCorner = vCorners.size();
+                b.nMaxCorners = lev.vMaxCorners.size();
+                putCorners(lev.vMaxCorners);
+                b.nFirstCandidate = vCandidates.size();
+                b.nCandidates = lev.vCandidates.size();
+                for (const auto &c : lev.vCandidates) {
+                    ModelBinCandidate bc;
+                    bc.x = c.irLevelPos.x;
+                    bc.y = c.irLevelPos.y;
+                    bc.dSTScore = c.dSTScore;
+                    vCandidates.push_back(bc);
+                }
+                bAnyLevels = true;
+            }
+            vLevels.push_back(b);
+        }
+    }
+    if (!bAnyLevels)
+        vLevels.clear();
+
+    for (size_t i : vPointOrder) {
+        const auto &modelP = model.points[i];
+        ModelBinPoint b;
+        memset(&b, 0, sizeof(b));
+        b.nSourceKF = vNewKF[modelP.sourceKF];
+        b.nCenterX = modelP.centerX;
+        b.nCenterY = modelP.centerY;
+        b.x = modelP.x;
+        b.y = modelP.y;
+        b.z = modelP.z;
+        b.nSourceLevel = modelP.sourceLevel;
+        b.bFromModel = modelP.fromModel;
+        vPoints.push_back(b);
+    }
+
+    for (size_t i : vMeasOrder) {
+        const auto &modelM = model.measurements[i];
+        ModelBinMeasurement b;
+        memset(&b, 0, sizeof(b));
+        b.nKF = vNewKF[modelM.kfID];
+        b.nPoint = vNewPoint[modelM.pointID];
+        b.x = modelM.x;
+        b.y = modelM.y;
+        b.nSource = modelM.source;
+        b.nLevel = modelM.level;
+        b.bSubPix = modelM.sub;
+        vMeasurements.push_back(b);
+    }
+
+    // Lay the sections out one after the other, each aligned
+    ModelBinHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.acMagic, acModelMagic, sizeof(acModelMagic));
+    header.nVersion = MODEL_BINARY_VERSION;
+    header.nByteOrder = nModelByteOrder;
+    header.dOneCM = model.oneCM;
+    header.dTileSize = std::max(dTileSize, 0.0);
+    uint64_t nEnd = sizeof(header);
+    auto place = [&nEnd](ModelBinSection &s, uint64_t nCount, uint64_t nRecordSize) {
+        nEnd = (nEnd + nSectionAlign - 1) / nSectionAlign * nSectionAlign;
+        s.nOffset = nEnd;
+        s.nCount = nCount;
+        nEnd += nCount * nRecordSize;
+    };
+    place(header.name, model.name.size(), 1);
+    place(header.keyFrames, vKeyFrames.size(), sizeof(ModelBinKeyFrame));
+    place(header.keyPoints, vKeyPoints.size(), sizeof(ModelBinKeyPoint));
+    place(header.worldPoints, vWorldPoints.size(), sizeof(ModelBinWorldPoint));
+    place(header.points, vPoints.size(), sizeof(ModelBinPoint));
+    place(header.measurements, vMeasurements.size(), sizeof(ModelBinMeasurement));
+    place(header.descriptors, vDescriptors.size(), 1);
+    place(header.strings, sStrings.size(), 1);
+    place(header.levels, vLevels.size(), sizeof(ModelBinLevel));
+    place(header.pixels, vPixels.size(), 1);
+    place(header.corners, vCorners.size(), sizeof(ModelBinCorner));
+    place(header.candidates, vCandidates.size(), sizeof(ModelBinCandidate));
+    place(header.tiles, vTiles.size(), sizeof(ModelBinTile));
+
+    std::string sTemp = sPath + ".tmp";
+    {
+        std::ofstream file(sTemp, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cout << "ModelBinaryFile: can't write " << sTemp << std::endl;
+            return false;
+        }
+        uint64_t nWritten = 0;
+        auto put = [&file, &nWritten](const ModelBinSection &s, const void *pData, uint64_t nBytes) {
+            static const char acZeros[nSectionAlign] = {};
+            file.write(acZeros, s.nOffset - nWritten);
+            file.write(static_cast<const char *>(pData), nBytes);
+            nWritten = s.nOffset + nBytes;
+        };
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        nWritten = sizeof(header);
+        put(header.name, model.name.data(), model.name.size());
+        put(header.keyFrames, vKeyFrames.data(), vKeyFrames.size() * sizeof(ModelBinKeyFrame));
+        put(header.keyPoints, vKeyPoints.data(), vKeyPoints.size() * sizeof(ModelBinKeyPoint));
+        put(header.worldPoints, vWorldPoints.data(), vWorldPoints.size() * sizeof(ModelBinWorldPoint));
+        put(header.points, vPoints.data(), vPoints.size() * sizeof(ModelBinPoint));
+        put(header.measurements, vMeasurements.data(), vMeasurements.size() * sizeof(ModelBinMeasurement));
+        put(header.descriptors, vDescriptors.data(), vDescriptors.size());
+        put(header.strings, sStrings.data(), sStrings.size());
+        put(header.levels, vLevels.data(), vLevels.size() * sizeof(ModelBinLevel));
+        put(header.pixels, vPixels.data(), vPixels.size());
+        put(header.corners, vCorners.data(), vCorners.size() * sizeof(ModelBinCorner));
+        put(header.candidates, vCandidates.data(), vCandidates.size() * sizeof(ModelBinCandidate));
+        put(header.tiles, vTiles.data(), vTiles.size() * sizeof(ModelBinTile));
+        if (!file.good()) {
+            std::cout << "ModelBinaryFile: failed writing " << sTemp << std::endl;
+            return false;
+        }
+    }
+    if (std::rename(sTemp.c_str(), sPath.c_str()) != 0) {
+        std::cout << "ModelBinaryFile: can't rename " << sTemp << " to " << sPath << std::endl;
+        return false;
+    }
+    return true;
+}
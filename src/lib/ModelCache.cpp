@@ -0,0 +1,56 @@
+#include <sstream>
+
+#include <ptamsp/ModelCache.h>
+
+std::string ModelCache::Key(const std::string &sFolder, CVD::ImageRef irImageSize) {
+    std::ostringstream ss;
+    ss << sFolder << "@" << irImageSize.x << "x" << irImageSize.y;
+    return ss.str();
+}
+
+std::vector<CachedModel> ModelCache::Put(CachedModel &&model, size_t nMaxBytes) {
+    std::vector<CachedModel> vEvicted;
+    CachedModel stale;
+    if (Take(model.sKey, stale))   // Shouldn't happen, but never hold two of one model
+        vEvicted.push_back(std::move(stale));
+    if (model.nBytes > nMaxBytes) {
+        vEvicted.push_back(std::move(model));
+        return vEvicted;
+    }
+    mnBytes += model.nBytes;
+    mlEntries.push_front(std::move(model));
+    while (mnBytes > nMaxBytes) {
+        mnBytes -= mlEntries.back().nBytes;
+        vEvicted.push_back(std::move(mlEntries.back()));
+        mlEntries.pop_back();
+    }
+    return vEvicted;
+}
+
+bool ModelCache::Take(const std::string &sKey, CachedModel &model) {
+    for (auto it = mlEntries.begin(); it != mlEntries.end(); it++) {
+        if (it->sKey == sKey) {
+            mnBytes -= it->nBytes;
+            model = std::move(*it);
+            mlEntries.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ModelCache::Contains(const std::string &sKey) const {
+    for (const auto &m : mlEntries)
+        if (m.sKey == sKey)
+            return true;
+    return false;
+}
+
+std::vector<CachedModel> ModelCache::Clear() {
+    std::vector<CachedModel> vAll;
+    for (auto &m : mlEntries)
+        vAll.push_back(std::move(m));
+    mlEntries.clear();
+    mnBytes = 0;
+    return vAll;
+}
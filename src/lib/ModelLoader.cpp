@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <iostream>
+
+#include <ptamsp/ModelLoader.h>
+#include <ptamsp/MapMaker.h>
+
+ModelLoader::ModelLoader(const ATANCamera &cam, const std::string &sDeviceFolder)
+        : mCamera(cam), msDeviceFolder(sDeviceFolder) {
+}
+
+ModelLoader::~ModelLoader() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mbStop = true;
+    }
+    mcvWork.notify_all();
+    if (mWorker.joinable())
+        mWorker.join();
+    // A model nobody took: put it back so the staging map frees it
+    if (mbReady)
+        mStaging.RestoreContents(mReady.contents);
+}
+
+void ModelLoader::Request(const std::string &sFolder, CVD::ImageRef irImageSize, bool bPrefetch) {
+    static const size_t MAX_JOBS = 2;
+    Job job{sFolder, ModelCache::Key(sFolder, irImageSize), irImageSize};
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (job.sKey == msLoadingKey || (mbReady && job.sKey == mReady.sKey))
+            return;
+        auto it = std::find_if(mdqJobs.begin(), mdqJobs.end(), [&](const Job &j) { return j.sKey == job.sKey; });
+        if (it != mdqJobs.end()) {
+            if (bPrefetch)
+                return;
+            mdqJobs.erase(it);
+        }
+        if (bPrefetch)
+            mdqJobs.push_back(job);
+        else
+            mdqJobs.push_front(job);
+        while (mdqJobs.size() > MAX_JOBS)
+            mdqJobs.pop_back();
+        if (!mWorker.joinable())
+            mWorker = std::thread(&ModelLoader::WorkerLoop, this);
+    }
+    mcvWork.notify_one();
+}
+
+bool ModelLoader::IsPending(const std::string &sKey) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (sKey == msLoadingKey || (mbReady && sKey == mReady.sKey))
+        return true;
+    return std::any_of(mdqJobs.begin(), mdqJobs.end(), [&](const Job &j) { return j.sKey == sKey; });
+}
+
+bool ModelLoader::TakeReady(CachedModel &model, Map &map) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mbReady)
+            return false;
+        if (!map.pointPool.Adopt(mStaging.pointPool)) {
+            std::cout << "ModelLoader: can't hand over the points of " << mReady.sKey << std::endl;
+            return false;
+        }
+        model = std::move(mReady);
+        mReady = CachedModel();
+        mbReady = false;
+    }
+    mcvWork.notify_one();
+    return true;
+}
+
+void ModelLoader::WorkerLoop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mcvWork.wait(lock, [&] { return mbStop || (!mbReady && !mdqJobs.empty()); });
+            if (mbStop)
+                return;
+            job = mdqJobs.front();
+            mdqJobs.pop_front();
+            msLoadingKey = job.sKey;
+        }
+
+        CachedModel model;
+        mCamera.SetImageSize(job.irImageSize);
+        bool bOK = MapMaker::PrepareModel(mStaging, mCamera, msDeviceFolder + "/" + job.sFolder, model);
+        model.sKey = job.sKey;
+        // Whatever a failed load left behind. Nothing else reads this map, so it can all go now.
+        mStaging.Reset();
+        mStaging.Reclaim(mStaging.epochs.Current());
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        msLoadingKey.clear();
+        if (!bOK) {
+            std::cout << "ModelLoader: can't load " << job.sFolder << std::endl;
+            continue;
+        }
+        mReady = std::move(model);
+        mbReady = true;
+    }
+}
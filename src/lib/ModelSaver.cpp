@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gvars3/instances.h>
+
+#include <opencv2/imgcodecs.hpp>
+#include <cereal/archives/binary.hpp>
+
+#include <ptamsp/ModelSaver.h>
+#include <ptamsp/ModelBinaryFile.h>
+#include <ptamsp/WorkerPool.h>
+
+namespace fs = std::filesystem;
+
+// Flushes a file or folder to disk
+static bool SyncPath(const std::string &sPath) {
+    int fd = open(sPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool bOK = fsync(fd) == 0;
+    close(fd);
+    return bOK;
+}
+
+// A hard link if it can be, else a copy
+static bool LinkOrCopy(const std::string &sFrom, const std::string &sTo) {
+    std::error_code ec;
+    fs::create_hard_link(sFrom, sTo, ec);
+    if (ec)
+        fs::copy_file(sFrom, sTo, fs::copy_options::overwrite_existing, ec);
+    return !ec;
+}
+
+static bool WriteKeyFrameImage(const ModelSnapshot &s, const std::string &sStaging, size_t i) {
+    std::string sPath = sStaging + "/" + s.model.keyframes[i].image;
+    const CVD::Image<CVD::byte> &im = s.vpKeyFrames[i]->aLevels[0].im;
+    if (im.size().x > 0) {
+        cv::Mat img(im.size().y, im.size().x, CV_8UC1, const_cast<CVD::byte *>(im.data()));
+        if (!cv::imwrite(sPath, img)) {
+            std::cout << "ModelSaver: can't write " << sPath << std::endl;
+            return false;
+        }
+    } else if (KeyFrame::IsSpillFile(s.vsSourceImages[i])) {
+        CVD::Image<CVD::byte> imSpilled;
+        if (!KeyFrame::ReadImage(s.vsSourceImages[i], imSpilled)) {
+            std::cout << "ModelSaver: can't read " << s.vsSourceImages[i] << std::endl;
+            return false;
+        }
+        cv::Mat img(imSpilled.size().y, imSpilled.size().x, CV_8UC1, imSpilled.data());
+        if (!cv::imwrite(sPath, img)) {
+            std::cout << "ModelSaver: can't write " << sPath << std::endl;
+            return false;
+        }
+    } else if (!LinkOrCopy(s.vsSourceImages[i], sPath)) {
+        std::cout << "ModelSaver: can't copy " << s.vsSourceImages[i] << " to " << sPath << std::endl;
+        return false;
+    }
+    return SyncPath(sPath);
+}
+
+static bool WriteModelFiles(const ModelSnapshot &s, const std::string &sStaging, WorkerPool *pPool) {
+    // JPEG encoding is most of the work, and each image is independent
+    std::atomic<bool> bImagesOK(true);
+    auto writeImages = [&](int nBegin, int nEnd) {
+        for (int i = nBegin; i < nEnd; i++)
+            if (!WriteKeyFrameImage(s, sStaging, i))
+                bImagesOK = false;
+    };
+    if (pPool)
+        pPool->ParallelFor(s.vpKeyFrames.size(), writeImages);
+    else
+        writeImages(0, s.vpKeyFrames.size());
+    if (!bImagesOK)
+        return false;
+
+    std::string sPath = sStaging + "/data_ptam";
+    {
+        std::ofstream loaderFile(sPath, std::ios::binary | std::ios::trunc);
+        if (!loaderFile.is_open()) {
+            std::cout << "ModelSaver: can't write " << sPath << std::endl;
+            return false;
+        }
+        {
+            cereal::BinaryOutputArchive oarchive(loaderFile);
+            oarchive(s.model);
+        }
+        if (!loaderFile.good()) {
+            std::cout << "ModelSaver: failed writing " << sPath << std::endl;
+            return false;
+        }
+    }
+
+    // ... and in the binary format, which is what gets loaded. That also carries
+    // the keyframes' pyramids and features, so loading needn't recompute them.
+    std::vector<const KeyFrame *> vLevelSources;
+    for (const auto &kf : s.vpKeyFrames)
+        vLevelSources.push_back(kf.get());
+    std::string sBinPath = sStaging + "/data_ptam.bin";
+    if (!ModelBinaryFile::Write(sBinPath, s.model, vLevelSources, s.bCompressLevels, s.dTileSize))
+        return false;
+    return SyncPath(sPath) && SyncPath(sBinPath);
+}
+
+// Anything else in the folder being replaced (files the model doesn't name)
+// is carried over into the new one.
+static bool CarryOverOtherFiles(const std::string &sFolder, const std::string &sStaging) {
+    std::error_code ec;
+    if (!fs::is_directory(sFolder, ec))
+        return true;
+    for (const auto &entry : fs::directory_iterator(sFolder, ec)) {
+        fs::path target = fs::path(sStaging) / entry.path().filename();
+        if (fs::exists(target))
+            continue;
+        if (entry.is_directory())
+            fs::copy(entry.path(), target, fs::copy_options::recursive, ec);
+        else if (!LinkOrCopy(entry.path().string(), target.string()))
+            ec = std::make_error_code(std::errc::io_error);
+        if (ec) {
+            std::cout << "ModelSaver: can't carry over " << entry.path() << std::endl;
+            return false;
+        }
+    }
+    return !ec;
+}
+
+// Puts the finished staging folder where the model goes. With an old model
+// there, the two are exchanged in one step; where the filesystem can't do
+// that, the old one is moved aside first, leaving a moment with neither.
+static bool SwapIntoPlace(const std::string &sStaging, const std::string &sFolder) {
+    std::error_code ec;
+    if (!fs::exists(sFolder, ec)) {
+        if (std::rename(sStaging.c_str(), sFolder.c_str()) != 0)
+            return false;
+    } else if (renameat2(AT_FDCWD, sStaging.c_str(), AT_FDCWD, sFolder.c_str(), RENAME_EXCHANGE) == 0) {
+        fs::remove_all(sStaging, ec);   // Now the old model
+    } else {
+        std::string sOld = sFolder + ".old";
+        fs::remove_all(sOld, ec);
+        if (std::rename(sFolder.c_str(), sOld.c_str()) != 0)
+            return false;
+        if (std::rename(sStaging.c_str(), sFolder.c_str()) != 0) {
+            std::rename(sOld.c_str(), sFolder.c_str());
+            return false;
+        }
+        fs::remove_all(sOld, ec);
+    }
+    std::string sParent = fs::absolute(sFolder, ec).parent_path().string();
+    SyncPath(sParent);
+    return true;
+}
+
+bool ModelSaver::Write(const ModelSnapshot &s, WorkerPool *pPool) {
+    std::string sFolder = s.sFolder;
+    while (sFolder.size() > 1 && sFolder.back() == '/')
+        sFolder.pop_back();
+    std::string sStaging = sFolder + ".saving";
+    std::error_code ec;
+    fs::remove_all(sStaging, ec);   // Left by a save that didn't finish
+    if (!fs::create_directories(sStaging, ec)) {
+        std::cout << "ModelSaver: can't make " << sStaging << std::endl;
+        return false;
+    }
+    if (!WriteModelFiles(s, sStaging, pPool) || !CarryOverOtherFiles(sFolder, sStaging) || !SyncPath(sStaging) ||
+        !SwapIntoPlace(sStaging, sFolder)) {
+        std::cout << "ModelSaver: " << sFolder << " left as it was" << std::endl;
+        fs::remove_all(sStaging, ec);
+        return false;
+    }
+    return true;
+}
+
+ModelSaver::ModelSaver() {
+}
+
+ModelSaver::~ModelSaver() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mbStop = true;
+    }
+    mcvWork.notify_all();
+    if (mWorker.joinable())
+        mWorker.join();
+}
+
+void ModelSaver::Save(std::unique_ptr<ModelSnapshot> pSnapshot) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mdqSnapshots.push_back(std::move(pSnapshot));
+        if (!mWorker.joinable())
+            mWorker = std::thread(&ModelSaver::WorkerLoop, this);
+    }
+    mcvWork.notify_one();
+}
+
+size_t ModelSaver::Pending() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mdqSnapshots.size() + (mbBusy ? 1 : 0);
+}
+
+void ModelSaver::CollectFinished() {
+    std::vector<std::unique_ptr<ModelSnapshot> > vFinished;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        vFinished.swap(mvFinished);
+    }
+}
+
+void ModelSaver::WorkerLoop() {
+    // A few threads, so as not to starve the tracker
+    static GVars3::gvar3<int> gvnSaveThreads("Model.SaveThreads", 2, GVars3::SILENT);
+    WorkerPool pool(std::max(1, *gvnSaveThreads));
+    while (true) {
+        std::unique_ptr<ModelSnapshot> pSnapshot;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mbBusy = false;
+            mcvWork.wait(lock, [&] { return mbStop || !mdqSnapshots.empty(); });
+            if (mdqSnapshots.empty())
+                return;   // Stopping, with nothing left to save
+            pSnapshot = std::move(mdqSnapshots.front());
+            mdqSnapshots.pop_front();
+            mbBusy = true;
+        }
+        if (Write(*pSnapshot, &pool))
+            std::cout << "ModelSaver: saved '" << pSnapshot->model.name << "' to " << pSnapshot->sFolder << std::endl;
+        else
+            std::cout << "ModelSaver: saving '" << pSnapshot->model.name << "' to " << pSnapshot->sFolder << " failed" << std::endl;
+        std::lock_guard<std::mutex> lock(mMutex);
+        mvFinished.push_back(std::move(pSnapshot));   // Its images are freed back on the owner's thread
+    }
+}
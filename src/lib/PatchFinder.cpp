@@ -39,13 +39,21 @@ PatchFinder::PatchFinder(int nPatchSize)
 int PatchFinder::CalcSearchLevelAndWarpMatrix(MapPoint &p,
                                               SE3<> se3CFromW,
                                               Matrix<2> &m2CamDerivs) {
+    return CalcSearchLevelAndWarpMatrix(p.v3WorldPos, p.v3PixelRight_W, p.v3PixelDown_W, se3CFromW, m2CamDerivs);
+}
+
+int PatchFinder::CalcSearchLevelAndWarpMatrix(const Vector<3> &v3WorldPos,
+                                              const Vector<3> &v3PixelRight_W,
+                                              const Vector<3> &v3PixelDown_W,
+                                              SE3<> se3CFromW,
+                                              Matrix<2> &m2CamDerivs) {
     // Calc point pos in new view camera frame
     // Slightly dumb that we re-calculate this here when the tracker's already done this!
-    Vector<3> v3Cam = se3CFromW * p.v3WorldPos;
+    Vector<3> v3Cam = se3CFromW * v3WorldPos;
     double dOneOverCameraZ = 1.0 / v3Cam[2];
     // Project the source keyframe's one-pixel-right and one-pixel-down vectors into the current view
-    Vector<3> v3MotionRight = se3CFromW.get_rotation() * p.v3PixelRight_W;
-    Vector<3> v3MotionDown = se3CFromW.get_rotation() * p.v3PixelDown_W;
+    Vector<3> v3MotionRight = se3CFromW.get_rotation() * v3PixelRight_W;
+    Vector<3> v3MotionDown = se3CFromW.get_rotation() * v3PixelDown_W;
     // Calculate in-image derivatives of source image pixel motions:
     mm2WarpInverse.T()[0] =
             m2CamDerivs * (v3MotionRight.slice<0, 2>() - v3Cam.slice<0, 2>() * v3MotionRight[2] * dOneOverCameraZ) *
@@ -84,6 +92,11 @@ void PatchFinder::MakeTemplateCoarse(MapPoint &p,
 
 // This function generates the warped search template.
 void PatchFinder::MakeTemplateCoarseCont(MapPoint &p) {
+    MakeTemplateCoarseCont(p, *p.pPatchSourceKF, p.nSourceLevel, p.irCenter);
+}
+
+// p is only used to recognise a repeat request for the same point.
+void PatchFinder::MakeTemplateCoarseCont(MapPoint &p, KeyFrame &kSource, int nSourceLevel, ImageRef irCenter) {
     // Get the warping matrix appropriate for use with CVD::transform...
     Matrix<2> m2 = M2Inverse(mm2WarpInverse) * LevelScale(mnSearchLevel);
     // m2 now represents the number of pixels in the source image for one
@@ -109,10 +122,10 @@ void PatchFinder::MakeTemplateCoarseCont(MapPoint &p) {
     if (bNeedToRefreshTemplate) {
         int nOutside;  // Use CVD::transform to warp the patch according the the warping matrix m2
         // This returns the number of pixels outside the source image hit, which should be zero.
-        nOutside = CVD::transform(p.pPatchSourceKF->aLevels[p.nSourceLevel].im,
+        nOutside = CVD::transform(kSource.aLevels[nSourceLevel].im,
                                   mimTemplate,
                                   m2,
-                                  vec(p.irCenter),
+                                  vec(irCenter),
                                   vec(mirCenter));
 
         if (nOutside)
@@ -32,6 +32,7 @@ Tracker::Tracker(CVD::ImageRef irVideoSize, const ATANCamera &c, Map &m, MapMake
     mCurrentKF.bFixed = false;
     GUI.RegisterCommand("Reset", GUICommandCallBack, this);
     TrackerData::irImageSize = mirSize;
+    mnEpochSlot = mMap.epochs.RegisterReader();
 
     mpSBILastFrame = NULL;
     mpSBIThisFrame = NULL;
@@ -83,6 +84,9 @@ void Tracker::Reset() {
 // functions. bDraw tells the tracker wether it should output any GL graphics
 // or not (it should not draw, for example, when AR stuff is being shown.)
 void Tracker::TrackFrame(cv::Mat &imFrame) {
+    // Map points and keyframes seen during this frame stay valid until it's done.
+    EpochManager::Guard epochGuard(mMap.epochs, mnEpochSlot);
+
     auto tmp = CVD::BasicImage<CVD::byte>(imFrame.data, mirSize);
     Image<byte> imBW(mirSize);
     convert_image(tmp, imBW);
@@ -121,6 +125,8 @@ void Tracker::TrackFrame(cv::Mat &imFrame) {
         UpdateMotionModel();      //
 
         AssessTrackingQuality();  //  Check if we're lost or if tracking is poor.
+        if (mTrackingQuality != BAD)
+            mMapMaker.SetPoseHint(mse3CamFromWorld);   // Loaded keyframes near here get prepared first
 
         { // Provide some feedback for the user:
             mMessageForUser << "Tracking Map: '" << mMapMaker.currentModelName << "', quality ";
@@ -131,13 +137,15 @@ void Tracker::TrackFrame(cv::Mat &imFrame) {
             for (int i = 0; i < LEVELS; i++)
                 mMessageForUser << " " << manMeasFound[i] << "/" << manMeasAttempted[i];
             //	    mMessageForUser << " Found " << mnMeasFound << " of " << mnMeasAttempted <<". (";
-            mMessageForUser << " Map: " << mMap.vpPoints.size() << "P, " << mMap.vpKeyFrames.size() << "KF";
+            mMessageForUser << " Map: " << mMap.Lists()->vpPoints.size() << "P, " << mMap.Lists()->vpKeyFrames.size() << "KF";
         }
 
         // Heuristics to check if a key-frame should be added to the map:
         if (mTrackingQuality == GOOD && mnFrame - mnLastKeyFrameDropped > 20 && mMapMaker.QueueSize() < 3 && mMapMaker.NeedNewKeyFrame(mCurrentKF) ) {
-            mMessageForUser << " Adding key-frame.";
-            AddNewKeyFrame();
+            if (AddNewKeyFrame())
+                mMessageForUser << " Adding key-frame.";
+            else
+                mMessageForUser << " Key-frame queue full, will retry.";
         };
     } else  // tracking has been lost
     {
@@ -152,10 +160,9 @@ void Tracker::TrackFrame(cv::Mat &imFrame) {
     }
 
     // GUI interface
-    while (!mvQueuedCommands.empty()) {
-        GUICommandHandler(mvQueuedCommands.begin()->sCommand, mvQueuedCommands.begin()->sParams);
-        mvQueuedCommands.erase(mvQueuedCommands.begin());
-    }
+    Command c;
+    while (mqQueuedCommands.TryPop(c))
+        GUICommandHandler(c.sCommand, c.sParams);
 };
 
 // Try to relocalise in case tracking was lost.
@@ -166,14 +173,13 @@ void Tracker::TrackFrame(cv::Mat &imFrame) {
 // but the way it is now gives a snappier response and I prefer it.
 bool Tracker::AttemptRecovery() {
     mMapMaker.AddRelocImage(mCurrentKF);
-    if (!mMapMaker.NewRelocPoseReady()) {
+    SE3<> se3Best;
+    KeyFrame *pBest;
+    if (!mMapMaker.PopRelocResult(se3Best, pBest))
         return false;
-    }
-    auto se3Best = mMapMaker.LastRelocPose();
-    auto nBest = mMapMaker.BestRelocKeyFrame();
     if (MatrixHasNaN(se3Best))
         return false;
-    if (mMapMaker.IsDistanceToRelocKeyFrameExcessive(se3Best, *mMap.vpKeyFrames[nBest]))
+    if (mMapMaker.IsDistanceToRelocKeyFrameExcessive(se3Best, *pBest))
         return false;
 
     mse3CamFromWorld = mse3StartPos = se3Best;
@@ -183,13 +189,14 @@ bool Tracker::AttemptRecovery() {
 }
 
 // GUI interface. Stuff commands onto the back of a queue so the tracker handles
-// them in its own thread at the end of each frame. Note the charming lack of
-// any thread safety (no lock on mvQueuedCommands).
+// them in its own thread at the end of each frame. mqQueuedCommands is a
+// single-producer/single-consumer queue, so this must only be called from the GUI thread.
 void Tracker::GUICommandCallBack(void *ptr, std::string sCommand, std::string sParams) {
     Command c;
     c.sCommand = sCommand;
     c.sParams = sParams;
-    ((Tracker *) ptr)->mvQueuedCommands.push_back(c);
+    if (!((Tracker *) ptr)->mqQueuedCommands.TryPush(std::move(c)))
+        std::cout << "! Tracker::GUICommandCallBack: command queue full, dropping " << sCommand << std::endl;
 }
 
 // This is called in the tracker's own thread.
@@ -224,16 +231,37 @@ void Tracker::TrackMap() {
     for (int i = 0; i < LEVELS; i++)
         avPVS[i].reserve(500);
 
-    // For all points in the map..
-    for (unsigned int i = 0; i < mMap.vpPoints.size(); i++) {
-        MapPoint &p = *(mMap.vpPoints[i]);
-        // Ensure that this map point has an associated TrackerData struct.
-        if (!p.pTData)
-            p.pTData = new TrackerData(&p);
-        TrackerData &TData = *p.pTData;
+    // Take a consistent copy of the published state of the points which
+    // might be visible. Points behind the camera or outside the image's
+    // largest radius on the z=1 plane are culled from their live position
+    // and never copied. If the mapmaker publishes bundle adjustment results
+    // while we copy, just copy again. The rest of the frame only looks at
+    // the points in the copy. The point list itself is the published one,
+    // which never changes, and its points stay allocated while we're in
+    // this frame's epoch.
+    const std::vector<MapPoint *> &vpPoints = mMap.Lists()->vpPoints;
+    const double dMaxRadiusSq = mCamera.LargestRadiusInImage() * mCamera.LargestRadiusInImage();
+    unsigned int nVersion;
+    do {
+        nVersion = mMap.poseSeq.ReadBegin();
+        mvpSnapshot.clear();
+        for (unsigned int i = 0; i < vpPoints.size(); i++) {
+            TrackerData *pTData = vpPoints[i]->pTData;   // Allocated alongside the point by the map's pool
+            if (!pTData->MayBeInImage(mse3CamFromWorld, dMaxRadiusSq))
+                continue;
+            pTData->Snapshot();
+            mvpSnapshot.push_back(pTData);
+        }
+    } while (mMap.poseSeq.ReadRetry(nVersion));
+
+    // For all points that survived the cull..
+    for (unsigned int i = 0; i < mvpSnapshot.size(); i++) {
+        TrackerData &TData = *mvpSnapshot[i];
 
         // Project according to current view, and if it's not in the image, skip.
         TData.Project(mse3CamFromWorld, mCamera);
+        if (TData.bSourcePagedOut)
+            TData.bInImage = TData.bPotentiallyVisible = false;
         if (!TData.bInImage)
             continue;
 
@@ -241,7 +269,7 @@ void Tracker::TrackMap() {
         TData.GetDerivsUnsafe(mCamera);
 
         // And check what the PatchFinder (included in TrackerData) makes of the mappoint in this view..
-        TData.nSearchLevel = TData.Finder.CalcSearchLevelAndWarpMatrix(TData.Point, mse3CamFromWorld,TData.m2CamDerivs);
+        TData.nSearchLevel = TData.CalcSearchLevelAndWarpMatrix(mse3CamFromWorld);
         if (TData.nSearchLevel == -1) {
             continue;   // a negative search pyramid level indicates an inappropriate warp for this view, so skip.
         }
@@ -490,7 +518,7 @@ int Tracker::SearchForPoints(std::vector<TrackerData *> &vTD, int nRange, int nS
         // (PatchFinder::FindPatchCoarse)
         TrackerData &TD = *vTD[i];
         PatchFinder &Finder = TD.Finder;
-        Finder.MakeTemplateCoarseCont(TD.Point);
+        TD.MakeTemplateCoarseCont();
         if (Finder.TemplateBad()) {
             TD.bInImage = TD.bPotentiallyVisible = TD.bFound = false;
             continue;
@@ -654,9 +682,13 @@ void Tracker::UpdateMotionModel() {
 }
 
 // Time to add a new keyframe? The MapMaker handles most of this.
-void Tracker::AddNewKeyFrame() {
-    mMapMaker.AddKeyFrame(mCurrentKF);
+// If its queue was full the frame counter isn't reset, so the next good
+// frame tries again.
+bool Tracker::AddNewKeyFrame() {
+    if (!mMapMaker.AddKeyFrame(mCurrentKF))
+        return false;
     mnLastKeyFrameDropped = mnFrame;
+    return true;
 }
 
 // Some heuristics to decide if tracking is any good, for this frame.
@@ -0,0 +1,76 @@
+#include <algorithm>
+
+#include <ptamsp/WorkerPool.h>
+
+WorkerPool::WorkerPool(int nThreads) {
+    if (nThreads <= 0)
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < nThreads; i++)
+        mvWorkers.emplace_back(&WorkerPool::WorkerLoop, this);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mbStop = true;
+    }
+    mcvWork.notify_all();
+    for (auto &t : mvWorkers)
+        t.join();
+}
+
+void WorkerPool::RunChunks() {
+    while (true) {
+        int nBegin = mnNext.fetch_add(mnChunk);
+        if (nBegin >= mnItems)
+            break;
+        (*mpJob)(nBegin, std::min(nBegin + mnChunk, mnItems));
+    }
+}
+
+void WorkerPool::WorkerLoop() {
+    unsigned long nSeen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mcvWork.wait(lock, [&] { return mbStop || mnGeneration != nSeen; });
+            if (mbStop)
+                return;
+            nSeen = mnGeneration;
+        }
+        RunChunks();
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mnBusy--;
+        }
+        mcvDone.notify_one();
+    }
+}
+
+void WorkerPool::ParallelFor(int nItems, const std::function<void(int, int)> &fn) {
+    if (nItems <= 0)
+        return;
+    // Not worth waking anyone up for
+    if (mvWorkers.empty() || nItems == 1) {
+        fn(0, nItems);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mpJob = &fn;
+        mnItems = nItems;
+        // A few chunks per thread evens out the load without much contention
+        mnChunk = std::max(1, nItems / (Threads() * 8));
+        mnNext.store(0);
+        mnBusy = mvWorkers.size();
+        mnGeneration++;
+    }
+    mcvWork.notify_all();
+
+    RunChunks();
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mcvDone.wait(lock, [&] { return mnBusy == 0; });
+    mpJob = nullptr;
+}
@@ -0,0 +1,126 @@
+// ptam_model_convert
+//
+// Converts installed models from the cereal data_ptam file to the mappable
+// data_ptam.bin (see ModelBinaryFile.h), which Map::LoadModelFromFile()
+// prefers when it's there. Models installed from now on get both.
+// Unless told not to, the keyframes' pyramids and features are computed from
+// the model's JPEGs and stored as well.
+//
+// Usage: ptam_model_convert [--no-levels] [--compress] [--tile-size cm] modelFolder [modelFolder ...]
+//   --no-levels     Don't store pyramids, corners and candidates
+//   --compress      PNG-compress the stored pyramid levels
+//   --tile-size cm  Edge of the model's tiles (default 500; 0 for one tile)
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <cereal/archives/binary.hpp>
+
+#include <ptamsp/PTAMModelFile.h>
+#include <ptamsp/ModelBinaryFile.h>
+#include <ptamsp/KeyFrame.h>
+
+bool ConvertModel(const std::string &modelFolder, bool bLevels, bool bCompress, double dTileSizeCM) {
+    std::ifstream loaderFile(modelFolder + "/data_ptam", std::ios::binary);
+    if (!loaderFile.is_open()) {
+        std::cout << "No data_ptam in " << modelFolder << std::endl;
+        return false;
+    }
+    PTAMModelFile loader;
+    {
+        cereal::BinaryInputArchive iarchive(loaderFile);
+        iarchive(loader);
+    }
+
+    // Same as the mapmaker does with a freshly loaded keyframe
+    std::vector<std::unique_ptr<KeyFrame> > vKFs;
+    std::vector<const KeyFrame *> vLevelSources;
+    if (bLevels) {
+        for (const auto &modelKF : loader.keyframes) {
+            cv::Mat img = cv::imread(modelFolder + "/" + modelKF.image, cv::IMREAD_GRAYSCALE);
+            if (img.empty()) {
+                std::cout << "Can't read " << modelKF.image << ", its levels won't be stored" << std::endl;
+                vLevelSources.push_back(NULL);
+                continue;
+            }
+            CVD::Image<CVD::byte> imBW(CVD::ImageRef(img.cols, img.rows));
+            cv::Mat tmp(img.rows, img.cols, CV_8UC1, imBW.data());
+            img.copyTo(tmp);
+            vKFs.emplace_back(new KeyFrame());
+            vKFs.back()->MakeKeyFrame_Lite(imBW);
+            vKFs.back()->MakeKeyFrame_Rest();
+            vLevelSources.push_back(vKFs.back().get());
+        }
+    }
+
+    std::string binaryPath = modelFolder + "/data_ptam.bin";
+    if (!ModelBinaryFile::Write(binaryPath, loader, vLevelSources, bCompress, dTileSizeCM * loader.oneCM))
+        return false;
+
+    // Read it back and check it holds the same model. Keyframes are stored
+    // tile by tile, so they're matched up by image name.
+    std::shared_ptr<const ModelBinaryFile> pFile = ModelBinaryFile::Open(binaryPath);
+    if (!pFile || pFile->Name() != loader.name || pFile->KeyFrameCount() != loader.keyframes.size() ||
+        pFile->PointCount() != loader.points.size() || pFile->MeasurementCount() != loader.measurements.size()) {
+        std::cout << "Verification of " << binaryPath << " failed" << std::endl;
+        return false;
+    }
+    for (size_t t = 0; t < pFile->TileCount(); t++) {
+        if (!pFile->ValidateTile(t)) {
+            std::cout << "Verification of " << binaryPath << " failed: tile " << t << " is damaged" << std::endl;
+            return false;
+        }
+    }
+    std::map<std::string, size_t> mOriginalKF;
+    for (size_t i = 0; i < loader.keyframes.size(); i++)
+        mOriginalKF[loader.keyframes[i].image] = i;
+    for (size_t i = 0; i < pFile->KeyFrameCount(); i++) {
+        auto it = mOriginalKF.find(pFile->ImageName(pFile->KeyFrames()[i]));
+        if (it == mOriginalKF.end()) {
+            std::cout << "Verification of " << binaryPath << " failed: keyframe " << i << " isn't in the model" << std::endl;
+            return false;
+        }
+        const cv::Mat &original = loader.keyframes[it->second].descriptor.mat;
+        cv::Mat mapped = pFile->Descriptor(pFile->KeyFrames()[i]);
+        if (original.size() != mapped.size() || (!original.empty() && cv::norm(original, mapped, cv::NORM_L1) != 0)) {
+            std::cout << "Verification of " << binaryPath << " failed: keyframe " << i << " descriptors differ" << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "Converted '" << loader.name << "' (" << loader.keyframes.size() << " keyframes, "
+              << loader.points.size() << " points, " << loader.measurements.size() << " measurements, "
+              << pFile->TileCount() << " tiles) to " << binaryPath << std::endl;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool bLevels = true;
+    bool bCompress = false;
+    double dTileSizeCM = 500;
+    std::vector<std::string> vFolders;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--no-levels")
+            bLevels = false;
+        else if (arg == "--compress")
+            bCompress = true;
+        else if (arg == "--tile-size" && i + 1 < argc)
+            dTileSizeCM = atof(argv[++i]);
+        else
+            vFolders.push_back(arg);
+    }
+    if (vFolders.empty()) {
+        std::cout << "Missing required parameters: [--no-levels] [--compress] [--tile-size cm] modelFolder [modelFolder ...]" << std::endl;
+        exit(1);
+    }
+    bool bOK = true;
+    for (const auto &folder : vFolders)
+        bOK = ConvertModel(folder, bLevels, bCompress, dTileSizeCM) && bOK;
+    exit(bOK ? 0 : 1);
+}